@@ -5,7 +5,18 @@
                          'src/gateway/simple_gateway.cc',      'src/gateway/simple_gateway.hh',
                          'src/gateway/streaming_gateway.cc',   'src/gateway/streaming_gateway.hh',
                          'src/gateway/zmq_gateway.cc',         'src/gateway/zmq_gateway.hh',
+                         'src/gateway/striped_gateway.cc',     'src/gateway/striped_gateway.hh',
+                         'src/gateway/fanout_gateway.cc',      'src/gateway/fanout_gateway.hh',
                          'src/gateway/virtdb_gateway.cc',      'src/gateway/virtdb_gateway.hh',
+                         'src/gateway/pushdown.cc',            'src/gateway/pushdown.hh',
+                         'src/gateway/result_cache.cc',        'src/gateway/result_cache.hh',
+                         'src/gateway/crc32c.cc',              'src/gateway/crc32c.hh',
+                         'src/gateway/position_file.cc',       'src/gateway/position_file.hh',
+                         'src/gateway/placement.cc',           'src/gateway/placement.hh',
+                         'src/gateway/queue_replay.cc',        'src/gateway/queue_replay.hh',
+                         'src/gateway/column_frame.cc',        'src/gateway/column_frame.hh',
+                         'src/gateway/gateway_pool.cc',        'src/gateway/gateway_pool.hh',
+                         'src/gateway/spill_file.cc',          'src/gateway/spill_file.hh',
                          # stream building blocks
                          'src/gateway/duplex_stream.cc',       'src/gateway/duplex_stream.hh',
                          'src/gateway/listener.cc',            'src/gateway/listener.hh',
@@ -19,6 +30,10 @@
                          'src/gateway/listener_fsm.cc',        'src/gateway/listener_fsm.hh',
                          # header only helpers
                          'src/gateway/exception.hh',
+                         'src/gateway/arena.hh',
+                         'src/gateway/views.hh',
+                         'src/gateway/frame_pool.hh',
+                         'src/gateway/pb_wire.hh',
                        ],
   },
   'conditions': [
@@ -107,6 +122,34 @@
                        ],
       'sources':       [ 'test/gateway_test.cc', ],
     },
+    {
+      'target_name':     'gateway_bench',
+      'type':            'executable',
+      'dependencies':  [
+                         'gateway',
+                         './deps_/fsm/fsm.gyp:fsm',
+                         './deps_/queue/queue.gyp:queue',
+                       ],
+      'include_dirs':  [
+                         './deps_/fsm/src/',
+                         './deps_/queue/src/',
+                       ],
+      'sources':       [ 'test/gateway_bench.cc', ],
+    },
+    {
+      'target_name':     'gateway_replay',
+      'type':            'executable',
+      'dependencies':  [
+                         'gateway',
+                         './deps_/fsm/fsm.gyp:fsm',
+                         './deps_/queue/queue.gyp:queue',
+                       ],
+      'include_dirs':  [
+                         './deps_/fsm/src/',
+                         './deps_/queue/src/',
+                       ],
+      'sources':       [ 'test/gateway_replay.cc', ],
+    },
   ],
 }
 
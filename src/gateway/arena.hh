@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+namespace virtdb { namespace gateway {
+
+  // bump allocator for short lived decoded data. reset() rewinds without
+  // releasing the blocks, so a long stream allocates only on its first parts
+  class arena
+  {
+    struct block
+    {
+      std::unique_ptr<uint8_t[]>  data_;
+      uint64_t                    size_;
+    };
+
+    std::vector<block>  blocks_;
+    uint64_t            block_size_;
+    size_t              act_block_;
+    uint64_t            act_pos_;
+    uint64_t            used_;
+
+    // disable copying until properly implemented
+    arena(const arena &) = delete;
+    arena & operator=(const arena &) = delete;
+
+    void next_block(uint64_t min_size)
+    {
+      // reuse the following blocks if large enough
+      while( ++act_block_ < blocks_.size() )
+      {
+        if( blocks_[act_block_].size_ >= min_size )
+        {
+          act_pos_ = 0;
+          return;
+        }
+      }
+      uint64_t sz = (min_size > block_size_ ? min_size : block_size_);
+      blocks_.push_back(block{std::unique_ptr<uint8_t[]>{new uint8_t[sz]}, sz});
+      act_block_  = blocks_.size()-1;
+      act_pos_    = 0;
+    }
+
+  public:
+    typedef std::shared_ptr<arena> sptr;
+
+    arena(uint64_t block_size=64*1024)
+    : block_size_{block_size},
+      act_block_{0},
+      act_pos_{0},
+      used_{0}
+    {
+      blocks_.push_back(block{std::unique_ptr<uint8_t[]>{new uint8_t[block_size_]}, block_size_});
+    }
+
+    void * allocate(uint64_t bytes,
+                    uint64_t align=sizeof(uint64_t))
+    {
+      uint64_t pos = (act_pos_ + align - 1) & ~(align - 1);
+      if( pos + bytes > blocks_[act_block_].size_ )
+      {
+        next_block(bytes + align);
+        pos = 0;
+      }
+      act_pos_  = pos + bytes;
+      used_    += bytes;
+      return blocks_[act_block_].data_.get() + pos;
+    }
+
+    template <typename T>
+    T * allocate_array(uint64_t count)
+    {
+      if( count == 0 ) return nullptr;
+      return static_cast<T *>(allocate(sizeof(T)*count, alignof(T)));
+    }
+
+    void reset()
+    {
+      act_block_  = 0;
+      act_pos_    = 0;
+      used_       = 0;
+    }
+
+    uint64_t used() const     { return used_; }
+    uint64_t reserved() const
+    {
+      uint64_t ret = 0;
+      for( auto & b : blocks_ ) ret += b.size_;
+      return ret;
+    }
+  };
+
+}}
@@ -0,0 +1,409 @@
+#include <gateway/column_frame.hh>
+#include <gateway/exception.hh>
+#include <cstring>
+
+namespace virtdb { namespace gateway {
+
+  namespace
+  {
+    template <typename T>
+    void
+    put(std::vector<uint8_t> & buf,
+        uint64_t pos,
+        T value)
+    {
+      ::memcpy(buf.data()+pos, &value, sizeof(T));
+    }
+
+    template <typename T>
+    T
+    get(const uint8_t * ptr)
+    {
+      T ret;
+      ::memcpy(&ret, ptr, sizeof(T));
+      return ret;
+    }
+
+    uint64_t
+    aligned(uint64_t pos)
+    {
+      return (pos + column_frame::ALIGN - 1) & ~(column_frame::ALIGN - 1);
+    }
+  }
+
+  bool
+  column_frame::is_frame(const uint8_t * data,
+                         uint64_t size)
+  {
+    return data != nullptr && size >= HEADER_SIZE && get<uint32_t>(data) == MAGIC;
+  }
+
+  uint64_t
+  column_frame::width(uint8_t type)
+  {
+    switch( type )
+    {
+      case INT32:
+      case UINT32:
+      case FLOAT:   return 4;
+      case INT64:
+      case UINT64:
+      case DOUBLE:  return 8;
+      case BOOL:    return 1;
+      default:      return 0;
+    };
+  }
+
+  column_frame_writer::column_frame_writer(uint64_t rows)
+  : rows_{rows},
+    finished_{false}
+  {
+    frame_.reserve(64*1024);
+    reset(rows);
+  }
+
+  void
+  column_frame_writer::reset(uint64_t rows)
+  {
+    rows_      = rows;
+    finished_  = false;
+    columns_.clear();
+    frame_.assign(column_frame::HEADER_SIZE, 0);
+  }
+
+  uint64_t
+  column_frame_writer::append(const void * data,
+                              uint64_t size)
+  {
+    uint64_t pos = aligned(frame_.size());
+    frame_.resize(pos+size, 0);
+    if( size > 0 )
+      ::memcpy(frame_.data()+pos, data, size);
+    return pos;
+  }
+
+  uint64_t
+  column_frame_writer::append_validity(const uint8_t * is_null)
+  {
+    if( is_null == nullptr )
+      return 0;
+
+    bool any_null = false;
+    for( uint64_t i=0; i<rows_ && !any_null; ++i )
+      any_null = (is_null[i] != 0);
+    if( !any_null )
+      return 0;
+
+    uint64_t pos = aligned(frame_.size());
+    frame_.resize(pos+(rows_+7)/8, 0);
+    uint8_t * bits = frame_.data()+pos;
+    for( uint64_t i=0; i<rows_; ++i )
+      if( !is_null[i] ) bits[i/8] |= (uint8_t)(1 << (i%8));
+    return pos;
+  }
+
+  void
+  column_frame_writer::add(const std::string & name,
+                           uint8_t type,
+                           const void * values,
+                           const uint8_t * is_null)
+  {
+    if( finished_ )
+    {
+      THROW_("column added after finish()");
+    }
+
+    descriptor d;
+    d.name_         = name;
+    d.type_         = type;
+    d.values_size_  = rows_*column_frame::width(type);
+    d.values_       = append(values, d.values_size_);
+    d.validity_     = append_validity(is_null);
+    d.offsets_      = 0;
+    columns_.push_back(d);
+  }
+
+  void
+  column_frame_writer::add_strings(const std::string & name,
+                                   const std::string * values,
+                                   const uint8_t * is_null,
+                                   bool bytes)
+  {
+    if( finished_ )
+    {
+      THROW_("column added after finish()");
+    }
+
+    uint64_t total = 0;
+    for( uint64_t i=0; i<rows_; ++i )
+      total += values[i].size();
+    if( total > UINT32_MAX )
+    {
+      THROW_(std::string{"string column too large: "}+name);
+    }
+
+    descriptor d;
+    d.name_         = name;
+    d.type_         = (bytes ? column_frame::BYTES : column_frame::STRING);
+    d.values_size_  = total;
+    d.values_       = aligned(frame_.size());
+    frame_.resize(d.values_+total, 0);
+    uint8_t * data = frame_.data()+d.values_;
+    for( uint64_t i=0; i<rows_; ++i )
+    {
+      ::memcpy(data, values[i].data(), values[i].size());
+      data += values[i].size();
+    }
+    d.validity_ = append_validity(is_null);
+
+    d.offsets_ = aligned(frame_.size());
+    frame_.resize(d.offsets_+(rows_+1)*sizeof(uint32_t), 0);
+    uint32_t off = 0;
+    for( uint64_t i=0; i<rows_; ++i )
+    {
+      put<uint32_t>(frame_, d.offsets_+i*sizeof(uint32_t), off);
+      off += (uint32_t)values[i].size();
+    }
+    put<uint32_t>(frame_, d.offsets_+rows_*sizeof(uint32_t), off);
+    columns_.push_back(d);
+  }
+
+  const std::vector<uint8_t> &
+  column_frame_writer::finish()
+  {
+    if( finished_ )
+      return frame_;
+    if( columns_.size() > UINT16_MAX )
+    {
+      THROW_("too many columns in a frame");
+    }
+
+    uint64_t desc_pos = aligned(frame_.size());
+    frame_.resize(desc_pos+columns_.size()*column_frame::DESC_SIZE, 0);
+    uint64_t pos = desc_pos;
+    for( auto & c : columns_ )
+    {
+      if( c.name_.size() > UINT16_MAX )
+      {
+        THROW_(std::string{"column name too long: "}+c.name_.substr(0, 64));
+      }
+      put<uint8_t>(frame_, pos, c.type_);
+      put<uint16_t>(frame_, pos+2, (uint16_t)c.name_.size());
+      put<uint64_t>(frame_, pos+8, c.values_);
+      put<uint64_t>(frame_, pos+16, c.values_size_);
+      put<uint64_t>(frame_, pos+24, c.validity_);
+      put<uint64_t>(frame_, pos+32, c.offsets_);
+      pos += column_frame::DESC_SIZE;
+    }
+    for( auto & c : columns_ )
+      frame_.insert(frame_.end(), c.name_.begin(), c.name_.end());
+
+    put<uint32_t>(frame_, 0, column_frame::MAGIC);
+    put<uint16_t>(frame_, 4, column_frame::VERSION);
+    put<uint16_t>(frame_, 6, (uint16_t)columns_.size());
+    put<uint64_t>(frame_, 8, rows_);
+    put<uint64_t>(frame_, 16, desc_pos);
+    put<uint64_t>(frame_, 24, (uint64_t)frame_.size());
+    finished_ = true;
+    return frame_;
+  }
+
+  const uint8_t *
+  column_frame_writer::frame() const
+  {
+    return frame_.data();
+  }
+
+  uint64_t
+  column_frame_writer::size() const
+  {
+    return frame_.size();
+  }
+
+  uint64_t
+  column_frame_writer::rows() const
+  {
+    return rows_;
+  }
+
+  column_frame_reader::column_frame_reader()
+  : rows_{0},
+    copy_size_{0},
+    copied_{false}
+  {
+  }
+
+  bool
+  column_frame_reader::parse(const uint8_t * data,
+                             uint64_t size)
+  {
+    columns_.clear();
+    rows_    = 0;
+    copied_  = false;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if( !column_frame::is_frame(data, size) ||
+        get<uint16_t>(data+4) != column_frame::VERSION )
+      return false;
+
+    uint64_t columns   = get<uint16_t>(data+6);
+    uint64_t rows      = get<uint64_t>(data+8);
+    uint64_t desc_pos  = get<uint64_t>(data+16);
+    uint64_t frame     = get<uint64_t>(data+24);
+    if( frame > size || desc_pos > frame ||
+        columns*column_frame::DESC_SIZE > frame-desc_pos )
+      return false;
+
+    // typed access needs aligned values, the queue gives no guarantee
+    if( ((uintptr_t)data % sizeof(uint64_t)) != 0 )
+    {
+      uint64_t words = (frame+sizeof(uint64_t)-1)/sizeof(uint64_t);
+      if( words > copy_size_ )
+      {
+        copy_.reset(new uint64_t[words]);
+        copy_size_ = words;
+      }
+      ::memcpy(copy_.get(), data, frame);
+      data     = (const uint8_t *)copy_.get();
+      copied_  = true;
+    }
+
+    uint64_t name_pos = desc_pos+columns*column_frame::DESC_SIZE;
+    auto in_frame = [frame](uint64_t pos, uint64_t len) {
+      return pos <= frame && len <= frame-pos;
+    };
+
+    for( uint64_t i=0; i<columns; ++i )
+    {
+      const uint8_t * d = data+desc_pos+i*column_frame::DESC_SIZE;
+      column c;
+      c.type_              = d[0];
+      uint64_t name_len    = get<uint16_t>(d+2);
+      uint64_t values      = get<uint64_t>(d+8);
+      c.values_size_       = get<uint64_t>(d+16);
+      uint64_t validity    = get<uint64_t>(d+24);
+      uint64_t offsets     = get<uint64_t>(d+32);
+      uint64_t width       = column_frame::width(c.type_);
+      bool variable        = (c.type_ == column_frame::STRING || c.type_ == column_frame::BYTES);
+
+      if( (width == 0 && !variable) ||
+          !in_frame(name_pos, name_len) ||
+          !in_frame(values, c.values_size_) ||
+          (values % column_frame::ALIGN) != 0 ||
+          (width > 0 && (rows > c.values_size_/width)) ||
+          (validity > 0 && !in_frame(validity, (rows+7)/8)) ||
+          (variable && (offsets == 0 || (offsets % sizeof(uint32_t)) != 0 ||
+                        rows >= UINT64_MAX/sizeof(uint32_t) ||
+                        !in_frame(offsets, (rows+1)*sizeof(uint32_t)))) )
+      {
+        columns_.clear();
+        return false;
+      }
+
+      c.name_      = bytes_view{data+name_pos, name_len};
+      c.values_    = data+values;
+      c.validity_  = (validity > 0 ? data+validity : nullptr);
+      c.offsets_   = (variable ? (const uint32_t *)(data+offsets) : nullptr);
+      if( variable && c.offsets_[rows] > c.values_size_ )
+      {
+        columns_.clear();
+        return false;
+      }
+      name_pos += name_len;
+      columns_.push_back(c);
+    }
+    rows_ = rows;
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  uint64_t
+  column_frame_reader::rows() const
+  {
+    return rows_;
+  }
+
+  uint64_t
+  column_frame_reader::columns() const
+  {
+    return columns_.size();
+  }
+
+  int64_t
+  column_frame_reader::find(const std::string & name) const
+  {
+    for( uint64_t i=0; i<columns_.size(); ++i )
+      if( columns_[i].name_ == name )
+        return (int64_t)i;
+    return -1;
+  }
+
+  bytes_view
+  column_frame_reader::name(uint64_t col) const
+  {
+    return columns_[col].name_;
+  }
+
+  uint8_t
+  column_frame_reader::type(uint64_t col) const
+  {
+    return columns_[col].type_;
+  }
+
+  bool
+  column_frame_reader::copied() const
+  {
+    return copied_;
+  }
+
+  const uint8_t *
+  column_frame_reader::validity(uint64_t col) const
+  {
+    return columns_[col].validity_;
+  }
+
+  bool
+  column_frame_reader::is_null(uint64_t col,
+                               uint64_t row) const
+  {
+    const uint8_t * bits = columns_[col].validity_;
+    return bits != nullptr && (bits[row/8] & (1 << (row%8))) == 0;
+  }
+
+  array_view<uint32_t>
+  column_frame_reader::offsets(uint64_t col) const
+  {
+    const column & c = columns_[col];
+    if( c.offsets_ == nullptr )
+      return array_view<uint32_t>{};
+    return array_view<uint32_t>{c.offsets_, rows_+1};
+  }
+
+  bytes_view
+  column_frame_reader::string_data(uint64_t col) const
+  {
+    const column & c = columns_[col];
+    if( c.offsets_ == nullptr )
+      return bytes_view{};
+    return bytes_view{c.values_, c.values_size_};
+  }
+
+  bytes_view
+  column_frame_reader::string(uint64_t col,
+                             uint64_t row) const
+  {
+    const column & c = columns_[col];
+    if( c.offsets_ == nullptr || row >= rows_ )
+      return bytes_view{};
+
+    // offsets are only checked at the end by parse()
+    uint32_t from  = c.offsets_[row];
+    uint32_t to    = c.offsets_[row+1];
+    if( from > to || to > c.values_size_ )
+      return bytes_view{};
+    return bytes_view{c.values_+from, to-from};
+  }
+
+}}
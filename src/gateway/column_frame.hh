@@ -0,0 +1,184 @@
+#pragma once
+
+#include <gateway/views.hh>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace virtdb { namespace gateway {
+
+  // a stream part laid out by column, so handlers scan the values where
+  // they are in the queue. buffers start at 64 byte offsets from the
+  // frame start, all numbers are little endian:
+  //
+  //  header      : u32 magic "VCF1", u16 version, u16 columns,
+  //                u64 rows, u64 descriptor offset, u64 frame size
+  //  buffers     : per column the values, then the validity bitmap if the
+  //                column has nulls (LSB first, 1 is valid), then for
+  //                strings and bytes the u32 offsets, rows+1 of them,
+  //                into the values
+  //  descriptors : u8 type, u8 reserved, u16 name length, u32 reserved,
+  //                u64 values, u64 values size, u64 validity, u64 offsets
+  //                (buffer offsets, 0 if absent), one per column
+  //  names       : the column names back to back
+  class column_frame
+  {
+  public:
+    static const uint8_t   INT32      = 1;
+    static const uint8_t   INT64      = 2;
+    static const uint8_t   UINT32     = 3;
+    static const uint8_t   UINT64     = 4;
+    static const uint8_t   FLOAT      = 5;
+    static const uint8_t   DOUBLE     = 6;
+    static const uint8_t   BOOL       = 7;
+    static const uint8_t   STRING     = 8;
+    static const uint8_t   BYTES      = 9;
+
+    static const uint32_t  MAGIC        = 0x31464356;
+    static const uint16_t  VERSION      = 1;
+    static const uint64_t  ALIGN        = 64;
+    static const uint64_t  HEADER_SIZE  = 32;
+    static const uint64_t  DESC_SIZE    = 40;
+
+    // the frame magic, a cheap check before parsing
+    static bool is_frame(const uint8_t * data,
+                         uint64_t size);
+    // bytes per value, 0 for strings and bytes
+    static uint64_t width(uint8_t type);
+  };
+
+  template <typename T> struct column_type;
+  template <> struct column_type<int32_t>   { static const uint8_t value = column_frame::INT32;  };
+  template <> struct column_type<int64_t>   { static const uint8_t value = column_frame::INT64;  };
+  template <> struct column_type<uint32_t>  { static const uint8_t value = column_frame::UINT32; };
+  template <> struct column_type<uint64_t>  { static const uint8_t value = column_frame::UINT64; };
+  template <> struct column_type<float>     { static const uint8_t value = column_frame::FLOAT;  };
+  template <> struct column_type<double>    { static const uint8_t value = column_frame::DOUBLE; };
+  template <> struct column_type<uint8_t>   { static const uint8_t value = column_frame::BOOL;   };
+
+  // builds a frame in a buffer that is reused after reset(). a feeder
+  // points the stream part at frame() and keeps the writer until the
+  // part is sent
+  class column_frame_writer
+  {
+    struct descriptor
+    {
+      std::string  name_;
+      uint8_t      type_;
+      uint64_t     values_;
+      uint64_t     values_size_;
+      uint64_t     validity_;
+      uint64_t     offsets_;
+    };
+
+    uint64_t                  rows_;
+    std::vector<descriptor>   columns_;
+    std::vector<uint8_t>      frame_;
+    bool                      finished_;
+
+    uint64_t append(const void * data,
+                    uint64_t size);
+    uint64_t append_validity(const uint8_t * is_null);
+    void add(const std::string & name,
+             uint8_t type,
+             const void * values,
+             const uint8_t * is_null);
+
+    // disable copying until properly implemented
+    column_frame_writer(const column_frame_writer &) = delete;
+    column_frame_writer & operator=(const column_frame_writer &) = delete;
+
+  public:
+    column_frame_writer(uint64_t rows=0);
+
+    // starts a new frame, the buffer is kept
+    void reset(uint64_t rows);
+
+    // rows values, is_null is one byte per row like value_view, nullptr
+    // if the column has no nulls
+    template <typename T>
+    void add_column(const std::string & name,
+                    const T * values,
+                    const uint8_t * is_null=nullptr)
+    {
+      add(name, column_type<T>::value, values, is_null);
+    }
+
+    void add_strings(const std::string & name,
+                     const std::string * values,
+                     const uint8_t * is_null=nullptr,
+                     bool bytes=false);
+
+    // writes the descriptors, the frame is complete after this
+    const std::vector<uint8_t> & finish();
+
+    const uint8_t * frame() const;
+    uint64_t size() const;
+    uint64_t rows() const;
+  };
+
+  // typed views over a received frame. the values are used in place
+  // unless the frame is not 8 byte aligned in memory, then it is copied
+  // once into the reader's own buffer. views stay valid until the next
+  // parse() or until the part's buffer goes away
+  class column_frame_reader
+  {
+    struct column
+    {
+      bytes_view        name_;
+      uint8_t           type_;
+      const uint8_t *   values_;
+      uint64_t          values_size_;
+      const uint8_t *   validity_;
+      const uint32_t *  offsets_;
+    };
+
+    std::vector<column>          columns_;
+    uint64_t                     rows_;
+    std::unique_ptr<uint64_t[]>  copy_;
+    uint64_t                     copy_size_;
+    bool                         copied_;
+
+    // disable copying until properly implemented
+    column_frame_reader(const column_frame_reader &) = delete;
+    column_frame_reader & operator=(const column_frame_reader &) = delete;
+
+  public:
+    column_frame_reader();
+
+    // false if the frame is malformed, nothing is exposed then
+    bool parse(const uint8_t * data,
+               uint64_t size);
+
+    uint64_t rows() const;
+    uint64_t columns() const;
+    // -1 if there is no such column
+    int64_t find(const std::string & name) const;
+    bytes_view name(uint64_t col) const;
+    uint8_t type(uint64_t col) const;
+    bool copied() const;
+
+    // empty if the column is not of type T
+    template <typename T>
+    array_view<T> values(uint64_t col) const
+    {
+      const column & c = columns_[col];
+      if( c.type_ != column_type<T>::value )
+        return array_view<T>{};
+      return array_view<T>{(const T *)c.values_, rows_};
+    }
+
+    // nullptr if the column has no nulls
+    const uint8_t * validity(uint64_t col) const;
+    bool is_null(uint64_t col,
+                 uint64_t row) const;
+
+    // strings and bytes
+    array_view<uint32_t> offsets(uint64_t col) const;
+    bytes_view string_data(uint64_t col) const;
+    bytes_view string(uint64_t col,
+                      uint64_t row) const;
+  };
+
+}}
@@ -0,0 +1,245 @@
+#include <gateway/crc32c.hh>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define GATEWAY_CRC32C_HW 1
+#endif
+
+namespace virtdb { namespace gateway {
+
+  namespace
+  {
+    // reflected Castagnoli polynomial
+    const uint32_t POLY   = 0x82f63b78;
+    // lane lengths of the hardware version, powers of two
+    const uint64_t LONG   = 8192;
+    const uint64_t SHORT  = 256;
+
+    uint32_t
+    gf2_matrix_times(const uint32_t * mat,
+                     uint32_t vec)
+    {
+      uint32_t sum = 0;
+      while( vec )
+      {
+        if( vec & 1 ) sum ^= *mat;
+        vec >>= 1;
+        ++mat;
+      }
+      return sum;
+    }
+
+    void
+    gf2_matrix_square(uint32_t * square,
+                      const uint32_t * mat)
+    {
+      for( int n=0; n<32; ++n )
+        square[n] = gf2_matrix_times(mat, mat[n]);
+    }
+
+    // the operator that appends len zero bytes to a crc
+    void
+    zeros_op(uint32_t * even,
+             uint64_t len)
+    {
+      uint32_t odd[32];
+      odd[0] = POLY;
+      uint32_t row = 1;
+      for( int n=1; n<32; ++n )
+      {
+        odd[n] = row;
+        row <<= 1;
+      }
+
+      // 2 then 4 zero bits
+      gf2_matrix_square(even, odd);
+      gf2_matrix_square(odd, even);
+
+      do
+      {
+        gf2_matrix_square(even, odd);
+        len >>= 1;
+        if( len == 0 )
+          return;
+        gf2_matrix_square(odd, even);
+        len >>= 1;
+      }
+      while( len );
+
+      for( int n=0; n<32; ++n )
+        even[n] = odd[n];
+    }
+
+    struct tables
+    {
+      uint32_t  bytes_[256];
+      uint32_t  long_[4][256];
+      uint32_t  short_[4][256];
+
+      static void
+      zeros(uint32_t table[][256],
+            uint64_t len)
+      {
+        uint32_t op[32];
+        zeros_op(op, len);
+        for( uint32_t n=0; n<256; ++n )
+        {
+          table[0][n] = gf2_matrix_times(op, n);
+          table[1][n] = gf2_matrix_times(op, n << 8);
+          table[2][n] = gf2_matrix_times(op, n << 16);
+          table[3][n] = gf2_matrix_times(op, n << 24);
+        }
+      }
+
+      tables()
+      {
+        for( uint32_t n=0; n<256; ++n )
+        {
+          uint32_t crc = n;
+          for( int k=0; k<8; ++k )
+            crc = (crc & 1) ? (crc >> 1) ^ POLY : crc >> 1;
+          bytes_[n] = crc;
+        }
+        zeros(long_, LONG);
+        zeros(short_, SHORT);
+      }
+    };
+
+    const tables crc_tables;
+
+    inline uint32_t
+    shift(const uint32_t table[][256],
+          uint32_t crc)
+    {
+      return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^
+             table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+    }
+
+#ifdef GATEWAY_CRC32C_HW
+    bool
+    detect_hw()
+    {
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("sse4.2");
+    }
+
+    const bool has_hw = detect_hw();
+
+    inline uint64_t
+    load64(const uint8_t * p)
+    {
+      uint64_t v;
+      ::memcpy(&v, p, sizeof(v));
+      return v;
+    }
+
+    // three independent lanes keep the crc32 unit busy, the lanes are
+    // merged by shifting with the zero operator tables
+    __attribute__((target("sse4.2")))
+    uint32_t
+    crc32c_hw(uint32_t crc,
+              const uint8_t * next,
+              uint64_t len)
+    {
+      uint64_t crc0 = crc ^ 0xffffffff;
+
+      while( len && ((uintptr_t)next & 7) != 0 )
+      {
+        crc0 = _mm_crc32_u8((uint32_t)crc0, *next);
+        ++next;
+        --len;
+      }
+
+      while( len >= LONG*3 )
+      {
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+        const uint8_t * end = next + LONG;
+        do
+        {
+          crc0 = _mm_crc32_u64(crc0, load64(next));
+          crc1 = _mm_crc32_u64(crc1, load64(next + LONG));
+          crc2 = _mm_crc32_u64(crc2, load64(next + LONG*2));
+          next += 8;
+        }
+        while( next < end );
+        crc0 = shift(crc_tables.long_, (uint32_t)crc0) ^ crc1;
+        crc0 = shift(crc_tables.long_, (uint32_t)crc0) ^ crc2;
+        next += LONG*2;
+        len  -= LONG*3;
+      }
+
+      while( len >= SHORT*3 )
+      {
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+        const uint8_t * end = next + SHORT;
+        do
+        {
+          crc0 = _mm_crc32_u64(crc0, load64(next));
+          crc1 = _mm_crc32_u64(crc1, load64(next + SHORT));
+          crc2 = _mm_crc32_u64(crc2, load64(next + SHORT*2));
+          next += 8;
+        }
+        while( next < end );
+        crc0 = shift(crc_tables.short_, (uint32_t)crc0) ^ crc1;
+        crc0 = shift(crc_tables.short_, (uint32_t)crc0) ^ crc2;
+        next += SHORT*2;
+        len  -= SHORT*3;
+      }
+
+      while( len >= 8 )
+      {
+        crc0 = _mm_crc32_u64(crc0, load64(next));
+        next += 8;
+        len  -= 8;
+      }
+
+      while( len )
+      {
+        crc0 = _mm_crc32_u8((uint32_t)crc0, *next);
+        ++next;
+        --len;
+      }
+
+      return (uint32_t)crc0 ^ 0xffffffff;
+    }
+#endif
+  }
+
+  uint32_t
+  crc32c_sw(uint32_t crc,
+            const void * data,
+            uint64_t len)
+  {
+    const uint8_t * p = static_cast<const uint8_t *>(data);
+    crc = ~crc;
+    while( len-- )
+      crc = crc_tables.bytes_[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+  }
+
+  uint32_t
+  crc32c(uint32_t crc,
+         const void * data,
+         uint64_t len)
+  {
+#ifdef GATEWAY_CRC32C_HW
+    if( has_hw )
+      return crc32c_hw(crc, static_cast<const uint8_t *>(data), len);
+#endif
+    return crc32c_sw(crc, data, len);
+  }
+
+  bool
+  crc32c_hw_available()
+  {
+#ifdef GATEWAY_CRC32C_HW
+    return has_hw;
+#else
+    return false;
+#endif
+  }
+
+}}
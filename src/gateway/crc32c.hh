@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+
+namespace virtdb { namespace gateway {
+
+  // CRC32C (Castagnoli), chained by passing the previous result as crc.
+  // uses the SSE4.2 crc32 instruction on three interleaved lanes when the
+  // CPU has it, a byte table otherwise
+  uint32_t crc32c(uint32_t crc,
+                  const void * data,
+                  uint64_t len);
+
+  // the table version, for checking the other one
+  uint32_t crc32c_sw(uint32_t crc,
+                     const void * data,
+                     uint64_t len);
+
+  bool crc32c_hw_available();
+
+}}
@@ -1,5 +1,457 @@
 #include <gateway/duplex_stream.hh>
+#include <gateway/exception.hh>
+#include <gateway/pb_wire.hh>
+#include <chrono>
 
 namespace virtdb { namespace gateway {
-  
+
+  namespace
+  {
+    // how long the receiver waits for the server's EV_END after ours
+    const uint64_t  END_WAIT_MS  = 1000;
+    const uint64_t  POLL_MS      = 100;
+
+    void
+    no_trace(uint16_t seqno,
+             const std::string & desc,
+             const fsm::transition & trans,
+             const fsm::state_machine & sm)
+    {
+    }
+  }
+
+  bool
+  duplex_stream::parse(const uint8_t * ptr,
+                       uint64_t len,
+                       std::function<void(uint64_t tag, bytes_view data)> f)
+  {
+    if( ptr == nullptr )
+      return (len == 0);
+
+    pb_reader r{ptr, len};
+    while( !r.at_end() )
+    {
+      uint64_t tag = 0;
+      const uint8_t * data = nullptr;
+      uint64_t size = 0;
+      if( !r.varint(tag) || !r.length_delimited(data, size) )
+        return false;
+      f(tag, bytes_view{data, size});
+    }
+    return !r.failed();
+  }
+
+  void
+  duplex_stream::append(std::string & buf,
+                        uint64_t tag,
+                        const uint8_t * data,
+                        uint64_t size)
+  {
+    pb_writer w{buf};
+    w.varint(tag);
+    w.varint(size);
+    buf.append((const char *)data, size);
+  }
+
+  duplex_client::duplex_client(const std::string & path,
+                               uint8_t stream_type,
+                               uint64_t max_outstanding,
+                               const queue::params & prms,
+                               const simple_gateway::options & opts)
+  : client_{simple_client::create(path, prms, opts)},
+    stream_type_{stream_type},
+    max_outstanding_{(max_outstanding > 0 ? max_outstanding : 1)},
+    next_tag_{0},
+    id_{-1},
+    closing_{false},
+    sent_end_{false},
+    failed_{false},
+    completed_{0}
+  {
+    client_->seek_to_end();
+    sender_    = std::thread{[this](){ send_loop(); }};
+    receiver_  = std::thread{[this](){ receive_loop(); }};
+  }
+
+  duplex_client::~duplex_client()
+  {
+    close();
+  }
+
+  duplex_client::sptr
+  duplex_client::create(const std::string & path,
+                        uint8_t stream_type,
+                        uint64_t max_outstanding,
+                        const queue::params & prms,
+                        const simple_gateway::options & opts)
+  {
+    return sptr{new duplex_client{path, stream_type, max_outstanding, prms, opts}};
+  }
+
+  bool
+  duplex_client::feed(simple_gateway::stream_part & part)
+  {
+    std::unique_lock<std::mutex> lock{mtx_};
+    if( id_ == -1 )
+    {
+      // the receiver waits for this
+      id_ = (int64_t)part.id_;
+      cv_.notify_all();
+    }
+
+    cv_.wait(lock, [this](){ return !pending_.empty() || closing_; });
+    sending_.clear();
+    sending_.swap(pending_);
+    part.buffer_  = (const uint8_t *)sending_.data();
+    part.size_    = sending_.size();
+    return !closing_;
+  }
+
+  void
+  duplex_client::send_loop()
+  {
+    fsm::state_machine::sptr fsm{new fsm::state_machine{"duplex_client", no_trace}};
+    simple_gateway::stream_info::sptr info{new simple_gateway::stream_info};
+    try
+    {
+      client_->start(stream_type_,
+                     [this](simple_gateway::stream_part & part) { return feed(part); },
+                     fsm,
+                     { 0 },
+                     info);
+    }
+    catch (...)
+    {
+      std::lock_guard<std::mutex> lock{mtx_};
+      failed_ = true;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock{mtx_};
+      sent_end_  = true;
+      closing_   = true;
+      if( info->cancelled_ )
+        failed_ = true;
+    }
+    cv_.notify_all();
+  }
+
+  void
+  duplex_client::receive_loop()
+  {
+    uint64_t id = 0;
+    {
+      std::unique_lock<std::mutex> lock{mtx_};
+      cv_.wait(lock, [this](){ return id_ != -1 || sent_end_; });
+      if( id_ == -1 )
+        return;
+      id = (uint64_t)id_;
+    }
+
+    uint64_t seqno = 0;
+    auto give_up = std::chrono::steady_clock::time_point::max();
+    while( true )
+    {
+      if( client_->wait_data(id, seqno, POLL_MS) )
+      {
+        simple_gateway::stream_part part;
+        if( !client_->get_data(id, seqno, part) )
+          break;
+        ++seqno;
+
+        bool ok = duplex_stream::parse(part.buffer_, part.size_, [this](uint64_t tag, bytes_view response) {
+          response_fun done;
+          {
+            std::lock_guard<std::mutex> lock{mtx_};
+            auto it = outstanding_.find(tag);
+            if( it == outstanding_.end() )
+              return;
+            done.swap(it->second);
+            outstanding_.erase(it);
+          }
+          ++completed_;
+          cv_.notify_all();
+          if( done ) done(true, response);
+        });
+        if( !ok || part.event_ == simple_gateway::EV_END )
+          break;
+        continue;
+      }
+
+      if( client_->is_reply_stopped(id) )
+        break;
+
+      std::lock_guard<std::mutex> lock{mtx_};
+      if( sent_end_ )
+      {
+        auto now = std::chrono::steady_clock::now();
+        if( give_up == std::chrono::steady_clock::time_point::max() )
+          give_up = now + std::chrono::milliseconds(END_WAIT_MS);
+        else if( now >= give_up )
+          break;
+      }
+    }
+    client_->release_data(id);
+
+    {
+      std::lock_guard<std::mutex> lock{mtx_};
+      if( !outstanding_.empty() )
+        failed_ = true;
+      closing_ = true;
+    }
+    cv_.notify_all();
+    fail_outstanding();
+  }
+
+  void
+  duplex_client::fail_outstanding()
+  {
+    std::map<uint64_t, response_fun> failed;
+    {
+      std::lock_guard<std::mutex> lock{mtx_};
+      failed.swap(outstanding_);
+    }
+    cv_.notify_all();
+    for( auto & f : failed )
+      if( f.second ) f.second(false, bytes_view{});
+  }
+
+  uint64_t
+  duplex_client::call(const uint8_t * data,
+                      uint64_t size,
+                      response_fun done)
+  {
+    uint64_t tag = 0;
+    {
+      std::unique_lock<std::mutex> lock{mtx_};
+      cv_.wait(lock, [this](){ return outstanding_.size() < max_outstanding_ || closing_; });
+      if( closing_ )
+      {
+        THROW_("duplex stream is closed");
+      }
+      tag = next_tag_++;
+      duplex_stream::append(pending_, tag, data, size);
+      outstanding_[tag] = done;
+    }
+    cv_.notify_all();
+    return tag;
+  }
+
+  std::future<std::string>
+  duplex_client::call(const std::string & request)
+  {
+    std::shared_ptr<std::promise<std::string>> result{new std::promise<std::string>};
+    call((const uint8_t *)request.data(), request.size(), [result](bool ok, bytes_view response) {
+      if( ok )
+      {
+        result->set_value(response.str());
+        return;
+      }
+      try
+      {
+        THROW_("duplex stream closed before the response");
+      }
+      catch (...)
+      {
+        result->set_exception(std::current_exception());
+      }
+    });
+    return result->get_future();
+  }
+
+  void
+  duplex_client::close(uint64_t timeout_ms)
+  {
+    {
+      std::unique_lock<std::mutex> lock{mtx_};
+      if( !closing_ )
+      {
+        cv_.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this](){
+          return outstanding_.empty() || closing_;
+        });
+        closing_ = true;
+      }
+    }
+    cv_.notify_all();
+
+    if( sender_.joinable() )    sender_.join();
+    if( receiver_.joinable() )  receiver_.join();
+    fail_outstanding();
+  }
+
+  bool
+  duplex_client::is_open() const
+  {
+    std::lock_guard<std::mutex> lock{mtx_};
+    return !closing_;
+  }
+
+  uint64_t
+  duplex_client::outstanding() const
+  {
+    std::lock_guard<std::mutex> lock{mtx_};
+    return outstanding_.size();
+  }
+
+  uint64_t
+  duplex_client::completed() const
+  {
+    return completed_.load();
+  }
+
+  // the reply side of one client stream, shared with the responders
+  struct duplex_server::channel
+  {
+    simple_server::sptr  server_;
+    uint64_t             id_;
+    std::mutex           mtx_;
+    uint64_t             next_seqno_;
+    bool                 open_;
+
+    channel(simple_server::sptr server,
+            uint64_t id)
+    : server_{server},
+      id_{id},
+      next_seqno_{0},
+      open_{true}
+    {
+    }
+
+    bool send(uint64_t tag,
+              const uint8_t * data,
+              uint64_t size)
+    {
+      std::string header;
+      pb_writer w{header};
+      w.varint(tag);
+      w.varint(size);
+      queue::simple_publisher::buffer_vector data_vec{
+        queue::simple_publisher::buffer{header.data(), header.size()},
+        queue::simple_publisher::buffer{data, size},
+      };
+
+      std::lock_guard<std::mutex> lock{mtx_};
+      if( !open_ )
+        return false;
+      server_->reply(id_, next_seqno_++, data_vec, false);
+      return true;
+    }
+
+    // the empty EV_END tells the client we are done
+    void close(bool reply_end)
+    {
+      std::lock_guard<std::mutex> lock{mtx_};
+      if( !open_ )
+        return;
+      open_ = false;
+      if( reply_end )
+        server_->reply(id_, next_seqno_++, queue::simple_publisher::buffer_vector{}, true);
+    }
+  };
+
+  class duplex_server::coroutine : public stream_coroutine
+  {
+    duplex_server *           owner_;
+    std::shared_ptr<channel>  channel_;
+
+  public:
+    coroutine(duplex_server * owner,
+              const simple_gateway::stream_part & start)
+    : owner_{owner},
+      channel_{new channel{owner->server_, start.id_}}
+    {
+      ++(owner_->channels_);
+    }
+
+    virtual ~coroutine()
+    {
+      channel_->close(false);
+      --(owner_->channels_);
+    }
+
+    bool resume(simple_server & server,
+                const simple_gateway::stream_part & part)
+    {
+      bool ok = duplex_stream::parse(part.buffer_, part.size_, [this](uint64_t tag, bytes_view request) {
+        ++(owner_->requests_);
+        owner_->handler_(request, responder{channel_, tag});
+      });
+      if( !ok )
+      {
+        channel_->close(false);
+        server.send_error(part.id_, part.seqno_, "malformed duplex exchange");
+        return false;
+      }
+
+      if( part.event_ == simple_gateway::EV_END || part.event_ == simple_gateway::EV_ONE )
+      {
+        channel_->close(true);
+        return false;
+      }
+      return true;
+    }
+  };
+
+  duplex_server::responder::responder(std::shared_ptr<channel> ch,
+                                      uint64_t tag)
+  : channel_{ch},
+    tag_{tag}
+  {
+  }
+
+  uint64_t
+  duplex_server::responder::tag() const
+  {
+    return tag_;
+  }
+
+  bool
+  duplex_server::responder::operator()(const uint8_t * data,
+                                       uint64_t size) const
+  {
+    return channel_->send(tag_, data, size);
+  }
+
+  bool
+  duplex_server::responder::operator()(const std::string & response) const
+  {
+    return channel_->send(tag_, (const uint8_t *)response.data(), response.size());
+  }
+
+  duplex_server::duplex_server(simple_server::sptr server,
+                               uint8_t stream_type,
+                               request_fun handler)
+  : server_{server},
+    handler_{handler},
+    requests_{0},
+    channels_{0}
+  {
+    server_->add_coroutine_handler(stream_type, sizeof(coroutine), [this](void * frame,
+                                                                         const simple_gateway::stream_part & start) -> stream_coroutine * {
+      return new (frame) coroutine{this, start};
+    });
+  }
+
+  duplex_server::~duplex_server() {}
+
+  duplex_server::sptr
+  duplex_server::create(simple_server::sptr server,
+                        uint8_t stream_type,
+                        request_fun handler)
+  {
+    return sptr{new duplex_server{server, stream_type, handler}};
+  }
+
+  uint64_t
+  duplex_server::requests() const
+  {
+    return requests_.load();
+  }
+
+  uint64_t
+  duplex_server::channels() const
+  {
+    return channels_.load();
+  }
+
 }}
@@ -1,5 +1,184 @@
 #pragma once
 
+#include <gateway/simple_gateway.hh>
+#include <gateway/views.hh>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
 namespace virtdb { namespace gateway {
-  
+
+  // many request/response exchanges inside one long lived stream, so a
+  // small request costs no stream setup on either side. every part
+  // carries one or more exchanges as:
+  //
+  //  - 1-10B: tag       / VarInt64, picked by the client per request
+  //  - 1-10B: length    / VarInt64
+  //  - data             /
+  //
+  // the client packs the requests queued since its last part into the
+  // next one. the server answers with reply parts in the same format, in
+  // the order it finishes them, the tag tells which request they answer.
+  // the client's EV_END is answered with an empty EV_END once the
+  // server is done with the channel
+  class duplex_stream
+  {
+  public:
+    // calls f for each exchange in the part, false if it is malformed
+    static bool parse(const uint8_t * ptr,
+                      uint64_t len,
+                      std::function<void(uint64_t tag, bytes_view data)> f);
+    static void append(std::string & buf,
+                       uint64_t tag,
+                       const uint8_t * data,
+                       uint64_t size);
+  };
+
+  class duplex_client
+  {
+  public:
+    typedef std::shared_ptr<duplex_client>  sptr;
+    // ok is false if the stream went away before the response. runs on
+    // the client's receiver thread, so it must not wait for other
+    // responses
+    typedef std::function<void(bool ok, bytes_view response)>  response_fun;
+
+  private:
+    simple_client::sptr               client_;
+    uint8_t                           stream_type_;
+    uint64_t                          max_outstanding_;
+
+    mutable std::mutex                mtx_;
+    std::condition_variable           cv_;
+    // framed requests not sent yet, the sender swaps them out
+    std::string                       pending_;
+    std::string                       sending_;
+    std::map<uint64_t, response_fun>  outstanding_;
+    uint64_t                          next_tag_;
+    int64_t                           id_;
+    bool                              closing_;
+    bool                              sent_end_;
+    bool                              failed_;
+    std::atomic<uint64_t>             completed_;
+    std::thread                       sender_;
+    std::thread                       receiver_;
+
+    bool feed(simple_gateway::stream_part & part);
+    void send_loop();
+    void receive_loop();
+    void fail_outstanding();
+
+    // disable default construction
+    duplex_client() = delete;
+
+    // disable copying until properly implemented
+    duplex_client(const duplex_client &) = delete;
+    duplex_client & operator=(const duplex_client &) = delete;
+
+  protected:
+    duplex_client(const std::string & path,
+                  uint8_t stream_type,
+                  uint64_t max_outstanding,
+                  const queue::params & prms,
+                  const simple_gateway::options & opts);
+
+  public:
+    // closes the stream
+    virtual ~duplex_client();
+
+    // the client has its own simple_client on path, the stream starts
+    // with the first request
+    static sptr create(const std::string & path,
+                       uint8_t stream_type,
+                       uint64_t max_outstanding=256,
+                       const queue::params & prms=queue::params(),
+                       const simple_gateway::options & opts=simple_gateway::options());
+
+    // queues a request and returns its tag. blocks while max_outstanding
+    // requests wait for their response, throws once the stream is closed
+    uint64_t call(const uint8_t * data,
+                  uint64_t size,
+                  response_fun done);
+    std::future<std::string> call(const std::string & request);
+
+    // waits up to timeout_ms for the outstanding responses, then ends the
+    // stream. the ones still missing get ok == false
+    void close(uint64_t timeout_ms=1000);
+
+    bool is_open() const;
+    uint64_t outstanding() const;
+    uint64_t completed() const;
+  };
+
+  class duplex_server
+  {
+    struct channel;
+    class coroutine;
+
+  public:
+    typedef std::shared_ptr<duplex_server>  sptr;
+
+    // answers one request, from any thread. answers after the client
+    // closed the stream are dropped and return false
+    class responder
+    {
+      friend class duplex_server;
+
+      std::shared_ptr<channel>  channel_;
+      uint64_t                  tag_;
+
+      responder(std::shared_ptr<channel> ch,
+                uint64_t tag);
+
+    public:
+      uint64_t tag() const;
+      bool operator()(const uint8_t * data,
+                      uint64_t size) const;
+      bool operator()(const std::string & response) const;
+    };
+
+    // runs on the server's dispatcher thread, respond may be kept and
+    // called later
+    typedef std::function<void(bytes_view request,
+                               const responder & respond)>  request_fun;
+
+  private:
+    simple_server::sptr     server_;
+    request_fun             handler_;
+    std::atomic<uint64_t>   requests_;
+    std::atomic<uint64_t>   channels_;
+
+    // disable default construction
+    duplex_server() = delete;
+
+    // disable copying until properly implemented
+    duplex_server(const duplex_server &) = delete;
+    duplex_server & operator=(const duplex_server &) = delete;
+
+  protected:
+    duplex_server(simple_server::sptr server,
+                  uint8_t stream_type,
+                  request_fun handler);
+
+  public:
+    virtual ~duplex_server();
+
+    // registers a coroutine handler for stream_type on server, keep the
+    // duplex_server as long as the server runs
+    static sptr create(simple_server::sptr server,
+                       uint8_t stream_type,
+                       request_fun handler);
+
+    uint64_t requests() const;
+    // channels open now
+    uint64_t channels() const;
+  };
+
 }}
@@ -0,0 +1,264 @@
+#include <gateway/fanout_gateway.hh>
+#include <gateway/exception.hh>
+#include <queue/varint.hh>
+
+// C libs
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+
+namespace virtdb { namespace gateway {
+
+  namespace
+  {
+    void
+    make_dir(const std::string & path)
+    {
+      if( ::mkdir(path.c_str(), 0700) != 0 && errno != EEXIST )
+      {
+        THROW_(std::string{"failed to create folder at: "}+path);
+      }
+    }
+
+    // creates the folders before the queue and position files are opened
+    std::string
+    fanout_path(const std::string & path,
+                const std::string & file)
+    {
+      make_dir(path);
+      make_dir(path+"/cursors");
+      return path + "/" + file;
+    }
+  }
+
+  fanout_publisher::fanout_publisher(const std::string & path,
+                                     const queue::params & prms)
+  : path_{path},
+    sender_{fanout_path(path, "fanout"), prms},
+    head_{path+"/fanout.head"}
+  {
+    head_.store(sender_.position());
+  }
+
+  fanout_publisher::~fanout_publisher() {}
+
+  fanout_publisher::sptr
+  fanout_publisher::create(const std::string & path,
+                           const queue::params & prms)
+  {
+    sptr ret{new fanout_publisher{path, prms}};
+    return ret;
+  }
+
+  uint64_t
+  fanout_publisher::publish(uint8_t stream_type,
+                            simple_gateway::feeder_fun feeder)
+  {
+    using namespace virtdb::queue;
+
+    std::lock_guard<std::mutex> lock{mtx_};
+
+    uint64_t id = sender_.position();
+    uint64_t seqno = 0;
+    bool send_more = true;
+
+    while( send_more )
+    {
+      simple_gateway::stream_part part;
+      part.id_     = id;
+      part.seqno_  = seqno;
+      send_more = feeder(part);
+
+      simple_publisher::buffer_vector data_vec;
+      uint8_t type_start[2] = { 0, stream_type };
+      varint v_id{id};
+      varint v_seqno{seqno};
+
+      if( seqno == 0 )
+      {
+        type_start[0] = (send_more ? simple_gateway::EV_START : simple_gateway::EV_ONE);
+        data_vec.push_back(simple_publisher::buffer{type_start, 2});
+        data_vec.push_back(simple_publisher::buffer{v_id.buf(), v_id.len()});
+      }
+      else
+      {
+        type_start[0] = (send_more ? simple_gateway::EV_NEXT : simple_gateway::EV_END);
+        data_vec.push_back(simple_publisher::buffer{type_start, 1});
+        data_vec.push_back(simple_publisher::buffer{v_id.buf(), v_id.len()});
+        data_vec.push_back(simple_publisher::buffer{v_seqno.buf(), v_seqno.len()});
+      }
+
+      if( part.size_ > 0 && part.buffer_ != nullptr )
+        data_vec.push_back(simple_publisher::buffer{part.buffer_, part.size_});
+
+      sender_.push(data_vec);
+      head_.store(sender_.position());
+      ++seqno;
+    }
+    return id;
+  }
+
+  uint64_t
+  fanout_publisher::position() const
+  {
+    return sender_.position();
+  }
+
+  std::map<std::string, uint64_t>
+  fanout_publisher::cursors() const
+  {
+    std::map<std::string, uint64_t> ret;
+    std::string dir_path{path_+"/cursors"};
+    DIR * dir = ::opendir(dir_path.c_str());
+    if( !dir )
+      return ret;
+
+    while( struct dirent * e = ::readdir(dir) )
+    {
+      if( e->d_name[0] == '.' )
+        continue;
+      try
+      {
+        position_file cursor{dir_path+"/"+e->d_name, true};
+        ret[e->d_name] = cursor.load();
+      }
+      catch(...) { }
+    }
+    ::closedir(dir);
+    return ret;
+  }
+
+  std::map<std::string, uint64_t>
+  fanout_publisher::subscriber_lags() const
+  {
+    std::map<std::string, uint64_t> ret;
+    uint64_t head = head_.load();
+    for( auto & c : cursors() )
+      ret[c.first] = (head > c.second ? head-c.second : 0);
+    return ret;
+  }
+
+  uint64_t
+  fanout_publisher::reclaim()
+  {
+    std::lock_guard<std::mutex> lock{mtx_};
+    uint64_t mark = sender_.position();
+    for( auto & c : cursors() )
+      if( c.second < mark ) mark = c.second;
+    sender_.cleanup_all_before(mark);
+    return mark;
+  }
+
+  fanout_subscriber::fanout_subscriber(const std::string & path,
+                                       const std::string & name,
+                                       bool resume,
+                                       const queue::params & prms)
+  : name_{name},
+    receiver_{fanout_path(path, "fanout"), prms},
+    cursor_{path+"/cursors/"+name},
+    head_{path+"/fanout.head"},
+    messages_{0},
+    bytes_{0}
+  {
+    // a resumed cursor may well be at 0, with the whole queue to read
+    if( !resume )
+      seek_to_end();
+  }
+
+  fanout_subscriber::~fanout_subscriber() {}
+
+  fanout_subscriber::sptr
+  fanout_subscriber::create(const std::string & path,
+                            const std::string & name,
+                            const queue::params & prms)
+  {
+    // the cursor file only exists once the name has subscribed
+    struct stat st;
+    bool resume = (::stat((path+"/cursors/"+name).c_str(), &st) == 0);
+
+    // a single pass when the publisher has run, which is the usual case
+    try
+    {
+      return sptr{new fanout_subscriber{path, name, resume, prms}};
+    }
+    catch(...) { }
+
+    // the queue and the head are made, the publisher's state is left alone
+    queue::simple_publisher lane{fanout_path(path, "fanout"), prms};
+    position_file head{path+"/fanout.head"};
+    sptr ret{new fanout_subscriber{path, name, resume, prms}};
+    return ret;
+  }
+
+  uint64_t
+  fanout_subscriber::poll(part_fun f,
+                          uint64_t timeout_ms)
+  {
+    uint64_t from = cursor_.load();
+    auto pull = [&](uint64_t msg_id,
+                    const uint8_t * ptr,
+                    uint64_t len)
+    {
+      simple_gateway::stream_part part;
+      part.position_ = msg_id;
+      bool ret = true;
+      if( simple_gateway::parse_part(ptr, len, part) )
+      {
+        ++messages_;
+        bytes_ += len;
+        ret = f(part);
+      }
+      return ret;
+    };
+
+    from = receiver_.pull(from, pull, timeout_ms);
+    cursor_.store(from);
+    return from;
+  }
+
+  void
+  fanout_subscriber::seek(uint64_t pos)
+  {
+    cursor_.store(pos);
+  }
+
+  void
+  fanout_subscriber::seek_to_end()
+  {
+    receiver_.seek_to_end();
+    cursor_.store(receiver_.position());
+  }
+
+  const std::string &
+  fanout_subscriber::name() const
+  {
+    return name_;
+  }
+
+  uint64_t
+  fanout_subscriber::cursor() const
+  {
+    return cursor_.load();
+  }
+
+  uint64_t
+  fanout_subscriber::lag() const
+  {
+    uint64_t head = head_.load();
+    uint64_t pos = cursor_.load();
+    return (head > pos ? head-pos : 0);
+  }
+
+  uint64_t
+  fanout_subscriber::messages() const
+  {
+    return messages_.load();
+  }
+
+  uint64_t
+  fanout_subscriber::bytes() const
+  {
+    return bytes_.load();
+  }
+
+}}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <gateway/simple_gateway.hh>
+#include <gateway/position_file.hh>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <atomic>
+
+namespace virtdb { namespace gateway {
+
+  // push-sub*: streams are published once into path/fanout, every
+  // subscriber reads the same queue at its own cursor, kept in
+  // path/cursors/<name>. the publisher never waits for subscribers
+  class fanout_publisher
+  {
+    std::string               path_;
+    queue::simple_publisher   sender_;
+    position_file             head_;
+    std::mutex                mtx_;
+
+    // cursor positions by subscriber name
+    std::map<std::string, uint64_t> cursors() const;
+
+    // disable default construction
+    fanout_publisher() = delete;
+
+    // disable copying until properly implemented
+    fanout_publisher(const fanout_publisher &) = delete;
+    fanout_publisher & operator=(const fanout_publisher &) = delete;
+
+  protected:
+    fanout_publisher(const std::string & path,
+                     const queue::params & prms);
+
+  public:
+    typedef std::shared_ptr<fanout_publisher> sptr;
+
+    virtual ~fanout_publisher();
+    static sptr create(const std::string & path,
+                       const queue::params & prms=queue::params());
+
+    // sends the parts returned by the feeder as one stream, returns its id
+    uint64_t publish(uint8_t stream_type,
+                     simple_gateway::feeder_fun feeder);
+
+    uint64_t position() const;
+
+    // bytes not yet read, per subscriber name
+    std::map<std::string, uint64_t> subscriber_lags() const;
+
+    // drops the queue below the slowest cursor and returns that position.
+    // every cursor file holds the queue back, the one of a subscriber gone
+    // for good has to be removed
+    uint64_t reclaim();
+  };
+
+  class fanout_subscriber
+  {
+  public:
+    typedef std::shared_ptr<fanout_subscriber>                            sptr;
+    // the part points into the queue, valid until the callback returns.
+    // returning false stops the poll
+    typedef std::function<bool(const simple_gateway::stream_part & part)> part_fun;
+
+  private:
+    std::string                 name_;
+    queue::simple_subscriber    receiver_;
+    position_file               cursor_;
+    position_file               head_;
+    std::atomic<uint64_t>       messages_;
+    std::atomic<uint64_t>       bytes_;
+
+    // disable default construction
+    fanout_subscriber() = delete;
+
+    // disable copying until properly implemented
+    fanout_subscriber(const fanout_subscriber &) = delete;
+    fanout_subscriber & operator=(const fanout_subscriber &) = delete;
+
+  protected:
+    fanout_subscriber(const std::string & path,
+                      const std::string & name,
+                      bool resume,
+                      const queue::params & prms);
+
+  public:
+    virtual ~fanout_subscriber();
+
+    // an existing cursor of the same name is resumed, a new one starts
+    // at the end of the queue
+    static sptr create(const std::string & path,
+                       const std::string & name,
+                       const queue::params & prms=queue::params());
+
+    // reads the parts published since the cursor, returns the new cursor
+    uint64_t poll(part_fun f,
+                  uint64_t timeout_ms);
+
+    void seek(uint64_t pos);
+    void seek_to_end();
+
+    const std::string & name() const;
+    uint64_t cursor() const;
+    uint64_t lag() const;
+    uint64_t messages() const;
+    uint64_t bytes() const;
+  };
+
+}}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace virtdb { namespace gateway {
+
+  // free lists of fixed size frames in 64 byte classes. frames are carved
+  // from chunks that are kept until the pool goes away, so a server that
+  // keeps starting the same kind of handler stops allocating
+  class frame_pool
+  {
+    static const size_t CLASS_SIZE    = 64;
+    static const size_t CHUNK_FRAMES  = 32;
+
+    struct free_frame
+    {
+      free_frame * next_;
+    };
+
+    std::vector<free_frame *>               free_;
+    std::vector<std::unique_ptr<uint8_t[]>> chunks_;
+    uint64_t                                reserved_;
+    uint64_t                                in_use_;
+
+    // disable copying until properly implemented
+    frame_pool(const frame_pool &) = delete;
+    frame_pool & operator=(const frame_pool &) = delete;
+
+    static size_t size_class(size_t size)
+    {
+      return (size + CLASS_SIZE - 1) / CLASS_SIZE;
+    }
+
+  public:
+    typedef std::shared_ptr<frame_pool> sptr;
+
+    frame_pool()
+    : reserved_{0},
+      in_use_{0}
+    {
+    }
+
+    void * allocate(size_t size)
+    {
+      size_t cls = size_class(size ? size : 1);
+      if( cls >= free_.size() )
+        free_.resize(cls+1, nullptr);
+
+      if( !free_[cls] )
+      {
+        // a new chunk for this class, threaded onto the free list
+        size_t frame_size = cls * CLASS_SIZE;
+        std::unique_ptr<uint8_t[]> chunk{new uint8_t[frame_size*CHUNK_FRAMES]};
+        for( size_t i=0; i<CHUNK_FRAMES; ++i )
+        {
+          free_frame * f = reinterpret_cast<free_frame *>(chunk.get() + i*frame_size);
+          f->next_   = free_[cls];
+          free_[cls] = f;
+        }
+        reserved_ += frame_size*CHUNK_FRAMES;
+        chunks_.push_back(std::move(chunk));
+      }
+
+      free_frame * ret = free_[cls];
+      free_[cls] = ret->next_;
+      ++in_use_;
+      return ret;
+    }
+
+    // size must be the one passed to allocate()
+    void release(void * p,
+                 size_t size)
+    {
+      if( !p ) return;
+      size_t cls = size_class(size ? size : 1);
+      free_frame * f = static_cast<free_frame *>(p);
+      f->next_   = free_[cls];
+      free_[cls] = f;
+      --in_use_;
+    }
+
+    // what a frame of size really takes from its chunk
+    static size_t frame_bytes(size_t size)
+    {
+      return size_class(size ? size : 1) * CLASS_SIZE;
+    }
+
+    uint64_t in_use() const    { return in_use_; }
+    uint64_t reserved() const  { return reserved_; }
+  };
+
+}}
@@ -0,0 +1,154 @@
+#include <gateway/gateway_pool.hh>
+#include <sstream>
+
+namespace virtdb { namespace gateway {
+
+  gateway_pool::state::state(uint64_t max_idle)
+  : max_idle_{max_idle},
+    closed_{false},
+    hits_{0},
+    misses_{0}
+  {
+  }
+
+  void
+  gateway_pool::state::put_back(const std::string & key,
+                                simple_client::sptr client)
+  {
+    if( client->async_in_flight() > 0 )
+      return;
+
+    // the next user doesn't see this one's replies or stops
+    client->reset();
+
+    std::lock_guard<std::mutex> lock{mtx_};
+    if( closed_ )
+      return;
+    auto & idle = idle_[key];
+    if( idle.size() < max_idle_ )
+      idle.push_back(client);
+  }
+
+  std::string
+  gateway_pool::key(const std::string & path,
+                    const queue::params & prms,
+                    const simple_gateway::options & opts)
+  {
+    // clients with different params or options are not interchangeable.
+    // params are taken by their bytes, equal ones that differ in padding
+    // only cost a miss
+    std::ostringstream os;
+    os << path << '|' << std::hex;
+    const uint8_t * p = (const uint8_t *)&prms;
+    for( size_t i=0; i<sizeof(prms); ++i )
+      os << (unsigned)(p[i] >> 4) << (unsigned)(p[i] & 0x0f);
+    os << std::dec << '|' << opts.concurrent_send_ << ',' << opts.send_slots_
+       << ',' << opts.oob_threshold_ << ',' << opts.crc_ << ',' << opts.timestamp_
+       << ',' << opts.reclaim_interval_ms_ << ',' << opts.placement_.huge_pages_
+       << ',' << opts.placement_.numa_node_;
+    for( int cpu : opts.placement_.cpus_ )
+      os << ',' << cpu;
+    return os.str();
+  }
+
+  gateway_pool::gateway_pool(uint64_t max_idle)
+  : state_{new state{max_idle}}
+  {
+  }
+
+  gateway_pool::~gateway_pool()
+  {
+    std::lock_guard<std::mutex> lock{state_->mtx_};
+    state_->closed_ = true;
+    state_->idle_.clear();
+  }
+
+  gateway_pool &
+  gateway_pool::instance()
+  {
+    static gateway_pool pool;
+    return pool;
+  }
+
+  simple_client::sptr
+  gateway_pool::acquire(const std::string & path,
+                        const queue::params & prms,
+                        const simple_gateway::options & opts)
+  {
+    std::string k{key(path, prms, opts)};
+    simple_client::sptr client;
+    {
+      std::lock_guard<std::mutex> lock{state_->mtx_};
+      auto it = state_->idle_.find(k);
+      if( it != state_->idle_.end() && !it->second.empty() )
+      {
+        client = it->second.back();
+        it->second.pop_back();
+      }
+    }
+
+    if( client )
+    {
+      ++(state_->hits_);
+    }
+    else
+    {
+      ++(state_->misses_);
+      client = simple_client::create(path, prms, opts);
+    }
+
+    // the user's copy gives the client back when it goes away
+    std::shared_ptr<state> st{state_};
+    return simple_client::sptr{client.get(), [st, k, client](simple_client *) {
+      st->put_back(k, client);
+    }};
+  }
+
+  void
+  gateway_pool::warm(const std::string & path,
+                     uint64_t count,
+                     const queue::params & prms,
+                     const simple_gateway::options & opts)
+  {
+    std::string k{key(path, prms, opts)};
+    while( idle(path, prms, opts) < count )
+    {
+      simple_client::sptr client{simple_client::create(path, prms, opts)};
+      std::lock_guard<std::mutex> lock{state_->mtx_};
+      auto & idle = state_->idle_[k];
+      if( idle.size() >= state_->max_idle_ )
+        break;
+      idle.push_back(client);
+    }
+  }
+
+  void
+  gateway_pool::clear()
+  {
+    std::lock_guard<std::mutex> lock{state_->mtx_};
+    state_->idle_.clear();
+  }
+
+  uint64_t
+  gateway_pool::idle(const std::string & path,
+                     const queue::params & prms,
+                     const simple_gateway::options & opts) const
+  {
+    std::lock_guard<std::mutex> lock{state_->mtx_};
+    auto it = state_->idle_.find(key(path, prms, opts));
+    return (it == state_->idle_.end() ? 0 : it->second.size());
+  }
+
+  uint64_t
+  gateway_pool::hits() const
+  {
+    return state_->hits_.load();
+  }
+
+  uint64_t
+  gateway_pool::misses() const
+  {
+    return state_->misses_.load();
+  }
+
+}}
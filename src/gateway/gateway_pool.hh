@@ -0,0 +1,80 @@
+#pragma once
+
+#include <gateway/simple_gateway.hh>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace virtdb { namespace gateway {
+
+  // connected clients kept per gateway folder, queue params and options,
+  // so short lived users skip the connect. a client goes to one user at a
+  // time and comes back to the pool when the last copy of the returned
+  // pointer is gone, unless it still has async streams or the pool is
+  // gone. it is reset on the way back, the next user starts at the queue
+  // positions the last one left it at
+  class gateway_pool
+  {
+  public:
+    typedef std::shared_ptr<gateway_pool>  sptr;
+
+  private:
+    // shared with the returned pointers, which may outlive the pool
+    struct state
+    {
+      std::mutex                                               mtx_;
+      std::map<std::string, std::vector<simple_client::sptr>>  idle_;
+      uint64_t                                                 max_idle_;
+      bool                                                     closed_;
+      std::atomic<uint64_t>                                    hits_;
+      std::atomic<uint64_t>                                    misses_;
+
+      state(uint64_t max_idle);
+      void put_back(const std::string & key,
+                    simple_client::sptr client);
+    };
+
+    std::shared_ptr<state>  state_;
+
+    static std::string key(const std::string & path,
+                           const queue::params & prms,
+                           const simple_gateway::options & opts);
+
+    // disable copying until properly implemented
+    gateway_pool(const gateway_pool &) = delete;
+    gateway_pool & operator=(const gateway_pool &) = delete;
+
+  public:
+    // at most max_idle clients kept per folder and options
+    gateway_pool(uint64_t max_idle=8);
+    virtual ~gateway_pool();
+
+    // the process wide pool
+    static gateway_pool & instance();
+
+    // an idle client, or a new one
+    simple_client::sptr acquire(const std::string & path,
+                                const queue::params & prms=queue::params(),
+                                const simple_gateway::options & opts=simple_gateway::options());
+
+    // connects up to count idle clients ahead of use
+    void warm(const std::string & path,
+              uint64_t count,
+              const queue::params & prms=queue::params(),
+              const simple_gateway::options & opts=simple_gateway::options());
+
+    // drops the idle clients
+    void clear();
+
+    uint64_t idle(const std::string & path,
+                  const queue::params & prms=queue::params(),
+                  const simple_gateway::options & opts=simple_gateway::options()) const;
+    uint64_t hits() const;
+    uint64_t misses() const;
+  };
+
+}}
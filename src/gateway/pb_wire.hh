@@ -0,0 +1,146 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace virtdb { namespace gateway {
+
+  // minimal protobuf wire format helpers. the reader never copies, length
+  // delimited fields point into the original buffer
+  class pb_reader
+  {
+  public:
+    static const uint8_t WT_VARINT     = 0;
+    static const uint8_t WT_FIXED64    = 1;
+    static const uint8_t WT_LENGTH     = 2;
+    static const uint8_t WT_FIXED32    = 5;
+
+  private:
+    const uint8_t *  ptr_;
+    const uint8_t *  end_;
+    bool             failed_;
+
+  public:
+    pb_reader(const uint8_t * ptr,
+              uint64_t len)
+    : ptr_{ptr},
+      end_{ptr+len},
+      failed_{false}
+    {
+    }
+
+    bool at_end() const   { return ptr_ >= end_ || failed_; }
+    bool failed() const   { return failed_; }
+
+    bool varint(uint64_t & result)
+    {
+      result = 0;
+      for( int shift=0; shift<64 && ptr_ < end_; shift+=7 )
+      {
+        uint8_t b = *ptr_++;
+        result |= (uint64_t)(b & 0x7f) << shift;
+        if( (b & 0x80) == 0 )
+          return true;
+      }
+      failed_ = true;
+      return false;
+    }
+
+    bool tag(uint32_t & field,
+             uint8_t & wire_type)
+    {
+      uint64_t t = 0;
+      if( !varint(t) ) return false;
+      field      = (uint32_t)(t >> 3);
+      wire_type  = (uint8_t)(t & 7);
+      return true;
+    }
+
+    bool fixed64(uint64_t & result)
+    {
+      if( end_-ptr_ < 8 ) { failed_ = true; return false; }
+      ::memcpy(&result, ptr_, 8);
+      ptr_ += 8;
+      return true;
+    }
+
+    bool fixed32(uint32_t & result)
+    {
+      if( end_-ptr_ < 4 ) { failed_ = true; return false; }
+      ::memcpy(&result, ptr_, 4);
+      ptr_ += 4;
+      return true;
+    }
+
+    bool length_delimited(const uint8_t *& data,
+                          uint64_t & len)
+    {
+      if( !varint(len) ) return false;
+      if( (uint64_t)(end_-ptr_) < len ) { failed_ = true; return false; }
+      data  = ptr_;
+      ptr_ += len;
+      return true;
+    }
+
+    bool skip(uint8_t wire_type)
+    {
+      uint64_t         v64  = 0;
+      uint32_t         v32  = 0;
+      const uint8_t *  data = nullptr;
+      switch( wire_type )
+      {
+        case WT_VARINT:   return varint(v64);
+        case WT_FIXED64:  return fixed64(v64);
+        case WT_LENGTH:   return length_delimited(data, v64);
+        case WT_FIXED32:  return fixed32(v32);
+        default:          failed_ = true; return false;
+      }
+    }
+  };
+
+  // the counterpart of pb_reader, appends to a string buffer
+  class pb_writer
+  {
+    std::string & out_;
+
+  public:
+    pb_writer(std::string & out) : out_(out) {}
+
+    void varint(uint64_t v)
+    {
+      do
+      {
+        uint8_t b = v & 0x7f;
+        v >>= 7;
+        if( v ) b |= 0x80;
+        out_.push_back((char)b);
+      } while( v );
+    }
+
+    void tag(uint32_t field,
+             uint8_t wire_type)
+    {
+      varint(((uint64_t)field << 3) | wire_type);
+    }
+
+    void varint_field(uint32_t field, uint64_t v)
+    {
+      tag(field, pb_reader::WT_VARINT);
+      varint(v);
+    }
+
+    void bytes_field(uint32_t field, const void * data, uint64_t len)
+    {
+      tag(field, pb_reader::WT_LENGTH);
+      varint(len);
+      out_.append((const char *)data, len);
+    }
+
+    void string_field(uint32_t field, const std::string & s)
+    {
+      bytes_field(field, s.data(), s.size());
+    }
+  };
+
+}}
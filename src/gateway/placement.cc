@@ -0,0 +1,201 @@
+#include <gateway/placement.hh>
+#include <fstream>
+#include <sstream>
+
+#ifdef GATEWAY_LINUX_BUILD
+// C libs
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+namespace virtdb { namespace gateway {
+
+  namespace
+  {
+    // numaif.h values, so libnuma is not needed
+    const int       MPOL_PREFERRED_  = 1;
+    const int       MPOL_BIND_       = 2;
+    const unsigned  MPOL_MF_MOVE_    = (1<<1);
+    const uint64_t  MAX_NODES        = 64;
+
+    // "0-3,8,10-11" as in /sys/devices/system/node
+    std::vector<int>
+    parse_list(const std::string & list)
+    {
+      std::vector<int> ret;
+      std::istringstream is{list};
+      std::string range;
+      while( std::getline(is, range, ',') )
+      {
+        if( range.empty() )
+          continue;
+        size_t dash = range.find('-');
+        int from = std::stoi(range.substr(0, dash));
+        int to   = (dash == std::string::npos ? from : std::stoi(range.substr(dash+1)));
+        for( int i=from; i<=to; ++i )
+          ret.push_back(i);
+      }
+      return ret;
+    }
+
+    std::vector<int>
+    read_list(const std::string & path)
+    {
+      std::ifstream f{path};
+      std::string line;
+      if( !f || !std::getline(f, line) )
+        return std::vector<int>{};
+      try
+      {
+        return parse_list(line);
+      }
+      catch(...)
+      {
+        return std::vector<int>{};
+      }
+    }
+  }
+
+  placement::placement()
+  : huge_pages_{false},
+    numa_node_{-1}
+  {
+  }
+
+  bool
+  placement::empty() const
+  {
+    return !huge_pages_ && numa_node_ < 0 && cpus_.empty();
+  }
+
+#ifdef GATEWAY_LINUX_BUILD
+
+  bool
+  place_memory(void * addr,
+               uint64_t len,
+               const placement & p)
+  {
+    if( addr == nullptr || len == 0 )
+      return false;
+
+    // both calls want whole pages
+    uint64_t page   = (uint64_t)::sysconf(_SC_PAGESIZE);
+    uint64_t start  = ((uint64_t)addr) & ~(page-1);
+    len = ((((uint64_t)addr) + len - start) + page - 1) & ~(page-1);
+
+    bool ret = true;
+#ifdef MADV_HUGEPAGE
+    if( p.huge_pages_ && ::madvise((void *)start, len, MADV_HUGEPAGE) != 0 )
+      ret = false;
+#else
+    if( p.huge_pages_ )
+      ret = false;
+#endif
+
+    if( p.numa_node_ >= 0 && (uint64_t)p.numa_node_ < MAX_NODES )
+    {
+      unsigned long mask = (1UL << p.numa_node_);
+      if( ::syscall(SYS_mbind, start, len, MPOL_BIND_, &mask, MAX_NODES, MPOL_MF_MOVE_) != 0 )
+        ret = false;
+    }
+    return ret;
+  }
+
+  uint64_t
+  place_mappings(const std::string & prefix,
+                 const placement & p)
+  {
+    uint64_t ret = 0;
+    if( p.empty() || prefix.empty() )
+      return ret;
+
+    // start-end perms offset dev inode path
+    std::ifstream maps{"/proc/self/maps"};
+    std::string line;
+    while( std::getline(maps, line) )
+    {
+      size_t path_at = line.find('/');
+      if( path_at == std::string::npos || line.compare(path_at, prefix.size(), prefix) != 0 )
+        continue;
+
+      uint64_t start = 0, end = 0;
+      char dash = 0;
+      std::istringstream is{line};
+      is >> std::hex >> start >> dash >> end;
+      if( !is || dash != '-' || end <= start )
+        continue;
+
+      if( place_memory((void *)start, end-start, p) )
+        ret += end-start;
+    }
+    return ret;
+  }
+
+  bool
+  place_thread(const placement & p)
+  {
+    bool ret = true;
+    if( !p.cpus_.empty() )
+    {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for( int cpu : p.cpus_ )
+        if( cpu >= 0 && cpu < CPU_SETSIZE )
+          CPU_SET(cpu, &set);
+      if( ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set) != 0 )
+        ret = false;
+    }
+
+    if( p.numa_node_ >= 0 && (uint64_t)p.numa_node_ < MAX_NODES )
+    {
+      unsigned long mask = (1UL << p.numa_node_);
+      if( ::syscall(SYS_set_mempolicy, MPOL_PREFERRED_, &mask, MAX_NODES) != 0 )
+        ret = false;
+    }
+    return ret;
+  }
+
+#else
+
+  bool
+  place_memory(void * addr,
+               uint64_t len,
+               const placement & p)
+  {
+    return false;
+  }
+
+  uint64_t
+  place_mappings(const std::string & prefix,
+                 const placement & p)
+  {
+    return 0;
+  }
+
+  bool
+  place_thread(const placement & p)
+  {
+    return false;
+  }
+
+#endif
+
+  std::vector<int>
+  numa_nodes()
+  {
+    std::vector<int> ret = read_list("/sys/devices/system/node/online");
+    if( ret.empty() )
+      ret.push_back(0);
+    return ret;
+  }
+
+  std::vector<int>
+  node_cpus(int node)
+  {
+    return read_list("/sys/devices/system/node/node"+std::to_string(node)+"/cpulist");
+  }
+
+}}
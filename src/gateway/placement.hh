@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace virtdb { namespace gateway {
+
+  // where the gateway's memory and threads go. the defaults leave
+  // everything to the OS. only Linux builds act on it, elsewhere the
+  // calls below do nothing and return false
+  struct placement
+  {
+    // madvise(MADV_HUGEPAGE) on queue and out-of-band mappings
+    bool               huge_pages_;
+    // mbind() the mappings and prefer the node for the pages our threads
+    // fault in, -1 is any node
+    int                numa_node_;
+    // the gateway's own threads run on these CPUs, empty is any
+    std::vector<int>   cpus_;
+
+    placement();
+    bool empty() const;
+  };
+
+  // applies the page and node settings to an existing mapping
+  bool place_memory(void * addr,
+                    uint64_t len,
+                    const placement & p);
+
+  // the mappings of the files under prefix, as listed in /proc/self/maps.
+  // the queue maps its segments itself, this is how they are reached.
+  // returns the number of bytes placed
+  uint64_t place_mappings(const std::string & prefix,
+                          const placement & p);
+
+  // pins the calling thread to cpus_ and makes numa_node_ its preferred
+  // node for new pages
+  bool place_thread(const placement & p);
+
+  // the online NUMA nodes and their CPUs, node 0 only if unknown
+  std::vector<int> numa_nodes();
+  std::vector<int> node_cpus(int node);
+
+}}
@@ -0,0 +1,73 @@
+#include <gateway/position_file.hh>
+#include <gateway/exception.hh>
+
+// C libs
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace virtdb { namespace gateway {
+
+  position_file::position_file(const std::string & path,
+                               bool read_only)
+  : path_{path},
+    fd_{-1},
+    pos_{nullptr}
+  {
+    fd_ = ::open(path_.c_str(), (read_only ? O_RDONLY : O_RDWR|O_CREAT), 0600);
+    if( fd_ < 0 )
+    {
+      THROW_(std::string{"failed to open position file: "}+path);
+    }
+
+    struct stat st;
+    if( ::fstat(fd_, &st) != 0 ||
+        ((uint64_t)st.st_size < sizeof(uint64_t) && (read_only || ::ftruncate(fd_, sizeof(uint64_t)) != 0)) )
+    {
+      ::close(fd_);
+      THROW_(std::string{"failed to size position file: "}+path);
+    }
+
+    void * p = ::mmap(nullptr, sizeof(uint64_t), (read_only ? PROT_READ : PROT_READ|PROT_WRITE), MAP_SHARED, fd_, 0);
+    if( p == MAP_FAILED )
+    {
+      ::close(fd_);
+      THROW_(std::string{"failed to map position file: "}+path);
+    }
+    pos_ = (uint64_t *)p;
+  }
+
+  position_file::~position_file()
+  {
+    if( pos_ ) ::munmap(pos_, sizeof(uint64_t));
+    if( fd_ >= 0 ) ::close(fd_);
+  }
+
+  uint64_t
+  position_file::load() const
+  {
+    return __atomic_load_n(pos_, __ATOMIC_ACQUIRE);
+  }
+
+  void
+  position_file::store(uint64_t pos)
+  {
+    __atomic_store_n(pos_, pos, __ATOMIC_RELEASE);
+  }
+
+  bool
+  position_file::compare_exchange(uint64_t & expected,
+                                  uint64_t desired)
+  {
+    return __atomic_compare_exchange_n(pos_, &expected, desired, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+  }
+
+  const std::string &
+  position_file::path() const
+  {
+    return path_;
+  }
+
+}}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace virtdb { namespace gateway {
+
+  // a uint64_t position shared between processes through a mapped file
+  class position_file
+  {
+    std::string   path_;
+    int           fd_;
+    uint64_t *    pos_;
+
+    // disable default construction
+    position_file() = delete;
+
+    // disable copying until properly implemented
+    position_file(const position_file &) = delete;
+    position_file & operator=(const position_file &) = delete;
+
+  public:
+    typedef std::shared_ptr<position_file> sptr;
+
+    // read_only opens an existing file, otherwise it is created if needed
+    position_file(const std::string & path,
+                  bool read_only=false);
+    virtual ~position_file();
+
+    uint64_t load() const;
+    void store(uint64_t pos);
+    // atomic on the shared mapping, so processes sharing the file may
+    // race on it. expected is updated when it fails
+    bool compare_exchange(uint64_t & expected,
+                          uint64_t desired);
+    const std::string & path() const;
+  };
+
+}}
@@ -0,0 +1,535 @@
+#include <gateway/pushdown.hh>
+#include <gateway/exception.hh>
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace virtdb { namespace gateway {
+
+  namespace
+  {
+    template <typename T>
+    void
+    compare_scalar(const T * v,
+                   uint64_t n,
+                   pushdown::op_type op,
+                   T x,
+                   uint8_t * mask)
+    {
+      // branch free loops, the compiler vectorizes these
+      switch( op )
+      {
+        case pushdown::OP_EQ:  for( uint64_t i=0; i<n; ++i ) mask[i] &= (uint8_t)(v[i] == x); break;
+        case pushdown::OP_NE:  for( uint64_t i=0; i<n; ++i ) mask[i] &= (uint8_t)(v[i] != x); break;
+        case pushdown::OP_LT:  for( uint64_t i=0; i<n; ++i ) mask[i] &= (uint8_t)(v[i] <  x); break;
+        case pushdown::OP_LE:  for( uint64_t i=0; i<n; ++i ) mask[i] &= (uint8_t)(v[i] <= x); break;
+        case pushdown::OP_GT:  for( uint64_t i=0; i<n; ++i ) mask[i] &= (uint8_t)(v[i] >  x); break;
+        case pushdown::OP_GE:  for( uint64_t i=0; i<n; ++i ) mask[i] &= (uint8_t)(v[i] >= x); break;
+        default: break;
+      };
+    }
+
+#if defined(__SSE2__)
+    // movemask bits to one byte per row
+    const uint32_t expand4[16] = {
+      0x00000000, 0x00000001, 0x00000100, 0x00000101,
+      0x00010000, 0x00010001, 0x00010100, 0x00010101,
+      0x01000000, 0x01000001, 0x01000100, 0x01000101,
+      0x01010000, 0x01010001, 0x01010100, 0x01010101,
+    };
+
+    inline void
+    and_mask4(uint8_t * mask,
+              int bits)
+    {
+      uint32_t m = 0;
+      ::memcpy(&m, mask, 4);
+      m &= expand4[bits & 0xf];
+      ::memcpy(mask, &m, 4);
+    }
+
+    void
+    compare_double(const double * v,
+                   uint64_t n,
+                   pushdown::op_type op,
+                   double x,
+                   uint8_t * mask)
+    {
+      __m128d xx = _mm_set1_pd(x);
+      uint64_t i = 0;
+      for( ; i+4 <= n; i+=4 )
+      {
+        __m128d a = _mm_loadu_pd(v+i);
+        __m128d b = _mm_loadu_pd(v+i+2);
+        __m128d ra, rb;
+        switch( op )
+        {
+          case pushdown::OP_EQ:  ra = _mm_cmpeq_pd(a, xx);  rb = _mm_cmpeq_pd(b, xx);  break;
+          case pushdown::OP_NE:  ra = _mm_cmpneq_pd(a, xx); rb = _mm_cmpneq_pd(b, xx); break;
+          case pushdown::OP_LT:  ra = _mm_cmplt_pd(a, xx);  rb = _mm_cmplt_pd(b, xx);  break;
+          case pushdown::OP_LE:  ra = _mm_cmple_pd(a, xx);  rb = _mm_cmple_pd(b, xx);  break;
+          case pushdown::OP_GT:  ra = _mm_cmpgt_pd(a, xx);  rb = _mm_cmpgt_pd(b, xx);  break;
+          case pushdown::OP_GE:  ra = _mm_cmpge_pd(a, xx);  rb = _mm_cmpge_pd(b, xx);  break;
+          default: return;
+        };
+        and_mask4(mask+i, _mm_movemask_pd(ra) | (_mm_movemask_pd(rb) << 2));
+      }
+      compare_scalar(v+i, n-i, op, x, mask+i);
+    }
+
+    void
+    compare_int32(const int32_t * v,
+                  uint64_t n,
+                  pushdown::op_type op,
+                  int32_t x,
+                  uint8_t * mask)
+    {
+      __m128i xx = _mm_set1_epi32(x);
+      uint64_t i = 0;
+      for( ; i+4 <= n; i+=4 )
+      {
+        __m128i a = _mm_loadu_si128((const __m128i *)(v+i));
+        int bits = 0;
+        switch( op )
+        {
+          // SSE2 has no LE/GE/NE, these are the negated GT/LT/EQ
+          case pushdown::OP_EQ:  bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(a, xx)));        break;
+          case pushdown::OP_NE:  bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(a, xx))) ^ 0xf;  break;
+          case pushdown::OP_LT:  bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(a, xx)));        break;
+          case pushdown::OP_LE:  bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(a, xx))) ^ 0xf;  break;
+          case pushdown::OP_GT:  bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(a, xx)));        break;
+          case pushdown::OP_GE:  bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(a, xx))) ^ 0xf;  break;
+          default: return;
+        };
+        and_mask4(mask+i, bits);
+      }
+      compare_scalar(v+i, n-i, op, x, mask+i);
+    }
+#else
+    void
+    compare_double(const double * v, uint64_t n, pushdown::op_type op, double x, uint8_t * mask)
+    {
+      compare_scalar(v, n, op, x, mask);
+    }
+
+    void
+    compare_int32(const int32_t * v, uint64_t n, pushdown::op_type op, int32_t x, uint8_t * mask)
+    {
+      compare_scalar(v, n, op, x, mask);
+    }
+#endif
+
+    int
+    compare_bytes(const bytes_view & a,
+                  const std::string & b)
+    {
+      uint64_t common = std::min<uint64_t>(a.size_, b.size());
+      int ret = (common ? ::memcmp(a.data_, b.data(), common) : 0);
+      if( ret ) return ret;
+      if( a.size_ < b.size() ) return -1;
+      if( a.size_ > b.size() ) return 1;
+      return 0;
+    }
+
+    void
+    compare_strings(const bytes_view * v,
+                    uint64_t n,
+                    pushdown::op_type op,
+                    const std::string & x,
+                    uint8_t * mask)
+    {
+      for( uint64_t i=0; i<n; ++i )
+      {
+        int c = compare_bytes(v[i], x);
+        bool r = false;
+        switch( op )
+        {
+          case pushdown::OP_EQ:  r = (c == 0); break;
+          case pushdown::OP_NE:  r = (c != 0); break;
+          case pushdown::OP_LT:  r = (c <  0); break;
+          case pushdown::OP_LE:  r = (c <= 0); break;
+          case pushdown::OP_GT:  r = (c >  0); break;
+          case pushdown::OP_GE:  r = (c >= 0); break;
+          default: break;
+        };
+        mask[i] &= (uint8_t)r;
+      }
+    }
+
+    // floating point columns compare with the doubles, or with the ints
+    // when there are no doubles. never a mix of the two
+    bool
+    doubles_from_ints(const pushdown::predicate & p)
+    {
+      return p.doubles_.empty();
+    }
+
+    uint64_t
+    operand_count(const value_view & value,
+                  const pushdown::predicate & p)
+    {
+      switch( value.kind_ )
+      {
+        case value_view::DOUBLE:
+        case value_view::FLOAT:
+          return (doubles_from_ints(p) ? p.ints_.size() : p.doubles_.size());
+        case value_view::INT32:
+        case value_view::INT64:
+        case value_view::UINT32:
+        case value_view::UINT64:
+        case value_view::BOOL:
+          return p.ints_.size();
+        default:
+          return p.strings_.size();
+      };
+    }
+
+    int64_t
+    int_operand(const pushdown::predicate & p,
+                uint64_t i)
+    {
+      return p.ints_[i];
+    }
+
+    double
+    double_operand(const pushdown::predicate & p,
+                   uint64_t i)
+    {
+      if( doubles_from_ints(p) ) return (double)p.ints_[i];
+      return p.doubles_[i];
+    }
+
+    // ANDs the comparison with the i-th operand into mask
+    void
+    compare(const value_view & value,
+            const pushdown::predicate & p,
+            pushdown::op_type op,
+            uint64_t i,
+            uint8_t * mask)
+    {
+      switch( value.kind_ )
+      {
+        case value_view::INT32:
+          compare_int32(value.int32s_.data_, value.int32s_.size_, op, (int32_t)int_operand(p, i), mask);
+          break;
+        case value_view::INT64:
+          compare_scalar(value.int64s_.data_, value.int64s_.size_, op, int_operand(p, i), mask);
+          break;
+        case value_view::UINT32:
+          compare_scalar(value.uint32s_.data_, value.uint32s_.size_, op, (uint32_t)int_operand(p, i), mask);
+          break;
+        case value_view::UINT64:
+          compare_scalar(value.uint64s_.data_, value.uint64s_.size_, op, (uint64_t)int_operand(p, i), mask);
+          break;
+        case value_view::BOOL:
+          compare_scalar(value.bools_.data_, value.bools_.size_, op, (uint8_t)(int_operand(p, i) != 0), mask);
+          break;
+        case value_view::DOUBLE:
+          compare_double(value.doubles_.data_, value.doubles_.size_, op, double_operand(p, i), mask);
+          break;
+        case value_view::FLOAT:
+          compare_scalar(value.floats_.data_, value.floats_.size_, op, (float)double_operand(p, i), mask);
+          break;
+        case value_view::BYTES:
+          compare_strings(value.bytes_.data_, value.bytes_.size_, op, p.strings_[i], mask);
+          break;
+        default:
+          compare_strings(value.strings_.data_, value.strings_.size_, op, p.strings_[i], mask);
+          break;
+      };
+    }
+
+    template <typename T>
+    array_view<T>
+    gather(const array_view<T> & in,
+           uint64_t total_rows,
+           const uint32_t * sel,
+           uint64_t n,
+           arena & a)
+    {
+      if( in.size_ != total_rows )
+        return array_view<T>{};
+      T * out = a.allocate_array<T>(n);
+      for( uint64_t i=0; i<n; ++i )
+        out[i] = in.data_[sel[i]];
+      return array_view<T>{out, n};
+    }
+  }
+
+  uint64_t
+  pushdown::rows(const value_view & value)
+  {
+    switch( value.kind_ )
+    {
+      case value_view::INT32:   return value.int32s_.size_;
+      case value_view::INT64:   return value.int64s_.size_;
+      case value_view::UINT32:  return value.uint32s_.size_;
+      case value_view::UINT64:  return value.uint64s_.size_;
+      case value_view::DOUBLE:  return value.doubles_.size_;
+      case value_view::FLOAT:   return value.floats_.size_;
+      case value_view::BOOL:    return value.bools_.size_;
+      case value_view::BYTES:   return value.bytes_.size_;
+      default:                  return value.strings_.size_;
+    };
+  }
+
+  void
+  pushdown::evaluate(const value_view & value,
+                     const predicate & p,
+                     arena & a,
+                     uint8_t * mask)
+  {
+    uint64_t n = rows(value);
+    const uint8_t * nulls = (value.is_null_.size_ == n ? value.is_null_.data_ : nullptr);
+
+    if( p.op_ == OP_IS_NULL )
+    {
+      if( nulls ) for( uint64_t i=0; i<n; ++i ) mask[i] &= nulls[i];
+      else        ::memset(mask, 0, n);
+      return;
+    }
+
+    if( p.op_ != OP_NOT_NULL )
+    {
+      uint64_t operands = operand_count(value, p);
+      if( operands == 0 )
+      {
+        ::memset(mask, 0, n);
+        return;
+      }
+
+      if( p.op_ == OP_IN )
+      {
+        // OR the equality masks of the list members
+        uint8_t * any  = a.allocate_array<uint8_t>(n);
+        uint8_t * one  = a.allocate_array<uint8_t>(n);
+        ::memset(any, 0, n);
+        for( uint64_t i=0; i<operands; ++i )
+        {
+          ::memset(one, 1, n);
+          compare(value, p, OP_EQ, i, one);
+          for( uint64_t r=0; r<n; ++r ) any[r] |= one[r];
+        }
+        for( uint64_t r=0; r<n; ++r ) mask[r] &= any[r];
+      }
+      else
+      {
+        compare(value, p, p.op_, 0, mask);
+      }
+    }
+
+    // NULLs never match a comparison
+    if( nulls )
+    {
+      for( uint64_t i=0; i<n; ++i )
+        mask[i] &= (uint8_t)(nulls[i] == 0);
+    }
+  }
+
+  uint64_t
+  pushdown::build_selection(const uint8_t * mask,
+                            uint64_t n,
+                            uint32_t * sel)
+  {
+    uint64_t k = 0;
+    for( uint64_t i=0; i<n; ++i )
+    {
+      sel[k] = (uint32_t)i;
+      k += (mask[i] != 0);
+    }
+    return k;
+  }
+
+  void
+  pushdown::apply(const value_view & in,
+                  const uint32_t * sel,
+                  uint64_t n,
+                  arena & a,
+                  value_view & out)
+  {
+    uint64_t total = rows(in);
+    out.kind_     = in.kind_;
+    out.strings_  = gather(in.strings_,  total, sel, n, a);
+    out.int32s_   = gather(in.int32s_,   total, sel, n, a);
+    out.int64s_   = gather(in.int64s_,   total, sel, n, a);
+    out.uint32s_  = gather(in.uint32s_,  total, sel, n, a);
+    out.uint64s_  = gather(in.uint64s_,  total, sel, n, a);
+    out.doubles_  = gather(in.doubles_,  total, sel, n, a);
+    out.floats_   = gather(in.floats_,   total, sel, n, a);
+    out.bools_    = gather(in.bools_,    total, sel, n, a);
+    out.bytes_    = gather(in.bytes_,    total, sel, n, a);
+    out.is_null_  = gather(in.is_null_,  total, sel, n, a);
+  }
+
+  pushdown::pushdown(const std::vector<std::string> & projection)
+  : projection_{projection},
+    needed_{projection},
+    rows_in_{0},
+    rows_out_{0},
+    columns_dropped_{0},
+    columns_mismatched_{0}
+  {
+    if( projection_.empty() )
+    {
+      THROW_("the projection must name at least one column");
+    }
+  }
+
+  pushdown::~pushdown() {}
+
+  void
+  pushdown::add_predicate(const predicate & p)
+  {
+    predicates_.push_back(p);
+    if( std::find(needed_.begin(), needed_.end(), p.column_) == needed_.end() )
+      needed_.push_back(p.column_);
+  }
+
+  bool
+  pushdown::is_needed(const bytes_view & name) const
+  {
+    for( auto & n : needed_ )
+      if( name == n ) return true;
+    return false;
+  }
+
+  void
+  pushdown::push(uint64_t stream_id,
+                 const uint8_t * raw,
+                 uint64_t raw_size,
+                 const column_view & column,
+                 emit_fun emit)
+  {
+    if( !is_needed(column.name_) )
+    {
+      ++columns_dropped_;
+      return;
+    }
+
+    block_key key{stream_id, column.seqno_};
+    block & blk = blocks_[key];
+    std::string name{column.name_.str()};
+
+    uint64_t present = blk.held_.size() + (blk.held_.count(name) ? 0 : 1);
+    if( present < needed_.size() )
+    {
+      // the views die with the part, keep the raw message
+      blk.held_[name].assign((const char *)raw, raw_size);
+      return;
+    }
+
+    std::map<std::string, column_view> columns;
+    for( auto & h : blk.held_ )
+    {
+      column_view cv;
+      if( virtdb_gateway::decode_column((const uint8_t *)h.second.data(), h.second.size(), arena_, cv) )
+        columns[h.first] = cv;
+    }
+    columns[name] = column;
+
+    complete(columns, emit);
+    blocks_.erase(key);
+    arena_.reset();
+  }
+
+  void
+  pushdown::end_stream(uint64_t stream_id,
+                       emit_fun emit)
+  {
+    auto it = blocks_.lower_bound(block_key{stream_id, 0});
+    while( it != blocks_.end() && it->first.first == stream_id )
+    {
+      std::map<std::string, column_view> columns;
+      for( auto & h : it->second.held_ )
+      {
+        column_view cv;
+        if( virtdb_gateway::decode_column((const uint8_t *)h.second.data(), h.second.size(), arena_, cv) )
+          columns[h.first] = cv;
+      }
+      // predicates on missing columns are skipped
+      complete(columns, emit);
+      arena_.reset();
+      it = blocks_.erase(it);
+    }
+  }
+
+  void
+  pushdown::drop_stream(uint64_t stream_id)
+  {
+    auto from = blocks_.lower_bound(block_key{stream_id, 0});
+    auto to   = from;
+    while( to != blocks_.end() && to->first.first == stream_id )
+      ++to;
+    blocks_.erase(from, to);
+  }
+
+  void
+  pushdown::complete(std::map<std::string, column_view> & columns,
+                     emit_fun emit)
+  {
+    if( columns.empty() )
+      return;
+
+    // the row count of the first projected column is the block's
+    auto first = columns.begin();
+    for( auto & name : projection_ )
+    {
+      auto it = columns.find(name);
+      if( it != columns.end() )
+      {
+        first = it;
+        break;
+      }
+    }
+    uint64_t n = rows(first->second.data_);
+    uint8_t * mask = arena_.allocate_array<uint8_t>(n);
+    ::memset(mask, 1, n);
+
+    for( auto & p : predicates_ )
+    {
+      auto it = columns.find(p.column_);
+      if( it == columns.end() || rows(it->second.data_) != n )
+        continue;
+      evaluate(it->second.data_, p, arena_, mask);
+    }
+
+    uint32_t * sel = arena_.allocate_array<uint32_t>(n);
+    uint64_t k = build_selection(mask, n, sel);
+    rows_in_  += n;
+    rows_out_ += k;
+
+    for( auto & name : projection_ )
+    {
+      auto it = columns.find(name);
+      if( it == columns.end() )
+        continue;
+
+      // the selection can't be applied to it
+      if( rows(it->second.data_) != n )
+      {
+        ++columns_mismatched_;
+        continue;
+      }
+
+      if( k == n )
+      {
+        emit(it->second);
+      }
+      else
+      {
+        column_view out{it->second};
+        apply(it->second.data_, sel, k, arena_, out.data_);
+        emit(out);
+      }
+    }
+  }
+
+  uint64_t pushdown::rows_in() const             { return rows_in_.load(); }
+  uint64_t pushdown::rows_out() const            { return rows_out_.load(); }
+  uint64_t pushdown::columns_dropped() const     { return columns_dropped_.load(); }
+  uint64_t pushdown::columns_mismatched() const  { return columns_mismatched_.load(); }
+
+}}
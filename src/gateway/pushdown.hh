@@ -0,0 +1,122 @@
+#pragma once
+
+#include <gateway/virtdb_gateway.hh>
+#include <gateway/arena.hh>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <atomic>
+
+namespace virtdb { namespace gateway {
+
+  // evaluates simple predicates and projections on decoded column blocks
+  // before they reach the column handler. the columns of a block (same
+  // stream and Column.SeqNo) are held back until all needed columns arrived,
+  // then the rows are filtered through a selection vector
+  class pushdown
+  {
+  public:
+    typedef std::shared_ptr<pushdown>                         sptr;
+    typedef std::function<void(const column_view & column)>   emit_fun;
+    typedef std::vector<uint32_t>                             selection;
+
+    enum op_type {
+      OP_EQ,
+      OP_NE,
+      OP_LT,
+      OP_LE,
+      OP_GT,
+      OP_GE,
+      OP_IN,
+      OP_IS_NULL,
+      OP_NOT_NULL,
+    };
+
+    // the operand vector matching the column kind is used, IN uses all
+    // of its values, the comparisons the first one. floating point
+    // columns use ints_ only when doubles_ is empty
+    struct predicate
+    {
+      std::string               column_;
+      op_type                   op_;
+      std::vector<int64_t>      ints_;
+      std::vector<double>       doubles_;
+      std::vector<std::string>  strings_;
+    };
+
+  private:
+    struct block
+    {
+      // raw Column messages held back until the block completes
+      std::map<std::string, std::string>  held_;
+    };
+
+    typedef std::pair<uint64_t, uint64_t>   block_key;
+    typedef std::map<block_key, block>      block_map;
+
+    std::vector<std::string>  projection_;
+    std::vector<predicate>    predicates_;
+    std::vector<std::string>  needed_;
+    block_map                 blocks_;
+    arena                     arena_;
+    std::atomic<uint64_t>     rows_in_;
+    std::atomic<uint64_t>     rows_out_;
+    std::atomic<uint64_t>     columns_dropped_;
+    std::atomic<uint64_t>     columns_mismatched_;
+
+    bool is_needed(const bytes_view & name) const;
+    void complete(std::map<std::string, column_view> & columns,
+                  emit_fun emit);
+
+    // disable copying until properly implemented
+    pushdown(const pushdown &) = delete;
+    pushdown & operator=(const pushdown &) = delete;
+
+  public:
+    pushdown(const std::vector<std::string> & projection);
+    virtual ~pushdown();
+
+    void add_predicate(const predicate & p);
+
+    // called for each decoded column, emit is called with the filtered
+    // columns of the block when complete
+    void push(uint64_t stream_id,
+              const uint8_t * raw,
+              uint64_t raw_size,
+              const column_view & column,
+              emit_fun emit);
+
+    // forwards the incomplete blocks of a stream, filtered by the
+    // predicates whose columns arrived. the others are skipped
+    void end_stream(uint64_t stream_id,
+                    emit_fun emit);
+
+    // discards the held blocks of a stream that was stopped or failed
+    void drop_stream(uint64_t stream_id);
+
+    // kernels: evaluate ANDs the predicate into mask (one byte per row)
+    static uint64_t rows(const value_view & value);
+    static void evaluate(const value_view & value,
+                         const predicate & p,
+                         arena & a,
+                         uint8_t * mask);
+    static uint64_t build_selection(const uint8_t * mask,
+                                    uint64_t n,
+                                    uint32_t * sel);
+    static void apply(const value_view & in,
+                      const uint32_t * sel,
+                      uint64_t n,
+                      arena & a,
+                      value_view & out);
+
+    uint64_t rows_in() const;
+    uint64_t rows_out() const;
+    uint64_t columns_dropped() const;
+    // columns with a row count other than the block's, not emitted
+    uint64_t columns_mismatched() const;
+  };
+
+}}
@@ -0,0 +1,110 @@
+#include <gateway/queue_replay.hh>
+#include <gateway/exception.hh>
+#include <chrono>
+#include <thread>
+
+namespace virtdb { namespace gateway {
+
+  queue_replay::stats::stats()
+  : messages_{0},
+    bytes_{0},
+    skipped_{0},
+    unstamped_{0},
+    seconds_{0}
+  {
+  }
+
+  queue_replay::queue_replay(const std::string & capture_path,
+                             const std::string & target_path,
+                             const queue::params & prms)
+  : capture_{capture_path+"/0", prms},
+    target_{target_path+"/0", prms}
+  {
+  }
+
+  queue_replay::~queue_replay() {}
+
+  queue_replay::sptr
+  queue_replay::create(const std::string & capture_path,
+                       const std::string & target_path,
+                       const queue::params & prms)
+  {
+    if( capture_path == target_path )
+    {
+      THROW_("the capture can't be replayed into itself");
+    }
+
+    // sets up the target folder and its queues as a client would
+    simple_client::create(target_path, prms);
+
+    sptr ret{new queue_replay{capture_path, target_path, prms}};
+    return ret;
+  }
+
+  queue_replay::stats
+  queue_replay::run(double speed,
+                    uint64_t from,
+                    uint64_t max_messages,
+                    pushed_fun pushed)
+  {
+    using namespace std::chrono;
+    using namespace virtdb::queue;
+
+    stats ret;
+    uint64_t first_stamp  = 0;
+    uint64_t last_stamp   = 0;
+    auto start = steady_clock::now();
+
+    auto pull = [&](uint64_t msg_id,
+                    const uint8_t * ptr,
+                    uint64_t len)
+    {
+      if( ret.messages_ >= max_messages )
+        return false;
+
+      simple_gateway::stream_part part;
+      if( !simple_gateway::parse_part(ptr, len, part) ||
+          (part.flags_ & simple_gateway::FLAG_OOB) )
+      {
+        ++ret.skipped_;
+        return true;
+      }
+
+      if( part.stamp_us_ > 0 ) last_stamp = part.stamp_us_;
+      else                     ++ret.unstamped_;
+      if( first_stamp == 0 )   first_stamp = last_stamp;
+
+      // the recorded gaps, shrunk by the speed
+      if( speed > 0 && last_stamp > first_stamp )
+        std::this_thread::sleep_until(start + microseconds((uint64_t)((last_stamp-first_stamp)/speed)));
+
+      uint64_t pushed_us = simple_gateway::now_us();
+      part.position_ = target_.position();
+      target_.push(simple_publisher::buffer_vector{simple_publisher::buffer{ptr, len}});
+      pushed(part.position_, part, pushed_us);
+
+      ++ret.messages_;
+      ret.bytes_ += len;
+      return true;
+    };
+
+    // the capture is read to its current end
+    while( ret.messages_ < max_messages )
+    {
+      uint64_t next = capture_.pull(from, pull, 0);
+      if( next == from )
+        break;
+      from = next;
+    }
+
+    ret.seconds_ = duration_cast<duration<double>>(steady_clock::now()-start).count();
+    return ret;
+  }
+
+  uint64_t
+  queue_replay::target_position() const
+  {
+    return target_.position();
+  }
+
+}}
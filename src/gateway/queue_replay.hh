@@ -0,0 +1,77 @@
+#pragma once
+
+#include <gateway/simple_gateway.hh>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace virtdb { namespace gateway {
+
+  // every client message stays in <path>/0, so a gateway folder is a
+  // capture of its traffic. the replay reads a captured queue and pushes
+  // the messages into another gateway's <path>/0, keeping the pace of
+  // the FLAG_STAMP send times
+  class queue_replay
+  {
+  public:
+    typedef std::shared_ptr<queue_replay>  sptr;
+
+    struct stats
+    {
+      uint64_t   messages_;
+      uint64_t   bytes_;
+      // out-of-band parts, whose segments are not in the queue, and
+      // messages that don't parse
+      uint64_t   skipped_;
+      // messages without a stamp, sent with the previous one's time
+      uint64_t   unstamped_;
+      double     seconds_;
+
+      stats();
+    };
+
+    // called after a message was pushed, with its position in the target
+    // queue and the time just before the push, microseconds of the
+    // system clock
+    typedef std::function<void(uint64_t position,
+                               const simple_gateway::stream_part & part,
+                               uint64_t pushed_us)>                 pushed_fun;
+
+  private:
+    queue::simple_subscriber   capture_;
+    queue::simple_publisher    target_;
+
+    // disable default construction
+    queue_replay() = delete;
+
+    // disable copying until properly implemented
+    queue_replay(const queue_replay &) = delete;
+    queue_replay & operator=(const queue_replay &) = delete;
+
+  protected:
+    queue_replay(const std::string & capture_path,
+                 const std::string & target_path,
+                 const queue::params & prms);
+
+  public:
+    virtual ~queue_replay();
+
+    // the target folder is created if needed, like simple_client::create()
+    static sptr create(const std::string & capture_path,
+                       const std::string & target_path,
+                       const queue::params & prms=queue::params());
+
+    // speed 1.0 is the original timing, 2.0 twice as fast, 0 as fast as
+    // possible. stops at the end of the capture or after max_messages
+    stats run(double speed,
+              uint64_t from=0,
+              uint64_t max_messages=UINT64_MAX,
+              pushed_fun pushed=[](uint64_t position,
+                                   const simple_gateway::stream_part & part,
+                                   uint64_t pushed_us){});
+
+    uint64_t target_position() const;
+  };
+
+}}
@@ -0,0 +1,429 @@
+#include <gateway/result_cache.hh>
+#include <gateway/exception.hh>
+#include <cstring>
+
+// C libs
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace virtdb { namespace gateway {
+
+  result_cache::entry::entry()
+  : bytes_{0},
+    fingerprint_{0},
+    created_{clock_type::now()},
+    referenced_{false}
+  {
+  }
+
+  result_cache::result_cache(const std::string & path,
+                             uint64_t capacity_bytes,
+                             uint64_t ttl_ms,
+                             uint64_t slot_size)
+  : path_{path},
+    fd_{-1},
+    data_{nullptr},
+    slot_size_{slot_size},
+    slot_count_{slot_size ? capacity_bytes/slot_size : 0},
+    ttl_ms_{ttl_ms},
+    build_timeout_ms_{60000},
+    hand_{0},
+    hits_{0},
+    misses_{0},
+    evictions_{0},
+    expirations_{0},
+    stores_{0},
+    abandoned_{0}
+  {
+    if( slot_count_ == 0 )
+    {
+      THROW_(std::string{"cache capacity is smaller than a slot: "}+path);
+    }
+
+    // the index is not persisted, so the previous content is useless
+    fd_ = ::open(path_.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0600);
+    if( fd_ < 0 )
+    {
+      THROW_(std::string{"failed to open cache file: "}+path);
+    }
+
+    if( ::ftruncate(fd_, slot_count_*slot_size_) != 0 )
+    {
+      ::close(fd_);
+      THROW_(std::string{"failed to resize cache file: "}+path);
+    }
+
+    void * p = ::mmap(nullptr, slot_count_*slot_size_, PROT_READ|PROT_WRITE, MAP_SHARED, fd_, 0);
+    if( p == MAP_FAILED )
+    {
+      ::close(fd_);
+      THROW_(std::string{"failed to map cache file: "}+path);
+    }
+    data_ = (uint8_t *)p;
+
+    free_slots_.reserve(slot_count_);
+    for( uint64_t i=slot_count_; i>0; --i )
+      free_slots_.push_back((uint32_t)(i-1));
+    slot_pins_.assign(slot_count_, 0);
+    slot_retired_.assign(slot_count_, false);
+  }
+
+  result_cache::~result_cache()
+  {
+    if( data_ ) ::munmap(data_, slot_count_*slot_size_);
+    if( fd_ >= 0 )
+    {
+      ::close(fd_);
+      ::unlink(path_.c_str());
+    }
+  }
+
+  uint64_t
+  result_cache::fingerprint(const std::string & key)
+  {
+    // FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    for( auto c : key )
+    {
+      h ^= (uint8_t)c;
+      h *= 1099511628211ULL;
+    }
+    return h;
+  }
+
+  bool
+  result_cache::expired(const entry & e) const
+  {
+    if( ttl_ms_ == 0 ) return false;
+    return (clock_type::now() - e.created_) > std::chrono::milliseconds(ttl_ms_);
+  }
+
+  void
+  result_cache::release(entry & e)
+  {
+    for( auto slot : e.slots_ )
+    {
+      // a replay still reads it, unpin() frees it
+      if( slot_pins_[slot] > 0 ) slot_retired_[slot] = true;
+      else                       free_slots_.push_back(slot);
+    }
+    e.slots_.clear();
+  }
+
+  void
+  result_cache::forget(entry_map::iterator it)
+  {
+    for( size_t i=0; i<clock_.size(); ++i )
+    {
+      if( clock_[i] != it->first )
+        continue;
+      clock_.erase(clock_.begin()+i);
+      if( hand_ > i ) --hand_;
+      break;
+    }
+    release(it->second);
+    entries_.erase(it);
+  }
+
+  void
+  result_cache::unpin(const std::vector<uint32_t> & slots)
+  {
+    std::lock_guard<std::mutex> lock{mtx_};
+    for( auto slot : slots )
+    {
+      if( --slot_pins_[slot] == 0 && slot_retired_[slot] )
+      {
+        slot_retired_[slot] = false;
+        free_slots_.push_back(slot);
+      }
+    }
+  }
+
+  void
+  result_cache::abandon_stale_builds()
+  {
+    if( build_timeout_ms_ == 0 )
+      return;
+
+    auto limit = clock_type::now() - std::chrono::milliseconds(build_timeout_ms_);
+    for( auto it=pending_.begin(); it!=pending_.end(); )
+    {
+      if( it->second.created_ < limit )
+      {
+        release(it->second);
+        it = pending_.erase(it);
+        ++abandoned_;
+      }
+      else
+      {
+        ++it;
+      }
+    }
+  }
+
+  bool
+  result_cache::evict_one()
+  {
+    // CLOCK: referenced entries get a second chance
+    while( !clock_.empty() )
+    {
+      if( hand_ >= clock_.size() ) hand_ = 0;
+
+      auto it = entries_.find(clock_[hand_]);
+      if( it == entries_.end() )
+      {
+        clock_.erase(clock_.begin()+hand_);
+        continue;
+      }
+
+      if( it->second.referenced_ && !expired(it->second) )
+      {
+        it->second.referenced_ = false;
+        ++hand_;
+        continue;
+      }
+
+      if( expired(it->second) ) ++expirations_;
+      else                      ++evictions_;
+      release(it->second);
+      entries_.erase(it);
+      clock_.erase(clock_.begin()+hand_);
+      return true;
+    }
+    return false;
+  }
+
+  bool
+  result_cache::grab_slot(uint32_t & slot)
+  {
+    while( free_slots_.empty() )
+    {
+      if( !evict_one() )
+        return false;
+    }
+    slot = free_slots_.back();
+    free_slots_.pop_back();
+    return true;
+  }
+
+  bool
+  result_cache::replay(uint64_t fingerprint,
+                       const std::string & key,
+                       replay_fun f)
+  {
+    std::vector<uint32_t> slots;
+    std::vector<uint64_t> part_sizes;
+    {
+      std::lock_guard<std::mutex> lock{mtx_};
+
+      auto it = entries_.find(fingerprint);
+      if( it == entries_.end() || it->second.key_ != key )
+      {
+        ++misses_;
+        return false;
+      }
+
+      if( expired(it->second) )
+      {
+        ++expirations_;
+        ++misses_;
+        forget(it);
+        return false;
+      }
+
+      entry & e = it->second;
+      e.referenced_ = true;
+      ++hits_;
+
+      // the slots stay ours while the reply goes out without the lock
+      slots       = e.slots_;
+      part_sizes  = e.part_sizes_;
+      for( auto slot : slots )
+        ++slot_pins_[slot];
+    }
+
+    try
+    {
+      // parts may span slots, these are passed as multiple buffers
+      uint64_t offset = 0;
+      for( uint64_t seqno=0; seqno<part_sizes.size(); ++seqno )
+      {
+        buffer_vector data;
+        uint64_t remaining = part_sizes[seqno];
+        while( remaining > 0 )
+        {
+          uint64_t slot_idx  = offset / slot_size_;
+          uint64_t in_slot   = offset % slot_size_;
+          uint64_t len       = slot_size_ - in_slot;
+          if( len > remaining ) len = remaining;
+
+          const uint8_t * ptr = data_ + slots[slot_idx]*slot_size_ + in_slot;
+          data.push_back(queue::simple_publisher::buffer{ptr, len});
+          offset     += len;
+          remaining  -= len;
+        }
+        f(seqno, data, seqno+1 == part_sizes.size());
+      }
+    }
+    catch (...)
+    {
+      unpin(slots);
+      throw;
+    }
+    unpin(slots);
+    return true;
+  }
+
+  void
+  result_cache::begin(uint64_t handle,
+                      uint64_t fingerprint,
+                      const std::string & key)
+  {
+    std::lock_guard<std::mutex> lock{mtx_};
+    abandon_stale_builds();
+
+    entry & e = pending_[handle];
+    release(e);
+    e = entry{};
+    e.key_          = key;
+    e.fingerprint_  = fingerprint;
+  }
+
+  bool
+  result_cache::is_building(uint64_t handle)
+  {
+    std::lock_guard<std::mutex> lock{mtx_};
+    return pending_.count(handle) > 0;
+  }
+
+  void
+  result_cache::append(uint64_t handle,
+                       const uint8_t * data,
+                       uint64_t size)
+  {
+    std::lock_guard<std::mutex> lock{mtx_};
+    abandon_stale_builds();
+
+    auto it = pending_.find(handle);
+    if( it == pending_.end() )
+      return;
+
+    entry & e = it->second;
+    uint64_t offset = e.bytes_;
+    uint64_t remaining = size;
+    while( remaining > 0 )
+    {
+      uint64_t in_slot = offset % slot_size_;
+      if( offset / slot_size_ >= e.slots_.size() )
+      {
+        uint32_t slot = 0;
+        if( !grab_slot(slot) )
+        {
+          // does not fit, give up on caching this reply
+          release(e);
+          pending_.erase(it);
+          return;
+        }
+        e.slots_.push_back(slot);
+      }
+
+      uint64_t len = slot_size_ - in_slot;
+      if( len > remaining ) len = remaining;
+      ::memcpy(data_ + e.slots_[offset/slot_size_]*slot_size_ + in_slot, data, len);
+      data       += len;
+      offset     += len;
+      remaining  -= len;
+    }
+
+    e.bytes_ += size;
+    e.part_sizes_.push_back(size);
+  }
+
+  void
+  result_cache::commit(uint64_t handle)
+  {
+    std::lock_guard<std::mutex> lock{mtx_};
+
+    auto it = pending_.find(handle);
+    if( it == pending_.end() )
+      return;
+
+    uint64_t fp = it->second.fingerprint_;
+    auto old = entries_.find(fp);
+    if( old != entries_.end() )
+    {
+      release(old->second);
+      entries_.erase(old);
+    }
+    else
+    {
+      clock_.push_back(fp);
+    }
+
+    entry & e = entries_[fp];
+    e = it->second;
+    e.created_ = clock_type::now();
+    pending_.erase(it);
+    ++stores_;
+  }
+
+  void
+  result_cache::abort(uint64_t handle)
+  {
+    std::lock_guard<std::mutex> lock{mtx_};
+
+    auto it = pending_.find(handle);
+    if( it != pending_.end() )
+    {
+      release(it->second);
+      pending_.erase(it);
+    }
+  }
+
+  void
+  result_cache::invalidate(uint64_t fingerprint)
+  {
+    std::lock_guard<std::mutex> lock{mtx_};
+
+    auto it = entries_.find(fingerprint);
+    if( it != entries_.end() )
+      forget(it);
+  }
+
+  void
+  result_cache::set_build_timeout(uint64_t ms)
+  {
+    std::lock_guard<std::mutex> lock{mtx_};
+    build_timeout_ms_ = ms;
+  }
+
+  void
+  result_cache::clear()
+  {
+    std::lock_guard<std::mutex> lock{mtx_};
+
+    for( auto & e : entries_ )
+      release(e.second);
+    entries_.clear();
+    clock_.clear();
+    hand_ = 0;
+  }
+
+  uint64_t result_cache::hits() const         { return hits_.load(); }
+  uint64_t result_cache::misses() const       { return misses_.load(); }
+  uint64_t result_cache::evictions() const    { return evictions_.load(); }
+  uint64_t result_cache::expirations() const  { return expirations_.load(); }
+  uint64_t result_cache::stores() const       { return stores_.load(); }
+  uint64_t result_cache::abandoned() const    { return abandoned_.load(); }
+  uint64_t result_cache::capacity() const     { return slot_count_*slot_size_; }
+
+  uint64_t
+  result_cache::bytes_used()
+  {
+    std::lock_guard<std::mutex> lock{mtx_};
+    return (slot_count_-free_slots_.size())*slot_size_;
+  }
+
+}}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <queue/simple_queue.hh>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <atomic>
+
+namespace virtdb { namespace gateway {
+
+  // size bounded store of reply streams, keyed by a query fingerprint. the
+  // reply parts live in a memory mapped file cut into fixed size slots, the
+  // index is kept in memory. entries are evicted by CLOCK or when their TTL
+  // expires. a replay pins its slots and runs without the lock, slots of
+  // an entry dropped meanwhile are freed when the replay is done. builds
+  // not committed within the build timeout are abandoned
+  class result_cache
+  {
+  public:
+    typedef std::shared_ptr<result_cache>                     sptr;
+    typedef queue::simple_publisher::buffer_vector            buffer_vector;
+    typedef std::function<void(uint64_t seqno,
+                               const buffer_vector & data,
+                               bool last)>                    replay_fun;
+    typedef std::chrono::steady_clock                         clock_type;
+
+  private:
+    struct entry
+    {
+      std::string               key_;
+      std::vector<uint32_t>     slots_;
+      std::vector<uint64_t>     part_sizes_;
+      uint64_t                  bytes_;
+      uint64_t                  fingerprint_;
+      clock_type::time_point    created_;
+      bool                      referenced_;
+
+      entry();
+    };
+
+    typedef std::map<uint64_t, entry>   entry_map;
+
+    std::string             path_;
+    int                     fd_;
+    uint8_t *               data_;
+    uint64_t                slot_size_;
+    uint64_t                slot_count_;
+    uint64_t                ttl_ms_;
+    uint64_t                build_timeout_ms_;
+    std::vector<uint32_t>   free_slots_;
+    // replays using the slot, and whether its entry is gone
+    std::vector<uint32_t>   slot_pins_;
+    std::vector<bool>       slot_retired_;
+    entry_map               entries_;
+    entry_map               pending_;
+    std::vector<uint64_t>   clock_;
+    size_t                  hand_;
+    std::mutex              mtx_;
+
+    std::atomic<uint64_t>   hits_;
+    std::atomic<uint64_t>   misses_;
+    std::atomic<uint64_t>   evictions_;
+    std::atomic<uint64_t>   expirations_;
+    std::atomic<uint64_t>   stores_;
+    std::atomic<uint64_t>   abandoned_;
+
+    bool expired(const entry & e) const;
+    void release(entry & e);
+    void forget(entry_map::iterator it);
+    void unpin(const std::vector<uint32_t> & slots);
+    void abandon_stale_builds();
+    bool evict_one();
+    bool grab_slot(uint32_t & slot);
+
+    // disable copying until properly implemented
+    result_cache(const result_cache &) = delete;
+    result_cache & operator=(const result_cache &) = delete;
+
+  public:
+    result_cache(const std::string & path,
+                 uint64_t capacity_bytes,
+                 uint64_t ttl_ms,
+                 uint64_t slot_size=64*1024);
+    virtual ~result_cache();
+
+    static uint64_t fingerprint(const std::string & key);
+
+    // calls f with every stored part on a hit
+    bool replay(uint64_t fingerprint,
+                const std::string & key,
+                replay_fun f);
+
+    // building a new entry while the reply stream is produced. handle
+    // identifies the reply stream, the entry becomes visible on commit
+    void begin(uint64_t handle,
+               uint64_t fingerprint,
+               const std::string & key);
+    bool is_building(uint64_t handle);
+    void append(uint64_t handle,
+                const uint8_t * data,
+                uint64_t size);
+    void commit(uint64_t handle);
+    void abort(uint64_t handle);
+
+    // a build whose reply stream was stopped or failed without abort() is
+    // dropped after this, 0 keeps it. 60 seconds by default
+    void set_build_timeout(uint64_t ms);
+
+    void invalidate(uint64_t fingerprint);
+    void clear();
+
+    // metrics
+    uint64_t hits() const;
+    uint64_t misses() const;
+    uint64_t evictions() const;
+    uint64_t expirations() const;
+    uint64_t stores() const;
+    uint64_t abandoned() const;
+    uint64_t bytes_used();
+    uint64_t capacity() const;
+  };
+
+}}
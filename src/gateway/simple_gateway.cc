@@ -1,10 +1,21 @@
 #include <gateway/simple_gateway.hh>
 #include <gateway/exception.hh>
+#include <gateway/crc32c.hh>
 #include <queue/varint.hh>
+#include <algorithm>
 #include <iostream>
+#include <chrono>
+#include <cstring>
+#include <thread>
 
 // C libs
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
 
 namespace virtdb { namespace gateway {
   
@@ -41,94 +52,371 @@ namespace virtdb { namespace gateway {
                        fsm::state_machine::sptr fsm,
                        const state_set & terminal_states,
                        stream_info::sptr info)
+  {
+    send_state st;
+    st.stream_type_      = stream_type;
+    st.feeder_           = feeder;
+    st.fsm_              = fsm;
+    st.terminal_states_  = terminal_states;
+    st.info_             = info;
+    st.seen_epoch_       = cancel_epoch_.load(std::memory_order_acquire);
+    
+    try
+    {
+      while( step(st, true) ) {}
+    }
+    catch (...)
+    {
+      send_ended((uint64_t)st.info_->id_);
+      throw;
+    }
+    send_ended((uint64_t)st.info_->id_);
+  }
+  
+  // sends the next part of the stream and runs its FSM once
+  bool
+  simple_client::step(send_state & st,
+                      bool poll_control)
   {
     using namespace virtdb::queue;
     
-    uint16_t fsm_state = 0;
-    bool send_more = true;
+    stream_info::sptr & info = st.info_;
     
-    while( true )
+    if( st.send_more_ )
     {
-      if( send_more )
+      // a stop from either side ends the stream before the feeder runs again
+      if( info->id_ != -1 )
+      {
+        if( poll_control ) receive_control();
+        uint64_t epoch = cancel_epoch_.load(std::memory_order_acquire);
+        
+        // nobody waits for the rest after the deadline
+        bool cancel_now = (info->deadline_us_ > 0 && now_us() >= info->deadline_us_);
+        if( epoch != st.seen_epoch_ )
+        {
+          st.seen_epoch_ = epoch;
+          cancel_now = cancel_now || is_cancelled(info->id_);
+        }
+        
+        if( cancel_now )
+        {
+          // an empty EV_END lets the server forget the stream
+          uint8_t type = EV_END;
+          varint v_id{(uint64_t)info->id_};
+          varint v_seqno{(uint64_t)(++(info->sent_seqno_))};
+          simple_publisher::buffer_vector data_vec{
+            simple_publisher::buffer{&type, 1},
+            simple_publisher::buffer{v_id.buf(), v_id.len()},
+            simple_publisher::buffer{v_seqno.buf(), v_seqno.len()},
+          };
+          send_data(data_vec);
+          info->cancelled_ = true;
+          return false;
+        }
+      }
+      else if( info->deadline_us_ > 0 && now_us() >= info->deadline_us_ )
+      {
+        // expired before the first part, the server never hears of it
+        info->cancelled_ = true;
+        return false;
+      }
+      
+      ++(info->sent_seqno_);
+
+      stream_part new_stream_part;
+      new_stream_part.seqno_ = info->sent_seqno_;
+      
+      // set id in the message part
+      int64_t new_id = info->id_;
+      if( new_id == -1 ) { new_id = reserve_id(); }
+      new_stream_part.id_ = new_id;
+      
+      // gather feeders append their buffers here instead of buffer_
+      st.gather_.clear();
+      new_stream_part.gather_ = &st.gather_;
+      
+      st.send_more_ = st.feeder_(new_stream_part);
+      
+      // the segment lengths go in front of the gathered buffers
+      bool gathered = !st.gather_.empty();
+      if( gathered )
+      {
+        st.segment_table_.clear();
+        varint v_count{(uint64_t)st.gather_.size()};
+        st.segment_table_.insert(st.segment_table_.end(), v_count.buf(), v_count.buf()+v_count.len());
+        for( auto & b : st.gather_ )
+        {
+          varint v_len{(uint64_t)b.second};
+          st.segment_table_.insert(st.segment_table_.end(), v_len.buf(), v_len.buf()+v_len.len());
+        }
+      }
+      
+      // large parts go out-of-band: handle (the seqno), offset, length
+      uint8_t oob_desc[30];
+      uint64_t oob_len = 0;
+      bool oob_part = (!gathered &&
+                       oob_threshold() > 0 &&
+                       new_stream_part.buffer_ != nullptr &&
+                       new_stream_part.size_ >= oob_threshold() &&
+                       write_oob(new_id, info->sent_seqno_, new_stream_part.buffer_, new_stream_part.size_));
+      if( oob_part )
+      {
+        for( uint64_t v : { (uint64_t)info->sent_seqno_, (uint64_t)0, new_stream_part.size_ } )
+        {
+          varint vi{v};
+          ::memcpy(oob_desc+oob_len, vi.buf(), vi.len());
+          oob_len += vi.len();
+        }
+      }
+      
+      // default is to send a single message
+      uint8_t type_start[2] = { EV_ONE, st.stream_type_ };
+      uint8_t ts_len = 2;
+      
+      // filled in by seal_crc() once the message is complete
+      uint8_t crc_buf[4];
+      size_t crc_index = 0;
+      
+      // collect message parts
+      simple_publisher::buffer_vector data_vec;
+      
+      if( info->id_ == -1 )
       {
-        ++(info->sent_seqno_);
+        // first packet, but more to come
+        if( st.send_more_ )
+          type_start[0] = EV_START;
+        
+        // administer ourselves
+        info->id_ = new_id;
+        stream_opened((uint64_t)new_id, sender_position());
 
-        stream_part new_stream_part;
-        new_stream_part.seqno_ = info->sent_seqno_;
+        // always add the header part
+        data_vec.push_back(simple_publisher::buffer{type_start, ts_len});
         
-        // set id in the message part
-        if( info->id_ == -1 ) { new_stream_part.id_  = sender_position(); }
-        else                  { new_stream_part.id_  = info->id_; }
+        // add a client message id too
+        varint v_id{(uint64_t)info->id_};
+        data_vec.push_back(simple_publisher::buffer{v_id.buf(), v_id.len()});
         
-        send_more = feeder(new_stream_part);
+        // the server drops the stream's parts after the deadline
+        varint v_deadline{info->deadline_us_};
+        if( info->deadline_us_ > 0 )
+        {
+          type_start[0] |= FLAG_DEADLINE;
+          data_vec.push_back(simple_publisher::buffer{v_deadline.buf(), v_deadline.len()});
+        }
         
-        // default is to send a single message
-        uint8_t type_start[2] = { EV_ONE, stream_type };
-        uint8_t ts_len = 2;
+        if( crc() )
+        {
+          type_start[0] |= FLAG_CRC;
+          crc_index = data_vec.size();
+          data_vec.push_back(simple_publisher::buffer{crc_buf, 4});
+        }
         
-        // collect message parts
-        simple_publisher::buffer_vector data_vec;
+        varint v_stamp{(stamp() ? now_us() : 0)};
+        if( stamp() )
+        {
+          type_start[0] |= FLAG_STAMP;
+          data_vec.push_back(simple_publisher::buffer{v_stamp.buf(), v_stamp.len()});
+        }
         
-        if( info->id_ == -1 )
+        // may add data if available
+        if( oob_part )
         {
-          // first packet, but more to come
-          if( send_more )
-            type_start[0] = EV_START;
-          
-          // administer ourselves
-          info->id_ = sender_position();
-
-          // always add the header part
-          data_vec.push_back(simple_publisher::buffer{type_start, ts_len});
-          
-          // add a client message id too
-          varint v_id{(uint64_t)info->id_};
-          data_vec.push_back(simple_publisher::buffer{v_id.buf(), v_id.len()});
-          
-          // may add data if available
-          if( new_stream_part.size_ > 0 && new_stream_part.buffer_ != nullptr)
-            data_vec.push_back(simple_publisher::buffer{new_stream_part.buffer_, new_stream_part.size_});
-          
-          // shoot the data
-          send_data(data_vec);
+          type_start[0] |= FLAG_OOB;
+          data_vec.push_back(simple_publisher::buffer{oob_desc, oob_len});
+        }
+        else if( gathered )
+        {
+          type_start[0] |= FLAG_SEGMENTS;
+          data_vec.push_back(simple_publisher::buffer{st.segment_table_.data(), st.segment_table_.size()});
+          data_vec.insert(data_vec.end(), st.gather_.begin(), st.gather_.end());
+        }
+        else if( new_stream_part.size_ > 0 && new_stream_part.buffer_ != nullptr)
+        {
+          data_vec.push_back(simple_publisher::buffer{new_stream_part.buffer_, new_stream_part.size_});
         }
+        
+        if( crc() )
+          seal_crc(data_vec, crc_index, crc_buf, (oob_part ? new_stream_part.buffer_ : nullptr), new_stream_part.size_);
+        
+        // shoot the data
+        send_data(data_vec);
+      }
+      else
+      {
+        // we don't need to send the stream_type
+        ts_len = 1;
+        
+        // tell the receiver if we have more to be sent
+        if( st.send_more_ )
+          type_start[0] = EV_NEXT;
         else
+          type_start[0] = EV_END;
+        
+        // always add the header part
+        data_vec.push_back(simple_publisher::buffer{type_start, ts_len});
+        
+        // add identifiers too
+        varint v_id{(uint64_t)info->id_};
+        varint v_seqno{(uint64_t)info->sent_seqno_};
+        
+        data_vec.push_back(simple_publisher::buffer{v_id.buf(), v_id.len()});
+        data_vec.push_back(simple_publisher::buffer{v_seqno.buf(), v_seqno.len()});
+        
+        if( crc() )
         {
-          // we don't need to send the stream_type
-          ts_len = 1;
-          
-          // tell the receiver if we have more to be sent
-          if( send_more )
-            type_start[0] = EV_NEXT;
-          else
-            type_start[0] = EV_END;
-          
-          // always add the header part
-          data_vec.push_back(simple_publisher::buffer{type_start, ts_len});
-          
-          // add identifiers too
-          varint v_id{(uint64_t)info->id_};
-          varint v_seqno{(uint64_t)info->sent_seqno_};
-          
-          data_vec.push_back(simple_publisher::buffer{v_id.buf(), v_id.len()});
-          data_vec.push_back(simple_publisher::buffer{v_seqno.buf(), v_seqno.len()});
-
-          // may add data if available
-          if( new_stream_part.size_ > 0 && new_stream_part.buffer_ != nullptr)
-            data_vec.push_back(simple_publisher::buffer{new_stream_part.buffer_, new_stream_part.size_});
+          type_start[0] |= FLAG_CRC;
+          crc_index = data_vec.size();
+          data_vec.push_back(simple_publisher::buffer{crc_buf, 4});
+        }
+        
+        varint v_stamp{(stamp() ? now_us() : 0)};
+        if( stamp() )
+        {
+          type_start[0] |= FLAG_STAMP;
+          data_vec.push_back(simple_publisher::buffer{v_stamp.buf(), v_stamp.len()});
+        }
 
-          // shoot the data
-          send_data(data_vec);
-          info->sent_pos_ = sender_position();
+        // may add data if available
+        if( oob_part )
+        {
+          type_start[0] |= FLAG_OOB;
+          data_vec.push_back(simple_publisher::buffer{oob_desc, oob_len});
+        }
+        else if( gathered )
+        {
+          type_start[0] |= FLAG_SEGMENTS;
+          data_vec.push_back(simple_publisher::buffer{st.segment_table_.data(), st.segment_table_.size()});
+          data_vec.insert(data_vec.end(), st.gather_.begin(), st.gather_.end());
+        }
+        else if( new_stream_part.size_ > 0 && new_stream_part.buffer_ != nullptr)
+        {
+          data_vec.push_back(simple_publisher::buffer{new_stream_part.buffer_, new_stream_part.size_});
         }
+
+        if( crc() )
+          seal_crc(data_vec, crc_index, crc_buf, (oob_part ? new_stream_part.buffer_ : nullptr), new_stream_part.size_);
+        
+        // shoot the data
+        send_data(data_vec);
+        info->sent_pos_ = sender_position();
+      }
+    }
+    
+    st.fsm_state_ = st.fsm_->run(st.fsm_state_);
+    
+    // the stream is done when all parts are out and the FSM agrees
+    if( !st.send_more_ && st.terminal_states_.count(st.fsm_state_) )
+      return false;
+    
+    return true;
+  }
+  
+  void
+  simple_client::start_async(uint8_t stream_type,
+                             feeder_fun feeder,
+                             fsm::state_machine::sptr fsm,
+                             const state_set & terminal_states,
+                             stream_info::sptr info,
+                             done_fun done)
+  {
+    send_state::sptr st{new send_state};
+    st->stream_type_      = stream_type;
+    st->feeder_           = feeder;
+    st->fsm_              = fsm;
+    st->terminal_states_  = terminal_states;
+    st->info_             = info;
+    st->done_             = done;
+    st->seen_epoch_       = cancel_epoch_.load(std::memory_order_acquire);
+    
+    ++async_in_flight_;
+    {
+      std::lock_guard<std::mutex> lock{async_mtx_};
+      if( !async_thread_.joinable() )
+        async_thread_ = std::thread{[this](){ async_loop(); }};
+      async_incoming_.push_back(st);
+    }
+    async_cv_.notify_one();
+  }
+  
+  std::future<simple_gateway::stream_info::sptr>
+  simple_client::start_async(uint8_t stream_type,
+                             feeder_fun feeder,
+                             fsm::state_machine::sptr fsm,
+                             const state_set & terminal_states,
+                             stream_info::sptr info)
+  {
+    typedef std::promise<stream_info::sptr> promise_type;
+    std::shared_ptr<promise_type> promise{new promise_type};
+    
+    start_async(stream_type, feeder, fsm, terminal_states, info,
+                [promise](stream_info::sptr info, std::exception_ptr error) {
+                  if( error ) promise->set_exception(error);
+                  else        promise->set_value(info);
+                });
+    return promise->get_future();
+  }
+  
+  uint64_t
+  simple_client::async_in_flight() const
+  {
+    return async_in_flight_.load();
+  }
+  
+  void
+  simple_client::async_loop()
+  {
+    place_this_thread();
+    std::vector<send_state::sptr> active;
+    while( !async_stop_ )
+    {
+      {
+        std::unique_lock<std::mutex> lock{async_mtx_};
+        if( active.empty() )
+          async_cv_.wait_for(lock, std::chrono::milliseconds(100), [this](){
+            return async_stop_ || !async_incoming_.empty();
+          });
+        active.insert(active.end(), async_incoming_.begin(), async_incoming_.end());
+        async_incoming_.clear();
       }
       
-      fsm_state = fsm->run(fsm_state);
-      if( terminal_states.count(fsm_state) )
+      // one part per stream and round, a long stream doesn't hold up the rest
+      bool feeding = false;
+      for( size_t i=0; i<active.size(); )
       {
-        break;
+        send_state & st = *active[i];
+        std::exception_ptr error;
+        bool more = false;
+        feeding = feeding || st.send_more_;
+        try
+        {
+          // the control lane is polled once per round below
+          more = step(st, false);
+        }
+        catch (...)
+        {
+          error = std::current_exception();
+        }
+        
+        if( more )
+        {
+          ++i;
+          continue;
+        }
+        
+        send_state::sptr done_st{active[i]};
+        active[i] = active.back();
+        active.pop_back();
+        --async_in_flight_;
+        send_ended((uint64_t)done_st->info_->id_);
+        if( done_st->done_ )
+          done_st->done_(done_st->info_, error);
       }
-    };
+      
+      // replies and control messages, only waits when nothing is fed
+      if( !active.empty() )
+        receive_replies(feeding ? 0 : 1);
+    }
   }
   
   simple_server::simple_server(const std::string & path,
@@ -139,9 +427,42 @@ namespace virtdb { namespace gateway {
     stopped_{false},
     trace_{trace_cb},
     fsm_{std::string("SERVER:")+path, trace_cb},
-    last_state_{ST_INIT}
+    last_state_{ST_INIT},
+    control_epoch_{0},
+    seen_epoch_{0},
+    skipped_parts_{0},
+    expired_parts_{0},
+    corrupt_parts_{0},
+    quarantined_count_{0},
+    quarantine_limit_{4096},
+    reports_per_second_{10},
+    report_second_{0},
+    reports_left_{0},
+    ready_{256, ready_queue()},
+    scheduling_{false},
+    ready_parts_{0},
+    quantum_{64*1024},
+    read_ahead_{256},
+    memory_budget_{0},
+    buffered_bytes_{0},
+    spilled_parts_{0},
+    spilled_bytes_{0},
+    spill_errors_{0},
+    stream_memory_{0},
+    memory_limit_{0}
   {
     using namespace virtdb::fsm;
+    for( auto & f : failures_ )
+      f = 0;
+    for( int i=0; i<256; ++i )
+    {
+      type_streams_[i]  = 0;
+      type_bytes_[i]    = 0;
+      max_streams_[i]   = 0;
+      max_bytes_[i]     = 0;
+      stream_bytes_[i]  = 0;
+    }
+    
     {
       // server states
       fsm_.state_name(ST_INIT,     "INIT");
@@ -182,41 +503,26 @@ namespace virtdb { namespace gateway {
         transition::sptr client_fix   {new transition  {ST_READY, EV_FIX,    ST_READY,  "Client requests missing piece of server stream"}};
         transition::sptr client_error {new transition  {ST_READY, EV_ERROR,  ST_READY,  "Client says ERROR"}};
         
-        action::sptr init_one{new action{[this](uint16_t seqno,
-                                                transition & tran,
-                                                state_machine & sm)
+        action::sptr init_stream{new action{[this](uint16_t seqno,
+                                                   transition & tran,
+                                                   state_machine & sm)
+          {
+            start_stream();
+          }, "INIT STREAM"
+        }};
+        
+        action::sptr next_part{new action{[this](uint16_t seqno,
+                                                 transition & tran,
+                                                 state_machine & sm)
           {
-            auto handler = handlers_[act_message_.stream_type_];
-            if( handler )
-            {
-              stream::sptr stream_data{new stream};
-              stream_data->fsm_              = (handler->fsm_factory_)(act_message_, trace_);
-              stream_data->terminal_states_  = handler->terminal_states_;
-              stream_data->info_             = (handler->info_factory_)(act_message_.id_);
-              stream_data->type_             = act_message_.stream_type_;
-              
-              stream_data->fsm_->enqueue(act_message_.event_);
-              
-              stream_data->last_state_       = stream_data->fsm_->run(ST_INIT);
-              
-              // check if we are done here
-              if( stream_data->terminal_states_.count(stream_data->last_state_) == 0 )
-              {
-                // if the last state is non terminal state then we need to store the stream data
-                // because the server may want to send additional messages in response to this single
-                // request
-                streams_[act_message_.id_] = stream_data;
-              }
-            }
-            else
-            {
-              fsm_.enqueue(EV_STREAM_INIT_FAILED);
-              THROW_(std::string{"No handler for stream type:"}+std::to_string((int)act_message_.stream_type_));
-            }
-          }, "INIT ONE"
+            continue_stream();
+          }, "NEXT PART"
         }};
         
-        client_one->set_action(1, init_one);
+        client_one->set_action(1, init_stream);
+        client_start->set_action(1, init_stream);
+        client_next->set_action(1, next_part);
+        client_end->set_action(1, next_part);
 
         /*
         loop::sptr run_stream{new loop{[this](uint16_t seqno,
@@ -247,24 +553,153 @@ namespace virtdb { namespace gateway {
     }
   }
   
+  void
+  simple_server::start_stream()
+  {
+    uint8_t type = act_message_.stream_type_;
+    auto handler = handlers_[type];
+    if( handler && !admit(type, stream_cost(*handler, type)) )
+    {
+      release_oob(act_message_.id_);
+      fsm_.enqueue(EV_STREAM_INIT_FAILED);
+      fail(FAIL_REJECTED, (act_message_.event_ == EV_START), "stream refused, admission limit reached");
+    }
+    else if( handler && handler->coro_factory_ )
+    {
+      start_coroutine(*handler);
+    }
+    else if( handler )
+    {
+      stream::sptr stream_data{new stream};
+      stream_data->fsm_              = (handler->fsm_factory_)(act_message_, trace_);
+      stream_data->terminal_states_  = handler->terminal_states_;
+      stream_data->info_             = (handler->info_factory_)(act_message_.id_);
+      stream_data->type_             = act_message_.stream_type_;
+      
+      stream_data->fsm_->enqueue(act_message_.event_);
+      
+      stream_data->last_state_       = stream_data->fsm_->run(ST_INIT);
+      
+      // check if we are done here
+      if( stream_data->terminal_states_.count(stream_data->last_state_) == 0 )
+      {
+        // if the last state is non terminal state then we need to store the stream data
+        // because the server may want to send additional messages in response to this single
+        // request or more parts are coming
+        keep_stream(stream_data);
+      }
+      else
+      {
+        release_oob(act_message_.id_);
+      }
+    }
+    else
+    {
+      release_oob(act_message_.id_);
+      fsm_.enqueue(EV_STREAM_INIT_FAILED);
+      fail(FAIL_NO_HANDLER, (act_message_.event_ == EV_START), "no handler for the stream type");
+    }
+  }
+  
+  void
+  simple_server::start_coroutine(const handler & h)
+  {
+    void * frame = coro_pool_.allocate(h.coro_size_);
+    stream_coroutine * coro = nullptr;
+    try
+    {
+      coro = (h.coro_factory_)(frame, act_message_);
+    }
+    catch (...)
+    {
+      coro_pool_.release(frame, h.coro_size_);
+      release_oob(act_message_.id_);
+      throw;
+    }
+    
+    stream::sptr stream_data{new stream};
+    stream_data->coro_  = coroutine_ptr{coro, coroutine_deleter{&coro_pool_, h.coro_size_}};
+    stream_data->type_  = act_message_.stream_type_;
+    coro->id_ = act_message_.id_;
+    
+    // kept while the coroutine awaits more parts
+    if( coro->resume(*this, act_message_) )
+      keep_stream(stream_data);
+    else
+      release_oob(act_message_.id_);
+  }
+  
+  void
+  simple_server::continue_stream()
+  {
+    auto it = streams_.find(act_message_.id_);
+    if( it == streams_.end() )
+    {
+      release_oob(act_message_.id_);
+      fsm_.enqueue(EV_BAD_MESSAGE);
+      fail(FAIL_UNKNOWN_STREAM, (act_message_.event_ == EV_NEXT), "part of an unknown stream");
+      return;
+    }
+    
+    stream::sptr stream_data = it->second;
+    act_message_.stream_type_ = stream_data->type_;
+    
+    if( stream_data->coro_ )
+    {
+      if( !stream_data->coro_->resume(*this, act_message_) )
+      {
+        release_oob(act_message_.id_);
+        stream_closed(act_message_.id_);
+        forget_stream(it);
+      }
+      return;
+    }
+    
+    stream_data->fsm_->enqueue(act_message_.event_);
+    stream_data->last_state_ = stream_data->fsm_->run(stream_data->last_state_);
+    
+    if( stream_data->terminal_states_.count(stream_data->last_state_) )
+    {
+      release_oob(act_message_.id_);
+      stream_closed(act_message_.id_);
+      forget_stream(it);
+    }
+  }
+  
+  const simple_gateway::stream_part &
+  simple_server::current_part() const
+  {
+    return act_message_;
+  }
+  
   /* Packet descriptions:
    
    * EV_START / EV_ONE
    *  - 1B: msg. type    / = EV_START / EV_ONE
    *  - 1B: stream type  / to match stream handler at the server side
    *  - 1-10B: ID        / VarInt64, for client messages it is redundant
+   *  - [deadline]       / VarInt64 with FLAG_DEADLINE, microseconds of the system clock
+   *  - [crc]            / 4B with FLAG_CRC
+   *  - [stamp]          / VarInt64 with FLAG_STAMP, microseconds of the system clock
+   *  - [segments]       / VarInt64 count and lengths with FLAG_SEGMENTS
    *  - [data]           /
    
    * EV_NEXT:
    *  - 1B:    type      / = EV_NEXT
    *  - 1-10B: ID        / VarInt64, position of EV_START/EV_ONE message
    *  - 1-10B: Seq.No    / VarInt64, identifies the message number of the stream
+   *  - [crc]            / 4B with FLAG_CRC
+   *  - [stamp]          / VarInt64 with FLAG_STAMP, microseconds of the system clock
+   *  - [segments]       / VarInt64 count and lengths with FLAG_SEGMENTS
    *  - [data]           /
    
    * EV_END:             / This message flags end of stream
    *  - 1B:    msg.type  / = EV_END
    *  - 1-10B: ID        / VarInt64, position of EV_START/EV_ONE message
    *  - 1-10B: Seq.No    / VarInt64, identifies the message number of the stream
+   *  - [crc]            / 4B with FLAG_CRC
+   *  - [stamp]          / VarInt64 with FLAG_STAMP, microseconds of the system clock
+   *  - [segments]       / VarInt64 count and lengths with FLAG_SEGMENTS
    *  - [data]           /
    
    * EV_STOP:            / Either client or server may tell the other party to stop sending new parts
@@ -290,7 +725,20 @@ namespace virtdb { namespace gateway {
    * ID:      Varint64 encoded position of the client stream start position
    * Seq.No.: Sequence numbers identify the order of the stream part to make a continous stream of data.
    *          They may come out of order, even after EV_END message.
+
+   * EV_STOP, EV_FIX and EV_ERROR travel on the control lane (<data queue>.ctl), which is
+   * polled besides the data queue, so they don't wait behind queued stream parts.
    
+   * Flags:   The upper bits of msg.type. Extension fields follow the ID / Seq.No. in flag order.
+   *  - 0x80:  OOB       / [data] is replaced by VarInt64 handle, offset and length of the payload
+   *                     / in the <base>/oob/<ID>.<handle> segment file
+   *  - 0x40:  DEADLINE  / EV_START / EV_ONE only, parts of the stream arriving after it are dropped
+   *  - 0x20:  CRC       / CRC32C of the message without the crc field, plus the OOB payload.
+   *                     / parts failing it are asked for again with EV_FIX
+   *  - 0x10:  STAMP     / the client's send time, so a captured queue can be replayed at its pace
+   *  - 0x08:  SEGMENTS  / [data] is VarInt64 count and lengths, then the segments back to back,
+   *                     / as a gather feeder gave them. never together with OOB
+
    */
   
   void
@@ -306,173 +754,1322 @@ namespace virtdb { namespace gateway {
     {
       try
       {
+        // stops that arrived on the control lane in the meantime
+        if( control_epoch_.load(std::memory_order_acquire) != seen_epoch_ )
+          apply_control();
+        
         if( len > 1 )
         {
-          uint8_t  event   = *ptr;
-          uint64_t pos     = 1;
-          uint64_t remain  = len-1;
-          uint64_t id      = 0;
-          uint64_t seqno   = 0;
+          act_message_.position_ = msg_id;
+          bool parsed = parse_part(ptr, len, act_message_);
           
-          act_message_.position_     = msg_id;
-          act_message_.total_bytes_  = len;
-          act_message_.event_        = ptr[0];
-          act_message_.stream_type_  = 0; // unknown
+          // the rest of a failed stream goes before its payload is looked at
+          if( parsed && quarantined_part() )
+            return !is_stopped();
           
-          switch( *ptr )
+          // torn or corrupt parts are asked for again
+          if( parsed && !(act_message_.flags_ & FLAG_OOB) && !verify_part(ptr, len, act_message_) )
           {
-            case EV_START:
-            case EV_ONE:
-            {
-              uint8_t stream_type = ptr[pos];
-              ++pos;
-              --remain;
-              
-              if( get_varint64(ptr, id, pos, remain) )
-              {
-                act_message_.id_           = id;
-                act_message_.seqno_        = seqno;
-                act_message_.buffer_       = ptr + pos;
-                act_message_.size_         = remain;
-                act_message_.stream_type_  = ptr[1];
-                
-                fsm_.enqueue(*ptr);
-              }
-              else
-              {
-                fsm_.enqueue(EV_STREAM_INIT_FAILED);
-              }
-              break;
-            }
-              
-            case EV_NEXT:
-            case EV_END:
-            {
-              
-              if( get_varint64(ptr, id, pos, remain) &&
-                  get_varint64(ptr, seqno, pos, remain) )
-              {
-                act_message_.id_           = id;
-                act_message_.seqno_        = seqno;
-                act_message_.buffer_       = ptr + pos;
-                act_message_.size_         = remain;
-                
-                fsm_.enqueue(*ptr);
-              }
-              else
-              {
-                fsm_.enqueue(EV_BAD_MESSAGE);
-              }
-              break;
-            }
-              
-            case EV_STOP:   // break; // TODO
-            case EV_FIX:    // break; // TODO
-            case EV_ERROR:  // break; // TODO
-            default:
-            {
-              fsm_.enqueue(EV_BAD_MESSAGE);
-              break;
-            }
-          };
+            request_fix();
+            return !is_stopped();
+          }
+          
+          // parts of stopped streams are dropped by their header
+          if( parsed && skip_part() )
+          {
+            if( act_message_.flags_ & FLAG_OOB )
+              discard_oob(act_message_);
+            ++skipped_parts_;
+            return !is_stopped();
+          }
+          
+          // shed work nobody waits for, before mapping the payload
+          if( parsed && expired_part(false) )
+            return !is_stopped();
+          
+          if( parsed && (act_message_.flags_ & FLAG_OOB) )
+            parsed = map_oob(act_message_);
+          
+          if( parsed && (act_message_.flags_ & FLAG_OOB) && !verify_part(ptr, len, act_message_) )
+          {
+            request_fix();
+            return !is_stopped();
+          }
+          
+          // queued for the scheduler, served when enough parts are read ahead
+          if( parsed && scheduling_ && schedule_part() )
+          {
+            if( ready_parts_ >= read_ahead_ )
+              serve_ready(1);
+            return !is_stopped();
+          }
+          
+          process_part(parsed);
+        }
+        else
+        {
+          last_state_ = fsm_.run(last_state_);
         }
-        last_state_ = fsm_.run(last_state_);
       }
       catch (const std::exception & e)
       {
-        std::cerr << "TODO: exception during stream processing: " << e.what() << "\n";
+        fail(FAIL_HANDLER_ERROR, false, e.what());
       }
       
       return !is_stopped();
     };
     
+    place_this_thread();
+    apply_placement();
+    std::thread control{[this](){
+      place_this_thread();
+      control_loop();
+    }};
+    
     while( !is_stopped() )
     {
-      from = pull_data(from, pull, 1000);
+      // with parts waiting only look for new arrivals, then serve a few
+      from = pull_data(from, pull, (ready_parts_ ? 0 : 1000));
+      set_consumed(from);
+      serve_ready(8);
+      
+      if( control_epoch_.load(std::memory_order_acquire) != seen_epoch_ )
+        apply_control();
     }
     
+    control.join();
+    
     // telling our state machine that we have been stoppped
     fsm_.enqueue(EV_STOP_SERVER);
     last_state_ = fsm_.run(last_state_);
   }
   
-  // the data stream's state machine may upcall to these
   void
-  simple_client::stop(uint64_t id)
-  {
-  }
-  
-  bool
-  simple_client::wait_data(uint64_t id,
-                           uint64_t start_seqno)
-  {
-    return false;
-  }
-  
-  bool
-  simple_client::get_data(uint64_t id,
-                          uint64_t seqno,
-                          stream_part & part)
+  simple_server::process_part(bool parsed)
   {
-    return false;
+    switch( act_message_.event_ )
+    {
+      case EV_START:
+      case EV_ONE:
+      {
+        if( parsed ) fsm_.enqueue(act_message_.event_);
+        else         fsm_.enqueue(EV_STREAM_INIT_FAILED);
+        break;
+      }
+        
+      case EV_NEXT:
+      case EV_END:
+      {
+        if( parsed ) fsm_.enqueue(act_message_.event_);
+        else         fsm_.enqueue(EV_BAD_MESSAGE);
+        break;
+      }
+        
+      case EV_STOP:
+      case EV_FIX:
+      case EV_ERROR:
+      {
+        // normally on the control lane
+        if( parsed ) { on_control(act_message_); apply_control(); }
+        else         fsm_.enqueue(EV_BAD_MESSAGE);
+        break;
+      }
+        
+      default:
+      {
+        fsm_.enqueue(EV_BAD_MESSAGE);
+        break;
+      }
+    };
+    if( !parsed )
+      fail(FAIL_MALFORMED, false, "malformed part");
+    last_state_ = fsm_.run(last_state_);
   }
   
-  void
-  simple_client::request_resend(uint64_t id,
-                                uint64_t seqno)
-  {
-  }
-
-
   bool
-  simple_gateway::get_varint64(const uint8_t * ptr,
-                               uint64_t & result,
-                               uint64_t & position,
-                               uint64_t & remaining)
+  simple_server::schedule_part()
   {
-    bool ret = false;
-    if( ptr && remaining && remaining > position )
+    uint8_t type = 0;
+    uint64_t id = act_message_.id_;
+    
+    switch( act_message_.event_ )
     {
-      uint8_t sz = (remaining>10?10:remaining);
-      queue::varint v{ptr+position, sz};
-      position   += v.len();
-      remaining  -= v.len();
-      result     = v.get64();
-      ret        = true;
-    }
+      case EV_START:
+      case EV_ONE:
+      {
+        type = act_message_.stream_type_;
+        if( act_message_.event_ == EV_START )
+          sched_types_[id] = type;
+        break;
+      }
+        
+      case EV_NEXT:
+      case EV_END:
+      {
+        // the stream's type is known from its queued or dispatched start
+        auto sit = sched_types_.find(id);
+        if( sit != sched_types_.end() )
+        {
+          type = sit->second;
+          if( act_message_.event_ == EV_END )
+            sched_types_.erase(sit);
+        }
+        else
+        {
+          auto it = streams_.find(id);
+          if( it == streams_.end() )
+            return false;
+          type = it->second->type_;
+        }
+        break;
+      }
+        
+      default:
+        return false;
+    };
+    
+    ready_queue & q = ready_[type];
+    q.parts_.push_back(ready_part{});
+    ready_part & rp = q.parts_.back();
+    rp.part_ = act_message_;
+    
+    // mapped out-of-band payloads stay where they are
+    // the segment table goes along, segment_reader looks for it before buffer_
+    uint64_t table = act_message_.segment_table_;
+    uint64_t bytes = table+act_message_.size_;
+    if( !(act_message_.flags_ & FLAG_OOB) && bytes > 0 )
+    {
+      const uint8_t * from = act_message_.buffer_-table;
+      if( memory_budget_ && buffered_bytes_+bytes > memory_budget_ )
+      {
+        try
+        {
+          if( !spill_ )
+            spill_.reset(new spill_file{spill_dir()});
+          rp.offset_   = spill_->append(from, bytes);
+          rp.spilled_  = true;
+          rp.part_.buffer_ = nullptr;
+          ++spilled_parts_;
+          spilled_bytes_ += bytes;
+        }
+        catch (const std::exception & e)
+        {
+          // the disk is no option, memory still is
+          ++spill_errors_;
+        }
+      }
+      
+      if( !rp.spilled_ )
+      {
+        rp.data_.assign((const char *)from, bytes);
+        rp.part_.buffer_ = (const uint8_t *)rp.data_.data()+table;
+        buffered_bytes_ += bytes;
+        type_bytes_[type] += bytes;
+      }
+    }
+    
+    if( !q.active_ )
+    {
+      q.active_ = true;
+      active_types_.push_back(type);
+    }
+    ++ready_parts_;
+    return true;
+  }
+  
+  void
+  simple_server::serve_ready(uint64_t max_parts)
+  {
+    uint64_t served = 0;
+    while( served < max_parts && !active_types_.empty() )
+    {
+      uint8_t type = active_types_.front();
+      ready_queue & q = ready_[type];
+      if( !q.turn_ )
+      {
+        q.deficit_ += quantum_ * (q.weight_ ? q.weight_ : 1);
+        q.turn_ = true;
+      }
+      
+      while( !q.parts_.empty() && served < max_parts )
+      {
+        ready_part & rp = q.parts_.front();
+        uint64_t cost = (rp.part_.total_bytes_ ? rp.part_.total_bytes_ : 1);
+        if( cost > q.deficit_ )
+          break;
+        q.deficit_ -= cost;
+        
+        try
+        {
+          act_message_ = rp.part_;
+          uint64_t bytes = act_message_.size_+act_message_.segment_table_;
+          if( rp.spilled_ )
+            act_message_.buffer_ = spill_->read(rp.offset_, bytes)+act_message_.segment_table_;
+          else if( bytes > 0 && !(act_message_.flags_ & FLAG_OOB) )
+            act_message_.buffer_ = (const uint8_t *)rp.data_.data()+act_message_.segment_table_;
+          
+          // may have been stopped while waiting
+          if( skip_part() )
+          {
+            // already mapped
+            if( act_message_.flags_ & FLAG_OOB )
+              release_oob(act_message_.id_);
+            ++skipped_parts_;
+          }
+          else if( !expired_part(true) )
+          {
+            process_part(true);
+          }
+        }
+        catch (const std::exception & e)
+        {
+          fail(FAIL_HANDLER_ERROR, false, e.what());
+        }
+        
+        if( rp.spilled_ )
+        {
+          spill_->release(rp.offset_, rp.part_.size_+rp.part_.segment_table_);
+        }
+        else
+        {
+          buffered_bytes_ -= rp.data_.size();
+          type_bytes_[type] -= rp.data_.size();
+        }
+        q.parts_.pop_front();
+        --ready_parts_;
+        ++served;
+      }
+      
+      // the round ended for this type unless we ran out of budget
+      if( q.parts_.empty() )
+      {
+        q.deficit_  = 0;
+        q.active_   = false;
+        q.turn_     = false;
+        active_types_.pop_front();
+      }
+      else if( served < max_parts )
+      {
+        q.turn_ = false;
+        active_types_.pop_front();
+        active_types_.push_back(type);
+      }
+    }
+  }
+  
+  void
+  simple_server::set_weight(uint8_t stream_type,
+                            uint32_t weight)
+  {
+    ready_[stream_type].weight_ = weight;
+    scheduling_ = true;
+  }
+  
+  void
+  simple_server::set_scheduling(uint64_t quantum_bytes,
+                                uint64_t read_ahead_parts)
+  {
+    quantum_     = (quantum_bytes ? quantum_bytes : 1);
+    read_ahead_  = (read_ahead_parts ? read_ahead_parts : 1);
+  }
+  
+  void
+  simple_server::set_memory_budget(uint64_t bytes)
+  {
+    memory_budget_ = bytes;
+  }
+  
+  uint64_t
+  simple_server::buffered_bytes() const
+  {
+    return buffered_bytes_.load();
+  }
+  
+  uint64_t
+  simple_server::spilled_parts() const
+  {
+    return spilled_parts_.load();
+  }
+  
+  uint64_t
+  simple_server::spilled_bytes() const
+  {
+    return spilled_bytes_.load();
+  }
+  
+  uint64_t
+  simple_server::spill_errors() const
+  {
+    return spill_errors_.load();
+  }
+  
+  simple_server::ready_queue::ready_queue()
+  : weight_{1},
+    deficit_{0},
+    active_{false},
+    turn_{false}
+  {
+  }
+  
+  // the data stream's state machine may upcall to these
+  void
+  simple_client::stop(uint64_t id)
+  {
+    cancel(id);
+    send_control(EV_STOP, id, 0, std::string{});
+  }
+  
+  simple_client::reply_stream::reply_stream()
+  : ended_{false},
+    stopped_{false},
+    last_seqno_{0}
+  {
+  }
+  
+  void
+  simple_client::receive_control()
+  {
+    // the send loops and the reply path may poll at the same time
+    std::unique_lock<std::mutex> lock{control_rcv_mtx_, std::try_to_lock};
+    if( !lock.owns_lock() )
+      return;
+    
+    if( !control_from_set_ )
+    {
+      control_from_      = control_position();
+      control_from_set_  = true;
+    }
+    
+    auto pull = [&](uint64_t msg_id,
+                    const uint8_t * ptr,
+                    uint64_t len)
+    {
+      stream_part part;
+      if( !parse_part(ptr, len, part) )
+        return true;
+      
+      if( part.event_ == EV_STOP || part.event_ == EV_ERROR )
+      {
+        cancel(part.id_);
+      }
+      else if( part.event_ == EV_FIX )
+      {
+        std::lock_guard<std::mutex> lock{cancel_mtx_};
+        fix_requests_[part.id_].insert(part.seqno_);
+      }
+      return true;
+    };
+    
+    // never waits, the data lane does
+    control_from_ = pull_control(control_from_, pull, 0);
+  }
+  
+  void
+  simple_client::cancel(uint64_t id)
+  {
+    {
+      // a stream done sending has no send loop to tell, see send_ended()
+      std::lock_guard<std::mutex> lock{cancel_mtx_};
+      if( stream_open(id) )
+        cancelled_.insert(id);
+      pending_cancels_.push_back(id);
+    }
+    cancel_epoch_.fetch_add(1, std::memory_order_release);
+  }
+  
+  void
+  simple_client::send_ended(uint64_t id)
+  {
+    stream_closed(id);
+    std::lock_guard<std::mutex> lock{cancel_mtx_};
+    cancelled_.erase(id);
+  }
+  
+  bool
+  simple_client::is_cancelled(uint64_t id)
+  {
+    std::lock_guard<std::mutex> lock{cancel_mtx_};
+    return cancelled_.count(id) > 0;
+  }
+  
+  bool
+  simple_client::receive_replies(uint64_t timeout_ms)
+  {
+    std::lock_guard<std::mutex> rcv_lock{reply_rcv_mtx_};
+    if( !reply_from_set_ )
+    {
+      reply_from_      = receiver_position();
+      reply_from_set_  = true;
+    }
+    
+    // control messages first
+    receive_control();
+    uint64_t epoch = cancel_epoch_.load(std::memory_order_acquire);
+    if( epoch != reply_epoch_ )
+    {
+      // the rest of these replies is not coming
+      reply_epoch_ = epoch;
+      std::vector<uint64_t> ids;
+      {
+        std::lock_guard<std::mutex> lock{cancel_mtx_};
+        ids.swap(pending_cancels_);
+      }
+      std::lock_guard<std::mutex> replies_lock{replies_mtx_};
+      for( auto id : ids )
+      {
+        if( id < reply_floor_ )
+          continue;
+        reply_stream & rs = replies_[id];
+        rs.parts_.clear();
+        rs.stopped_  = true;
+        rs.ended_    = true;
+      }
+    }
+    
+    bool received = false;
+    auto pull = [&](uint64_t msg_id,
+                    const uint8_t * ptr,
+                    uint64_t len)
+    {
+      stream_part part;
+      if( parse_part(ptr, len, part) &&
+          (part.event_ == EV_NEXT || part.event_ == EV_END) )
+      {
+        std::lock_guard<std::mutex> lock{replies_mtx_};
+        if( part.id_ < reply_floor_ )
+          return true;
+        reply_stream & rs = replies_[part.id_];
+        if( rs.stopped_ )
+          return true;
+        rs.parts_[part.seqno_].assign((const char *)part.buffer_, part.size_);
+        if( part.event_ == EV_END )
+        {
+          rs.ended_       = true;
+          rs.last_seqno_  = part.seqno_;
+        }
+        received = true;
+      }
+      return true;
+    };
+    
+    reply_from_ = pull_data(reply_from_, pull, timeout_ms);
+    set_consumed(reply_from_);
+    return received;
+  }
+  
+  bool
+  simple_client::wait_data(uint64_t id,
+                           uint64_t start_seqno,
+                           uint64_t timeout_ms)
+  {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while( true )
+    {
+      {
+        std::lock_guard<std::mutex> lock{replies_mtx_};
+        auto it = replies_.find(id);
+        if( it != replies_.end() )
+        {
+          if( it->second.stopped_ )
+            return false;
+          if( it->second.parts_.count(start_seqno) )
+            return true;
+          if( it->second.ended_ && start_seqno > it->second.last_seqno_ )
+            return false;
+        }
+      }
+      
+      auto now = std::chrono::steady_clock::now();
+      if( now >= deadline )
+        return false;
+      
+      uint64_t wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline-now).count();
+      receive_replies(wait_ms > 0 ? wait_ms : 1);
+    }
+  }
+  
+  bool
+  simple_client::get_data(uint64_t id,
+                          uint64_t seqno,
+                          stream_part & part)
+  {
+    std::lock_guard<std::mutex> lock{replies_mtx_};
+    auto it = replies_.find(id);
+    if( it == replies_.end() )
+      return false;
+    
+    reply_stream & rs = it->second;
+    auto pit = rs.parts_.find(seqno);
+    if( pit == rs.parts_.end() )
+      return false;
+    
+    // the part stays valid until the next get_data() on this stream
+    rs.current_.swap(pit->second);
+    rs.parts_.erase(pit);
+    
+    part.id_           = id;
+    part.seqno_        = seqno;
+    part.buffer_       = (const uint8_t *)rs.current_.data();
+    part.size_         = rs.current_.size();
+    part.total_bytes_  = rs.current_.size();
+    part.event_        = ((rs.ended_ && seqno == rs.last_seqno_) ? EV_END : EV_NEXT);
+    
+    return true;
+  }
+  
+  void
+  simple_client::release_data(uint64_t id)
+  {
+    std::lock_guard<std::mutex> replies_lock{replies_mtx_};
+    replies_.erase(id);
+    std::lock_guard<std::mutex> lock{cancel_mtx_};
+    pending_cancels_.erase(std::remove(pending_cancels_.begin(), pending_cancels_.end(), id),
+                           pending_cancels_.end());
+  }
+  
+  void
+  simple_client::request_resend(uint64_t id,
+                                uint64_t seqno)
+  {
+    send_control(EV_FIX, id, seqno, std::string{});
+  }
+  
+  bool
+  simple_client::is_reply_stopped(uint64_t id) const
+  {
+    std::lock_guard<std::mutex> lock{replies_mtx_};
+    auto it = replies_.find(id);
+    return (it != replies_.end() && it->second.stopped_);
+  }
+  
+  std::set<uint64_t>
+  simple_client::take_fix_requests(uint64_t id)
+  {
+    receive_control();
+    std::set<uint64_t> ret;
+    std::lock_guard<std::mutex> lock{cancel_mtx_};
+    auto it = fix_requests_.find(id);
+    if( it != fix_requests_.end() )
+    {
+      ret.swap(it->second);
+      fix_requests_.erase(it);
+    }
     return ret;
   }
   
   void
-  simple_server::add_handler(uint8_t stream_type,
-                             new_stream_fun new_handler,
-                             const state_set & terminal_states,
-                             new_info_fun new_info)
+  simple_client::reset()
+  {
+    std::lock_guard<std::mutex> rcv_lock{reply_rcv_mtx_};
+    std::lock_guard<std::mutex> replies_lock{replies_mtx_};
+    std::lock_guard<std::mutex> lock{cancel_mtx_};
+    
+    // ids only grow, the next stream starts at or above this
+    reply_floor_ = std::max(next_id_.load(), sender_position());
+    replies_.clear();
+    cancelled_.clear();
+    pending_cancels_.clear();
+    fix_requests_.clear();
+    reply_epoch_ = cancel_epoch_.load(std::memory_order_acquire);
+  }
+
+
+  bool
+  simple_gateway::get_varint64(const uint8_t * ptr,
+                               uint64_t & result,
+                               uint64_t & position,
+                               uint64_t & remaining)
+  {
+    bool ret = false;
+    if( ptr && remaining > 0 )
+    {
+      uint8_t sz = (remaining>10?10:remaining);
+      queue::varint v{ptr+position, sz};
+      // the last byte read must not have the continuation bit set
+      if( v.len() > 0 && (ptr[position+v.len()-1] & 0x80) == 0 )
+      {
+        position   += v.len();
+        remaining  -= v.len();
+        result     = v.get64();
+        ret        = true;
+      }
+    }
+    return ret;
+  }
+  
+  bool
+  simple_gateway::parse_part(const uint8_t * ptr,
+                             uint64_t len,
+                             stream_part & part)
+  {
+    if( !ptr || len < 2 )
+      return false;
+    
+    uint64_t pos     = 1;
+    uint64_t remain  = len-1;
+    uint64_t id      = 0;
+    uint64_t seqno   = 0;
+    
+    part.total_bytes_  = len;
+    part.event_        = ptr[0] & EV_MASK;
+    part.flags_        = ptr[0] & ~EV_MASK;
+    part.stream_type_  = 0; // unknown
+    
+    switch( part.event_ )
+    {
+      case EV_START:
+      case EV_ONE:
+      {
+        uint8_t stream_type = ptr[pos];
+        ++pos;
+        --remain;
+        
+        if( !get_varint64(ptr, id, pos, remain) )
+          return false;
+        
+        part.deadline_us_ = 0;
+        if( (part.flags_ & FLAG_DEADLINE) &&
+            !get_varint64(ptr, part.deadline_us_, pos, remain) )
+          return false;
+        
+        part.stream_type_ = stream_type;
+        break;
+      }
+        
+      case EV_NEXT:
+      case EV_END:
+      case EV_FIX:
+      case EV_ERROR:
+      {
+        if( !get_varint64(ptr, id, pos, remain) ||
+            !get_varint64(ptr, seqno, pos, remain) )
+          return false;
+        break;
+      }
+        
+      case EV_STOP:
+      {
+        if( !get_varint64(ptr, id, pos, remain) )
+          return false;
+        break;
+      }
+        
+      default:
+        return false;
+    };
+    
+    part.id_      = id;
+    part.seqno_   = seqno;
+    
+    if( part.flags_ & FLAG_CRC )
+    {
+      // fixed 4 bytes, little endian
+      if( remain < 4 )
+        return false;
+      part.crc_offset_  = pos;
+      part.crc_         = (uint32_t)ptr[pos] | ((uint32_t)ptr[pos+1] << 8) |
+                          ((uint32_t)ptr[pos+2] << 16) | ((uint32_t)ptr[pos+3] << 24);
+      pos     += 4;
+      remain  -= 4;
+    }
+    
+    part.stamp_us_ = 0;
+    if( (part.flags_ & FLAG_STAMP) &&
+        !get_varint64(ptr, part.stamp_us_, pos, remain) )
+      return false;
+    
+    if( part.flags_ & FLAG_OOB )
+    {
+      // the payload is in a segment file, see map_oob()
+      uint64_t length = 0;
+      part.oob_at_ = pos;
+      if( !get_varint64(ptr, part.oob_handle_, pos, remain) ||
+          !get_varint64(ptr, part.oob_offset_, pos, remain) ||
+          !get_varint64(ptr, length, pos, remain) )
+        return false;
+      part.buffer_  = nullptr;
+      part.size_    = length;
+      return !(part.flags_ & FLAG_SEGMENTS);
+    }
+    
+    part.segments_       = 0;
+    part.segment_table_  = 0;
+    if( part.flags_ & FLAG_SEGMENTS )
+    {
+      // the lengths must add up to the rest of the message
+      uint64_t table_at  = pos;
+      uint64_t total     = 0;
+      if( !get_varint64(ptr, part.segments_, pos, remain) )
+        return false;
+      for( uint64_t i=0; i<part.segments_; ++i )
+      {
+        uint64_t seg_len = 0;
+        if( !get_varint64(ptr, seg_len, pos, remain) || seg_len > len )
+          return false;
+        total += seg_len;
+      }
+      if( total != remain )
+        return false;
+      part.segment_table_ = pos-table_at;
+    }
+    
+    part.buffer_  = ptr + pos;
+    part.size_    = remain;
+    return true;
+  }
+  
+  void
+  simple_server::add_handler(uint8_t stream_type,
+                             new_stream_fun new_handler,
+                             const state_set & terminal_states,
+                             new_info_fun new_info)
+  {
+    handler::sptr h{new handler};
+    h->fsm_factory_      = new_handler;
+    h->terminal_states_  = terminal_states;
+    h->info_factory_     = new_info;
+    handlers_[stream_type].swap(h);
+  }
+  
+  void
+  simple_server::add_coroutine_handler(uint8_t stream_type,
+                                       size_t frame_size,
+                                       new_coroutine_fun new_coroutine)
+  {
+    handler::sptr h{new handler};
+    h->coro_factory_  = new_coroutine;
+    h->coro_size_     = frame_size;
+    handlers_[stream_type].swap(h);
+  }
+  
+  uint64_t
+  simple_server::coroutine_frames() const
+  {
+    return coro_pool_.in_use();
+  }
+  
+  simple_server::handler::handler()
+  : coro_size_{0}
+  {
+  }
+  
+  simple_server::coroutine_deleter::coroutine_deleter()
+  : pool_{nullptr},
+    size_{0}
+  {
+  }
+  
+  simple_server::coroutine_deleter::coroutine_deleter(frame_pool * pool,
+                                                      size_t size)
+  : pool_{pool},
+    size_{size}
+  {
+  }
+  
+  void
+  simple_server::coroutine_deleter::operator()(stream_coroutine * coro) const
+  {
+    coro->~stream_coroutine();
+    if( pool_ ) pool_->release(coro, size_);
+  }
+  
+  stream_coroutine::stream_coroutine()
+  : id_{0},
+    reply_seqno_{0},
+    resume_point_{0}
+  {
+  }
+  
+  stream_coroutine::~stream_coroutine() {}
+  
+  uint64_t
+  stream_coroutine::id() const
+  {
+    return id_;
+  }
+  
+  void
+  stream_coroutine::yield(simple_server & server,
+                          const queue::simple_publisher::buffer_vector & data,
+                          bool last)
+  {
+    server.reply(id_, reply_seqno_++, data, last);
+  }
+  
+  void
+  simple_server::push_event(uint64_t id,
+                            uint16_t event,
+                            bool if_empty)
+  {
+    auto it = streams_.find(id);
+    if( it != streams_.end() && !it->second->fsm_ )
+    {
+      THROW_(std::string{"coroutine stream has no state machine:"}+std::to_string(id));
+    }
+    else if( it != streams_.end() )
+    {
+      if( if_empty )
+        it->second->fsm_->enqueue_if_empty(event);
+      else
+        it->second->fsm_->enqueue(event);
+    }
+    else
+    {
+      THROW_(std::string{"invalid stream id:"}+std::to_string(id));
+    }
+  }
+  
+  void
+  simple_server::reply(uint64_t id,
+                       uint64_t seqno,
+                       const queue::simple_publisher::buffer_vector & data,
+                       bool last)
+  {
+    using namespace virtdb::queue;
+    
+    uint8_t type = (last ? EV_END : EV_NEXT);
+    varint v_id{id};
+    varint v_seqno{seqno};
+    
+    simple_publisher::buffer_vector data_vec;
+    data_vec.reserve(3+data.size());
+    data_vec.push_back(simple_publisher::buffer{&type, 1});
+    data_vec.push_back(simple_publisher::buffer{v_id.buf(), v_id.len()});
+    data_vec.push_back(simple_publisher::buffer{v_seqno.buf(), v_seqno.len()});
+    data_vec.insert(data_vec.end(), data.begin(), data.end());
+    
+    // handlers may reply from their own threads
+    std::lock_guard<std::mutex> lock{reply_mtx_};
+    if( seqno == 0 ) stream_opened(id, sender_position());
+    send_data(data_vec);
+    if( last ) stream_closed(id);
+  }
+  
+  void
+  simple_server::control_loop()
+  {
+    auto pull = [this](uint64_t msg_id,
+                       const uint8_t * ptr,
+                       uint64_t len)
+    {
+      stream_part part;
+      if( parse_part(ptr, len, part) )
+        on_control(part);
+      return !is_stopped();
+    };
+    
+    uint64_t from = control_position();
+    while( !is_stopped() )
+    {
+      from = pull_control(from, pull, 100);
+    }
+  }
+  
+  void
+  simple_server::on_control(const stream_part & part)
+  {
+    if( part.event_ != EV_STOP && part.event_ != EV_FIX && part.event_ != EV_ERROR )
+      return;
+    
+    {
+      std::lock_guard<std::mutex> lock{stop_mtx_};
+      if( part.event_ != EV_FIX )
+        stopped_ids_.insert(part.id_);
+      
+      // the payload is not kept
+      stream_part p{part};
+      p.buffer_  = nullptr;
+      p.size_    = 0;
+      pending_control_.push_back(p);
+    }
+    control_epoch_.fetch_add(1, std::memory_order_release);
+  }
+  
+  void
+  simple_server::apply_control()
+  {
+    std::vector<stream_part> pending;
+    {
+      std::lock_guard<std::mutex> lock{stop_mtx_};
+      seen_epoch_     = control_epoch_.load(std::memory_order_acquire);
+      stopped_local_  = stopped_ids_;
+      pending.swap(pending_control_);
+    }
+    
+    for( auto & p : pending )
+    {
+      auto it = streams_.find(p.id_);
+      if( it == streams_.end() )
+        continue;
+      
+      stream::sptr stream_data = it->second;
+      if( p.event_ == EV_FIX )
+      {
+        // the handler may resend
+        act_message_ = p;
+        act_message_.stream_type_ = stream_data->type_;
+        if( stream_data->coro_ )
+        {
+          if( stream_data->coro_->resume(*this, act_message_) )
+            continue;
+        }
+        else
+        {
+          stream_data->fsm_->enqueue(EV_FIX);
+          stream_data->last_state_ = stream_data->fsm_->run(stream_data->last_state_);
+          if( stream_data->terminal_states_.count(stream_data->last_state_) == 0 )
+            continue;
+        }
+      }
+      
+      release_oob(p.id_);
+      stream_closed(p.id_);
+      drop_stream(it);
+    }
+  }
+  
+  bool
+  simple_server::skip_part()
+  {
+    if( stopped_local_.empty() )
+      return false;
+    
+    uint64_t id = act_message_.id_;
+    if( stopped_local_.count(id) == 0 )
+      return false;
+    
+    // nothing comes after the last part, forget the id
+    if( act_message_.event_ == EV_END || act_message_.event_ == EV_ONE )
+    {
+      stopped_local_.erase(id);
+      deadlines_.erase(id);
+      sched_types_.erase(id);
+      std::lock_guard<std::mutex> lock{stop_mtx_};
+      stopped_ids_.erase(id);
+    }
+    return (act_message_.event_ >= EV_START && act_message_.event_ <= EV_END);
+  }
+  
+  void
+  simple_server::stop_stream(uint64_t id)
+  {
+    send_control(EV_STOP, id, 0, std::string{});
+    stream_closed(id);
+    
+    stream_part part;
+    part.id_     = id;
+    part.event_  = EV_STOP;
+    on_control(part);
+  }
+  
+  void
+  simple_server::send_error(uint64_t id,
+                            uint64_t seqno,
+                            const std::string & reason)
+  {
+    send_control(EV_ERROR, id, seqno, reason);
+    stream_closed(id);
+  }
+  
+  uint64_t
+  simple_server::skipped_parts() const
+  {
+    return skipped_parts_.load();
+  }
+  
+  bool
+  simple_server::expired_part(bool mapped)
+  {
+    bool has_deadline = (act_message_.flags_ & FLAG_DEADLINE) != 0;
+    if( deadlines_.empty() && !has_deadline )
+      return false;
+    
+    uint64_t id = act_message_.id_;
+    uint64_t deadline = 0;
+    bool last = (act_message_.event_ == EV_END || act_message_.event_ == EV_ONE);
+    
+    switch( act_message_.event_ )
+    {
+      case EV_START:
+      case EV_ONE:
+      {
+        if( !has_deadline )
+          return false;
+        deadline = act_message_.deadline_us_;
+        if( act_message_.event_ == EV_START )
+          deadlines_[id] = deadline;
+        break;
+      }
+        
+      case EV_NEXT:
+      case EV_END:
+      {
+        auto it = deadlines_.find(id);
+        if( it == deadlines_.end() )
+          return false;
+        deadline = it->second;
+        if( last )
+          deadlines_.erase(it);
+        break;
+      }
+        
+      default:
+        return false;
+    };
+    
+    if( now_us() < deadline )
+      return false;
+    
+    ++expired_parts_;
+    if( mapped ) release_oob(id);
+    else if( act_message_.flags_ & FLAG_OOB ) discard_oob(act_message_);
+    
+    if( last )
+    {
+      // nothing more comes, just forget the stream
+      auto it = streams_.find(id);
+      if( it != streams_.end() )
+        drop_stream(it);
+      release_oob(id);
+      stream_closed(id);
+    }
+    else
+    {
+      // the client stops feeding, the rest is skipped
+      deadlines_.erase(id);
+      stop_stream(id);
+    }
+    return true;
+  }
+  
+  int64_t
+  simple_server::remaining_budget_us() const
+  {
+    uint64_t deadline = act_message_.deadline_us_;
+    if( act_message_.event_ != EV_START && act_message_.event_ != EV_ONE )
+    {
+      auto it = deadlines_.find(act_message_.id_);
+      deadline = (it == deadlines_.end() ? 0 : it->second);
+    }
+    if( deadline == 0 )
+      return INT64_MAX;
+    return (int64_t)deadline - (int64_t)now_us();
+  }
+  
+  uint64_t
+  simple_server::expired_parts() const
+  {
+    return expired_parts_.load();
+  }
+  
+  void
+  simple_server::request_fix()
+  {
+    ++corrupt_parts_;
+    send_control(EV_FIX, act_message_.id_, act_message_.seqno_, std::string{});
+  }
+  
+  uint64_t
+  simple_server::corrupt_parts() const
+  {
+    return corrupt_parts_.load();
+  }
+  
+  bool
+  simple_server::quarantined_part()
+  {
+    if( quarantined_.empty() ||
+        act_message_.event_ < EV_START || act_message_.event_ > EV_END )
+      return false;
+    
+    auto it = quarantined_.find(act_message_.id_);
+    if( it == quarantined_.end() )
+      return false;
+    
+    ++failures_[FAIL_QUARANTINED];
+    if( act_message_.flags_ & FLAG_OOB )
+      discard_oob(act_message_);
+    
+    // nothing comes after the last part, forget the id
+    if( act_message_.event_ == EV_END || act_message_.event_ == EV_ONE )
+    {
+      quarantined_.erase(it);
+      quarantined_count_ = quarantined_.size();
+    }
+    return true;
+  }
+  
+  void
+  simple_server::fail(uint8_t code,
+                      bool quarantine,
+                      const char * reason)
+  {
+    ++failures_[code];
+    uint64_t id = act_message_.id_;
+    
+    // a quarantined or never kept stream has no FSM to run out of time
+    if( quarantine || streams_.count(id) == 0 )
+      deadlines_.erase(id);
+    
+    if( quarantine && quarantine_limit_ > 0 && quarantined_.insert(id).second )
+    {
+      // ids already forgotten are still in the order, so both stay bounded
+      quarantine_order_.push_back(id);
+      while( quarantine_order_.size() > quarantine_limit_ )
+      {
+        quarantined_.erase(quarantine_order_.front());
+        quarantine_order_.pop_front();
+      }
+      quarantined_count_ = quarantined_.size();
+    }
+    
+    // a flood of bad parts must not turn into a flood of reports
+    uint64_t second = now_us()/1000000;
+    if( second != report_second_ )
+    {
+      report_second_  = second;
+      reports_left_   = reports_per_second_;
+    }
+    bool report = (reports_left_ > 0);
+    if( report )
+    {
+      --reports_left_;
+      std::cerr << "gateway server " << base_path() << ": " << reason
+                << " (stream:" << id << " type:" << (int)act_message_.stream_type_ << ")\n";
+    }
+    
+    // a refused client would feed its stream in vain
+    if( code == FAIL_REJECTED || (report && code == FAIL_NO_HANDLER) )
+      send_error(id, act_message_.seqno_, reason);
+  }
+  
+  uint64_t
+  simple_server::failed_parts(uint8_t code) const
+  {
+    return (code < FAIL_CODES ? failures_[code].load() : 0);
+  }
+  
+  uint64_t
+  simple_server::quarantined_streams() const
+  {
+    return quarantined_count_.load();
+  }
+  
+  uint64_t
+  simple_server::stream_cost(const handler & h,
+                             uint8_t type) const
+  {
+    // what the server allocates itself, the handler's objects are not
+    // seen from here and only count as declared
+    uint64_t ret = sizeof(stream) + stream_bytes_[type];
+    if( h.coro_factory_ )
+      ret += frame_pool::frame_bytes(h.coro_size_);
+    return ret;
+  }
+  
+  bool
+  simple_server::admit(uint8_t type,
+                       uint64_t cost)
+  {
+    if( max_streams_[type] && type_streams_[type] >= max_streams_[type] )
+      return false;
+    if( max_bytes_[type] && type_bytes_[type]+cost > max_bytes_[type] )
+      return false;
+    if( memory_limit_ && memory_used()+cost > memory_limit_ )
+      return false;
+    return true;
+  }
+  
+  void
+  simple_server::keep_stream(stream::sptr stream_data)
+  {
+    uint8_t type = stream_data->type_;
+    auto h = handlers_[type];
+    stream_data->bytes_ = (h ? stream_cost(*h, type) : sizeof(stream));
+    
+    auto it = streams_.find(act_message_.id_);
+    if( it != streams_.end() )
+    {
+      // the deadline already in place is the new stream's
+      auto dl = deadlines_.find(act_message_.id_);
+      bool has_deadline = (dl != deadlines_.end());
+      uint64_t deadline = (has_deadline ? dl->second : 0);
+      drop_stream(it);
+      if( has_deadline ) deadlines_[act_message_.id_] = deadline;
+    }
+    streams_[act_message_.id_] = stream_data;
+    ++type_streams_[type];
+    type_bytes_[type] += stream_data->bytes_;
+    stream_memory_ += stream_data->bytes_;
+  }
+  
+  void
+  simple_server::forget_stream(stream_map::iterator it)
+  {
+    const stream & s = *(it->second);
+    --type_streams_[s.type_];
+    type_bytes_[s.type_] -= s.bytes_;
+    stream_memory_ -= s.bytes_;
+    deadlines_.erase(it->first);
+    streams_.erase(it);
+  }
+  
+  void
+  simple_server::drop_stream(stream_map::iterator it)
+  {
+    uint64_t id    = it->first;
+    uint8_t  type  = it->second->type_;
+    forget_stream(it);
+    if( on_dropped_ ) on_dropped_(id, type);
+  }
+  
+  void
+  simple_server::on_stream_dropped(dropped_fun f)
+  {
+    on_dropped_ = f;
+  }
+  
+  void
+  simple_server::set_admission(uint8_t stream_type,
+                               uint64_t max_streams,
+                               uint64_t max_bytes,
+                               uint64_t stream_bytes)
+  {
+    max_streams_[stream_type]   = max_streams;
+    max_bytes_[stream_type]     = max_bytes;
+    stream_bytes_[stream_type]  = stream_bytes;
+  }
+  
+  void
+  simple_server::set_memory_limit(uint64_t bytes)
   {
-    handler::sptr h{new handler};
-    h->fsm_factory_      = new_handler;
-    h->terminal_states_  = terminal_states;
-    h->info_factory_     = new_info;
-    handlers_[stream_type].swap(h);
+    memory_limit_ = bytes;
+  }
+  
+  uint64_t
+  simple_server::active_streams(uint8_t stream_type) const
+  {
+    return type_streams_[stream_type].load();
+  }
+  
+  uint64_t
+  simple_server::memory_used(uint8_t stream_type) const
+  {
+    return type_bytes_[stream_type].load();
+  }
+  
+  uint64_t
+  simple_server::memory_used() const
+  {
+    return stream_memory_.load() + buffered_bytes_.load();
   }
   
   void
-  simple_server::push_event(uint64_t id,
-                            uint16_t event,
-                            bool if_empty)
+  simple_server::set_quarantine(uint64_t max_streams,
+                                uint64_t reports_per_second)
   {
-    auto it = streams_.find(id);
-    if( it != streams_.end() )
-    {
-      if( if_empty )
-        it->second->fsm_->enqueue_if_empty(event);
-      else
-        it->second->fsm_->enqueue(event);
-    }
-    else
-    {
-      THROW_(std::string{"invalid stream id:"}+std::to_string(id));
-    }
+    quarantine_limit_    = max_streams;
+    reports_per_second_  = reports_per_second;
   }
   
   void
@@ -504,7 +2101,218 @@ namespace virtdb { namespace gateway {
   void
   simple_gateway::send_data(const queue::simple_publisher::buffer_vector & data)
   {
-    sender_.push(data);
+    if( !concurrent_send_ )
+    {
+      // only the reclaimer competes for it
+      std::lock_guard<std::mutex> lock{combiner_mtx_};
+      sender_.push(data);
+      return;
+    }
+    
+    // reserve a slot without locking, wait for free room in the ring
+    uint64_t ticket = tickets_.fetch_add(1, std::memory_order_relaxed);
+    while( ticket - served_.load(std::memory_order_acquire) >= slot_count_ )
+      std::this_thread::yield();
+    
+    slots_[ticket % slot_count_].data_.store(&data, std::memory_order_release);
+    
+    // one of the waiting threads pushes all published slots in ticket
+    // order, data must stay valid until then
+    while( served_.load(std::memory_order_acquire) <= ticket )
+    {
+      if( combiner_mtx_.try_lock() )
+      {
+        combine_sends();
+        combiner_mtx_.unlock();
+      }
+      else
+      {
+        std::this_thread::yield();
+      }
+    }
+  }
+  
+  std::string
+  simple_gateway::oob_path(uint64_t id,
+                           uint64_t handle) const
+  {
+    return path_ + "/oob/" + std::to_string(id) + "." + std::to_string(handle);
+  }
+  
+  uint64_t
+  simple_gateway::oob_threshold() const
+  {
+    return oob_threshold_;
+  }
+  
+  bool
+  simple_gateway::write_oob(uint64_t id,
+                            uint64_t handle,
+                            const uint8_t * data,
+                            uint64_t size)
+  {
+    std::string dir{path_+"/oob"};
+    if( ::mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST )
+      return false;
+    
+    std::string path{oob_path(id, handle)};
+    int fd = ::open(path.c_str(), O_WRONLY|O_CREAT|O_EXCL, 0600);
+    if( fd < 0 )
+      return false;
+    
+    uint64_t written = 0;
+    while( written < size )
+    {
+      ssize_t res = ::pwrite(fd, data+written, size-written, written);
+      if( res <= 0 )
+      {
+        if( res < 0 && errno == EINTR ) continue;
+        ::close(fd);
+        ::unlink(path.c_str());
+        return false;
+      }
+      written += res;
+    }
+    
+    // sealed: read-only from here
+    ::fchmod(fd, 0400);
+    ::close(fd);
+    return true;
+  }
+  
+  bool
+  simple_gateway::map_oob(stream_part & part)
+  {
+    std::string path{oob_path(part.id_, part.oob_handle_)};
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if( fd < 0 )
+      return false;
+    
+    struct stat st;
+    if( ::fstat(fd, &st) != 0 ||
+        (uint64_t)st.st_size < part.oob_offset_ + part.size_ ||
+        st.st_size == 0 )
+    {
+      ::close(fd);
+      return false;
+    }
+    
+    void * p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if( p == MAP_FAILED )
+      return false;
+    
+    // pulls the pages to the reader's node
+    if( !placement_.empty() )
+      place_memory(p, st.st_size, placement_);
+    
+    oob_segments_[part.id_].push_back(oob_segment{p, (uint64_t)st.st_size, path});
+    part.buffer_ = (const uint8_t *)p + part.oob_offset_;
+    return true;
+  }
+  
+  void
+  simple_gateway::discard_oob(const stream_part & part)
+  {
+    ::unlink(oob_path(part.id_, part.oob_handle_).c_str());
+  }
+  
+  void
+  simple_gateway::release_oob(uint64_t id)
+  {
+    auto it = oob_segments_.find(id);
+    if( it == oob_segments_.end() )
+      return;
+    
+    for( auto & seg : it->second )
+    {
+      ::munmap(seg.data_, seg.size_);
+      ::unlink(seg.path_.c_str());
+    }
+    oob_segments_.erase(it);
+  }
+  
+  std::string
+  simple_gateway::spill_dir() const
+  {
+    return path_ + "/spill";
+  }
+  
+  bool
+  simple_gateway::concurrent_send() const
+  {
+    return concurrent_send_;
+  }
+  
+  bool
+  simple_gateway::crc() const
+  {
+    return crc_;
+  }
+  
+  bool
+  simple_gateway::stamp() const
+  {
+    return stamp_;
+  }
+  
+  void
+  simple_gateway::seal_crc(const queue::simple_publisher::buffer_vector & data,
+                           size_t crc_index,
+                           uint8_t * crc_buf,
+                           const uint8_t * oob_payload,
+                           uint64_t oob_size)
+  {
+    uint32_t crc = 0;
+    for( size_t i=0; i<data.size(); ++i )
+      if( i != crc_index )
+        crc = crc32c(crc, data[i].first, data[i].second);
+    if( oob_payload )
+      crc = crc32c(crc, oob_payload, oob_size);
+    
+    crc_buf[0] = crc & 0xff;
+    crc_buf[1] = (crc >> 8) & 0xff;
+    crc_buf[2] = (crc >> 16) & 0xff;
+    crc_buf[3] = (crc >> 24) & 0xff;
+  }
+  
+  bool
+  simple_gateway::verify_part(const uint8_t * ptr,
+                              uint64_t len,
+                              const stream_part & part)
+  {
+    if( !(part.flags_ & FLAG_CRC) )
+      return true;
+    
+    uint64_t after = part.crc_offset_ + 4;
+    uint32_t crc = crc32c(0, ptr, part.crc_offset_);
+    crc = crc32c(crc, ptr + after, len - after);
+    if( part.flags_ & FLAG_OOB )
+    {
+      if( !part.buffer_ )
+        return false;
+      crc = crc32c(crc, part.buffer_, part.size_);
+    }
+    return crc == part.crc_;
+  }
+  
+  void
+  simple_gateway::combine_sends()
+  {
+    uint64_t served = served_.load(std::memory_order_relaxed);
+    while( true )
+    {
+      send_slot & slot = slots_[served % slot_count_];
+      auto data = slot.data_.load(std::memory_order_acquire);
+      
+      // the next ticket's owner has not published yet
+      if( data == nullptr )
+        break;
+      
+      sender_.push(*data);
+      slot.data_.store(nullptr, std::memory_order_relaxed);
+      served_.store(++served, std::memory_order_release);
+    }
   }
   
   uint64_t
@@ -515,10 +2323,192 @@ namespace virtdb { namespace gateway {
     return receiver_.pull(from, f, timeout_ms);
   }
   
+  void
+  simple_gateway::send_control(uint8_t event,
+                               uint64_t id,
+                               uint64_t seqno,
+                               const std::string & reason)
+  {
+    using namespace virtdb::queue;
+    
+    varint v_id{id};
+    varint v_seqno{seqno};
+    
+    simple_publisher::buffer_vector data_vec;
+    data_vec.push_back(simple_publisher::buffer{&event, 1});
+    data_vec.push_back(simple_publisher::buffer{v_id.buf(), v_id.len()});
+    if( event != EV_STOP )
+      data_vec.push_back(simple_publisher::buffer{v_seqno.buf(), v_seqno.len()});
+    if( event != EV_FIX && !reason.empty() )
+      data_vec.push_back(simple_publisher::buffer{reason.data(), reason.size()});
+    
+    // may be called from any thread
+    std::lock_guard<std::mutex> lock{control_mtx_};
+    control_sender_.push(data_vec);
+  }
+  
+  uint64_t
+  simple_gateway::pull_control(uint64_t from,
+                               queue::simple_subscriber::pull_fun f,
+                               uint64_t timeout_ms)
+  {
+    uint64_t ret = control_receiver_.pull(from, f, timeout_ms);
+    control_consumed_.store(ret);
+    return ret;
+  }
+  
+  uint64_t
+  simple_gateway::control_position() const
+  {
+    return control_receiver_.position();
+  }
+  
+  const std::string &
+  simple_gateway::base_path() const
+  {
+    return path_;
+  }
+  
+  void
+  simple_gateway::set_consumed(uint64_t pos)
+  {
+    consumed_.store(pos);
+  }
+  
+  void
+  simple_gateway::stream_opened(uint64_t id,
+                                uint64_t position)
+  {
+    std::lock_guard<std::mutex> lock{live_mtx_};
+    live_streams_.insert(std::make_pair(id, position));
+  }
+  
+  void
+  simple_gateway::stream_closed(uint64_t id)
+  {
+    std::lock_guard<std::mutex> lock{live_mtx_};
+    live_streams_.erase(id);
+  }
+  
+  bool
+  simple_gateway::stream_open(uint64_t id)
+  {
+    std::lock_guard<std::mutex> lock{live_mtx_};
+    return live_streams_.count(id) > 0;
+  }
+  
+  uint64_t
+  simple_gateway::low_water_mark()
+  {
+    // a stale or foreign position file can't point past our end
+    uint64_t mark = std::min(peer_consumed_.load(), sender_position());
+    std::lock_guard<std::mutex> lock{live_mtx_};
+    for( auto const & s : live_streams_ )
+      if( s.second < mark ) mark = s.second;
+    return mark;
+  }
+  
+  uint64_t
+  simple_gateway::reclaim()
+  {
+    // one caller cleans up to a mark, not under the senders' feet
+    uint64_t mark = low_water_mark();
+    uint64_t done = reclaimed_.load();
+    if( mark > done && reclaimed_.compare_exchange_strong(done, mark) )
+    {
+      std::lock_guard<std::mutex> lock{combiner_mtx_};
+      sender_.cleanup_all_before(mark);
+    }
+    
+    // nothing is resent on the control lane
+    std::lock_guard<std::mutex> lock{control_mtx_};
+    control_sender_.cleanup_all_before(peer_control_consumed_.load());
+    return mark;
+  }
+  
+  uint64_t
+  simple_gateway::reclaimed_position() const
+  {
+    return reclaimed_.load();
+  }
+  
+  void
+  simple_gateway::start_reclaimer(uint64_t interval_ms)
+  {
+    std::lock_guard<std::mutex> lock{reclaim_mtx_};
+    if( interval_ms == 0 || reclaimer_.joinable() )
+      return;
+    
+    reclaim_stop_ = false;
+    reclaimer_ = std::thread{[this,interval_ms]() {
+      place_this_thread();
+      std::unique_lock<std::mutex> lock{reclaim_mtx_};
+      while( !reclaim_cv_.wait_for(lock, std::chrono::milliseconds(interval_ms), [this](){ return reclaim_stop_; }) )
+      {
+        lock.unlock();
+        reclaim();
+        lock.lock();
+      }
+    }};
+  }
+  
+  uint64_t
+  simple_gateway::set_placement(const placement & p)
+  {
+    placement_ = p;
+    return apply_placement();
+  }
+  
+  uint64_t
+  simple_gateway::apply_placement()
+  {
+    if( placement_.empty() )
+      return 0;
+    
+    // the maps list absolute paths
+    char real[PATH_MAX];
+    if( ::realpath(path_.c_str(), real) == nullptr )
+      return 0;
+    return place_mappings(std::string{real}+"/", placement_);
+  }
+  
+  void
+  simple_gateway::place_this_thread()
+  {
+    if( placement_.numa_node_ >= 0 || !placement_.cpus_.empty() )
+      place_thread(placement_);
+  }
+  
+  void
+  simple_gateway::stop_reclaimer()
+  {
+    {
+      std::lock_guard<std::mutex> lock{reclaim_mtx_};
+      reclaim_stop_ = true;
+    }
+    reclaim_cv_.notify_all();
+    if( reclaimer_.joinable() )
+      reclaimer_.join();
+  }
+  
   void
   simple_gateway::seek_to_end()
   {
     receiver_.seek_to_end();
+    control_receiver_.seek_to_end();
+  }
+  
+  uint64_t
+  simple_gateway::now_us()
+  {
+    using namespace std::chrono;
+    return duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+  }
+  
+  uint64_t
+  simple_gateway::deadline_after(uint64_t timeout_ms)
+  {
+    return now_us() + timeout_ms*1000;
   }
   
   void
@@ -536,16 +2526,86 @@ namespace virtdb { namespace gateway {
   simple_gateway::simple_gateway(const std::string & base_path,
                                  const std::string & sender_path,
                                  const std::string & receiver_path,
-                                 const queue::params & prms)
-  : base_path_{base_path},
+                                 const queue::params & prms,
+                                 const options & opts)
+  : path_{base_path},
+    base_path_{base_path},
     sender_{sender_path, prms},
-    receiver_{receiver_path, prms}
+    receiver_{receiver_path, prms},
+    control_sender_{sender_path+".ctl", prms},
+    control_receiver_{receiver_path+".ctl", prms},
+    concurrent_send_{opts.concurrent_send_},
+    slot_count_{opts.send_slots_ > 0 ? opts.send_slots_ : 1},
+    tickets_{0},
+    served_{0},
+    oob_threshold_{opts.oob_threshold_},
+    crc_{opts.crc_},
+    stamp_{opts.timestamp_},
+    consumed_{receiver_path+".consumed"},
+    peer_consumed_{sender_path+".consumed"},
+    control_consumed_{receiver_path+".ctl.consumed"},
+    peer_control_consumed_{sender_path+".ctl.consumed"},
+    reclaimed_{0},
+    reclaim_stop_{false},
+    placement_{opts.placement_}
   {
+    if( concurrent_send_ )
+      slots_.reset(new send_slot[slot_count_]);
+    apply_placement();
+    start_reclaimer(opts.reclaim_interval_ms_);
   }
 
   simple_client::simple_client(const std::string & path,
-                               const queue::params & prms)
-  : simple_gateway{path, path+"/0", path+"/1", prms}
+                               const queue::params & prms,
+                               const options & opts)
+  : simple_gateway{path, path+"/0", path+"/1", prms, opts},
+    control_from_{0},
+    control_from_set_{false},
+    reply_from_{0},
+    reply_from_set_{false},
+    reply_epoch_{0},
+    reply_floor_{0},
+    cancel_epoch_{0},
+    next_id_{path+"/0.ids"},
+    async_stop_{false},
+    async_in_flight_{0}
+  {
+  }
+  
+  simple_client::send_state::send_state()
+  : stream_type_{0},
+    fsm_state_{0},
+    send_more_{true},
+    seen_epoch_{0}
+  {
+  }
+  
+  int64_t
+  simple_client::reserve_id()
+  {
+    // the queue position the stream starts at, unless another sender
+    // took it already: threads of a concurrent client and other clients
+    // of the folder may read the same position before either pushes.
+    // ids are reserved in a shared file, a single sender still gets the
+    // positions of its EV_START messages
+    uint64_t pos = sender_position();
+    uint64_t id  = next_id_.load();
+    while( !next_id_.compare_exchange(id, std::max(id, pos)+1) ) { }
+    return (int64_t)std::max(id, pos);
+  }
+  
+  simple_gateway::options::options()
+  : concurrent_send_{false},
+    send_slots_{64},
+    oob_threshold_{0},
+    crc_{false},
+    timestamp_{false},
+    reclaim_interval_ms_{0}
+  {
+  }
+  
+  simple_gateway::send_slot::send_slot()
+  : data_{nullptr}
   {
   }
   
@@ -557,8 +2617,74 @@ namespace virtdb { namespace gateway {
     position_{0},
     total_bytes_{0},
     event_{0},
-    stream_type_{0}
+    stream_type_{0},
+    flags_{0},
+    oob_handle_{0},
+    oob_offset_{0},
+    oob_at_{0},
+    deadline_us_{0},
+    crc_{0},
+    crc_offset_{0},
+    stamp_us_{0},
+    segments_{0},
+    segment_table_{0},
+    gather_{nullptr}
+  {
+  }
+  
+  simple_gateway::feeder_fun
+  simple_gateway::gather_feeder(gather_fun f)
+  {
+    return [f](stream_part & part) {
+      if( part.gather_ == nullptr )
+      {
+        THROW_("gather feeder without a gather buffer");
+      }
+      return f(part, *part.gather_);
+    };
+  }
+  
+  simple_gateway::segment_reader::segment_reader(const stream_part & part)
+  : table_{nullptr},
+    table_left_{0},
+    data_{part.buffer_},
+    data_left_{part.buffer_ ? part.size_ : 0},
+    segments_left_{(part.buffer_ && part.size_ > 0) ? 1ULL : 0ULL}
+  {
+    if( (part.flags_ & FLAG_SEGMENTS) && part.buffer_ != nullptr )
+    {
+      // parse_part() checked the table already
+      table_       = part.buffer_-part.segment_table_;
+      table_left_  = part.segment_table_;
+      uint64_t pos = 0;
+      if( !get_varint64(table_, segments_left_, pos, table_left_) )
+        segments_left_ = 0;
+      table_ += pos;
+    }
+  }
+  
+  bool
+  simple_gateway::segment_reader::next(bytes_view & segment)
   {
+    if( segments_left_ == 0 )
+      return false;
+    --segments_left_;
+    
+    uint64_t len = data_left_;
+    if( table_ != nullptr )
+    {
+      uint64_t pos = 0;
+      if( !get_varint64(table_, len, pos, table_left_) || len > data_left_ )
+      {
+        segments_left_ = 0;
+        return false;
+      }
+      table_ += pos;
+    }
+    segment    = bytes_view{data_, len};
+    data_      += len;
+    data_left_ -= len;
+    return true;
   }
   
   simple_gateway::stream_info::stream_info()
@@ -566,32 +2692,56 @@ namespace virtdb { namespace gateway {
     sent_seqno_{-1},
     received_seqno_{-1},
     sent_pos_{0},
-    received_pos_{0}
+    received_pos_{0},
+    cancelled_{false},
+    deadline_us_{0}
   {
   }
 
-  simple_gateway::~simple_gateway() { }
-  simple_client::~simple_client() { }
+  simple_gateway::~simple_gateway()
+  {
+    stop_reclaimer();
+    
+    // streams that never finished
+    while( !oob_segments_.empty() )
+      release_oob(oob_segments_.begin()->first);
+  }
+  
+  simple_client::~simple_client()
+  {
+    async_stop_ = true;
+    async_cv_.notify_all();
+    if( async_thread_.joinable() )
+      async_thread_.join();
+  }
   simple_server::~simple_server() { }
   
+  void
+  simple_gateway::init_peer_lanes(const std::string & base_path,
+                                  const std::string & peer_sender_path,
+                                  const queue::params & prms)
+  {
+    make_base_path base{base_path};
+    queue::simple_publisher data{peer_sender_path, prms};
+    queue::simple_publisher control{peer_sender_path+".ctl", prms};
+  }
+  
   simple_client::sptr
   simple_client::create(const std::string & path,
-                        const queue::params & prms)
+                        const queue::params & prms,
+                        const options & opts)
   {
+    // a single pass when the server side exists, which is the usual case
     try
     {
-      // quick try to initialize the other side of the connection
-      // which may very well fail because of the missing semaphore of the
-      // other channel
-      std::unique_ptr<simple_server> tmp{new simple_server{path, prms, [](uint16_t seqno,
-                                                                          const std::string & desc,
-                                                                          const fsm::transition & trans,
-                                                                          const fsm::state_machine & sm){}}};
+      return sptr{new simple_client{path, prms, opts}};
     }
     catch(...) { }
     
-    // this part may throw
-    sptr ret{new simple_client{path, prms}};
+    // first connect in this folder: only the server's lanes are made,
+    // then this part may throw
+    init_peer_lanes(path, path+"/1", prms);
+    sptr ret{new simple_client{path, prms, opts}};
     return ret;
   }
   
@@ -600,16 +2750,15 @@ namespace virtdb { namespace gateway {
                         const queue::params & prms,
                         fsm::state_machine::trace_fun trace_cb)
   {
+    // a single pass when the client side exists
     try
     {
-      // quick try to initialize the other side of the connection
-      // which may very well fail because of the missing semaphore of the
-      // other channel
-      std::unique_ptr<simple_client> tmp{new simple_client{path, prms}};
+      return sptr{new simple_server{path, prms, trace_cb}};
     }
     catch(...) { }
-
+    
     // this part may throw
+    init_peer_lanes(path, path+"/0", prms);
     sptr ret{new simple_server{path, prms, trace_cb}};
     return ret;
   }
@@ -3,13 +3,26 @@
 #include <queue/simple_queue.hh>
 #include <queue/params.hh>
 #include <fsm/state_machine.hh>
+#include <gateway/frame_pool.hh>
+#include <gateway/position_file.hh>
+#include <gateway/placement.hh>
+#include <gateway/spill_file.hh>
+#include <gateway/views.hh>
 #include <cstdint>
 #include <set>
 #include <map>
+#include <deque>
 #include <functional>
 #include <memory>
+#include <new>
 #include <vector>
 #include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
 
 namespace virtdb { namespace gateway {
   
@@ -29,6 +42,25 @@ namespace virtdb { namespace gateway {
       uint64_t         total_bytes_;
       uint8_t          event_;
       uint8_t          stream_type_;
+      uint8_t          flags_;
+      // out-of-band payload descriptor and where it is in the message
+      uint64_t         oob_handle_;
+      uint64_t         oob_offset_;
+      uint64_t         oob_at_;
+      // EV_START / EV_ONE only, 0 is no deadline
+      uint64_t         deadline_us_;
+      // with FLAG_CRC, the checksum and where it is in the message
+      uint32_t         crc_;
+      uint64_t         crc_offset_;
+      // with FLAG_STAMP, the client's send time, 0 if not sent
+      uint64_t         stamp_us_;
+      // with FLAG_SEGMENTS, the number of segments in buffer_ and the
+      // size of their length table, which is right before buffer_
+      uint64_t         segments_;
+      uint64_t         segment_table_;
+      // a feeder may append buffers here instead of setting buffer_,
+      // they are sent as they are. set by the client for each part
+      queue::simple_publisher::buffer_vector *  gather_;
       
       stream_part();
     };
@@ -40,15 +72,63 @@ namespace virtdb { namespace gateway {
       int64_t    received_seqno_;
       uint64_t   sent_pos_;
       uint64_t   received_pos_;
+      bool       cancelled_;
+      // the client gives up on the stream after this, 0 is no deadline
+      uint64_t   deadline_us_;
       
       stream_info();
       
       typedef std::shared_ptr<stream_info> sptr;
     };
   
+    struct options
+    {
+      // many threads may send through the same gateway
+      bool       concurrent_send_;
+      // pending sends in concurrent mode
+      uint32_t   send_slots_;
+      // parts of this size and above go through a segment file under
+      // <base>/oob, only a descriptor is queued. 0 disables. zmq_gateway
+      // relays the segment's bytes inline
+      uint64_t   oob_threshold_;
+      // a CRC32C on every part sent, checked by the receiver
+      bool       crc_;
+      // the send time on every part, so gateway_replay can keep the pace
+      bool       timestamp_;
+      // runs reclaim() in the background this often, 0 disables
+      uint64_t   reclaim_interval_ms_;
+      // huge pages, NUMA node and CPUs for queue mappings, out-of-band
+      // parts and the gateway's threads
+      placement  placement_;
+      
+      options();
+    };
+    
     typedef std::function<bool(stream_part & part)>  feeder_fun;
     typedef std::set<uint16_t>                        state_set;
     
+    // a feeder that gives several buffers per part, e.g. the columns of
+    // a row group, without copying them into one. the buffers must stay
+    // valid until the next call
+    typedef std::function<bool(stream_part & part,
+                               queue::simple_publisher::buffer_vector & buffers)>  gather_fun;
+    static feeder_fun gather_feeder(gather_fun f);
+    
+    // the segments of a received part as the gather feeder gave them,
+    // a part without FLAG_SEGMENTS is a single segment
+    class segment_reader
+    {
+      const uint8_t *  table_;
+      uint64_t         table_left_;
+      const uint8_t *  data_;
+      uint64_t         data_left_;
+      uint64_t         segments_left_;
+      
+    public:
+      segment_reader(const stream_part & part);
+      bool next(bytes_view & segment);
+    };
+    
     // only 8 bits for internal events
     static const uint8_t EV_START   = 1;
     static const uint8_t EV_ONE     = 2;
@@ -58,6 +138,14 @@ namespace virtdb { namespace gateway {
     static const uint8_t EV_FIX     = 6;
     static const uint8_t EV_ERROR   = 7;
     
+    // upper bits of the message type byte
+    static const uint8_t EV_MASK         = 0x07;
+    static const uint8_t FLAG_OOB        = 0x80;
+    static const uint8_t FLAG_DEADLINE   = 0x40;
+    static const uint8_t FLAG_CRC        = 0x20;
+    static const uint8_t FLAG_STAMP      = 0x10;
+    static const uint8_t FLAG_SEGMENTS   = 0x08;
+    
   private:
     class make_base_path
     {
@@ -69,9 +157,66 @@ namespace virtdb { namespace gateway {
       make_base_path(const std::string & path);
     };
     
-    make_base_path            base_path_;
-    queue::simple_publisher   sender_;
-    queue::simple_subscriber  receiver_;
+    // a send waiting for the combiner in concurrent mode
+    struct send_slot
+    {
+      std::atomic<const queue::simple_publisher::buffer_vector *>  data_;
+      char                                                         pad_[64-sizeof(void *)];
+      
+      send_slot();
+    };
+    
+    std::string                   path_;
+    make_base_path                base_path_;
+    queue::simple_publisher       sender_;
+    queue::simple_subscriber      receiver_;
+    // low volume lane for EV_STOP, EV_FIX and EV_ERROR
+    queue::simple_publisher       control_sender_;
+    queue::simple_subscriber      control_receiver_;
+    std::mutex                    control_mtx_;
+    bool                          concurrent_send_;
+    uint64_t                      slot_count_;
+    std::unique_ptr<send_slot[]>  slots_;
+    std::atomic<uint64_t>         tickets_;
+    std::atomic<uint64_t>         served_;
+    // held by whoever pushes to sender_, reclaim() included
+    std::mutex                    combiner_mtx_;
+    uint64_t                      oob_threshold_;
+    bool                          crc_;
+    bool                          stamp_;
+    
+    // how far each side has read the other's queues, in <queue>.consumed
+    position_file                 consumed_;
+    position_file                 peer_consumed_;
+    position_file                 control_consumed_;
+    position_file                 peer_control_consumed_;
+    
+    // start positions of the streams being sent, by id
+    std::mutex                    live_mtx_;
+    std::map<uint64_t, uint64_t>  live_streams_;
+    
+    std::atomic<uint64_t>         reclaimed_;
+    std::mutex                    reclaim_mtx_;
+    std::condition_variable       reclaim_cv_;
+    bool                          reclaim_stop_;
+    std::thread                   reclaimer_;
+    placement                     placement_;
+    
+    // mapped out-of-band segments, per stream id
+    struct oob_segment
+    {
+      void *       data_;
+      uint64_t     size_;
+      std::string  path_;
+    };
+    
+    typedef std::map<uint64_t, std::vector<oob_segment>>  oob_map;
+    
+    oob_map                       oob_segments_;
+    
+    void combine_sends();
+    std::string oob_path(uint64_t id,
+                         uint64_t handle) const;
     
     // disable default construction
     simple_gateway() = delete;
@@ -84,12 +229,70 @@ namespace virtdb { namespace gateway {
     simple_gateway(const std::string & base_path,
                    const std::string & sender_path,
                    const std::string & receiver_path,
-                   const queue::params & prms);
+                   const queue::params & prms,
+                   const options & opts=options());
+    
+    bool concurrent_send() const;
+    bool crc() const;
+    bool stamp() const;
+    
+    // fills crc_buf with the checksum of the message, skipping the
+    // buffer at crc_index that holds crc_buf itself. an out-of-band
+    // payload is covered too
+    static void seal_crc(const queue::simple_publisher::buffer_vector & data,
+                         size_t crc_index,
+                         uint8_t * crc_buf,
+                         const uint8_t * oob_payload,
+                         uint64_t oob_size);
     
+    // out-of-band payloads: the sender writes a sealed segment, the
+    // receiver maps it read-only until release_oob() at the stream's end
+    uint64_t oob_threshold() const;
+    bool write_oob(uint64_t id,
+                   uint64_t handle,
+                   const uint8_t * data,
+                   uint64_t size);
+    bool map_oob(stream_part & part);
+    void release_oob(uint64_t id);
+    void discard_oob(const stream_part & part);
+    
+    // where parts over the memory budget are spilled
+    std::string spill_dir() const;
+    
+    // safe to call from multiple threads in concurrent send mode
     void send_data(const queue::simple_publisher::buffer_vector & data);
     uint64_t pull_data(uint64_t from,
                        queue::simple_subscriber::pull_fun f,
                        uint64_t timeout_ms);
+    
+    // control lane, seqno is only sent with EV_FIX and EV_ERROR
+    void send_control(uint8_t event,
+                      uint64_t id,
+                      uint64_t seqno,
+                      const std::string & reason);
+    uint64_t pull_control(uint64_t from,
+                          queue::simple_subscriber::pull_fun f,
+                          uint64_t timeout_ms);
+    uint64_t control_position() const;
+    
+    // the receiver's queue was processed up to pos, the peer may drop the
+    // messages before it. pull_control() does this itself
+    void set_consumed(uint64_t pos);
+    
+    // a stream being sent keeps the queue from its first message on
+    void stream_opened(uint64_t id,
+                       uint64_t position);
+    void stream_closed(uint64_t id);
+    bool stream_open(uint64_t id);
+    
+    // the queues our receiving side opens belong to the peer. create()
+    // makes them with this when the peer has never run in base_path
+    static void init_peer_lanes(const std::string & base_path,
+                                const std::string & peer_sender_path,
+                                const queue::params & prms);
+    
+    // called first on the threads the gateway runs
+    void place_this_thread();
     static bool get_varint64(const uint8_t * ptr,
                              uint64_t & result,
                              uint64_t & position,
@@ -100,13 +303,52 @@ namespace virtdb { namespace gateway {
     
     static void set_event_names(fsm::state_machine & fsm);
     
+    // deadlines are absolute microseconds of the system clock, so
+    // both processes agree on them
+    static uint64_t now_us();
+    static uint64_t deadline_after(uint64_t timeout_ms);
+    
+    // parse the header of a raw queue message, buffer_ will point
+    // to the payload inside the message
+    static bool parse_part(const uint8_t * ptr,
+                           uint64_t len,
+                           stream_part & part);
+    
+    // checks FLAG_CRC parts, out-of-band ones after they are mapped
+    static bool verify_part(const uint8_t * ptr,
+                            uint64_t len,
+                            const stream_part & part);
+    
     void seek_to_end();
     uint64_t sender_position() const;
     uint64_t receiver_position() const;
+    const std::string & base_path() const;
+    
+    // the sender queue is not needed below the low-water mark: the peer
+    // has read it and no live stream starts there. reclaim() hands the
+    // mark to the queue which drops the fully consumed segments, and
+    // returns it
+    uint64_t low_water_mark();
+    uint64_t reclaim();
+    uint64_t reclaimed_position() const;
+    void start_reclaimer(uint64_t interval_ms);
+    void stop_reclaimer();
+    
+    // the server has no options, it is placed here before run(). the
+    // queue mappings are placed right away, returns their size
+    uint64_t set_placement(const placement & p);
+    uint64_t apply_placement();
   };
 
   class simple_client : public simple_gateway
   {
+  public:
+    typedef std::shared_ptr<simple_client>                     sptr;
+    // error is null when the stream completed normally
+    typedef std::function<void(stream_info::sptr info,
+                               std::exception_ptr error)>      done_fun;
+    
+  private:
     struct stream
     {
       feeder_fun                 upstream_feed_;
@@ -117,38 +359,153 @@ namespace virtdb { namespace gateway {
       typedef std::shared_ptr<stream> sptr;
     };
     
-    typedef std::map<uint64_t, stream::sptr> stream_map;
+    // parts of the server's reply streams, waiting for get_data()
+    struct reply_stream
+    {
+      std::map<uint64_t, std::string>  parts_;
+      std::string                      current_;
+      bool                             ended_;
+      bool                             stopped_;
+      uint64_t                         last_seqno_;
+      
+      reply_stream();
+    };
+    
+    typedef std::map<uint64_t, stream::sptr>   stream_map;
+    typedef std::map<uint64_t, reply_stream>   reply_map;
+    
+    stream_map  streams_;
+    uint64_t    control_from_;
+    bool        control_from_set_;
+    std::mutex  control_rcv_mtx_;
+    
+    // the async loop and the callers of wait_data() both receive: one
+    // pulls at a time under reply_rcv_mtx_, the map is under replies_mtx_
+    std::mutex          reply_rcv_mtx_;
+    uint64_t            reply_from_;
+    bool                reply_from_set_;
+    uint64_t            reply_epoch_;
+    // replies of streams below this id belong to an earlier user
+    uint64_t            reply_floor_;
+    mutable std::mutex  replies_mtx_;
+    reply_map           replies_;
+    
+    // cancelled streams still being sent, until their send ends. the send
+    // loop only reads the epoch per part. the reply path marks the ids
+    // cancelled since its last epoch
+    std::mutex              cancel_mtx_;
+    std::set<uint64_t>      cancelled_;
+    std::vector<uint64_t>   pending_cancels_;
+    std::atomic<uint64_t>   cancel_epoch_;
+    
+    // parts the server asked for again, per stream id
+    std::map<uint64_t, std::set<uint64_t>>  fix_requests_;
+    
+    // the next free stream id, shared by the clients of the folder
+    position_file  next_id_;
+    
+    // a stream being sent by start() or by the async loop
+    struct send_state
+    {
+      uint8_t                    stream_type_;
+      feeder_fun                 feeder_;
+      fsm::state_machine::sptr   fsm_;
+      state_set                  terminal_states_;
+      stream_info::sptr          info_;
+      uint16_t                   fsm_state_;
+      bool                       send_more_;
+      uint64_t                   seen_epoch_;
+      done_fun                   done_;
+      // what the gather feeder gave for the current part
+      queue::simple_publisher::buffer_vector  gather_;
+      std::vector<uint8_t>                    segment_table_;
+      
+      send_state();
+      
+      typedef std::shared_ptr<send_state> sptr;
+    };
+    
+    // async streams are handed over to a single loop thread
+    std::mutex                     async_mtx_;
+    std::condition_variable        async_cv_;
+    std::vector<send_state::sptr>  async_incoming_;
+    std::thread                    async_thread_;
+    std::atomic<bool>              async_stop_;
+    std::atomic<uint64_t>          async_in_flight_;
     
-    stream_map streams_;
+    bool step(send_state & st,
+              bool poll_control);
+    void async_loop();
+    bool receive_replies(uint64_t timeout_ms);
+    void receive_control();
+    void cancel(uint64_t id);
+    bool is_cancelled(uint64_t id);
+    void send_ended(uint64_t id);
+    int64_t reserve_id();
     
   protected:
     friend class simple_server;
     simple_client(const std::string & path,
-                  const queue::params & prms);
+                  const queue::params & prms,
+                  const options & opts=options());
 
   public:
-    typedef std::shared_ptr<simple_client> sptr;
-    
     virtual ~simple_client();
     static sptr create(const std::string & path,
-                       const queue::params & prms=queue::params());
+                       const queue::params & prms=queue::params(),
+                       const options & opts=options());
     
-    // start a new data stream
+    // start a new data stream, with concurrent_send_ streams may be
+    // started and fed from many threads
     void start(uint8_t stream_type,
                feeder_fun feeder,
                fsm::state_machine::sptr fsm,
                const state_set & terminal_states,
                stream_info::sptr info); // ???
     
-    // the data stream's state machine may upcall to these
+    // non-blocking start: the client's loop thread, started on first
+    // use, feeds all async streams a part at a time, runs their FSMs and
+    // pumps the reply parts. the FSMs and done run on that thread, so
+    // they may use get_data() but not wait_data(). streams still in
+    // flight when the client is destroyed never complete
+    void start_async(uint8_t stream_type,
+                     feeder_fun feeder,
+                     fsm::state_machine::sptr fsm,
+                     const state_set & terminal_states,
+                     stream_info::sptr info,
+                     done_fun done);
+    std::future<stream_info::sptr> start_async(uint8_t stream_type,
+                                               feeder_fun feeder,
+                                               fsm::state_machine::sptr fsm,
+                                               const state_set & terminal_states,
+                                               stream_info::sptr info);
+    uint64_t async_in_flight() const;
+    
+    // the data stream's state machine may upcall to these. stop and
+    // request_resend go on the control lane. a stopped stream's feeder
+    // is not called again, start() returns with info->cancelled_ set
     void stop(uint64_t id);
+    // safe from any thread. the buffer get_data() gives stays valid
+    // until the next get_data() or release_data() of the same stream
     bool wait_data(uint64_t id,
-                   uint64_t start_seqno);
+                   uint64_t start_seqno,
+                   uint64_t timeout_ms=1000);
     bool get_data(uint64_t id,
                   uint64_t seqno,
                   stream_part & part);
+    void release_data(uint64_t id);
     void request_resend(uint64_t id,
                         uint64_t seqno);
+    // the server stopped or failed the reply stream
+    bool is_reply_stopped(uint64_t id) const;
+    // seqnos the server received corrupt, taken from the pending set
+    std::set<uint64_t> take_fix_requests(uint64_t id);
+    
+    // forgets the replies, stops and fix requests of the streams started
+    // so far, their late replies are dropped. the queue positions stay,
+    // so the client goes on after what it has seen. gateway_pool resets
+    // a client when it comes back
+    void reset();
     
     // pre-canned communication patterns:
     // - push1
@@ -156,6 +513,44 @@ namespace virtdb { namespace gateway {
     // - push-sub*
   };
   
+  // a stream handler written as a stackless coroutine: resume() gets every
+  // part of the stream and continues after the await it returned from.
+  // this is C++11, the GATEWAY_CO_ macros switch on the resume point, so
+  // anything that lives across an await must be a member
+  class stream_coroutine
+  {
+    friend class simple_server;
+    
+    uint64_t  id_;
+    uint64_t  reply_seqno_;
+    
+    // disable copying until properly implemented
+    stream_coroutine(const stream_coroutine &) = delete;
+    stream_coroutine & operator=(const stream_coroutine &) = delete;
+    
+  protected:
+    int       resume_point_;
+    
+    // the next reply part of this stream, see simple_server::reply()
+    void yield(simple_server & server,
+               const queue::simple_publisher::buffer_vector & data,
+               bool last);
+    
+  public:
+    stream_coroutine();
+    virtual ~stream_coroutine();
+    
+    uint64_t id() const;
+    
+    // returns false when the handler is done with the stream
+    virtual bool resume(simple_server & server,
+                        const simple_gateway::stream_part & part) = 0;
+  };
+  
+#define GATEWAY_CO_BEGIN  switch( resume_point_ ) { case 0:
+#define GATEWAY_CO_AWAIT  do { resume_point_ = __LINE__; return true; case __LINE__: ; } while( 0 )
+#define GATEWAY_CO_END    } resume_point_ = -1; return false
+  
   class simple_server : public simple_gateway
   {
   public:
@@ -163,6 +558,19 @@ namespace virtdb { namespace gateway {
     typedef std::function<fsm::state_machine::sptr(const stream_part & start,
                                                    fsm::state_machine::trace_fun)>   new_stream_fun;
     typedef std::function<stream_info::sptr(uint64_t id)>                            new_info_fun;
+    // constructs the coroutine in the given frame
+    typedef std::function<stream_coroutine *(void * frame,
+                                             const stream_part & start)>             new_coroutine_fun;
+    typedef std::function<void(uint64_t id, uint8_t stream_type)>                    dropped_fun;
+    
+    // why a part was dropped, see failed_parts()
+    static const uint8_t FAIL_NO_HANDLER      = 0;
+    static const uint8_t FAIL_UNKNOWN_STREAM  = 1;
+    static const uint8_t FAIL_MALFORMED       = 2;
+    static const uint8_t FAIL_HANDLER_ERROR   = 3;
+    static const uint8_t FAIL_QUARANTINED     = 4;
+    static const uint8_t FAIL_REJECTED        = 5;
+    static const uint8_t FAIL_CODES           = 6;
 
   private:
     // internal FSM states
@@ -179,20 +587,41 @@ namespace virtdb { namespace gateway {
     
     struct handler
     {
-      new_stream_fun   fsm_factory_;
-      state_set        terminal_states_;
-      new_info_fun     info_factory_;
+      new_stream_fun      fsm_factory_;
+      state_set           terminal_states_;
+      new_info_fun        info_factory_;
+      new_coroutine_fun   coro_factory_;
+      size_t              coro_size_;
+      
+      handler();
       
       typedef std::shared_ptr<handler> sptr;
     };
     
+    // gives the frame back to the server's pool
+    struct coroutine_deleter
+    {
+      frame_pool *  pool_;
+      size_t        size_;
+      
+      coroutine_deleter();
+      coroutine_deleter(frame_pool * pool,
+                        size_t size);
+      void operator()(stream_coroutine * coro) const;
+    };
+    
+    typedef std::unique_ptr<stream_coroutine, coroutine_deleter>  coroutine_ptr;
+    
     struct stream
     {
       fsm::state_machine::sptr   fsm_;
+      coroutine_ptr              coro_;
       state_set                  terminal_states_;
       stream_info::sptr          info_;
       uint16_t                   last_state_;
       uint8_t                    type_;
+      // charged to the type while the stream is kept
+      uint64_t                   bytes_;
       
       typedef std::shared_ptr<stream> sptr;
     };
@@ -200,6 +629,8 @@ namespace virtdb { namespace gateway {
     typedef std::vector<handler::sptr>         handler_vector;
     typedef std::map<uint64_t, stream::sptr>   stream_map;
     
+    // coroutine frames, outlives the streams
+    frame_pool                       coro_pool_;
     handler_vector                   handlers_;
     stream_map                       streams_;
     std::atomic<bool>                stopped_;
@@ -207,6 +638,106 @@ namespace virtdb { namespace gateway {
     fsm::state_machine               fsm_;
     uint16_t                         last_state_;
     stream_part                      act_message_;
+    std::mutex                       reply_mtx_;
+    
+    // control lane: the control thread collects, the data loop applies
+    // them when the epoch changes
+    std::mutex                       stop_mtx_;
+    std::set<uint64_t>               stopped_ids_;
+    std::vector<stream_part>         pending_control_;
+    std::atomic<uint64_t>            control_epoch_;
+    uint64_t                         seen_epoch_;
+    std::set<uint64_t>               stopped_local_;
+    std::atomic<uint64_t>            skipped_parts_;
+    
+    // deadlines of the streams that have one
+    std::map<uint64_t, uint64_t>     deadlines_;
+    std::atomic<uint64_t>            expired_parts_;
+    std::atomic<uint64_t>            corrupt_parts_;
+    
+    // failed streams, their other parts are dropped by the header. only
+    // the newest quarantine_limit_ ids are kept. failures are counted,
+    // reported at most reports_per_second_ times a second
+    std::set<uint64_t>               quarantined_;
+    std::deque<uint64_t>             quarantine_order_;
+    std::atomic<uint64_t>            quarantined_count_;
+    uint64_t                         quarantine_limit_;
+    std::atomic<uint64_t>            failures_[FAIL_CODES];
+    uint64_t                         reports_per_second_;
+    uint64_t                         report_second_;
+    uint64_t                         reports_left_;
+    
+    // deficit round robin between stream types, parts are copied into
+    // the ready queues. off until a weight is set. over the memory budget
+    // the copy goes to the spill file, offset_ tells where
+    struct ready_part
+    {
+      stream_part   part_;
+      std::string   data_;
+      bool          spilled_;
+      uint64_t      offset_;
+    };
+    
+    struct ready_queue
+    {
+      std::deque<ready_part>   parts_;
+      uint32_t                 weight_;
+      uint64_t                 deficit_;
+      bool                     active_;
+      bool                     turn_;
+      
+      ready_queue();
+    };
+    
+    std::vector<ready_queue>         ready_;
+    std::deque<uint8_t>              active_types_;
+    std::map<uint64_t, uint8_t>      sched_types_;
+    bool                             scheduling_;
+    uint64_t                         ready_parts_;
+    uint64_t                         quantum_;
+    uint64_t                         read_ahead_;
+    uint64_t                         memory_budget_;
+    std::atomic<uint64_t>            buffered_bytes_;
+    std::atomic<uint64_t>            spilled_parts_;
+    std::atomic<uint64_t>            spilled_bytes_;
+    std::atomic<uint64_t>            spill_errors_;
+    spill_file::uptr                 spill_;
+    
+    // admission: what each stream type holds now, kept streams and ready
+    // parts in memory, and the limits a new stream is checked against.
+    // 0 is no limit
+    std::atomic<uint64_t>            type_streams_[256];
+    std::atomic<uint64_t>            type_bytes_[256];
+    uint64_t                         max_streams_[256];
+    uint64_t                         max_bytes_[256];
+    uint64_t                         stream_bytes_[256];
+    std::atomic<uint64_t>            stream_memory_;
+    uint64_t                         memory_limit_;
+    dropped_fun                      on_dropped_;
+    
+    void start_stream();
+    void start_coroutine(const handler & h);
+    void continue_stream();
+    void process_part(bool parsed);
+    bool schedule_part();
+    void serve_ready(uint64_t max_parts);
+    void control_loop();
+    void on_control(const stream_part & part);
+    void apply_control();
+    bool skip_part();
+    bool expired_part(bool mapped);
+    void request_fix();
+    bool quarantined_part();
+    void fail(uint8_t code,
+              bool quarantine,
+              const char * reason);
+    uint64_t stream_cost(const handler & h,
+                         uint8_t type) const;
+    bool admit(uint8_t type,
+               uint64_t cost);
+    void keep_stream(stream::sptr stream_data);
+    void forget_stream(stream_map::iterator it);
+    void drop_stream(stream_map::iterator it);
     
   protected:
     friend class simple_client;
@@ -229,6 +760,25 @@ namespace virtdb { namespace gateway {
                      const state_set & terminal_states,
                      new_info_fun new_info);
     
+    // coroutine handlers run on the same dispatcher, one frame of
+    // frame_size bytes per stream from the server's pool
+    void add_coroutine_handler(uint8_t stream_type,
+                               size_t frame_size,
+                               new_coroutine_fun new_coroutine);
+    
+    // T is constructed from the start part
+    template <typename T>
+    void add_coroutine_handler(uint8_t stream_type)
+    {
+      add_coroutine_handler(stream_type, sizeof(T), [](void * frame,
+                                                       const stream_part & start) -> stream_coroutine * {
+        return new (frame) T{start};
+      });
+    }
+    
+    // coroutine frames in use
+    uint64_t coroutine_frames() const;
+    
     void run(uint64_t from=0);
     void stop();
     bool is_stopped() const;
@@ -238,6 +788,85 @@ namespace virtdb { namespace gateway {
                     uint16_t event,
                     bool if_empty=false);
     
+    // the stream part being processed, valid while the handler FSM runs
+    const stream_part & current_part() const;
+    
+    // send a reply part to the client stream, last one is sent as EV_END
+    void reply(uint64_t id,
+               uint64_t seqno,
+               const queue::simple_publisher::buffer_vector & data,
+               bool last);
+    
+    // drop the client stream and tell the client on the control lane
+    void stop_stream(uint64_t id);
+    void send_error(uint64_t id,
+                    uint64_t seqno,
+                    const std::string & reason);
+    
+    // parts of stopped streams skipped without running their FSM
+    uint64_t skipped_parts() const;
+    
+    // time left for the current part's stream, INT64_MAX without a
+    // deadline. expired parts are dropped before their FSM runs and the
+    // client is told to stop feeding the stream
+    int64_t remaining_budget_us() const;
+    uint64_t expired_parts() const;
+    
+    // parts failing their CRC, asked for again with EV_FIX
+    uint64_t corrupt_parts() const;
+    
+    // parts that could not be processed, by FAIL_ code. nothing throws on
+    // the dispatch path: a stream without a handler or unknown to the
+    // server is quarantined, its other parts are dropped by their header.
+    // a stream without a handler is answered with EV_ERROR. stderr and
+    // these EV_ERROR reports are limited to reports_per_second, refused
+    // streams are always answered
+    uint64_t failed_parts(uint8_t code) const;
+    uint64_t quarantined_streams() const;
+    // before run()
+    void set_quarantine(uint64_t max_streams,
+                        uint64_t reports_per_second);
+    
+    // weighted fair dispatch: each round a stream type may use
+    // quantum*weight bytes. up to read_ahead parts are taken from the
+    // queue to choose from. types without a weight have weight 1
+    void set_weight(uint8_t stream_type,
+                    uint32_t weight);
+    void set_scheduling(uint64_t quantum_bytes,
+                        uint64_t read_ahead_parts);
+    
+    // ready parts beyond budget bytes in memory are spilled to a file
+    // under the gateway folder and read back when their turn comes. 0,
+    // the default, keeps them all in memory
+    void set_memory_budget(uint64_t bytes);
+    uint64_t buffered_bytes() const;
+    uint64_t spilled_parts() const;
+    uint64_t spilled_bytes() const;
+    // parts kept in memory because the spill file failed
+    uint64_t spill_errors() const;
+    
+    // admission control, before run(). a new stream of stream_type is
+    // refused with EV_ERROR and quarantined when the type already keeps
+    // max_streams streams or max_bytes bytes, or the server keeps
+    // memory_limit bytes in all. the bytes are the ones the server holds:
+    // a kept stream's record and its coroutine frame as cut from the
+    // pool, and the buffers of ready parts while in memory. an FSM, its
+    // stream_info and whatever else a handler allocates is not visible
+    // here, it counts as the stream_bytes declared for the type
+    void set_admission(uint8_t stream_type,
+                       uint64_t max_streams,
+                       uint64_t max_bytes,
+                       uint64_t stream_bytes=0);
+    void set_memory_limit(uint64_t bytes);
+    uint64_t active_streams(uint8_t stream_type) const;
+    uint64_t memory_used(uint8_t stream_type) const;
+    uint64_t memory_used() const;
+    
+    // called on the dispatch thread for a kept stream that is forgotten
+    // before its handler finished: stopped, expired or replaced by a new
+    // stream with the same id. before run()
+    void on_stream_dropped(dropped_fun f);
+    
   };
   
 }}
@@ -0,0 +1,217 @@
+#include <gateway/spill_file.hh>
+#include <gateway/exception.hh>
+#include <atomic>
+
+// C libs
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+namespace virtdb { namespace gateway {
+
+  namespace
+  {
+    std::atomic<uint64_t> spill_seq{0};
+
+    uint64_t
+    page_size()
+    {
+      static uint64_t ret = (uint64_t)::sysconf(_SC_PAGESIZE);
+      return ret;
+    }
+  }
+
+  spill_file::spill_file(const std::string & dir,
+                         uint64_t window)
+  : path_{dir + "/" + std::to_string(::getpid()) + "." + std::to_string(spill_seq++)},
+    fd_{-1},
+    size_{0},
+    live_{0},
+    window_{(window > page_size() ? window : page_size())},
+    map_{nullptr},
+    map_offset_{0},
+    map_size_{0},
+    total_bytes_{0},
+    consumed_{0},
+    punched_{0},
+    reclaimed_bytes_{0}
+  {
+    if( ::mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST )
+    {
+      THROW_(std::string{"failed to create spill folder at: "}+dir);
+    }
+
+    fd_ = ::open(path_.c_str(), O_RDWR|O_CREAT|O_EXCL, 0600);
+    if( fd_ < 0 )
+    {
+      THROW_(std::string{"failed to create spill file: "}+path_);
+    }
+    ::unlink(path_.c_str());
+  }
+
+  spill_file::~spill_file()
+  {
+    unmap();
+    if( fd_ >= 0 ) ::close(fd_);
+  }
+
+  void
+  spill_file::unmap()
+  {
+    if( map_ ) ::munmap(map_, map_size_);
+    map_         = nullptr;
+    map_offset_  = 0;
+    map_size_    = 0;
+  }
+
+  uint64_t
+  spill_file::append(const uint8_t * data,
+                     uint64_t size)
+  {
+    uint64_t offset = size_;
+    uint64_t written = 0;
+    while( written < size )
+    {
+      ssize_t res = ::pwrite(fd_, data+written, size-written, offset+written);
+      if( res <= 0 )
+      {
+        if( res < 0 && errno == EINTR ) continue;
+        // the partial write is overwritten by the next append
+        THROW_(std::string{"failed to write spill file: "}+path_);
+      }
+      written += res;
+    }
+
+    size_         += size;
+    total_bytes_  += size;
+    ++live_;
+    return offset;
+  }
+
+  const uint8_t *
+  spill_file::read(uint64_t offset,
+                   uint64_t size)
+  {
+    if( size == 0 )
+      return nullptr;
+
+    if( offset+size > size_ )
+    {
+      THROW_("spill file read past the end");
+    }
+
+    if( map_ == nullptr || offset < map_offset_ || offset+size > map_offset_+map_size_ )
+    {
+      unmap();
+      uint64_t from = offset & ~(page_size()-1);
+      uint64_t len  = window_;
+      if( from+len > size_ )    len = size_-from;
+      if( from+len < offset+size ) len = offset+size-from;
+
+      void * p = ::mmap(nullptr, len, PROT_READ, MAP_SHARED, fd_, from);
+      if( p == MAP_FAILED )
+      {
+        THROW_(std::string{"failed to map spill file: "}+path_);
+      }
+      map_         = (uint8_t *)p;
+      map_offset_  = from;
+      map_size_    = len;
+
+      // this window is read front to back, the next one is likely next
+      ::madvise(map_, map_size_, MADV_SEQUENTIAL);
+      ::madvise(map_, map_size_, MADV_WILLNEED);
+#ifdef GATEWAY_LINUX_BUILD
+      ::posix_fadvise(fd_, from+len, window_, POSIX_FADV_WILLNEED);
+#endif
+    }
+    return map_+(offset-map_offset_);
+  }
+
+  void
+  spill_file::release(uint64_t offset,
+                      uint64_t size)
+  {
+    if( live_ == 0 )
+      return;
+
+    if( --live_ == 0 )
+    {
+      // nothing left to read, start over from an empty file
+      unmap();
+      if( ::ftruncate(fd_, 0) == 0 )
+      {
+        size_      = 0;
+        consumed_  = 0;
+        punched_   = 0;
+        released_.clear();
+      }
+      return;
+    }
+
+    if( offset != consumed_ )
+    {
+      released_[offset] = offset+size;
+      return;
+    }
+
+    // the prefix grows over the parts released before this one
+    consumed_ = offset+size;
+    auto it = released_.begin();
+    while( it != released_.end() && it->first == consumed_ )
+    {
+      consumed_ = it->second;
+      it = released_.erase(it);
+    }
+    reclaim();
+  }
+
+  void
+  spill_file::reclaim()
+  {
+    // whole pages below the first live part, the read window starts at
+    // or after them
+    uint64_t to = consumed_ & ~(page_size()-1);
+    if( to < punched_+window_ )
+      return;
+
+#ifdef GATEWAY_LINUX_BUILD
+    if( ::fallocate(fd_, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, punched_, to-punched_) != 0 )
+      return;
+    reclaimed_bytes_ += to-punched_;
+    punched_ = to;
+#endif
+  }
+
+  uint64_t
+  spill_file::size() const
+  {
+    return size_;
+  }
+
+  uint64_t
+  spill_file::total_bytes() const
+  {
+    return total_bytes_;
+  }
+
+  uint64_t
+  spill_file::reclaimed_bytes() const
+  {
+    return reclaimed_bytes_;
+  }
+
+  uint64_t
+  spill_file::live() const
+  {
+    return live_;
+  }
+
+  const std::string &
+  spill_file::path() const
+  {
+    return path_;
+  }
+
+}}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+
+namespace virtdb { namespace gateway {
+
+  // parts that do not fit the memory budget, written once and read back
+  // through a mapped window that moves forward with the reader. the next
+  // window is asked for ahead, so a reader going through the file in
+  // append order mostly finds its pages in memory. the released prefix of
+  // the file is given back to the file system a window at a time, so a
+  // backlog that never drains holds the disk space of its live parts only.
+  // the file is emptied whenever every part is released, it is unlinked
+  // when created so nothing is left behind after a crash
+  class spill_file
+  {
+    std::string   path_;
+    int           fd_;
+    uint64_t      size_;
+    uint64_t      live_;
+    uint64_t      window_;
+    uint8_t *     map_;
+    uint64_t      map_offset_;
+    uint64_t      map_size_;
+    uint64_t      total_bytes_;
+    // everything below consumed_ is released, punched_ of it given back.
+    // parts released out of order wait in released_, offset -> end
+    uint64_t                      consumed_;
+    uint64_t                      punched_;
+    uint64_t                      reclaimed_bytes_;
+    std::map<uint64_t, uint64_t>  released_;
+
+    void unmap();
+    void reclaim();
+
+    // disable default construction
+    spill_file() = delete;
+
+    // disable copying until properly implemented
+    spill_file(const spill_file &) = delete;
+    spill_file & operator=(const spill_file &) = delete;
+
+  public:
+    typedef std::unique_ptr<spill_file> uptr;
+
+    // creates a new file in dir, window is the mapped read size
+    spill_file(const std::string & dir,
+               uint64_t window=4*1024*1024);
+    virtual ~spill_file();
+
+    // returns the offset to read the data back from
+    uint64_t append(const uint8_t * data,
+                    uint64_t size);
+
+    // the pointer is into the mapped window, valid until the next read()
+    // or release() of any part. a caller that shares the file between
+    // threads copies the part out under its own lock
+    const uint8_t * read(uint64_t offset,
+                         uint64_t size);
+
+    // the part appended at offset is not needed anymore
+    void release(uint64_t offset,
+                 uint64_t size);
+
+    // bytes in the file now, ever appended, and given back while parts
+    // were still live
+    uint64_t size() const;
+    uint64_t total_bytes() const;
+    uint64_t reclaimed_bytes() const;
+    // parts not released yet
+    uint64_t live() const;
+    const std::string & path() const;
+  };
+
+}}
@@ -0,0 +1,537 @@
+#include <gateway/striped_gateway.hh>
+#include <gateway/exception.hh>
+#include <queue/varint.hh>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+
+// C libs
+#include <sys/stat.h>
+#include <errno.h>
+
+namespace virtdb { namespace gateway {
+
+  namespace
+  {
+    std::string
+    stripe_path(const std::string & path,
+                uint32_t stripe)
+    {
+      return path + "/0-" + std::to_string(stripe);
+    }
+
+    void
+    make_dir(const std::string & path)
+    {
+      if( ::mkdir(path.c_str(), 0700) != 0 && errno != EEXIST )
+      {
+        THROW_(std::string{"failed to create folder at: "}+path);
+      }
+    }
+
+    // the part a stripe thread is dispatching, see current_part()
+    thread_local const simple_gateway::stream_part * current = nullptr;
+  }
+
+  striped_client::striped_client(const std::string & path,
+                                 uint32_t stripes,
+                                 const queue::params & prms)
+  : path_{path}
+  {
+    if( stripes == 0 )
+    {
+      THROW_("at least one stripe is needed");
+    }
+
+    make_dir(path_);
+    for( uint32_t i=0; i<stripes; ++i )
+      senders_.push_back(publisher_ptr{new queue::simple_publisher{stripe_path(path_, i), prms}});
+    next_id_.reset(new position_file{path_+"/0.ids"});
+  }
+
+  striped_client::~striped_client() {}
+
+  striped_client::sptr
+  striped_client::create(const std::string & path,
+                         uint32_t stripes,
+                         const queue::params & prms)
+  {
+    // the client makes its stripes, the server is not needed for that
+    sptr ret{new striped_client{path, stripes, prms}};
+    return ret;
+  }
+
+  void
+  striped_client::send_part(uint32_t stripe,
+                            uint8_t stream_type,
+                            uint64_t id,
+                            uint64_t seqno,
+                            uint64_t parts,
+                            part_fun f)
+  {
+    using namespace virtdb::queue;
+
+    simple_gateway::stream_part part;
+    part.id_     = id;
+    part.seqno_  = seqno;
+    f(seqno, part);
+
+    bool last = (seqno+1 == parts);
+    simple_publisher::buffer_vector data_vec;
+    uint8_t type_start[2] = { 0, stream_type };
+    varint v_id{id};
+    varint v_seqno{seqno};
+
+    if( seqno == 0 )
+    {
+      type_start[0] = (last ? simple_gateway::EV_ONE : simple_gateway::EV_START);
+      data_vec.push_back(simple_publisher::buffer{type_start, 2});
+      data_vec.push_back(simple_publisher::buffer{v_id.buf(), v_id.len()});
+    }
+    else
+    {
+      type_start[0] = (last ? simple_gateway::EV_END : simple_gateway::EV_NEXT);
+      data_vec.push_back(simple_publisher::buffer{type_start, 1});
+      data_vec.push_back(simple_publisher::buffer{v_id.buf(), v_id.len()});
+      data_vec.push_back(simple_publisher::buffer{v_seqno.buf(), v_seqno.len()});
+    }
+
+    if( part.size_ > 0 && part.buffer_ != nullptr )
+      data_vec.push_back(simple_publisher::buffer{part.buffer_, part.size_});
+
+    senders_[stripe]->push(data_vec);
+  }
+
+  uint64_t
+  striped_client::start(uint8_t stream_type,
+                        uint64_t parts,
+                        part_fun f)
+  {
+    if( parts == 0 )
+    {
+      THROW_("a stream has at least one part");
+    }
+
+    // above any stripe's end, so above the streams of earlier clients.
+    // clients sending at the same time reserve it in the shared file
+    uint64_t max_pos = 0;
+    for( auto & s : senders_ )
+      if( s->position() > max_pos ) max_pos = s->position();
+    uint64_t next = next_id_->load();
+    while( !next_id_->compare_exchange(next, std::max(next, max_pos)+1) ) { }
+    uint64_t id = std::max(next, max_pos);
+    uint32_t k = stripes();
+
+    auto send_stripe = [this,stream_type,id,parts,k,f](uint32_t stripe)
+    {
+      for( uint64_t seqno=stripe; seqno<parts; seqno+=k )
+        send_part(stripe, stream_type, id, seqno, parts, f);
+    };
+
+    // stripe 0 is sent from the caller's thread
+    std::vector<std::thread> threads;
+    for( uint32_t i=1; i<k && i<parts; ++i )
+      threads.push_back(std::thread{send_stripe, i});
+    send_stripe(0);
+
+    for( auto & t : threads )
+      t.join();
+
+    return id;
+  }
+
+  uint32_t
+  striped_client::stripes() const
+  {
+    return (uint32_t)senders_.size();
+  }
+
+  striped_server::stream::stream()
+  : last_state_{0},
+    next_seqno_{0},
+    type_{0},
+    failed_{false},
+    done_{false}
+  {
+  }
+
+  striped_server::striped_server(const std::string & path,
+                                 uint32_t stripes,
+                                 const queue::params & prms,
+                                 fsm::state_machine::trace_fun trace_cb)
+  : path_{path},
+    handlers_{256, handler::sptr()},
+    trace_{trace_cb},
+    stopped_{false},
+    held_parts_{0},
+    failed_streams_{0},
+    handler_errors_{0},
+    memory_budget_{0},
+    buffered_bytes_{0},
+    spilled_parts_{0},
+    spill_errors_{0}
+  {
+    if( stripes == 0 )
+    {
+      THROW_("at least one stripe is needed");
+    }
+
+    make_dir(path_);
+    for( uint32_t i=0; i<stripes; ++i )
+      receivers_.push_back(subscriber_ptr{new queue::simple_subscriber{stripe_path(path_, i), prms}});
+  }
+
+  striped_server::~striped_server() {}
+
+  striped_server::sptr
+  striped_server::create(const std::string & path,
+                         uint32_t stripes,
+                         const queue::params & prms,
+                         fsm::state_machine::trace_fun trace_cb)
+  {
+    // a single pass when the client side exists
+    try
+    {
+      return sptr{new striped_server{path, stripes, prms, trace_cb}};
+    }
+    catch(...) { }
+
+    // this part may throw
+    init_stripes(path, stripes, prms);
+    sptr ret{new striped_server{path, stripes, prms, trace_cb}};
+    return ret;
+  }
+
+  void
+  striped_server::init_stripes(const std::string & path,
+                               uint32_t stripes,
+                               const queue::params & prms)
+  {
+    make_dir(path);
+    for( uint32_t i=0; i<stripes; ++i )
+      queue::simple_publisher stripe{stripe_path(path, i), prms};
+  }
+
+  void
+  striped_server::add_handler(uint8_t stream_type,
+                              simple_server::new_stream_fun new_handler,
+                              const simple_gateway::state_set & terminal_states,
+                              simple_server::new_info_fun new_info)
+  {
+    handler::sptr h{new handler};
+    h->fsm_factory_      = new_handler;
+    h->terminal_states_  = terminal_states;
+    h->info_factory_     = new_info;
+    handlers_[stream_type].swap(h);
+  }
+
+  bool
+  striped_server::dispatch(stream & s,
+                           const simple_gateway::stream_part & part)
+  {
+    ++s.next_seqno_;
+
+    try
+    {
+      if( part.seqno_ == 0 )
+      {
+        s.type_ = part.stream_type_;
+        auto h = handlers_[s.type_];
+        if( !h )
+        {
+          fail(s);
+        }
+        else
+        {
+          s.fsm_              = (h->fsm_factory_)(part, trace_);
+          s.terminal_states_  = h->terminal_states_;
+          s.info_             = (h->info_factory_)(part.id_);
+        }
+      }
+
+      if( s.fsm_ && !s.failed_ )
+      {
+        s.act_message_ = part;
+        s.act_message_.stream_type_ = s.type_;
+        current = &s.act_message_;
+        s.fsm_->enqueue(part.event_);
+        s.last_state_ = s.fsm_->run(s.last_state_);
+        current = nullptr;
+
+        // the rest of the stream is dropped
+        if( s.terminal_states_.count(s.last_state_) )
+          s.fsm_.reset();
+      }
+    }
+    catch (const std::exception & e)
+    {
+      current = nullptr;
+      ++handler_errors_;
+      fail(s);
+    }
+
+    return (part.event_ == simple_gateway::EV_END || part.event_ == simple_gateway::EV_ONE);
+  }
+
+  void
+  striped_server::fail(stream & s)
+  {
+    if( !s.failed_ )
+      ++failed_streams_;
+    s.failed_ = true;
+    s.fsm_.reset();
+  }
+
+  void
+  striped_server::hold(held_part & h,
+                       const simple_gateway::stream_part & part)
+  {
+    h.part_     = part;
+    h.spilled_  = false;
+    if( memory_budget_ && buffered_bytes_+part.size_ > memory_budget_ )
+    {
+      try
+      {
+        std::lock_guard<std::mutex> lock{spill_mtx_};
+        if( !spill_ )
+          spill_.reset(new spill_file{path_+"/spill"});
+        h.offset_   = spill_->append(part.buffer_, part.size_);
+        h.spilled_  = true;
+        ++spilled_parts_;
+        return;
+      }
+      catch (const std::exception & e)
+      {
+        // the disk is no option, memory still is
+        ++spill_errors_;
+      }
+    }
+    h.data_.assign((const char *)part.buffer_, part.size_);
+    buffered_bytes_ += part.size_;
+  }
+
+  void
+  striped_server::unspill(held_part & h)
+  {
+    // the mapped window belongs to the file, another stream's read or
+    // release may move it, so the part is copied out under the lock
+    std::lock_guard<std::mutex> lock{spill_mtx_};
+    const uint8_t * ptr = spill_->read(h.offset_, h.part_.size_);
+    h.data_.assign((const char *)ptr, h.part_.size_);
+    spill_->release(h.offset_, h.part_.size_);
+    h.spilled_ = false;
+  }
+
+  void
+  striped_server::release(held_part & h)
+  {
+    if( h.spilled_ )
+    {
+      std::lock_guard<std::mutex> lock{spill_mtx_};
+      spill_->release(h.offset_, h.part_.size_);
+    }
+    else
+    {
+      buffered_bytes_ -= h.data_.size();
+    }
+    h.spilled_ = false;
+    h.data_.clear();
+  }
+
+  bool
+  striped_server::on_message(const uint8_t * ptr,
+                             uint64_t len)
+  {
+    simple_gateway::stream_part part;
+    if( !simple_gateway::parse_part(ptr, len, part) )
+      return !is_stopped();
+
+    uint64_t id = part.id_;
+    stream::sptr sp;
+    {
+      std::lock_guard<std::mutex> lock{streams_mtx_};
+      stream::sptr & entry = streams_[id];
+      if( !entry ) entry.reset(new stream);
+      sp = entry;
+    }
+
+    stream & s = *sp;
+    bool finished = false;
+    {
+      std::unique_lock<std::mutex> lock{s.mtx_};
+
+      // wait for our turn, the other readers may be just about to catch up
+      auto due = [&]() { return s.done_ || s.next_seqno_ >= part.seqno_; };
+      s.turn_.wait_for(lock, std::chrono::milliseconds(1), due);
+
+      if( s.done_ || s.next_seqno_ > part.seqno_ )
+        return !is_stopped();
+
+      if( s.next_seqno_ < part.seqno_ )
+      {
+        // out of turn: keep a copy, the queue buffer is gone after return
+        hold(s.held_[part.seqno_], part);
+        ++held_parts_;
+        return !is_stopped();
+      }
+
+      finished = dispatch(s, part);
+
+      // the parts that were waiting for this one
+      while( !finished )
+      {
+        auto hit = s.held_.find(s.next_seqno_);
+        if( hit == s.held_.end() ) break;
+
+        held_part h;
+        h.part_     = hit->second.part_;
+        h.spilled_  = hit->second.spilled_;
+        h.offset_   = hit->second.offset_;
+        h.data_.swap(hit->second.data_);
+        s.held_.erase(hit);
+        uint64_t in_memory = (h.spilled_ ? 0 : h.data_.size());
+        if( h.spilled_ )
+        {
+          try
+          {
+            unspill(h);
+          }
+          catch (const std::exception & e)
+          {
+            // the part is lost, so is the stream
+            ++spill_errors_;
+            fail(s);
+            h.data_.clear();
+            h.part_.size_ = 0;
+          }
+        }
+        h.part_.buffer_ = (const uint8_t *)h.data_.data();
+        finished = dispatch(s, h.part_);
+        buffered_bytes_ -= in_memory;
+      }
+
+      if( finished )
+      {
+        s.done_ = true;
+        for( auto & h : s.held_ )
+          release(h.second);
+        s.held_.clear();
+      }
+    }
+    s.turn_.notify_all();
+
+    if( finished )
+    {
+      std::lock_guard<std::mutex> lock{streams_mtx_};
+      auto it = streams_.find(id);
+      if( it != streams_.end() && it->second == sp )
+        streams_.erase(it);
+    }
+    return !is_stopped();
+  }
+
+  void
+  striped_server::read_stripe(uint32_t stripe,
+                              uint64_t from)
+  {
+    auto pull = [this](uint64_t msg_id,
+                       const uint8_t * ptr,
+                       uint64_t len)
+    {
+      return on_message(ptr, len);
+    };
+
+    while( !is_stopped() )
+    {
+      from = receivers_[stripe]->pull(from, pull, 1000);
+    }
+  }
+
+  void
+  striped_server::seek_to_end()
+  {
+    for( auto & r : receivers_ )
+      r->seek_to_end();
+  }
+
+  void
+  striped_server::run()
+  {
+    // stripe 0 is read on the caller's thread
+    std::vector<std::thread> threads;
+    for( uint32_t i=1; i<stripes(); ++i )
+      threads.push_back(std::thread{[this,i](){ read_stripe(i, receivers_[i]->position()); }});
+    read_stripe(0, receivers_[0]->position());
+
+    for( auto & t : threads )
+      t.join();
+  }
+
+  void
+  striped_server::stop()
+  {
+    stopped_ = true;
+  }
+
+  bool
+  striped_server::is_stopped() const
+  {
+    return stopped_.load();
+  }
+
+  const simple_gateway::stream_part &
+  striped_server::current_part() const
+  {
+    static const simple_gateway::stream_part none;
+    return (current ? *current : none);
+  }
+
+  uint32_t
+  striped_server::stripes() const
+  {
+    return (uint32_t)receivers_.size();
+  }
+
+  uint64_t
+  striped_server::held_parts() const
+  {
+    return held_parts_.load();
+  }
+
+  uint64_t
+  striped_server::failed_streams() const
+  {
+    return failed_streams_.load();
+  }
+
+  uint64_t
+  striped_server::handler_errors() const
+  {
+    return handler_errors_.load();
+  }
+
+  void
+  striped_server::set_memory_budget(uint64_t bytes)
+  {
+    memory_budget_ = bytes;
+  }
+
+  uint64_t
+  striped_server::buffered_bytes() const
+  {
+    return buffered_bytes_.load();
+  }
+
+  uint64_t
+  striped_server::spilled_parts() const
+  {
+    return spilled_parts_.load();
+  }
+
+  uint64_t
+  striped_server::spill_errors() const
+  {
+    return spill_errors_.load();
+  }
+
+}}
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <gateway/simple_gateway.hh>
+#include <gateway/spill_file.hh>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <atomic>
+
+namespace virtdb { namespace gateway {
+
+  class striped_server;
+
+  // a stream's parts spread over K queues under the same base directory:
+  // part seqno goes to path/0-<seqno % K>. the wire format is the one of
+  // simple_gateway, so a stripe is readable by parse_part()
+  class striped_client
+  {
+  public:
+    typedef std::shared_ptr<striped_client>                               sptr;
+    // called concurrently, every stripe's thread fills its own seqnos
+    typedef std::function<void(uint64_t seqno,
+                               simple_gateway::stream_part & part)>       part_fun;
+
+  private:
+    typedef std::unique_ptr<queue::simple_publisher>   publisher_ptr;
+
+    std::string                 path_;
+    std::vector<publisher_ptr>  senders_;
+    // the next free stream id, shared by the clients of the folder
+    position_file::sptr         next_id_;
+
+    void send_part(uint32_t stripe,
+                   uint8_t stream_type,
+                   uint64_t id,
+                   uint64_t seqno,
+                   uint64_t parts,
+                   part_fun f);
+
+    // disable default construction
+    striped_client() = delete;
+
+    // disable copying until properly implemented
+    striped_client(const striped_client &) = delete;
+    striped_client & operator=(const striped_client &) = delete;
+
+  protected:
+    friend class striped_server;
+    striped_client(const std::string & path,
+                   uint32_t stripes,
+                   const queue::params & prms);
+
+  public:
+    virtual ~striped_client();
+    static sptr create(const std::string & path,
+                       uint32_t stripes,
+                       const queue::params & prms=queue::params());
+
+    // sends a stream of the given number of parts, one thread per stripe.
+    // returns the stream id
+    uint64_t start(uint8_t stream_type,
+                   uint64_t parts,
+                   part_fun f);
+
+    uint32_t stripes() const;
+  };
+
+  // reads the K stripes in parallel and hands the parts to the handlers in
+  // seqno order. a reader whose part is not yet due waits for its turn a
+  // little, then copies the part aside so the other stripes are not blocked.
+  // streams are locked one by one, handlers of different streams may run
+  // at the same time on different stripe threads. a handler that throws
+  // fails its stream, the rest of its parts are dropped
+  class striped_server
+  {
+  public:
+    typedef std::shared_ptr<striped_server>    sptr;
+
+  private:
+    typedef std::unique_ptr<queue::simple_subscriber>   subscriber_ptr;
+
+    struct handler
+    {
+      simple_server::new_stream_fun   fsm_factory_;
+      simple_gateway::state_set       terminal_states_;
+      simple_server::new_info_fun     info_factory_;
+
+      typedef std::shared_ptr<handler> sptr;
+    };
+
+    // over the memory budget the copy is in the spill file at offset_
+    struct held_part
+    {
+      simple_gateway::stream_part   part_;
+      std::string                   data_;
+      bool                          spilled_;
+      uint64_t                      offset_;
+    };
+
+    // the readers of a stream's parts take turns under its mtx_
+    struct stream
+    {
+      fsm::state_machine::sptr              fsm_;
+      simple_gateway::state_set             terminal_states_;
+      simple_gateway::stream_info::sptr     info_;
+      simple_gateway::stream_part           act_message_;
+      uint16_t                              last_state_;
+      uint64_t                              next_seqno_;
+      uint8_t                               type_;
+      bool                                  failed_;
+      bool                                  done_;
+      std::map<uint64_t, held_part>         held_;
+      std::mutex                            mtx_;
+      std::condition_variable               turn_;
+
+      stream();
+
+      typedef std::shared_ptr<stream> sptr;
+    };
+
+    typedef std::map<uint64_t, stream::sptr>     stream_map;
+
+    std::string                   path_;
+    std::vector<subscriber_ptr>   receivers_;
+    std::vector<handler::sptr>    handlers_;
+    // guards the map only, not the streams in it
+    stream_map                    streams_;
+    std::mutex                    streams_mtx_;
+    fsm::state_machine::trace_fun trace_;
+    std::atomic<bool>             stopped_;
+    std::atomic<uint64_t>         held_parts_;
+    std::atomic<uint64_t>         failed_streams_;
+    std::atomic<uint64_t>         handler_errors_;
+    uint64_t                      memory_budget_;
+    std::atomic<uint64_t>         buffered_bytes_;
+    std::atomic<uint64_t>         spilled_parts_;
+    std::atomic<uint64_t>         spill_errors_;
+    spill_file::uptr              spill_;
+    std::mutex                    spill_mtx_;
+
+    void read_stripe(uint32_t stripe,
+                     uint64_t from);
+    bool on_message(const uint8_t * ptr,
+                    uint64_t len);
+    bool dispatch(stream & s,
+                  const simple_gateway::stream_part & part);
+    void fail(stream & s);
+    void hold(held_part & h,
+              const simple_gateway::stream_part & part);
+    void unspill(held_part & h);
+    void release(held_part & h);
+    static void init_stripes(const std::string & path,
+                             uint32_t stripes,
+                             const queue::params & prms);
+
+    // disable default construction
+    striped_server() = delete;
+
+    // disable copying until properly implemented
+    striped_server(const striped_server &) = delete;
+    striped_server & operator=(const striped_server &) = delete;
+
+  protected:
+    friend class striped_client;
+    striped_server(const std::string & path,
+                   uint32_t stripes,
+                   const queue::params & prms,
+                   fsm::state_machine::trace_fun trace_cb);
+
+  public:
+    virtual ~striped_server();
+    static sptr create(const std::string & path,
+                       uint32_t stripes,
+                       const queue::params & prms=queue::params(),
+                       fsm::state_machine::trace_fun trace_cb=[](uint16_t seqno,
+                                                                 const std::string & desc,
+                                                                 const fsm::transition & trans,
+                                                                 const fsm::state_machine & sm){});
+
+    void add_handler(uint8_t stream_type,
+                     simple_server::new_stream_fun new_handler,
+                     const simple_gateway::state_set & terminal_states,
+                     simple_server::new_info_fun new_info);
+
+    // runs one reader thread per stripe until stop()
+    void seek_to_end();
+    void run();
+    void stop();
+    bool is_stopped() const;
+
+    // the stream part being processed by the calling thread, valid while
+    // the handler FSM runs
+    const simple_gateway::stream_part & current_part() const;
+
+    uint32_t stripes() const;
+    uint64_t held_parts() const;
+    // streams without a handler or with a handler that threw
+    uint64_t failed_streams() const;
+    uint64_t handler_errors() const;
+
+    // held parts beyond budget bytes in memory go to a spill file under
+    // path/spill until their turn. 0, the default, keeps them in memory
+    void set_memory_budget(uint64_t bytes);
+    uint64_t buffered_bytes() const;
+    uint64_t spilled_parts() const;
+    // parts kept in memory because the spill file failed
+    uint64_t spill_errors() const;
+  };
+
+}}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace virtdb { namespace gateway {
+
+  // non-owning views into a decoded stream part. they stay valid
+  // until the handler callback returns
+  struct bytes_view
+  {
+    const uint8_t *  data_;
+    uint64_t         size_;
+
+    bytes_view() : data_{nullptr}, size_{0} {}
+    bytes_view(const uint8_t * d, uint64_t s) : data_{d}, size_{s} {}
+    std::string str() const { return std::string{(const char *)data_, size_}; }
+    bool operator==(const std::string & s) const { return s.size() == size_ && (size_ == 0 || s.compare(0, size_, (const char *)data_, size_) == 0); }
+  };
+
+  template <typename T>
+  struct array_view
+  {
+    const T *  data_;
+    uint64_t   size_;
+
+    array_view() : data_{nullptr}, size_{0} {}
+    array_view(const T * d, uint64_t s) : data_{d}, size_{s} {}
+    const T & operator[](uint64_t i) const { return data_[i]; }
+    const T * begin() const { return data_; }
+    const T * end() const { return data_+size_; }
+    uint64_t size() const { return size_; }
+  };
+
+}}
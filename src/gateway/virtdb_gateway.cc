@@ -1,8 +1,682 @@
 #include <gateway/virtdb_gateway.hh>
+#include <gateway/pushdown.hh>
+#include <gateway/result_cache.hh>
+#include <gateway/pb_wire.hh>
+#include <gateway/exception.hh>
+#include <cstring>
 
 namespace virtdb { namespace gateway {
+
+  namespace
+  {
+    // the field numbers of the virtdb messages. the generated protobuf
+    // classes are not built with the gateway, these follow the .proto
+    // files of deps_/proto by hand, the field name is on each line
+
+    // ValueType, common.proto
+    const uint32_t VT_TYPE     = 1;   // Type
+    const uint32_t VT_STRING   = 2;   // StringValue
+    const uint32_t VT_INT32    = 3;   // Int32Value
+    const uint32_t VT_INT64    = 4;   // Int64Value
+    const uint32_t VT_UINT32   = 5;   // UInt32Value
+    const uint32_t VT_UINT64   = 6;   // UInt64Value
+    const uint32_t VT_DOUBLE   = 7;   // DoubleValue
+    const uint32_t VT_FLOAT    = 8;   // FloatValue
+    const uint32_t VT_BOOL     = 9;   // BoolValue
+    const uint32_t VT_BYTES    = 10;  // BytesValue
+    const uint32_t VT_ISNULL   = 11;  // IsNull
+    const uint32_t VT_MAX      = 12;  // not a field, one past the last
+
+    // Column, data.proto
+    const uint32_t COL_QUERY_ID           = 1;  // QueryId
+    const uint32_t COL_NAME               = 2;  // Name
+    const uint32_t COL_DATA               = 3;  // Data
+    const uint32_t COL_SEQNO              = 4;  // SeqNo
+    const uint32_t COL_END_OF_DATA        = 5;  // EndOfData
+    const uint32_t COL_COMP_TYPE          = 6;  // CompType
+    const uint32_t COL_UNCOMPRESSED_SIZE  = 7;  // UncompressedSize
+    const uint32_t COL_COMPRESSED_DATA    = 8;  // CompressedData
+
+    // Query, data.proto
+    const uint32_t QRY_QUERY_ID  = 1;  // QueryId
+    const uint32_t QRY_TABLE     = 2;  // Table
+    const uint32_t QRY_FIELDS    = 3;  // Fields
+    const uint32_t QRY_FILTER    = 4;  // Filter
+    const uint32_t QRY_LIMIT     = 5;  // Limit
+    const uint32_t QRY_SCHEMA    = 6;  // Schema
+
+    // Field, common.proto
+    const uint32_t FLD_NAME      = 1;  // Name
+
+    struct field_count
+    {
+      uint64_t         count_;
+      uint64_t         segments_;
+      const uint8_t *  first_;
+    };
+
+    uint64_t
+    count_varints(const uint8_t * ptr,
+                  uint64_t len)
+    {
+      uint64_t ret = 0;
+      for( uint64_t i=0; i<len; ++i )
+        ret += ((ptr[i] & 0x80) == 0);
+      return ret;
+    }
+
+    uint64_t
+    fixed_width(uint32_t field)
+    {
+      if( field == VT_DOUBLE ) return 8;
+      if( field == VT_FLOAT )  return 4;
+      return 0;
+    }
+
+    // little endian packed fixed width values may be used in place
+    template <typename T>
+    bool
+    can_alias(const field_count & c)
+    {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      return c.segments_ == 1 && (((uintptr_t)c.first_) % alignof(T)) == 0;
+#else
+      return false;
+#endif
+    }
+
+    template <typename T>
+    void
+    store_fixed(T * arr,
+                uint64_t & n,
+                const uint8_t * ptr,
+                uint64_t len)
+    {
+      uint64_t count = len / sizeof(T);
+      ::memcpy(arr+n, ptr, count*sizeof(T));
+      n += count;
+    }
+
+    template <typename T>
+    bool
+    store_varints(T * arr,
+                  uint64_t & n,
+                  const uint8_t * ptr,
+                  uint64_t len)
+    {
+      pb_reader r{ptr, len};
+      uint64_t v = 0;
+      while( !r.at_end() )
+      {
+        if( !r.varint(v) ) return false;
+        arr[n++] = (T)v;
+      }
+      return true;
+    }
+  }
+
+  bool
+  virtdb_gateway::decode_value(const uint8_t * ptr,
+                               uint64_t len,
+                               arena & a,
+                               value_view & value)
+  {
+    field_count counts[VT_MAX];
+    ::memset(counts, 0, sizeof(counts));
+
+    // first pass: count the values of each repeated field
+    {
+      pb_reader r{ptr, len};
+      uint32_t  field  = 0;
+      uint8_t   wt     = 0;
+      while( !r.at_end() )
+      {
+        if( !r.tag(field, wt) ) return false;
+
+        if( field == VT_TYPE && wt == pb_reader::WT_VARINT )
+        {
+          uint64_t kind = 0;
+          if( !r.varint(kind) ) return false;
+          value.kind_ = (uint32_t)kind;
+        }
+        else if( field > VT_TYPE && field < VT_MAX )
+        {
+          field_count & c = counts[field];
+          if( wt == pb_reader::WT_LENGTH && field != VT_STRING && field != VT_BYTES )
+          {
+            // packed repeated field
+            const uint8_t * data = nullptr;
+            uint64_t        dlen = 0;
+            if( !r.length_delimited(data, dlen) ) return false;
+
+            uint64_t width = fixed_width(field);
+            if( width )
+            {
+              if( dlen % width ) return false;
+              c.count_ += dlen / width;
+            }
+            else
+            {
+              c.count_ += count_varints(data, dlen);
+            }
+            if( c.segments_++ == 0 ) c.first_ = data;
+          }
+          else
+          {
+            // a non-packed element disables aliasing
+            ++c.count_;
+            c.segments_ += 2;
+            if( !r.skip(wt) ) return false;
+          }
+        }
+        else if( !r.skip(wt) )
+        {
+          return false;
+        }
+      }
+      if( r.failed() ) return false;
+    }
+
+    // allocate the arrays
+    bytes_view *  strings  = a.allocate_array<bytes_view>(counts[VT_STRING].count_);
+    int32_t *     int32s   = a.allocate_array<int32_t>(counts[VT_INT32].count_);
+    int64_t *     int64s   = a.allocate_array<int64_t>(counts[VT_INT64].count_);
+    uint32_t *    uint32s  = a.allocate_array<uint32_t>(counts[VT_UINT32].count_);
+    uint64_t *    uint64s  = a.allocate_array<uint64_t>(counts[VT_UINT64].count_);
+    uint8_t *     bools    = a.allocate_array<uint8_t>(counts[VT_BOOL].count_);
+    bytes_view *  bytes    = a.allocate_array<bytes_view>(counts[VT_BYTES].count_);
+    uint8_t *     is_null  = a.allocate_array<uint8_t>(counts[VT_ISNULL].count_);
+
+    double *  doubles  = nullptr;
+    float *   floats   = nullptr;
+    bool alias_doubles = can_alias<double>(counts[VT_DOUBLE]);
+    bool alias_floats  = can_alias<float>(counts[VT_FLOAT]);
+    if( alias_doubles ) value.doubles_ = array_view<double>{(const double *)counts[VT_DOUBLE].first_, counts[VT_DOUBLE].count_};
+    else                doubles = a.allocate_array<double>(counts[VT_DOUBLE].count_);
+    if( alias_floats )  value.floats_ = array_view<float>{(const float *)counts[VT_FLOAT].first_, counts[VT_FLOAT].count_};
+    else                floats = a.allocate_array<float>(counts[VT_FLOAT].count_);
+
+    // second pass: fill the arrays
+    uint64_t n[VT_MAX];
+    ::memset(n, 0, sizeof(n));
+    {
+      pb_reader r{ptr, len};
+      uint32_t  field  = 0;
+      uint8_t   wt     = 0;
+      while( !r.at_end() )
+      {
+        if( !r.tag(field, wt) ) return false;
+        if( field <= VT_TYPE || field >= VT_MAX )
+        {
+          if( !r.skip(wt) ) return false;
+          continue;
+        }
+
+        if( wt == pb_reader::WT_LENGTH )
+        {
+          const uint8_t * data = nullptr;
+          uint64_t        dlen = 0;
+          if( !r.length_delimited(data, dlen) ) return false;
+
+          bool ok = true;
+          switch( field )
+          {
+            case VT_STRING:  strings[n[field]++] = bytes_view{data, dlen}; break;
+            case VT_BYTES:   bytes[n[field]++]   = bytes_view{data, dlen}; break;
+            case VT_INT32:   ok = store_varints(int32s,  n[field], data, dlen); break;
+            case VT_INT64:   ok = store_varints(int64s,  n[field], data, dlen); break;
+            case VT_UINT32:  ok = store_varints(uint32s, n[field], data, dlen); break;
+            case VT_UINT64:  ok = store_varints(uint64s, n[field], data, dlen); break;
+            case VT_BOOL:    ok = store_varints(bools,   n[field], data, dlen); break;
+            case VT_ISNULL:  ok = store_varints(is_null, n[field], data, dlen); break;
+            case VT_DOUBLE:  if( !alias_doubles ) store_fixed(doubles, n[field], data, dlen); break;
+            case VT_FLOAT:   if( !alias_floats )  store_fixed(floats,  n[field], data, dlen); break;
+          };
+          if( !ok ) return false;
+        }
+        else if( wt == pb_reader::WT_VARINT )
+        {
+          uint64_t v = 0;
+          if( !r.varint(v) ) return false;
+          switch( field )
+          {
+            case VT_INT32:   int32s[n[field]++]   = (int32_t)v;   break;
+            case VT_INT64:   int64s[n[field]++]   = (int64_t)v;   break;
+            case VT_UINT32:  uint32s[n[field]++]  = (uint32_t)v;  break;
+            case VT_UINT64:  uint64s[n[field]++]  = v;            break;
+            case VT_BOOL:    bools[n[field]++]    = (v != 0);     break;
+            case VT_ISNULL:  is_null[n[field]++]  = (v != 0);     break;
+            default:         return false;
+          };
+        }
+        else if( wt == pb_reader::WT_FIXED64 && field == VT_DOUBLE )
+        {
+          uint64_t v = 0;
+          if( !r.fixed64(v) ) return false;
+          ::memcpy(doubles+n[field]++, &v, sizeof(double));
+        }
+        else if( wt == pb_reader::WT_FIXED32 && field == VT_FLOAT )
+        {
+          uint32_t v = 0;
+          if( !r.fixed32(v) ) return false;
+          ::memcpy(floats+n[field]++, &v, sizeof(float));
+        }
+        else
+        {
+          return false;
+        }
+      }
+      if( r.failed() ) return false;
+    }
+
+    value.strings_  = array_view<bytes_view>{strings, n[VT_STRING]};
+    value.int32s_   = array_view<int32_t>{int32s, n[VT_INT32]};
+    value.int64s_   = array_view<int64_t>{int64s, n[VT_INT64]};
+    value.uint32s_  = array_view<uint32_t>{uint32s, n[VT_UINT32]};
+    value.uint64s_  = array_view<uint64_t>{uint64s, n[VT_UINT64]};
+    value.bools_    = array_view<uint8_t>{bools, n[VT_BOOL]};
+    value.bytes_    = array_view<bytes_view>{bytes, n[VT_BYTES]};
+    value.is_null_  = array_view<uint8_t>{is_null, n[VT_ISNULL]};
+    if( !alias_doubles ) value.doubles_ = array_view<double>{doubles, n[VT_DOUBLE]};
+    if( !alias_floats )  value.floats_  = array_view<float>{floats, n[VT_FLOAT]};
+    return true;
+  }
+
+  bool
+  virtdb_gateway::decode_column(const uint8_t * ptr,
+                                uint64_t len,
+                                arena & a,
+                                column_view & column)
+  {
+    pb_reader r{ptr, len};
+    uint32_t  field  = 0;
+    uint8_t   wt     = 0;
+
+    while( !r.at_end() )
+    {
+      if( !r.tag(field, wt) ) return false;
+
+      const uint8_t * data = nullptr;
+      uint64_t        dlen = 0;
+      uint64_t        v    = 0;
+
+      if( wt == pb_reader::WT_LENGTH )
+      {
+        if( !r.length_delimited(data, dlen) ) return false;
+        switch( field )
+        {
+          case COL_QUERY_ID:         column.query_id_ = bytes_view{data, dlen}; break;
+          case COL_NAME:             column.name_ = bytes_view{data, dlen}; break;
+          case COL_COMPRESSED_DATA:  column.compressed_data_ = bytes_view{data, dlen}; break;
+          case COL_DATA:
+            if( !decode_value(data, dlen, a, column.data_) ) return false;
+            break;
+          default: break;
+        };
+      }
+      else if( wt == pb_reader::WT_VARINT )
+      {
+        if( !r.varint(v) ) return false;
+        switch( field )
+        {
+          case COL_SEQNO:              column.seqno_ = v; break;
+          case COL_END_OF_DATA:        column.end_of_data_ = (v != 0); break;
+          case COL_COMP_TYPE:          column.comp_type_ = (uint32_t)v; break;
+          case COL_UNCOMPRESSED_SIZE:  column.uncompressed_size_ = v; break;
+          default: break;
+        };
+      }
+      else if( !r.skip(wt) )
+      {
+        return false;
+      }
+    }
+    return !r.failed();
+  }
+
+  bool
+  virtdb_gateway::decode_query(const uint8_t * ptr,
+                               uint64_t len,
+                               arena & a,
+                               query_view & query)
+  {
+    uint64_t n_fields   = 0;
+    uint64_t n_filters  = 0;
+
+    // first pass: count the repeated fields
+    {
+      pb_reader r{ptr, len};
+      uint32_t  field  = 0;
+      uint8_t   wt     = 0;
+      while( !r.at_end() )
+      {
+        if( !r.tag(field, wt) ) return false;
+        if( wt == pb_reader::WT_LENGTH && field == QRY_FIELDS )  ++n_fields;
+        if( wt == pb_reader::WT_LENGTH && field == QRY_FILTER )  ++n_filters;
+        if( !r.skip(wt) ) return false;
+      }
+      if( r.failed() ) return false;
+    }
+
+    bytes_view * fields   = a.allocate_array<bytes_view>(n_fields);
+    bytes_view * filters  = a.allocate_array<bytes_view>(n_filters);
+    n_fields   = 0;
+    n_filters  = 0;
+
+    pb_reader r{ptr, len};
+    uint32_t  field  = 0;
+    uint8_t   wt     = 0;
+    while( !r.at_end() )
+    {
+      if( !r.tag(field, wt) ) return false;
+
+      const uint8_t * data = nullptr;
+      uint64_t        dlen = 0;
+
+      if( wt == pb_reader::WT_LENGTH )
+      {
+        if( !r.length_delimited(data, dlen) ) return false;
+        switch( field )
+        {
+          case QRY_QUERY_ID:  query.query_id_ = bytes_view{data, dlen}; break;
+          case QRY_TABLE:     query.table_ = bytes_view{data, dlen}; break;
+          case QRY_SCHEMA:    query.schema_ = bytes_view{data, dlen}; break;
+          case QRY_FILTER:    filters[n_filters++] = bytes_view{data, dlen}; break;
+          case QRY_FIELDS:
+          {
+            // only the field name is needed from the Field message
+            bytes_view name;
+            pb_reader fr{data, dlen};
+            uint32_t  ff  = 0;
+            uint8_t   fwt = 0;
+            while( !fr.at_end() )
+            {
+              if( !fr.tag(ff, fwt) ) return false;
+              if( ff == FLD_NAME && fwt == pb_reader::WT_LENGTH )
+              {
+                if( !fr.length_delimited(name.data_, name.size_) ) return false;
+              }
+              else if( !fr.skip(fwt) )
+              {
+                return false;
+              }
+            }
+            fields[n_fields++] = name;
+            break;
+          }
+          default: break;
+        };
+      }
+      else if( wt == pb_reader::WT_VARINT && field == QRY_LIMIT )
+      {
+        if( !r.varint(query.limit_) ) return false;
+      }
+      else if( !r.skip(wt) )
+      {
+        return false;
+      }
+    }
+
+    query.fields_   = array_view<bytes_view>{fields, n_fields};
+    query.filters_  = array_view<bytes_view>{filters, n_filters};
+    return !r.failed();
+  }
+
+  void
+  virtdb_gateway::decode_part(arena & a,
+                              uint8_t stream_type)
+  {
+    const simple_gateway::stream_part & part = server_->current_part();
+    uint64_t id = part.id_;
+    auto emit = [this,id](const column_view & c) { if( on_column_ ) on_column_(id, c); };
+
+    // the held blocks go out with the last part, even an empty or a bad one
+    bool last = (part.event_ == simple_gateway::EV_END || part.event_ == simple_gateway::EV_ONE);
+    bool end_blocks = (last && stream_type != QUERY_STREAM && pushdown_);
+
+    if( part.size_ == 0 || part.buffer_ == nullptr )
+    {
+      if( end_blocks )
+        pushdown_->end_stream(id, emit);
+      return;
+    }
+
+    bool ok = false;
+    if( stream_type == QUERY_STREAM )
+    {
+      query_view query;
+      ok = decode_query(part.buffer_, part.size_, a, query);
+      if( ok && !(cache_ && replay_cached(id, query)) && on_query_ )
+        on_query_(id, query);
+    }
+    else
+    {
+      column_view column;
+      ok = decode_column(part.buffer_, part.size_, a, column);
+      if( ok && pushdown_ )
+        pushdown_->push(id, part.buffer_, part.size_, column, emit);
+      else if( ok && on_column_ )
+        on_column_(id, column);
+      if( end_blocks )
+        pushdown_->end_stream(id, emit);
+    }
+
+    if( ok ) ++decoded_parts_;
+    else     ++decode_errors_;
+
+    // the views are gone, keep the memory for the next part
+    a.reset();
+  }
+
+  bool
+  virtdb_gateway::replay_cached(uint64_t id,
+                                const query_view & query)
+  {
+    std::string key{normalize(query)};
+    uint64_t fp = result_cache::fingerprint(key);
+    
+    // the cached parts have no QueryId, the one of this query goes first
+    std::string query_id;
+    pb_writer writer{query_id};
+    writer.bytes_field(COL_QUERY_ID, query.query_id_.data_, query.query_id_.size_);
+    
+    auto send = [this,id,&query_id](uint64_t seqno,
+                                    const result_cache::buffer_vector & data,
+                                    bool last)
+    {
+      result_cache::buffer_vector parts;
+      parts.reserve(data.size()+1);
+      parts.push_back(queue::simple_publisher::buffer{query_id.data(), query_id.size()});
+      parts.insert(parts.end(), data.begin(), data.end());
+      server_->reply(id, seqno, parts, last);
+    };
+    
+    if( cache_->replay(fp, key, send) )
+      return true;
+    
+    // miss: record the reply stream
+    cache_->begin(id, fp, key);
+    return false;
+  }
   
-  virtdb_gateway::virtdb_gateway() {}
+  std::string
+  virtdb_gateway::normalize(const query_view & query)
+  {
+    std::string ret;
+    pb_writer writer{ret};
+    writer.bytes_field(QRY_TABLE, query.table_.data_, query.table_.size_);
+    writer.bytes_field(QRY_SCHEMA, query.schema_.data_, query.schema_.size_);
+    for( auto & f : query.fields_ )
+      writer.bytes_field(QRY_FIELDS, f.data_, f.size_);
+    for( auto & f : query.filters_ )
+      writer.bytes_field(QRY_FILTER, f.data_, f.size_);
+    writer.varint_field(QRY_LIMIT, query.limit_);
+    return ret;
+  }
+  
+  fsm::state_machine::sptr
+  virtdb_gateway::new_stream(const simple_gateway::stream_part & start,
+                             fsm::state_machine::trace_fun trace_cb)
+  {
+    using namespace virtdb::fsm;
+
+    std::string name{"VIRTDB STREAM:"};
+    name += std::to_string(start.id_);
+    state_machine::sptr fsm{new state_machine{name, trace_cb}};
+    fsm->state_name(ST_INIT,       "INIT");
+    fsm->state_name(ST_STREAMING,  "STREAMING");
+    fsm->state_name(ST_DONE,       "DONE");
+    simple_gateway::set_event_names(*fsm);
+
+    // one arena per stream
+    arena::sptr stream_arena{new arena};
+    uint8_t stream_type = start.stream_type_;
+
+    action::sptr decode{new action{[this,stream_arena,stream_type](uint16_t seqno,
+                                                                   transition & tran,
+                                                                   state_machine & sm)
+      {
+        decode_part(*stream_arena, stream_type);
+      }, "DECODE PART"
+    }};
+
+    transition::sptr one    {new transition{ST_INIT,       simple_gateway::EV_ONE,   ST_DONE,       "Single part"}};
+    transition::sptr start_ {new transition{ST_INIT,       simple_gateway::EV_START, ST_STREAMING,  "First part"}};
+    transition::sptr next   {new transition{ST_STREAMING,  simple_gateway::EV_NEXT,  ST_STREAMING,  "Next part"}};
+    transition::sptr end    {new transition{ST_STREAMING,  simple_gateway::EV_END,   ST_DONE,       "Last part"}};
+
+    for( auto & t : { one, start_, next, end } )
+    {
+      t->set_action(1, decode);
+      fsm->add_transition(t);
+    }
+    return fsm;
+  }
+
+  virtdb_gateway::virtdb_gateway(simple_server::sptr server)
+  : server_{server},
+    decoded_parts_{0},
+    decode_errors_{0}
+  {
+    if( !server_ )
+    {
+      THROW_("server must not be null");
+    }
+
+    // the handlers refer to this object, so it must outlive the server's streams
+    auto factory = [this](const simple_gateway::stream_part & start,
+                          fsm::state_machine::trace_fun trace_cb)
+    {
+      return new_stream(start, trace_cb);
+    };
+    auto new_info = [](uint64_t id)
+    {
+      simple_gateway::stream_info::sptr info{new simple_gateway::stream_info};
+      info->id_ = id;
+      return info;
+    };
+
+    server_->add_handler(QUERY_STREAM,   factory, { ST_DONE }, new_info);
+    server_->add_handler(COLUMN_STREAM,  factory, { ST_DONE }, new_info);
+    server_->on_stream_dropped([this](uint64_t id, uint8_t stream_type)
+    {
+      if( stream_type == QUERY_STREAM )
+        cancel_reply(id);
+      else if( pushdown_ )
+        pushdown_->drop_stream(id);
+    });
+  }
+
   virtdb_gateway::~virtdb_gateway() {}
+
+  void
+  virtdb_gateway::on_query(query_fun f)
+  {
+    on_query_ = f;
+  }
+
+  void
+  virtdb_gateway::on_column(column_fun f)
+  {
+    on_column_ = f;
+  }
+
+  void
+  virtdb_gateway::set_pushdown(std::shared_ptr<pushdown> stage)
+  {
+    pushdown_ = stage;
+  }
+
+  void
+  virtdb_gateway::enable_cache(uint64_t capacity_bytes,
+                               uint64_t ttl_ms)
+  {
+    cache_.reset(new result_cache{server_->base_path()+"/cache", capacity_bytes, ttl_ms});
+  }
+  
+  result_cache::sptr
+  virtdb_gateway::cache() const
+  {
+    return cache_;
+  }
+  
+  void
+  virtdb_gateway::reply(uint64_t id,
+                        const uint8_t * data,
+                        uint64_t size,
+                        bool last)
+  {
+    // keeps the seqnos and the cached parts in sending order
+    std::lock_guard<std::mutex> lock{reply_mtx_};
+    
+    uint64_t seqno = reply_seqnos_[id]++;
+    if( last ) reply_seqnos_.erase(id);
+    
+    queue::simple_publisher::buffer_vector parts{ queue::simple_publisher::buffer{data, size} };
+    server_->reply(id, seqno, parts, last);
+    
+    if( !cache_ || !cache_->is_building(id) )
+      return;
+    
+    // store the message without the leading QueryId
+    pb_reader reader{data, size};
+    uint32_t         field      = 0;
+    uint8_t          wire_type  = 0;
+    const uint8_t *  query_id   = nullptr;
+    uint64_t         len        = 0;
+    if( reader.tag(field, wire_type) &&
+        field == COL_QUERY_ID &&
+        wire_type == pb_reader::WT_LENGTH &&
+        reader.length_delimited(query_id, len) )
+    {
+      const uint8_t * rest = query_id+len;
+      cache_->append(id, rest, size-(rest-data));
+      if( last ) cache_->commit(id);
+    }
+    else
+    {
+      cache_->abort(id);
+    }
+  }
   
+  void
+  virtdb_gateway::cancel_reply(uint64_t id)
+  {
+    std::lock_guard<std::mutex> lock{reply_mtx_};
+    reply_seqnos_.erase(id);
+    if( cache_ ) cache_->abort(id);
+  }
+  
+  uint64_t
+  virtdb_gateway::decoded_parts() const
+  {
+    return decoded_parts_.load();
+  }
+
+  uint64_t
+  virtdb_gateway::decode_errors() const
+  {
+    return decode_errors_.load();
+  }
+
 }}
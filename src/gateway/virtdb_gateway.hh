@@ -1,19 +1,172 @@
 #pragma once
 
+#include <gateway/simple_gateway.hh>
+#include <gateway/arena.hh>
+#include <gateway/views.hh>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <map>
+#include <mutex>
+#include <string>
+#include <atomic>
+
 namespace virtdb { namespace gateway {
-  
+
+  class pushdown;
+  class result_cache;
+
+  // ValueType from deps_/proto/common.proto
+  struct value_view
+  {
+    // ValueType.Kind, by hand like the field numbers in virtdb_gateway.cc
+    static const uint32_t STRING    = 2;
+    static const uint32_t INT32     = 3;
+    static const uint32_t INT64     = 4;
+    static const uint32_t UINT32    = 5;
+    static const uint32_t UINT64    = 6;
+    static const uint32_t DOUBLE    = 7;
+    static const uint32_t FLOAT     = 8;
+    static const uint32_t BOOL      = 9;
+    static const uint32_t BYTES     = 10;
+    static const uint32_t DATE      = 11;
+    static const uint32_t TIME      = 12;
+    static const uint32_t DATETIME  = 13;
+    static const uint32_t NUMERIC   = 14;
+
+    uint32_t                  kind_;
+    array_view<bytes_view>    strings_;
+    array_view<int32_t>       int32s_;
+    array_view<int64_t>       int64s_;
+    array_view<uint32_t>      uint32s_;
+    array_view<uint64_t>      uint64s_;
+    array_view<double>        doubles_;
+    array_view<float>         floats_;
+    array_view<uint8_t>       bools_;
+    array_view<bytes_view>    bytes_;
+    array_view<uint8_t>       is_null_;
+
+    value_view() : kind_{0} {}
+  };
+
+  // Column from deps_/proto/data.proto
+  struct column_view
+  {
+    bytes_view   query_id_;
+    bytes_view   name_;
+    value_view   data_;
+    uint64_t     seqno_;
+    bool         end_of_data_;
+    uint32_t     comp_type_;
+    uint64_t     uncompressed_size_;
+    bytes_view   compressed_data_;
+
+    column_view() : seqno_{0}, end_of_data_{false}, comp_type_{0}, uncompressed_size_{0} {}
+  };
+
+  // Query from deps_/proto/data.proto, filters are left encoded
+  struct query_view
+  {
+    bytes_view               query_id_;
+    bytes_view               table_;
+    array_view<bytes_view>   fields_;
+    array_view<bytes_view>   filters_;
+    uint64_t                 limit_;
+    bytes_view               schema_;
+
+    query_view() : limit_{0} {}
+  };
+
+  // decodes virtdb query and column messages arriving as stream parts of
+  // a simple_server. every stream has its own arena that is rewound after
+  // each part, string and bytes fields alias the queue buffer
   class virtdb_gateway
   {
+  public:
+    typedef std::shared_ptr<virtdb_gateway>                                  sptr;
+    typedef std::function<void(uint64_t id, const query_view & query)>       query_fun;
+    typedef std::function<void(uint64_t id, const column_view & column)>     column_fun;
+
+    // stream types registered at the server
+    static const uint8_t QUERY_STREAM    = 16;
+    static const uint8_t COLUMN_STREAM   = 17;
+
+  private:
+    // handler states
+    static const uint16_t ST_INIT        = 0;
+    static const uint16_t ST_STREAMING   = 1;
+    static const uint16_t ST_DONE        = 2;
+
+    simple_server::sptr      server_;
+    query_fun                on_query_;
+    column_fun               on_column_;
+    std::shared_ptr<pushdown> pushdown_;
+    std::shared_ptr<result_cache> cache_;
+    std::map<uint64_t, uint64_t> reply_seqnos_;
+    std::mutex               reply_mtx_;
+    std::atomic<uint64_t>    decoded_parts_;
+    std::atomic<uint64_t>    decode_errors_;
+
+    fsm::state_machine::sptr new_stream(const simple_gateway::stream_part & start,
+                                        fsm::state_machine::trace_fun trace_cb);
+    void decode_part(arena & a,
+                     uint8_t stream_type);
+    bool replay_cached(uint64_t id,
+                       const query_view & query);
+
     // disable default construction
-    // virtdb_gateway() = delete;
-    
+    virtdb_gateway() = delete;
+
     // disable copying until properly implemented
     virtdb_gateway(const virtdb_gateway &) = delete;
     virtdb_gateway & operator=(const virtdb_gateway &) = delete;
-    
+
   public:
-    virtdb_gateway();
+    virtdb_gateway(simple_server::sptr server);
     virtual ~virtdb_gateway();
+
+    void on_query(query_fun f);
+    void on_column(column_fun f);
+    
+    // optional predicate and projection stage in front of on_column
+    void set_pushdown(std::shared_ptr<pushdown> stage);
+    
+    // optional result cache under <base path>/cache. a query that matches
+    // a cached one is answered from the cache, on_query is not called
+    void enable_cache(uint64_t capacity_bytes,
+                      uint64_t ttl_ms);
+    std::shared_ptr<result_cache> cache() const;
+    
+    // send a Column message as a reply to the query stream id, these
+    // are stored in the cache when enabled
+    void reply(uint64_t id,
+               const uint8_t * data,
+               uint64_t size,
+               bool last);
+    
+    // the reply to query stream id ends without its last part, the
+    // partial reply is not cached. dropped query streams are cancelled
+    void cancel_reply(uint64_t id);
+    
+    // cache key: the query without its QueryId
+    static std::string normalize(const query_view & query);
+
+    // decoders, return false on malformed input
+    static bool decode_query(const uint8_t * ptr,
+                             uint64_t len,
+                             arena & a,
+                             query_view & query);
+    static bool decode_column(const uint8_t * ptr,
+                              uint64_t len,
+                              arena & a,
+                              column_view & column);
+    static bool decode_value(const uint8_t * ptr,
+                             uint64_t len,
+                             arena & a,
+                             value_view & value);
+
+    uint64_t decoded_parts() const;
+    uint64_t decode_errors() const;
   };
-  
+
 }}
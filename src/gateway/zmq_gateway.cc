@@ -1,8 +1,682 @@
 #include <gateway/zmq_gateway.hh>
+#include <gateway/exception.hh>
+#include <gateway/crc32c.hh>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+
+// C libs
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
 
 namespace virtdb { namespace gateway {
 
-  zmq_gateway::zmq_gateway() {}
-  zmq_gateway::~zmq_gateway() {}
-  
+  namespace
+  {
+    const std::string tcp_prefix{"tcp://"};
+    const std::string ipc_prefix{"ipc://"};
+
+    int
+    open_socket(const std::string & endpoint,
+                bool bind)
+    {
+      int fd = -1;
+
+      if( endpoint.compare(0, ipc_prefix.size(), ipc_prefix) == 0 )
+      {
+        std::string path{endpoint.substr(ipc_prefix.size())};
+        struct sockaddr_un addr;
+        ::memset(&addr, 0, sizeof(addr));
+        if( path.empty() || path.size() >= sizeof(addr.sun_path) )
+        {
+          THROW_(std::string{"invalid ipc endpoint: "}+endpoint);
+        }
+        addr.sun_family = AF_UNIX;
+        ::memcpy(addr.sun_path, path.c_str(), path.size());
+
+        fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if( fd < 0 )
+        {
+          THROW_(std::string{"failed to create socket for: "}+endpoint);
+        }
+
+        int rc = 0;
+        if( bind )
+        {
+          // remove the stale socket file of a previous run
+          ::unlink(path.c_str());
+          rc = ::bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+          if( rc == 0 ) rc = ::listen(fd, 1);
+        }
+        else
+        {
+          rc = ::connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+        }
+
+        if( rc != 0 )
+        {
+          ::close(fd);
+          fd = -1;
+        }
+      }
+      else if( endpoint.compare(0, tcp_prefix.size(), tcp_prefix) == 0 )
+      {
+        std::string host_port{endpoint.substr(tcp_prefix.size())};
+        auto colon = host_port.rfind(':');
+        if( colon == std::string::npos )
+        {
+          THROW_(std::string{"missing port in endpoint: "}+endpoint);
+        }
+        std::string host{host_port.substr(0, colon)};
+        std::string port{host_port.substr(colon+1)};
+
+        struct addrinfo hints;
+        ::memset(&hints, 0, sizeof(hints));
+        hints.ai_family    = AF_INET;
+        hints.ai_socktype  = SOCK_STREAM;
+        if( host == "*" )
+        {
+          hints.ai_flags = AI_PASSIVE;
+        }
+
+        struct addrinfo * res = nullptr;
+        if( ::getaddrinfo((host=="*"?nullptr:host.c_str()), port.c_str(), &hints, &res) != 0 || !res )
+        {
+          THROW_(std::string{"cannot resolve endpoint: "}+endpoint);
+        }
+
+        fd = ::socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        if( fd < 0 )
+        {
+          ::freeaddrinfo(res);
+          THROW_(std::string{"failed to create socket for: "}+endpoint);
+        }
+
+        int one = 1;
+        int rc = 0;
+        if( bind )
+        {
+          ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+          rc = ::bind(fd, res->ai_addr, res->ai_addrlen);
+          if( rc == 0 ) rc = ::listen(fd, 1);
+        }
+        else
+        {
+          rc = ::connect(fd, res->ai_addr, res->ai_addrlen);
+          if( rc == 0 ) ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        ::freeaddrinfo(res);
+
+        if( rc != 0 )
+        {
+          ::close(fd);
+          fd = -1;
+        }
+      }
+      else
+      {
+        THROW_(std::string{"unsupported endpoint: "}+endpoint);
+      }
+
+      return fd;
+    }
+
+    // the ZMTP frame header at p, false until all of it is there
+    bool
+    frame_header(const uint8_t * p,
+                 uint64_t avail,
+                 uint8_t & flags,
+                 uint64_t & len,
+                 uint64_t & hdr)
+    {
+      if( avail < 2 )
+        return false;
+
+      flags  = p[0];
+      len    = p[1];
+      hdr    = 2;
+      if( flags & zmq_gateway::FRAME_LONG )
+      {
+        if( avail < 9 )
+          return false;
+        len = 0;
+        for( int i=0; i<8; ++i )
+          len = (len << 8) | p[1+i];
+        hdr = 9;
+      }
+      return true;
+    }
+  }
+
+  zmq_gateway::batch::batch()
+  : bytes_{0},
+    messages_{0}
+  {
+  }
+
+  void
+  zmq_gateway::batch::clear()
+  {
+    frames_.clear();
+    bytes_     = 0;
+    messages_  = 0;
+    ids_.clear();
+    ends_.clear();
+    headers_.clear();
+  }
+
+  zmq_gateway::zmq_gateway(const std::string & path,
+                           const std::string & endpoint,
+                           bool bind,
+                           peer_side side,
+                           const queue::params & prms)
+  : simple_gateway{path,
+                   (side == LOCAL_CLIENTS ? path+"/1" : path+"/0"),
+                   (side == LOCAL_CLIENTS ? path+"/0" : path+"/1"),
+                   prms},
+    endpoint_{endpoint},
+    bind_{bind},
+    listen_fd_{-1},
+    fd_{-1},
+    stopped_{false},
+    batch_bytes_{64*1024},
+    batch_messages_{128},
+    rx_buffer_(1024*1024),
+    max_message_{256*1024*1024},
+    messages_out_{0},
+    messages_in_{0},
+    bytes_out_{0},
+    bytes_in_{0},
+    writes_{0},
+    inlined_oob_{0},
+    oversized_{0}
+  {
+    if( bind_ )
+    {
+      listen_fd_ = open_socket(endpoint_, true);
+      if( listen_fd_ < 0 )
+      {
+        THROW_(std::string{"failed to bind: "}+endpoint_);
+      }
+    }
+  }
+
+  zmq_gateway::~zmq_gateway()
+  {
+    if( listen_fd_ >= 0 )
+    {
+      ::close(listen_fd_);
+      if( endpoint_.compare(0, ipc_prefix.size(), ipc_prefix) == 0 )
+        ::unlink(endpoint_.substr(ipc_prefix.size()).c_str());
+    }
+  }
+
+  zmq_gateway::sptr
+  zmq_gateway::create(const std::string & path,
+                      const std::string & endpoint,
+                      bool bind,
+                      peer_side side,
+                      const queue::params & prms)
+  {
+    try
+    {
+      // quick try to initialize the channel we read from, which
+      // may not have been written by the local party yet
+      std::string channel{(side == LOCAL_CLIENTS ? path+"/0" : path+"/1")};
+      std::unique_ptr<queue::simple_publisher> tmp{new queue::simple_publisher{channel, prms}};
+    }
+    catch(...) { }
+
+    // this part may throw
+    sptr ret{new zmq_gateway{path, endpoint, bind, side, prms}};
+    return ret;
+  }
+
+  void
+  zmq_gateway::batch_limits(uint64_t bytes,
+                            uint64_t messages)
+  {
+    batch_bytes_     = (bytes ? bytes : 1);
+    // every message takes 4 iovecs
+    batch_messages_  = (messages ? messages : 1);
+    if( batch_messages_ > IOV_MAX/4 ) batch_messages_ = IOV_MAX/4;
+  }
+
+  void
+  zmq_gateway::set_max_message(uint64_t bytes)
+  {
+    max_message_ = (bytes > 1024 ? bytes : 1024);
+    if( rx_buffer_.size() > max_message_ )
+      rx_buffer_.resize(max_message_);
+  }
+
+  int
+  zmq_gateway::connect_peer()
+  {
+    while( !is_stopped() )
+    {
+      if( bind_ )
+      {
+        struct pollfd pfd{listen_fd_, POLLIN, 0};
+        if( ::poll(&pfd, 1, 100) == 1 )
+        {
+          int fd = ::accept(listen_fd_, nullptr, nullptr);
+          if( fd >= 0 )
+          {
+            int one = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            return fd;
+          }
+        }
+      }
+      else
+      {
+        int fd = open_socket(endpoint_, false);
+        if( fd >= 0 )
+          return fd;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      }
+    }
+    return -1;
+  }
+
+  void
+  zmq_gateway::add_frame(const uint8_t * ptr,
+                         uint64_t len,
+                         bool more)
+  {
+    frame f;
+    f.data_ = ptr;
+    f.len_  = len;
+    f.prefix_[0] = (more ? FRAME_MORE : 0);
+    if( len > 255 )
+    {
+      f.prefix_[0] |= FRAME_LONG;
+      for( int i=0; i<8; ++i )
+        f.prefix_[1+i] = (uint8_t)(len >> (56-8*i));
+      f.prefix_len_ = 9;
+    }
+    else
+    {
+      f.prefix_[1]   = (uint8_t)len;
+      f.prefix_len_  = 2;
+    }
+    batch_.frames_.push_back(f);
+    batch_.bytes_ += len + f.prefix_len_;
+  }
+
+  bool
+  zmq_gateway::add_inlined(const uint8_t * ptr,
+                           uint64_t len,
+                           stream_part & part)
+  {
+    if( !map_oob(part) )
+      return false;
+    bool intact = verify_part(ptr, len, part);
+    inlined_ids_.push_back(part.id_);
+
+    // the header up to the descriptor, without FLAG_OOB
+    batch_.headers_.emplace_back(ptr, ptr+part.oob_at_);
+    std::vector<uint8_t> & header = batch_.headers_.back();
+    header[0] &= ~FLAG_OOB;
+    if( part.flags_ & FLAG_CRC )
+    {
+      uint64_t after = part.crc_offset_ + 4;
+      uint32_t crc = crc32c(0, header.data(), part.crc_offset_);
+      crc = crc32c(crc, header.data()+after, header.size()-after);
+      crc = crc32c(crc, part.buffer_, part.size_);
+      // a corrupt segment must still fail the peer's check
+      if( !intact )
+        crc = ~crc;
+      for( int i=0; i<4; ++i )
+        header[part.crc_offset_+i] = (uint8_t)(crc >> (8*i));
+    }
+
+    add_frame(header.data(), header.size(), true);
+    add_frame(part.buffer_, part.size_, false);
+    return true;
+  }
+
+  bool
+  zmq_gateway::write_all(struct iovec * iov,
+                         int count,
+                         uint64_t & written)
+  {
+    written = 0;
+    int fd = fd_.load();
+    while( count > 0 && fd >= 0 )
+    {
+      struct msghdr msg;
+      ::memset(&msg, 0, sizeof(msg));
+      msg.msg_iov     = iov;
+      msg.msg_iovlen  = (count > IOV_MAX ? IOV_MAX : count);
+
+      ssize_t rc = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+      if( rc < 0 )
+      {
+        if( errno == EINTR ) continue;
+        return false;
+      }
+      ++writes_;
+      written += (uint64_t)rc;
+
+      // skip the fully written buffers and adjust the partial one
+      uint64_t left = (uint64_t)rc;
+      while( count > 0 && left >= iov->iov_len )
+      {
+        left -= iov->iov_len;
+        ++iov;
+        --count;
+      }
+      if( count > 0 )
+      {
+        iov->iov_base  = ((uint8_t *)iov->iov_base) + left;
+        iov->iov_len  -= left;
+      }
+    }
+    return (count == 0);
+  }
+
+  bool
+  zmq_gateway::flush(uint64_t & resend_from)
+  {
+    if( batch_.frames_.empty() )
+      return true;
+
+    // the payload iovecs point straight into the queue mapping
+    std::vector<struct iovec> iov;
+    iov.reserve(batch_.frames_.size()*2);
+    for( auto & f : batch_.frames_ )
+    {
+      iov.push_back(iovec{f.prefix_, f.prefix_len_});
+      if( f.len_ > 0 )
+        iov.push_back(iovec{(void *)f.data_, (size_t)f.len_});
+    }
+
+    uint64_t written = 0;
+    bool ret = write_all(iov.data(), (int)iov.size(), written);
+
+    // the messages that fully reached the socket are not sent again, the
+    // peer drops a partial one with the connection
+    uint64_t sent = 0;
+    while( sent < batch_.messages_ && batch_.ends_[sent] <= written )
+      ++sent;
+    if( !ret )
+      resend_from = batch_.ids_[sent];
+    messages_out_ += sent;
+    bytes_out_    += (sent ? batch_.ends_[sent-1] : 0);
+    batch_.clear();
+
+    // the segments of a failed batch stay, its parts are resent
+    if( ret )
+    {
+      for( auto id : inlined_ids_ )
+        release_oob(id);
+      inlined_ids_.clear();
+    }
+    return ret;
+  }
+
+  void
+  zmq_gateway::receive_loop()
+  {
+    using namespace virtdb::queue;
+
+    uint64_t have = 0;
+    // the rest of a message over the limit is read and dropped: closing
+    // the connection would only make the peer resend it
+    bool     skipping   = false;
+    uint64_t skip       = 0;
+    bool     skip_more  = false;
+    while( !is_stopped() )
+    {
+      int fd = fd_.load();
+      if( fd < 0 )
+        break;
+
+      struct pollfd pfd{fd, POLLIN, 0};
+      int prc = ::poll(&pfd, 1, 100);
+      if( prc == 0 || (prc < 0 && errno == EINTR) )
+        continue;
+
+      ssize_t rc = -1;
+      if( prc > 0 )
+        rc = ::recv(fd, rx_buffer_.data()+have, rx_buffer_.size()-have, 0);
+      if( rc < 0 && errno == EINTR )
+        continue;
+      if( rc <= 0 )
+      {
+        // peer went away, let the sender side reconnect
+        fd_ = -1;
+        break;
+      }
+      have += (uint64_t)rc;
+
+      // push all complete multipart messages straight out of the receive buffer
+      const uint8_t * buf = rx_buffer_.data();
+      uint64_t done = 0;
+      while( true )
+      {
+        if( skipping )
+        {
+          uint64_t n = std::min(skip, have-done);
+          done += n;
+          skip -= n;
+          if( skip > 0 )
+            break;
+          if( skip_more )
+          {
+            // the next frame of the dropped message
+            uint8_t flags = 0;
+            uint64_t len = 0, hdr = 0;
+            if( !frame_header(buf+done, have-done, flags, len, hdr) )
+              break;
+            done      += hdr;
+            skip       = len;
+            skip_more  = (flags & FRAME_MORE);
+            continue;
+          }
+          skipping = false;
+        }
+
+        simple_publisher::buffer_vector parts;
+        uint64_t pos       = done;
+        uint64_t msg_bytes = 0;
+        bool complete      = false;
+
+        while( true )
+        {
+          // a peer can't make us buffer without bounds, not even the
+          // header of a frame that can't fit
+          uint64_t need = ((have > pos && (buf[pos] & FRAME_LONG)) ? 9 : 2);
+          if( pos-done+need > max_message_ )
+          {
+            ++oversized_;
+            skipping   = true;
+            skip       = 0;
+            skip_more  = true;
+            break;
+          }
+
+          uint8_t  flags  = 0;
+          uint64_t len    = 0;
+          uint64_t hdr    = 0;
+          if( !frame_header(buf+pos, have-pos, flags, len, hdr) )
+            break;
+
+          if( pos-done+hdr+len > max_message_ )
+          {
+            ++oversized_;
+            skipping   = true;
+            skip       = len;
+            skip_more  = (flags & FRAME_MORE);
+            pos       += hdr;
+            break;
+          }
+          if( have-pos-hdr < len ) break;
+
+          if( len > 0 )
+            parts.push_back(simple_publisher::buffer{buf+pos+hdr, len});
+          pos       += hdr+len;
+          msg_bytes += len;
+
+          if( !(flags & FRAME_MORE) )
+          {
+            complete = true;
+            break;
+          }
+        }
+
+        // the frames before the one over the limit go with it
+        if( skipping )
+        {
+          done = pos;
+          continue;
+        }
+        if( !complete )
+          break;
+
+        if( msg_bytes > 0 )
+        {
+          send_data(parts);
+          ++messages_in_;
+          bytes_in_ += msg_bytes;
+        }
+        done = pos;
+      }
+
+      // keep the partial message at the beginning of the buffer
+      if( done > 0 )
+      {
+        ::memmove(rx_buffer_.data(), rx_buffer_.data()+done, have-done);
+        have -= done;
+      }
+      // a message within the limit fits once the buffer has grown to it
+      if( have == rx_buffer_.size() )
+        rx_buffer_.resize(std::min(rx_buffer_.size()*2, (size_t)max_message_));
+    }
+  }
+
+  void
+  zmq_gateway::run(uint64_t from)
+  {
+    while( !is_stopped() )
+    {
+      int fd = connect_peer();
+      if( fd < 0 )
+        break;
+      fd_ = fd;
+
+      std::thread rx{[this](){ receive_loop(); }};
+
+      bool      failed       = false;
+      uint64_t  resend_from  = from;
+
+      // parts are not copied, the frames point into the queue mapping. a
+      // segment stays mapped until the writer's cleanup_all_before()
+      // passes it, which waits for our consumed position. that moves past
+      // a batch only once flush() wrote it, after pull_data() returned
+      auto pull = [&](uint64_t msg_id,
+                      const uint8_t * ptr,
+                      uint64_t len)
+      {
+        stream_part part;
+        uint64_t header_len = len;
+        bool parsed = parse_part(ptr, len, part);
+
+        // the peer has no access to the segment file, its bytes go inline.
+        // a segment that can't be mapped is relayed as it is and fails there
+        if( parsed && (part.flags_ & FLAG_OOB) && add_inlined(ptr, len, part) )
+        {
+          ++inlined_oob_;
+        }
+        else
+        {
+          // everything before the payload, segment table included
+          if( parsed && part.buffer_ )
+            header_len = (uint64_t)(part.buffer_ - ptr);
+
+          add_frame(ptr, header_len, true);
+          add_frame(ptr+header_len, len-header_len, false);
+        }
+        ++batch_.messages_;
+        batch_.ids_.push_back(msg_id);
+        batch_.ends_.push_back(batch_.bytes_);
+
+        if( batch_.bytes_    >= batch_bytes_ ||
+            batch_.messages_ >= batch_messages_ )
+        {
+          if( !flush(resend_from) )
+          {
+            // resend what did not fully go out after reconnecting
+            failed = true;
+            return false;
+          }
+        }
+        return !is_stopped();
+      };
+
+      while( !is_stopped() )
+      {
+        uint64_t next = pull_data(from, pull, 100);
+        if( failed )
+        {
+          from = resend_from;
+          break;
+        }
+
+        if( batch_.messages_ > 0 )
+        {
+          if( !flush(from) )
+            break;
+        }
+        // only what reached the socket, a reconnect resends the rest
+        from = next;
+        set_consumed(from);
+
+        if( fd_.load() < 0 )
+          break;
+      }
+
+      // tear down the connection and wait for the receiver
+      ::shutdown(fd, SHUT_RDWR);
+      fd_ = -1;
+      rx.join();
+      ::close(fd);
+    }
+  }
+
+  void
+  zmq_gateway::stop()
+  {
+    stopped_ = true;
+  }
+
+  bool
+  zmq_gateway::is_stopped() const
+  {
+    return stopped_.load();
+  }
+
+  uint64_t zmq_gateway::messages_out() const  { return messages_out_.load(); }
+  uint64_t zmq_gateway::messages_in() const   { return messages_in_.load(); }
+  uint64_t zmq_gateway::bytes_out() const     { return bytes_out_.load(); }
+  uint64_t zmq_gateway::bytes_in() const      { return bytes_in_.load(); }
+  uint64_t zmq_gateway::writes() const        { return writes_.load(); }
+  uint64_t zmq_gateway::inlined_oob() const   { return inlined_oob_.load(); }
+  uint64_t zmq_gateway::oversized() const     { return oversized_.load(); }
+
 }}
@@ -1,19 +1,137 @@
 #pragma once
 
+#include <gateway/simple_gateway.hh>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <deque>
+
+// C libs
+#include <sys/uio.h>
+
 namespace virtdb { namespace gateway {
-  
-  class zmq_gateway
+
+  // relays the stream parts of a local simple_gateway queue pair over a
+  // socket to a remote zmq_gateway. the framing follows ZMTP: every queue
+  // message is sent as a two frame multipart message (header + payload)
+  //
+  // endpoints:
+  //  - tcp://host:port
+  //  - ipc:///path/to/socket
+  class zmq_gateway : public simple_gateway
   {
-    // disable default construction
-    // zmq_gateway() = delete;
-    
-    // disable copying until properly implemented
-    zmq_gateway(const zmq_gateway &) = delete;
-    zmq_gateway & operator=(const zmq_gateway &) = delete;
-    
   public:
-    zmq_gateway();
+    typedef std::shared_ptr<zmq_gateway> sptr;
+
+    // the local party the relay stands in for
+    enum peer_side {
+      LOCAL_CLIENTS,  // reads path/0, writes path/1, like a simple_server
+      LOCAL_SERVER,   // reads path/1, writes path/0, like a simple_client
+    };
+
+    // ZMTP frame flags
+    static const uint8_t FRAME_MORE  = 0x01;
+    static const uint8_t FRAME_LONG  = 0x02;
+
+  private:
+    struct frame
+    {
+      uint8_t          prefix_[9];
+      uint8_t          prefix_len_;
+      const uint8_t *  data_;
+      uint64_t         len_;
+    };
+
+    // outgoing parts are collected here and written with a single sendmsg().
+    // the queue position of every message and the batch bytes at its end
+    // tell where to resend from after a partial write. rewritten headers
+    // of inlined out-of-band parts are kept here until the batch is sent
+    struct batch
+    {
+      std::vector<frame>                 frames_;
+      uint64_t                           bytes_;
+      uint64_t                           messages_;
+      std::vector<uint64_t>              ids_;
+      std::vector<uint64_t>              ends_;
+      std::deque<std::vector<uint8_t>>   headers_;
+
+      batch();
+      void clear();
+    };
+
+    std::string             endpoint_;
+    bool                    bind_;
+    int                     listen_fd_;
+    std::atomic<int>        fd_;
+    std::atomic<bool>       stopped_;
+    uint64_t                batch_bytes_;
+    uint64_t                batch_messages_;
+    batch                   batch_;
+    std::vector<uint8_t>    rx_buffer_;
+    uint64_t                max_message_;
+    // streams with mapped segments, released when a batch is fully sent
+    std::vector<uint64_t>   inlined_ids_;
+
+    std::atomic<uint64_t>   messages_out_;
+    std::atomic<uint64_t>   messages_in_;
+    std::atomic<uint64_t>   bytes_out_;
+    std::atomic<uint64_t>   bytes_in_;
+    std::atomic<uint64_t>   writes_;
+    std::atomic<uint64_t>   inlined_oob_;
+    std::atomic<uint64_t>   oversized_;
+
+    int connect_peer();
+    bool flush(uint64_t & resend_from);
+    bool write_all(struct iovec * iov,
+                   int count,
+                   uint64_t & written);
+    void add_frame(const uint8_t * ptr, uint64_t len, bool more);
+    bool add_inlined(const uint8_t * ptr,
+                     uint64_t len,
+                     stream_part & part);
+    void receive_loop();
+
+  protected:
+    zmq_gateway(const std::string & path,
+                const std::string & endpoint,
+                bool bind,
+                peer_side side,
+                const queue::params & prms);
+
+  public:
     virtual ~zmq_gateway();
+    static sptr create(const std::string & path,
+                       const std::string & endpoint,
+                       bool bind,
+                       peer_side side,
+                       const queue::params & prms=queue::params());
+
+    // small parts are batched until either limit is reached
+    void batch_limits(uint64_t bytes,
+                      uint64_t messages);
+
+    // an incoming message, frame prefixes included, may not be larger.
+    // the receive buffer grows up to this, a larger message is read and
+    // dropped. 256 MB by default, before run()
+    void set_max_message(uint64_t bytes);
+
+    // relays in both directions until stop() is called
+    void run(uint64_t from=0);
+    void stop();
+    bool is_stopped() const;
+
+    // statistics
+    uint64_t messages_out() const;
+    uint64_t messages_in() const;
+    uint64_t bytes_out() const;
+    uint64_t bytes_in() const;
+    uint64_t writes() const;
+    // out-of-band parts point at a local segment file the peer can't
+    // open, they are sent with the segment's bytes as payload
+    uint64_t inlined_oob() const;
+    // messages dropped for being over the limit
+    uint64_t oversized() const;
   };
-  
+
 }}
@@ -0,0 +1,1393 @@
+#include <gateway/simple_gateway.hh>
+#include <gateway/zmq_gateway.hh>
+#include <gateway/striped_gateway.hh>
+#include <gateway/fanout_gateway.hh>
+#include <gateway/virtdb_gateway.hh>
+#include <gateway/pb_wire.hh>
+#include <gateway/pushdown.hh>
+#include <gateway/crc32c.hh>
+#include <gateway/placement.hh>
+#include <gateway/column_frame.hh>
+#include <gateway/duplex_stream.hh>
+#include <gateway/gateway_pool.hh>
+// std
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace virtdb::gateway;
+using namespace virtdb::fsm;
+using namespace virtdb::queue;
+
+namespace virtdb { namespace bench {
+
+  typedef std::chrono::steady_clock               clock_type;
+  typedef std::function<void()>                   bench_fun;
+  typedef std::map<std::string, bench_fun>        bench_map;
+
+  auto no_trace = [](uint16_t seqno,
+                     const std::string & desc,
+                     const fsm::transition & trans,
+                     const fsm::state_machine & sm) {};
+
+  double
+  seconds_since(const clock_type::time_point & start)
+  {
+    return std::chrono::duration<double>(clock_type::now()-start).count();
+  }
+
+  void
+  report(const std::string & name,
+         uint64_t messages,
+         uint64_t bytes,
+         double seconds)
+  {
+    std::cout << std::left << std::setw(40) << name << std::right
+              << std::setw(12) << (uint64_t)(messages/seconds) << " msg/s "
+              << std::setw(10) << std::fixed << std::setprecision(1)
+              << (bytes/seconds/1024.0/1024.0) << " MB/s\n";
+  }
+
+  // sends count single part messages of the given size through the client
+  void
+  push_messages(simple_client & client,
+                uint64_t count,
+                const std::vector<uint8_t> & payload)
+  {
+    auto feeder = [&](simple_gateway::stream_part & p) {
+      p.buffer_  = payload.data();
+      p.size_    = payload.size();
+      return false;
+    };
+    state_machine::sptr fsm { new state_machine{"BenchClient", no_trace} };
+    for( uint64_t i=0; i<count; ++i )
+    {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      client.start(1, feeder, fsm, { 0 }, info);
+    }
+  }
+
+  // waits until count messages arrive at the given queue
+  void
+  drain_messages(simple_subscriber & sub,
+                 uint64_t count)
+  {
+    uint64_t seen = 0;
+    uint64_t from = sub.position();
+    auto pull = [&](uint64_t msg_id,
+                    const uint8_t * ptr,
+                    uint64_t len) {
+      ++seen;
+      return seen < count;
+    };
+    while( seen < count )
+      from = sub.pull(from, pull, 1000);
+  }
+
+  void
+  local_queue_throughput(uint64_t size,
+                         uint64_t count)
+  {
+    std::string path{"/tmp/GatewayBench.LocalQueue"};
+    auto client = simple_client::create(path);
+    simple_subscriber sub{path+"/0"};
+    sub.seek_to_end();
+
+    std::vector<uint8_t> payload(size, 'x');
+    auto start = clock_type::now();
+    std::thread reader{[&](){ drain_messages(sub, count); }};
+    push_messages(*client, count, payload);
+    reader.join();
+    report("local queue "+std::to_string(size)+"B", count, count*size, seconds_since(start));
+  }
+
+  void
+  zmq_loopback_throughput(const std::string & endpoint,
+                          uint64_t size,
+                          uint64_t count)
+  {
+    std::string client_path{"/tmp/GatewayBench.ZmqLoopback.Client"};
+    std::string server_path{"/tmp/GatewayBench.ZmqLoopback.Server"};
+
+    auto client_relay = zmq_gateway::create(client_path, endpoint, true,  zmq_gateway::LOCAL_CLIENTS);
+    auto server_relay = zmq_gateway::create(server_path, endpoint, false, zmq_gateway::LOCAL_SERVER);
+    client_relay->seek_to_end();
+    server_relay->seek_to_end();
+
+    auto client = simple_client::create(client_path);
+    simple_subscriber sub{server_path+"/0"};
+    sub.seek_to_end();
+
+    std::thread client_relay_thr{[client_relay](){ client_relay->run(client_relay->receiver_position()); }};
+    std::thread server_relay_thr{[server_relay](){ server_relay->run(server_relay->receiver_position()); }};
+
+    std::vector<uint8_t> payload(size, 'x');
+    auto start = clock_type::now();
+    std::thread reader{[&](){ drain_messages(sub, count); }};
+    push_messages(*client, count, payload);
+    reader.join();
+    double secs = seconds_since(start);
+
+    client_relay->stop();
+    server_relay->stop();
+    client_relay_thr.join();
+    server_relay_thr.join();
+
+    report(endpoint.substr(0,6)+" relay "+std::to_string(size)+"B ("+
+           std::to_string(client_relay->messages_out()/(client_relay->writes()?client_relay->writes():1))+
+           " msg/write)", count, count*size, secs);
+  }
+
+  void
+  zmq_vs_local()
+  {
+    for( uint64_t size : { 64, 1024, 64*1024 } )
+    {
+      uint64_t count = std::min<uint64_t>(100000, (128*1024*1024)/size);
+      local_queue_throughput(size, count);
+      zmq_loopback_throughput("ipc:///tmp/GatewayBench.ZmqLoopback.sock", size, count);
+      zmq_loopback_throughput("tcp://127.0.0.1:17311", size, count);
+    }
+  }
+
+  // a column block of the given kind with rows values
+  std::string
+  make_column(uint32_t kind,
+              uint64_t rows)
+  {
+    std::string value;
+    pb_writer w{value};
+    w.varint_field(1, kind);
+    if( kind == value_view::STRING )
+    {
+      for( uint64_t i=0; i<rows; ++i )
+        w.string_field(2, "value-"+std::to_string(i));
+    }
+    else
+    {
+      std::string packed;
+      pb_writer pw{packed};
+      for( uint64_t i=0; i<rows; ++i )
+      {
+        if( kind == value_view::DOUBLE )
+        {
+          double d = i * 1.5;
+          packed.append((const char *)&d, sizeof(d));
+        }
+        else
+        {
+          pw.varint(i*12345);
+        }
+      }
+      w.bytes_field((kind == value_view::DOUBLE ? 7 : 4), packed.data(), packed.size());
+    }
+    
+    std::string ret;
+    pb_writer cw{ret};
+    cw.string_field(1, "bench-query");
+    cw.string_field(2, "column");
+    cw.string_field(3, value);
+    cw.varint_field(4, 1);
+    return ret;
+  }
+
+  void
+  virtdb_decode()
+  {
+    const uint64_t rows = 10000;
+    for( uint32_t kind : { value_view::INT64, value_view::DOUBLE, value_view::STRING } )
+    {
+      std::string msg{make_column(kind, rows)};
+      const uint8_t * ptr = (const uint8_t *)msg.data();
+      uint64_t iterations = (512*1024*1024) / msg.size();
+      std::string kind_name{kind == value_view::INT64 ? "int64" : kind == value_view::DOUBLE ? "double" : "string"};
+
+      // arena, aliased strings
+      {
+        arena a;
+        std::atomic<uint64_t> checksum{0};
+        auto start = clock_type::now();
+        for( uint64_t i=0; i<iterations; ++i )
+        {
+          column_view column;
+          virtdb_gateway::decode_column(ptr, msg.size(), a, column);
+          checksum += column.data_.int64s_.size() + column.data_.doubles_.size() + column.data_.strings_.size();
+          a.reset();
+        }
+        report("decode arena "+kind_name+" ("+std::to_string(checksum/iterations)+" rows)",
+               iterations, iterations*msg.size(), seconds_since(start));
+      }
+
+      // the same with freshly allocated containers, like a per part message object
+      {
+        uint64_t checksum = 0;
+        auto start = clock_type::now();
+        for( uint64_t i=0; i<iterations; ++i )
+        {
+          arena a{256};
+          column_view column;
+          virtdb_gateway::decode_column(ptr, msg.size(), a, column);
+          std::vector<int64_t>      ints{column.data_.int64s_.begin(), column.data_.int64s_.end()};
+          std::vector<double>       doubles{column.data_.doubles_.begin(), column.data_.doubles_.end()};
+          std::vector<std::string>  strings;
+          for( auto & sv : column.data_.strings_ ) strings.push_back(sv.str());
+          checksum += ints.size() + doubles.size() + strings.size();
+        }
+        report("decode heap  "+kind_name+" ("+std::to_string(checksum/iterations)+" rows)",
+               iterations, iterations*msg.size(), seconds_since(start));
+      }
+    }
+  }
+
+  // sums a column block: decoded from the virtdb message into the arena,
+  // or read in place from a column frame
+  void
+  frame_scan()
+  {
+    const uint64_t rows = 10000;
+    for( uint32_t kind : { value_view::INT64, value_view::DOUBLE, value_view::STRING } )
+    {
+      std::string kind_name{kind == value_view::INT64 ? "int64" : kind == value_view::DOUBLE ? "double" : "string"};
+      uint64_t iterations = 20000;
+
+      {
+        std::string msg{make_column(kind, rows)};
+        arena a;
+        double sum = 0;
+        auto start = clock_type::now();
+        for( uint64_t i=0; i<iterations; ++i )
+        {
+          column_view column;
+          virtdb_gateway::decode_column((const uint8_t *)msg.data(), msg.size(), a, column);
+          for( int64_t v : column.data_.int64s_ ) sum += v;
+          for( double v : column.data_.doubles_ ) sum += v;
+          for( auto & v : column.data_.strings_ ) sum += v.size_;
+          a.reset();
+        }
+        report("decoded "+kind_name+" (sum "+std::to_string((uint64_t)sum % 1000)+")",
+               iterations, iterations*msg.size(), seconds_since(start));
+      }
+
+      {
+        column_frame_writer writer{rows};
+        std::vector<int64_t> ints(rows);
+        std::vector<double> doubles(rows);
+        std::vector<std::string> strings(rows);
+        for( uint64_t i=0; i<rows; ++i )
+        {
+          ints[i]     = i*12345;
+          doubles[i]  = i*1.5;
+          strings[i]  = "value-"+std::to_string(i);
+        }
+        if( kind == value_view::INT64 )       writer.add_column("column", ints.data());
+        else if( kind == value_view::DOUBLE ) writer.add_column("column", doubles.data());
+        else                                  writer.add_strings("column", strings.data());
+        const std::vector<uint8_t> & frame = writer.finish();
+
+        column_frame_reader reader;
+        double sum = 0;
+        auto start = clock_type::now();
+        for( uint64_t i=0; i<iterations; ++i )
+        {
+          reader.parse(frame.data(), frame.size());
+          for( int64_t v : reader.values<int64_t>(0) ) sum += v;
+          for( double v : reader.values<double>(0) ) sum += v;
+          if( reader.offsets(0).size() > 0 )
+            for( uint64_t r=0; r<rows; ++r ) sum += reader.string(0, r).size_;
+        }
+        report("frame   "+kind_name+" (sum "+std::to_string((uint64_t)sum % 1000)+")",
+               iterations, iterations*frame.size(), seconds_since(start));
+      }
+    }
+  }
+
+  // filters a value block with a ~50% selective predicate and gathers the rows
+  void
+  pushdown_block(const std::string & name,
+                 const value_view & value,
+                 const pushdown::predicate & p)
+  {
+    arena a{16*1024*1024};
+    uint64_t n = pushdown::rows(value);
+    uint64_t iterations = 200;
+    uint64_t selected = 0;
+    auto start = clock_type::now();
+    for( uint64_t i=0; i<iterations; ++i )
+    {
+      uint8_t * mask = a.allocate_array<uint8_t>(n);
+      ::memset(mask, 1, n);
+      pushdown::evaluate(value, p, a, mask);
+      uint32_t * sel = a.allocate_array<uint32_t>(n);
+      uint64_t k = pushdown::build_selection(mask, n, sel);
+      value_view out;
+      pushdown::apply(value, sel, k, a, out);
+      selected += k;
+      a.reset();
+    }
+    double secs = seconds_since(start);
+    std::cout << std::left << std::setw(40) << ("pushdown "+name) << std::right
+              << std::setw(12) << (uint64_t)(iterations*n/secs) << " rows/s "
+              << std::setw(10) << (selected/iterations) << " selected/block\n";
+  }
+
+  void
+  pushdown_kernels()
+  {
+    const uint64_t rows = 1000000;
+
+    std::vector<int32_t> int32s(rows);
+    std::vector<int64_t> int64s(rows);
+    std::vector<double> doubles(rows);
+    std::vector<std::string> strings(rows);
+    std::vector<bytes_view> string_views(rows);
+    for( uint64_t i=0; i<rows; ++i )
+    {
+      int32s[i]   = (int32_t)((i * 7919) % 1000);
+      int64s[i]   = int32s[i];
+      doubles[i]  = int32s[i] / 10.0;
+      strings[i]  = std::to_string(int32s[i]);
+      string_views[i] = bytes_view{(const uint8_t *)strings[i].data(), strings[i].size()};
+    }
+
+    value_view v;
+    v.kind_ = value_view::INT32;
+    v.int32s_ = array_view<int32_t>{int32s.data(), rows};
+    pushdown_block("int32 >", v, pushdown::predicate{"c", pushdown::OP_GT, {500}, {}, {}});
+    pushdown_block("int32 IN(3)", v, pushdown::predicate{"c", pushdown::OP_IN, {1, 500, 999}, {}, {}});
+
+    v = value_view{};
+    v.kind_ = value_view::INT64;
+    v.int64s_ = array_view<int64_t>{int64s.data(), rows};
+    pushdown_block("int64 >", v, pushdown::predicate{"c", pushdown::OP_GT, {500}, {}, {}});
+
+    v = value_view{};
+    v.kind_ = value_view::DOUBLE;
+    v.doubles_ = array_view<double>{doubles.data(), rows};
+    pushdown_block("double >", v, pushdown::predicate{"c", pushdown::OP_GT, {}, {50.0}, {}});
+
+    v = value_view{};
+    v.kind_ = value_view::STRING;
+    v.strings_ = array_view<bytes_view>{string_views.data(), rows};
+    pushdown_block("string >", v, pushdown::predicate{"c", pushdown::OP_GT, {}, {}, {"500"}});
+  }
+
+  // producer threads sharing one client, serialized by an outside
+  // mutex or using the concurrent send mode
+  void
+  shared_client_send(uint64_t threads,
+                     bool concurrent)
+  {
+    std::string path{"/tmp/GatewayBench.SharedClient"};
+    uint64_t per_thread = 200000/threads;
+    uint64_t count = per_thread*threads;
+
+    simple_gateway::options opts;
+    opts.concurrent_send_ = concurrent;
+    auto client = simple_client::create(path, params(), opts);
+    simple_subscriber sub{path+"/0"};
+    sub.seek_to_end();
+
+    std::vector<uint8_t> payload(64, 'x');
+    std::mutex mtx;
+    auto start = clock_type::now();
+    std::thread reader{[&](){ drain_messages(sub, count); }};
+    std::vector<std::thread> producers;
+    for( uint64_t t=0; t<threads; ++t )
+    {
+      producers.push_back(std::thread{[&](){
+        auto feeder = [&](simple_gateway::stream_part & p) {
+          p.buffer_  = payload.data();
+          p.size_    = payload.size();
+          return false;
+        };
+        state_machine::sptr fsm { new state_machine{"BenchClient", no_trace} };
+        for( uint64_t i=0; i<per_thread; ++i )
+        {
+          simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+          if( concurrent )
+          {
+            client->start(1, feeder, fsm, { 0 }, info);
+          }
+          else
+          {
+            std::lock_guard<std::mutex> lock{mtx};
+            client->start(1, feeder, fsm, { 0 }, info);
+          }
+        }
+      }});
+    }
+    for( auto & p : producers )
+      p.join();
+    reader.join();
+    report(std::string{concurrent ? "combining " : "mutex "}+std::to_string(threads)+" threads",
+           count, count*payload.size(), seconds_since(start));
+  }
+
+  void
+  concurrent_send()
+  {
+    for( uint64_t threads : { 1, 2, 4, 8 } )
+    {
+      shared_client_send(threads, false);
+      shared_client_send(threads, true);
+    }
+  }
+
+  // one bulk stream over K stripes, the handler only touches the parts
+  void
+  striped_transfer(uint32_t stripes,
+                   uint64_t part_size,
+                   uint64_t parts)
+  {
+    std::string path{"/tmp/GatewayBench.Striped."+std::to_string(stripes)};
+    std::atomic<bool> done{false};
+    std::atomic<uint64_t> checksum{0};
+
+    auto server = striped_server::create(path, stripes, params(), no_trace);
+    server->seek_to_end();
+    auto new_stream = [&](const simple_gateway::stream_part & start,
+                          state_machine::trace_fun trace_cb) {
+      state_machine::sptr fsm { new state_machine{"BenchStripedServer", trace_cb} };
+      action::sptr touch{new action{[&](uint16_t seqno, transition & tran, state_machine & sm) {
+        const simple_gateway::stream_part & p = server->current_part();
+        checksum += p.buffer_[0] + p.buffer_[p.size_-1];
+        if( p.event_ == simple_gateway::EV_END ) done = true;
+      }, "TOUCH"}};
+      transition::sptr start_ {new transition{0, simple_gateway::EV_START, 1, "First part"}};
+      transition::sptr next   {new transition{1, simple_gateway::EV_NEXT,  1, "Next part"}};
+      transition::sptr end    {new transition{1, simple_gateway::EV_END,   2, "Last part"}};
+      for( auto & t : { start_, next, end } )
+      {
+        t->set_action(1, touch);
+        fsm->add_transition(t);
+      }
+      return fsm;
+    };
+    server->add_handler(1, new_stream, { 2 }, [](uint64_t id) {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      info->id_ = id;
+      return info;
+    });
+    std::thread server_thr{[server](){ server->run(); }};
+
+    auto client = striped_client::create(path, stripes);
+    std::vector<uint8_t> payload(part_size, 'x');
+    auto start = clock_type::now();
+    client->start(1, parts, [&](uint64_t seqno, simple_gateway::stream_part & p) {
+      p.buffer_  = payload.data();
+      p.size_    = payload.size();
+    });
+    while( !done )
+      std::this_thread::yield();
+    double secs = seconds_since(start);
+
+    server->stop();
+    server_thr.join();
+    report(std::to_string(stripes)+" stripes "+std::to_string(part_size/1024)+"KB parts ("+
+           std::to_string(server->held_parts())+" held)", parts, parts*part_size, secs);
+  }
+
+  void
+  striped_bulk()
+  {
+    for( uint32_t stripes : { 1, 2, 4, 8 } )
+      striped_transfer(stripes, 64*1024, 1024);
+  }
+
+  // one publisher, every subscriber reads all messages on its own thread
+  void
+  fanout_delivery(uint64_t subscribers,
+                  uint64_t size,
+                  uint64_t count)
+  {
+    std::string path{"/tmp/GatewayBench.Fanout."+std::to_string(subscribers)};
+    auto publisher = fanout_publisher::create(path);
+
+    std::vector<fanout_subscriber::sptr> subs;
+    for( uint64_t i=0; i<subscribers; ++i )
+    {
+      subs.push_back(fanout_subscriber::create(path, "sub-"+std::to_string(i)));
+      subs.back()->seek_to_end();
+    }
+
+    std::vector<uint8_t> payload(size, 'x');
+    auto start = clock_type::now();
+    std::vector<std::thread> readers;
+    for( auto & sub : subs )
+    {
+      readers.push_back(std::thread{[&,sub](){
+        uint64_t seen = 0;
+        while( seen < count )
+          sub->poll([&](const simple_gateway::stream_part & p) { return ++seen < count; }, 1000);
+      }});
+    }
+    for( uint64_t i=0; i<count; ++i )
+    {
+      publisher->publish(1, [&](simple_gateway::stream_part & p) {
+        p.buffer_  = payload.data();
+        p.size_    = payload.size();
+        return false;
+      });
+    }
+    for( auto & r : readers )
+      r.join();
+
+    // delivered messages, each written once
+    report(std::to_string(subscribers)+" subscribers "+std::to_string(size)+"B",
+           count*subscribers, count*subscribers*size, seconds_since(start));
+  }
+
+  void
+  fanout()
+  {
+    for( uint64_t subscribers : { 1, 8, 32 } )
+      fanout_delivery(subscribers, 1024, 50000);
+  }
+
+  // counts the bytes of a stream, the coroutine twin of the FSM below
+  class touch_parts : public stream_coroutine
+  {
+    std::atomic<uint64_t> &  bytes_;
+
+  public:
+    touch_parts(const simple_gateway::stream_part & start,
+                std::atomic<uint64_t> & bytes)
+    : bytes_(bytes) {}
+
+    bool resume(simple_server & server,
+                const simple_gateway::stream_part & part)
+    {
+      GATEWAY_CO_BEGIN;
+      while( true )
+      {
+        bytes_ += part.size_;
+        if( part.event_ == simple_gateway::EV_END || part.event_ == simple_gateway::EV_ONE )
+          break;
+        GATEWAY_CO_AWAIT;
+      }
+      GATEWAY_CO_END;
+    }
+  };
+
+  // the same queued streams handled by FSM or coroutine handlers
+  void
+  handler_style(bool coroutine)
+  {
+    std::string path{"/tmp/GatewayBench.Handlers"};
+    const uint64_t streams  = 20000;
+    const uint64_t parts    = 8;
+
+    std::atomic<uint64_t> bytes{0};
+    std::vector<uint8_t> payload(64, 'x');
+    uint64_t expected = streams*parts*payload.size();
+
+    auto server = simple_server::create(path, params(), no_trace);
+    server->seek_to_end();
+    if( coroutine )
+    {
+      server->add_coroutine_handler(1, sizeof(touch_parts), [&](void * frame,
+                                                                const simple_gateway::stream_part & start) -> stream_coroutine * {
+        return new (frame) touch_parts{start, bytes};
+      });
+    }
+    else
+    {
+      auto new_stream = [&](const simple_gateway::stream_part & start,
+                            state_machine::trace_fun trace_cb) {
+        state_machine::sptr fsm { new state_machine{"BenchHandlerServer", trace_cb} };
+        action::sptr touch{new action{[&](uint16_t seqno, transition & tran, state_machine & sm) {
+          bytes += server->current_part().size_;
+        }, "TOUCH"}};
+        transition::sptr start_ {new transition{0, simple_gateway::EV_START, 1, "First part"}};
+        transition::sptr next   {new transition{1, simple_gateway::EV_NEXT,  1, "Next part"}};
+        transition::sptr end    {new transition{1, simple_gateway::EV_END,   2, "Last part"}};
+        for( auto & t : { start_, next, end } )
+        {
+          t->set_action(1, touch);
+          fsm->add_transition(t);
+        }
+        return fsm;
+      };
+      server->add_handler(1, new_stream, { 2 }, [](uint64_t id) {
+        simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+        info->id_ = id;
+        return info;
+      });
+    }
+    uint64_t from = server->receiver_position();
+
+    // everything is queued before the server starts
+    auto client = simple_client::create(path);
+    state_machine::sptr fsm { new state_machine{"BenchHandlerClient", no_trace} };
+    for( uint64_t i=0; i<streams; ++i )
+    {
+      uint64_t sent = 0;
+      auto feeder = [&](simple_gateway::stream_part & p) {
+        p.buffer_  = payload.data();
+        p.size_    = payload.size();
+        return ++sent < parts;
+      };
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      client->start(1, feeder, fsm, { 0 }, info);
+    }
+
+    auto start = clock_type::now();
+    std::thread server_thr{[server,from](){ server->run(from); }};
+    while( bytes < expected )
+      std::this_thread::yield();
+    double secs = seconds_since(start);
+
+    server->stop();
+    server_thr.join();
+    report(std::string{coroutine ? "coroutine" : "fsm"}+" handlers", streams*parts, expected, secs);
+  }
+
+  void
+  handlers()
+  {
+    handler_style(false);
+    handler_style(true);
+  }
+
+  // client to server through simple_gateway with the given client
+  // options and server placement. the handler only counts
+  double
+  timed_transfer(const std::string & path,
+                 uint64_t size,
+                 uint64_t count,
+                 const simple_gateway::options & opts,
+                 const placement & server_placement=placement(),
+                 simple_gateway::feeder_fun feeder=simple_gateway::feeder_fun{})
+  {
+    std::atomic<uint64_t> handled{0};
+
+    auto server = simple_server::create(path, params(), no_trace);
+    server->seek_to_end();
+    server->set_placement(server_placement);
+    auto new_stream = [&](const simple_gateway::stream_part & start,
+                          state_machine::trace_fun trace_cb) {
+      state_machine::sptr fsm { new state_machine{"BenchTransferServer", trace_cb} };
+      action::sptr count_part{new action{[&](uint16_t seqno, transition & tran, state_machine & sm) {
+        ++handled;
+      }, "COUNT"}};
+      transition::sptr one {new transition{0, simple_gateway::EV_ONE, 2, "Single part"}};
+      one->set_action(1, count_part);
+      fsm->add_transition(one);
+      return fsm;
+    };
+    server->add_handler(1, new_stream, { 2 }, [](uint64_t id) {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      info->id_ = id;
+      return info;
+    });
+    std::thread server_thr{[server](){ server->run(server->receiver_position()); }};
+
+    auto client = simple_client::create(path, params(), opts);
+    std::vector<uint8_t> payload(size, 'x');
+    if( !feeder )
+    {
+      feeder = [&](simple_gateway::stream_part & p) {
+        p.buffer_  = payload.data();
+        p.size_    = payload.size();
+        return false;
+      };
+    }
+    state_machine::sptr fsm { new state_machine{"BenchTransferClient", no_trace} };
+
+    auto start = clock_type::now();
+    for( uint64_t i=0; i<count; ++i )
+    {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      client->start(1, feeder, fsm, { 0 }, info);
+    }
+    while( handled < count )
+      std::this_thread::yield();
+    double secs = seconds_since(start);
+
+    server->stop();
+    server_thr.join();
+    return secs;
+  }
+
+  void
+  crc_overhead()
+  {
+    std::vector<uint8_t> data(1024*1024, 'x');
+    for( bool hw : { false, true } )
+    {
+      if( hw && !crc32c_hw_available() )
+        continue;
+      uint64_t rounds = (hw ? 2000 : 100);
+      uint32_t crc = 0;
+      auto start = clock_type::now();
+      for( uint64_t i=0; i<rounds; ++i )
+        crc = (hw ? crc32c(crc, data.data(), data.size()) : crc32c_sw(crc, data.data(), data.size()));
+      report(std::string{hw ? "crc32c sse4.2" : "crc32c table"}+" (crc "+std::to_string(crc & 0xff)+")",
+             rounds, rounds*data.size(), seconds_since(start));
+    }
+
+    for( uint64_t size : { 256, 4096, 65536 } )
+    {
+      // alternating runs, the best of each is reported: the machine's
+      // noise is larger than the checksum's cost
+      uint64_t count = (size > 4096 ? 4000 : 100000);
+      double best[2] = { 1e9, 1e9 };
+      for( int round=0; round<6; ++round )
+      {
+        simple_gateway::options opts;
+        opts.crc_ = ((round%2) == 1);
+        best[round%2] = std::min(best[round%2], timed_transfer("/tmp/GatewayBench.Crc", size, count, opts));
+      }
+      report("unchecked "+std::to_string(size)+"B", count, count*size, best[0]);
+      report("crc32c "+std::to_string(size)+"B", count, count*size, best[1]);
+      std::cout << "  overhead: " << (100.0*(best[1]-best[0])/best[0]) << "%\n";
+    }
+  }
+
+  // a row group of 8 columns: copied into one buffer per part, or
+  // handed over as they are by a gather feeder
+  void
+  gather_vs_concat()
+  {
+    const uint64_t columns = 8;
+    for( uint64_t size : { 4*1024, 64*1024 } )
+    {
+      std::vector<std::vector<uint8_t>> group(columns, std::vector<uint8_t>(size/columns, 'x'));
+      std::vector<uint8_t> concat;
+      auto concat_feeder = [&](simple_gateway::stream_part & p) {
+        concat.clear();
+        for( auto & c : group )
+          concat.insert(concat.end(), c.begin(), c.end());
+        p.buffer_  = concat.data();
+        p.size_    = concat.size();
+        return false;
+      };
+      auto gather_feeder = simple_gateway::gather_feeder([&](simple_gateway::stream_part & p,
+                                                             simple_publisher::buffer_vector & buffers) {
+        for( auto & c : group )
+          buffers.push_back(simple_publisher::buffer{c.data(), c.size()});
+        return false;
+      });
+
+      uint64_t count = 4000;
+      simple_gateway::options opts;
+      double best[2] = { 1e9, 1e9 };
+      for( int round=0; round<6; ++round )
+      {
+        auto feeder = (round%2 ? simple_gateway::feeder_fun{gather_feeder} : simple_gateway::feeder_fun{concat_feeder});
+        best[round%2] = std::min(best[round%2], timed_transfer("/tmp/GatewayBench.Gather", size, count, opts, placement(), feeder));
+      }
+      report("concat "+std::to_string(size)+"B", count, count*size, best[0]);
+      report("gather "+std::to_string(size)+"B", count, count*size, best[1]);
+    }
+  }
+
+  // the sending thread writes the queue on one node, the server pinned to
+  // the first node reads it. out-of-band parts are mapped by the server
+  // and moved to its node, with or without huge pages
+  void
+  local_vs_remote()
+  {
+    std::vector<int> nodes = numa_nodes();
+    placement server_placement;
+    server_placement.numa_node_  = nodes[0];
+    server_placement.cpus_       = node_cpus(nodes[0]);
+
+    const uint64_t size   = 64*1024;
+    const uint64_t count  = 4000;
+    for( int node : nodes )
+    {
+      placement client_placement;
+      client_placement.numa_node_  = node;
+      client_placement.cpus_       = node_cpus(node);
+
+      for( bool oob : { false, true } )
+      {
+        for( bool huge : { false, true } )
+        {
+          if( huge && !oob )
+            continue;
+          simple_gateway::options opts;
+          opts.placement_ = client_placement;
+          opts.oob_threshold_ = (oob ? size : 0);
+          placement sp{server_placement};
+          sp.huge_pages_ = huge;
+
+          // the bench thread is the sender
+          double secs = 0;
+          std::thread sender{[&](){
+            place_thread(client_placement);
+            secs = timed_transfer("/tmp/GatewayBench.Numa", size, count, opts, sp);
+          }};
+          sender.join();
+          report(std::string{node == nodes[0] ? "local" : "remote"}+" node "+std::to_string(node)+
+                 (oob ? " oob" : " queue")+(huge ? " hugepages" : ""), count, count*size, secs);
+        }
+      }
+    }
+    if( nodes.size() < 2 )
+      std::cout << "  single NUMA node, no remote figures\n";
+  }
+
+  // count streams of a few parts each, in flight at the same time either
+  // on a thread per request or on the client's async loop
+  void
+  requests_in_flight(uint64_t in_flight,
+                     bool async)
+  {
+    std::string path{"/tmp/GatewayBench.Async"};
+    const uint64_t count  = 20000;
+    const uint64_t parts  = 4;
+
+    simple_gateway::options opts;
+    opts.concurrent_send_ = true;
+    auto client = simple_client::create(path, params(), opts);
+    simple_subscriber sub{path+"/0"};
+    sub.seek_to_end();
+
+    std::vector<uint8_t> payload(64, 'x');
+    state_machine::sptr fsm { new state_machine{"BenchAsyncClient", no_trace} };
+    auto new_feeder = [&]() {
+      std::shared_ptr<uint64_t> sent{new uint64_t{0}};
+      return [&payload,sent,parts](simple_gateway::stream_part & p) {
+        p.buffer_  = payload.data();
+        p.size_    = payload.size();
+        return ++(*sent) < parts;
+      };
+    };
+
+    auto start = clock_type::now();
+    std::thread reader{[&](){ drain_messages(sub, count*parts); }};
+    for( uint64_t done=0; done<count; done+=in_flight )
+    {
+      if( async )
+      {
+        std::vector<std::future<simple_gateway::stream_info::sptr>> futures;
+        for( uint64_t i=0; i<in_flight; ++i )
+        {
+          simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+          futures.push_back(client->start_async(1, new_feeder(), fsm, { 0 }, info));
+        }
+        for( auto & f : futures )
+          f.wait();
+      }
+      else
+      {
+        std::vector<std::thread> threads;
+        for( uint64_t i=0; i<in_flight; ++i )
+        {
+          threads.push_back(std::thread{[&](){
+            simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+            client->start(1, new_feeder(), fsm, { 0 }, info);
+          }});
+        }
+        for( auto & t : threads )
+          t.join();
+      }
+    }
+    reader.join();
+    report(std::string{async ? "async loop " : "thread per request "}+std::to_string(in_flight)+" in flight",
+           count, count*parts*payload.size(), seconds_since(start));
+  }
+
+  void
+  async_requests()
+  {
+    for( uint64_t in_flight : { 10, 100, 1000 } )
+    {
+      requests_in_flight(in_flight, false);
+      requests_in_flight(in_flight, true);
+    }
+  }
+
+  // small echo requests: a stream per request, each waiting for its
+  // reply, against many exchanges in flight on one duplex stream
+  void
+  small_rpc()
+  {
+    std::string path{"/tmp/GatewayBench.Rpc"};
+    const uint64_t count = 5000;
+    std::string request(64, 'x');
+
+    auto server = simple_server::create(path, params(), no_trace);
+    server->seek_to_end();
+    auto new_stream = [&](const simple_gateway::stream_part & start,
+                          state_machine::trace_fun trace_cb) {
+      state_machine::sptr fsm { new state_machine{"BenchRpcServer", trace_cb} };
+      action::sptr echo{new action{[&](uint16_t seqno, transition & tran, state_machine & sm) {
+        const simple_gateway::stream_part & p = server->current_part();
+        server->reply(p.id_, 0, { simple_publisher::buffer{p.buffer_, p.size_} }, true);
+      }, "ECHO"}};
+      transition::sptr one {new transition{0, simple_gateway::EV_ONE, 2, "Single part"}};
+      one->set_action(1, echo);
+      fsm->add_transition(one);
+      return fsm;
+    };
+    server->add_handler(1, new_stream, { 2 }, [](uint64_t id) {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      info->id_ = id;
+      return info;
+    });
+    auto duplex = duplex_server::create(server, 2, [](bytes_view req,
+                                                      const duplex_server::responder & respond) {
+      respond(req.data_, req.size_);
+    });
+    std::thread server_thr{[server](){ server->run(server->receiver_position()); }};
+
+    {
+      auto client = simple_client::create(path);
+      client->seek_to_end();
+      state_machine::sptr fsm { new state_machine{"BenchRpcClient", no_trace} };
+      auto feeder = [&](simple_gateway::stream_part & p) {
+        p.buffer_  = (const uint8_t *)request.data();
+        p.size_    = request.size();
+        return false;
+      };
+      uint64_t answered = 0;
+      auto start = clock_type::now();
+      for( uint64_t i=0; i<count; ++i )
+      {
+        simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+        client->start(1, feeder, fsm, { 0 }, info);
+        simple_gateway::stream_part reply;
+        if( client->wait_data(info->id_, 0, 1000) && client->get_data(info->id_, 0, reply) )
+          ++answered;
+        client->release_data(info->id_);
+      }
+      report("stream per request", answered, answered*request.size(), seconds_since(start));
+    }
+
+    for( uint64_t in_flight : { 16, 256 } )
+    {
+      std::atomic<uint64_t> answered{0};
+      auto client = duplex_client::create(path, 2, in_flight);
+      auto start = clock_type::now();
+      for( uint64_t i=0; i<count; ++i )
+      {
+        client->call((const uint8_t *)request.data(), request.size(), [&](bool ok, bytes_view response) {
+          if( ok ) ++answered;
+        });
+      }
+      while( client->outstanding() > 0 && client->is_open() )
+        std::this_thread::yield();
+      double secs = seconds_since(start);
+      client->close();
+      report("duplex "+std::to_string(in_flight)+" in flight", answered, answered*request.size(), secs);
+    }
+
+    server->stop();
+    server_thr.join();
+  }
+
+  // a backlog of streams for a type nobody handles, half single parts and
+  // half longer streams, with a good stream behind them. the server's
+  // time to reach the good stream's end
+  void
+  bad_flood()
+  {
+    std::string path{"/tmp/GatewayBench.Flood"};
+    const uint64_t bad_streams  = 4000;
+    const uint64_t bad_parts    = 10;
+    const uint64_t good_parts   = 1000;
+
+    std::atomic<bool> done{false};
+    auto server = simple_server::create(path, params(), no_trace);
+    server->seek_to_end();
+    uint64_t from = server->receiver_position();
+    auto new_stream = [&](const simple_gateway::stream_part & start,
+                          state_machine::trace_fun trace_cb) {
+      state_machine::sptr fsm { new state_machine{"BenchFloodServer", trace_cb} };
+      action::sptr finish{new action{[&](uint16_t seqno, transition & tran, state_machine & sm) {
+        done = true;
+      }, "DONE"}};
+      transition::sptr start_ {new transition{0, simple_gateway::EV_START, 1, "First part"}};
+      transition::sptr next   {new transition{1, simple_gateway::EV_NEXT,  1, "Next part"}};
+      transition::sptr end    {new transition{1, simple_gateway::EV_END,   2, "Last part"}};
+      end->set_action(1, finish);
+      for( auto & t : { start_, next, end } )
+        fsm->add_transition(t);
+      return fsm;
+    };
+    server->add_handler(1, new_stream, { 2 }, [](uint64_t id) {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      info->id_ = id;
+      return info;
+    });
+
+    std::vector<uint8_t> payload(64, 'x');
+    {
+      auto client = simple_client::create(path);
+      state_machine::sptr fsm { new state_machine{"BenchFloodClient", no_trace} };
+      auto send = [&](uint8_t type, uint64_t parts) {
+        uint64_t sent = 0;
+        auto feeder = [&](simple_gateway::stream_part & p) {
+          p.buffer_  = payload.data();
+          p.size_    = payload.size();
+          return ++sent < parts;
+        };
+        simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+        client->start(type, feeder, fsm, { 0 }, info);
+      };
+      for( uint64_t i=0; i<bad_streams; ++i )
+        send(9, (i%2 ? bad_parts : 1));
+      send(1, good_parts);
+    }
+
+    uint64_t messages = bad_streams/2 + (bad_streams/2)*bad_parts + good_parts;
+    auto start = clock_type::now();
+    std::thread server_thr{[server,from](){ server->run(from); }};
+    while( !done )
+      std::this_thread::yield();
+    double secs = seconds_since(start);
+    server->stop();
+    server_thr.join();
+    report("bad stream flood", messages, messages*payload.size(), secs);
+  }
+
+  // microseconds per connect to a gateway whose server is up
+  void
+  connect_latency()
+  {
+    std::string path{"/tmp/GatewayBench.Connect"};
+    const uint64_t count = 2000;
+    auto server = simple_server::create(path, params(), no_trace);
+
+    gateway_pool pool;
+    pool.warm(path, 1);
+    for( bool pooled : { false, true } )
+    {
+      std::vector<double> latencies;
+      for( uint64_t i=0; i<count; ++i )
+      {
+        auto start = clock_type::now();
+        auto client = (pooled ? pool.acquire(path) : simple_client::create(path));
+        latencies.push_back(std::chrono::duration<double, std::micro>(clock_type::now()-start).count());
+      }
+      std::sort(latencies.begin(), latencies.end());
+      std::cout << std::left << std::setw(40) << (pooled ? "gateway_pool::acquire" : "simple_client::create") << std::right
+                << std::setw(12) << std::fixed << std::setprecision(1)
+                << latencies[latencies.size()/2] << " us p50 "
+                << std::setw(10) << latencies[latencies.size()*99/100] << " us p99\n";
+    }
+  }
+
+  // a bulk stream with a slow handler and interactive single part messages
+  // on the same server. the interactive ones carry their send time
+  void
+  spilled_backlog(uint64_t budget)
+  {
+    std::string path{"/tmp/GatewayBench.Spill"};
+    const uint64_t parts = 1000;
+
+    std::atomic<uint64_t> handled{0};
+    uint64_t checksum = 0;
+    uint64_t peak = 0;
+
+    auto server = simple_server::create(path, params(), no_trace);
+    server->seek_to_end();
+    auto new_stream = [&](const simple_gateway::stream_part & start,
+                          state_machine::trace_fun trace_cb) {
+      state_machine::sptr fsm { new state_machine{"BenchSpillServer", trace_cb} };
+      action::sptr handle{new action{[&](uint16_t seqno, transition & tran, state_machine & sm) {
+        const simple_gateway::stream_part & p = server->current_part();
+        // touch every page like a real consumer would
+        for( uint64_t i=0; i<p.size_; i+=4096 )
+          checksum += p.buffer_[i];
+        peak = std::max(peak, server->buffered_bytes());
+        ++handled;
+      }, "HANDLE"}};
+      transition::sptr start_ {new transition{0, simple_gateway::EV_START, 1, "First part"}};
+      transition::sptr next   {new transition{1, simple_gateway::EV_NEXT,  1, "Next part"}};
+      transition::sptr end    {new transition{1, simple_gateway::EV_END,   2, "Last part"}};
+      for( auto & t : { start_, next, end } )
+      {
+        t->set_action(1, handle);
+        fsm->add_transition(t);
+      }
+      return fsm;
+    };
+    auto new_info = [](uint64_t id) {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      info->id_ = id;
+      return info;
+    };
+    server->add_handler(1, new_stream, { 2 }, new_info);
+    server->set_weight(1, 1);
+    server->set_scheduling(64*1024, parts);
+    server->set_memory_budget(budget);
+
+    // the whole upload is waiting when the server starts
+    auto client = simple_client::create(path);
+    std::vector<uint8_t> payload(64*1024, 'x');
+    {
+      uint64_t sent = 0;
+      auto feeder = [&](simple_gateway::stream_part & p) {
+        p.buffer_  = payload.data();
+        p.size_    = payload.size();
+        return ++sent < parts;
+      };
+      state_machine::sptr fsm { new state_machine{"BenchSpillClient", no_trace} };
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      client->start(1, feeder, fsm, { 0 }, info);
+    }
+
+    auto start = clock_type::now();
+    std::thread server_thr{[server](){ server->run(server->receiver_position()); }};
+    while( handled < parts )
+      std::this_thread::yield();
+    double secs = seconds_since(start);
+    server->stop();
+    server_thr.join();
+
+    std::string name{budget ? "spill budget "+std::to_string(budget/1024)+"k" : "spill off"};
+    report(name, parts, parts*payload.size(), secs);
+    std::cout << std::left << std::setw(40) << (name+" peak in memory") << std::right
+              << std::setw(12) << peak/1024 << " KB    "
+              << std::setw(10) << server->spilled_parts() << " spilled\n";
+  }
+
+  void
+  spill()
+  {
+    spilled_backlog(0);
+    spilled_backlog(8*1024*1024);
+    spilled_backlog(1024*1024);
+  }
+
+  void
+  start_burst(uint64_t max_streams)
+  {
+    std::string path{"/tmp/GatewayBench.Admit"};
+    const uint64_t burst = 20000;
+
+    std::atomic<bool> done{false};
+    auto server = simple_server::create(path, params(), no_trace);
+    server->seek_to_end();
+    uint64_t from = server->receiver_position();
+    // type 1 streams stay open, type 2 marks the end of the burst
+    auto new_stream = [&](const simple_gateway::stream_part & start,
+                          state_machine::trace_fun trace_cb) {
+      state_machine::sptr fsm { new state_machine{"BenchAdmitServer", trace_cb} };
+      transition::sptr keep   {new transition{0, simple_gateway::EV_ONE, 1, "Keep stream"}};
+      transition::sptr marker {new transition{0, simple_gateway::EV_ONE, 2, "End of burst"}};
+      marker->set_action(1, action::sptr{new action{[&](uint16_t seqno, transition & tran, state_machine & sm) {
+        done = true;
+      }, "DONE"}});
+      fsm->add_transition(start.stream_type_ == 1 ? keep : marker);
+      return fsm;
+    };
+    auto new_info = [](uint64_t id) {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      info->id_ = id;
+      return info;
+    };
+    server->add_handler(1, new_stream, { 2 }, new_info);
+    server->add_handler(2, new_stream, { 2 }, new_info);
+    server->set_admission(1, max_streams, 0);
+    server->set_quarantine(4096, 0);
+
+    std::vector<uint8_t> payload(64, 'x');
+    {
+      auto client = simple_client::create(path);
+      state_machine::sptr fsm { new state_machine{"BenchAdmitClient", no_trace} };
+      auto feeder = [&](simple_gateway::stream_part & p) {
+        p.buffer_  = payload.data();
+        p.size_    = payload.size();
+        return false;
+      };
+      for( uint64_t i=0; i<=burst; ++i )
+      {
+        simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+        client->start((i < burst ? 1 : 2), feeder, fsm, { 0 }, info);
+      }
+    }
+
+    auto start = clock_type::now();
+    std::thread server_thr{[server,from](){ server->run(from); }};
+    while( !done )
+      std::this_thread::yield();
+    double secs = seconds_since(start);
+    server->stop();
+    server_thr.join();
+
+    std::string name{max_streams ? "start burst, "+std::to_string(max_streams)+" admitted" : "start burst, no limit"};
+    report(name, burst, burst*payload.size(), secs);
+    std::cout << std::left << std::setw(40) << (name+" kept") << std::right
+              << std::setw(12) << server->active_streams(1) << " streams "
+              << std::setw(10) << server->memory_used()/1024 << " KB\n";
+  }
+
+  void
+  admission()
+  {
+    start_burst(0);
+    start_burst(1000);
+  }
+
+  void
+  mixed_load(bool weighted,
+             uint64_t read_ahead)
+  {
+    std::string path{"/tmp/GatewayBench.Fair"};
+    const uint64_t bulk_parts   = 10000;
+    const uint64_t interactive  = 200;
+
+    std::vector<double> latencies;
+    std::atomic<bool> bulk_done{false};
+
+    auto server = simple_server::create(path, params(), no_trace);
+    server->seek_to_end();
+    auto new_stream = [&](const simple_gateway::stream_part & start,
+                          state_machine::trace_fun trace_cb) {
+      state_machine::sptr fsm { new state_machine{"BenchFairServer", trace_cb} };
+      action::sptr handle{new action{[&](uint16_t seqno, transition & tran, state_machine & sm) {
+        const simple_gateway::stream_part & p = server->current_part();
+        if( p.stream_type_ == 2 )
+        {
+          clock_type::time_point sent;
+          ::memcpy(&sent, p.buffer_, sizeof(sent));
+          latencies.push_back(std::chrono::duration<double, std::micro>(clock_type::now()-sent).count());
+          return;
+        }
+        // some work per bulk part
+        auto until = clock_type::now() + std::chrono::microseconds(100);
+        while( clock_type::now() < until ) ;
+        if( p.event_ == simple_gateway::EV_END ) bulk_done = true;
+      }, "HANDLE"}};
+      transition::sptr one    {new transition{0, simple_gateway::EV_ONE,   2, "Single part"}};
+      transition::sptr start_ {new transition{0, simple_gateway::EV_START, 1, "First part"}};
+      transition::sptr next   {new transition{1, simple_gateway::EV_NEXT,  1, "Next part"}};
+      transition::sptr end    {new transition{1, simple_gateway::EV_END,   2, "Last part"}};
+      for( auto & t : { one, start_, next, end } )
+      {
+        t->set_action(1, handle);
+        fsm->add_transition(t);
+      }
+      return fsm;
+    };
+    auto new_info = [](uint64_t id) {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      info->id_ = id;
+      return info;
+    };
+    server->add_handler(1, new_stream, { 2 }, new_info);
+    server->add_handler(2, new_stream, { 2 }, new_info);
+    if( weighted )
+    {
+      server->set_weight(1, 1);
+      server->set_weight(2, 8);
+      server->set_scheduling(64*1024, read_ahead);
+    }
+    std::thread server_thr{[server](){ server->run(server->receiver_position()); }};
+
+    simple_gateway::options opts;
+    opts.concurrent_send_ = true;
+    auto client = simple_client::create(path, params(), opts);
+
+    std::vector<uint8_t> payload(16*1024, 'x');
+    auto start = clock_type::now();
+    std::thread bulk{[&](){
+      uint64_t sent = 0;
+      auto feeder = [&](simple_gateway::stream_part & p) {
+        p.buffer_  = payload.data();
+        p.size_    = payload.size();
+        return ++sent < bulk_parts;
+      };
+      state_machine::sptr fsm { new state_machine{"BenchFairBulk", no_trace} };
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      client->start(1, feeder, fsm, { 0 }, info);
+    }};
+
+    state_machine::sptr fsm { new state_machine{"BenchFairInteractive", no_trace} };
+    for( uint64_t i=0; i<interactive; ++i )
+    {
+      clock_type::time_point now = clock_type::now();
+      auto feeder = [&](simple_gateway::stream_part & p) {
+        p.buffer_  = (const uint8_t *)&now;
+        p.size_    = sizeof(now);
+        return false;
+      };
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      client->start(2, feeder, fsm, { 0 }, info);
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    bulk.join();
+    while( !bulk_done )
+      std::this_thread::yield();
+    double secs = seconds_since(start);
+
+    server->stop();
+    server_thr.join();
+
+    std::sort(latencies.begin(), latencies.end());
+    // interactive parts are only seen once inside the read ahead window
+    std::string name{weighted ? "weighted/"+std::to_string(read_ahead)+" " : "fifo "};
+    report(name+"bulk", bulk_parts, bulk_parts*payload.size(), secs);
+    if( latencies.empty() )
+      return;
+    std::cout << std::left << std::setw(40) << (name+"interactive latency") << std::right
+              << std::setw(12) << std::fixed << std::setprecision(1)
+              << latencies[latencies.size()/2] << " us p50 "
+              << std::setw(10) << latencies[latencies.size()*99/100] << " us p99\n";
+  }
+
+  void
+  fair()
+  {
+    mixed_load(false, 0);
+    mixed_load(true, 256);
+    mixed_load(true, 4096);
+  }
+
+}}
+
+using namespace virtdb::bench;
+
+int main(int argc, char ** argv)
+{
+  bench_map benchmarks{
+    { "zmq",      zmq_vs_local },
+    { "virtdb",   virtdb_decode },
+    { "pushdown", pushdown_kernels },
+    { "send",     concurrent_send },
+    { "striped",  striped_bulk },
+    { "fanout",   fanout },
+    { "fair",     fair },
+    { "async",    async_requests },
+    { "coro",     handlers },
+    { "crc",      crc_overhead },
+    { "numa",     local_vs_remote },
+    { "frame",    frame_scan },
+    { "gather",   gather_vs_concat },
+    { "rpc",      small_rpc },
+    { "flood",    bad_flood },
+    { "connect",  connect_latency },
+    { "spill",    spill },
+    { "admit",    admission },
+  };
+
+  // run all benchmarks unless some are named on the command line
+  for( auto & b : benchmarks )
+  {
+    bool selected = (argc < 2);
+    for( int i=1; i<argc; ++i )
+      if( b.first == argv[i] ) selected = true;
+
+    if( selected )
+    {
+      std::cout << "== " << b.first << "\n";
+      b.second();
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,157 @@
+#include <gateway/simple_gateway.hh>
+#include <gateway/queue_replay.hh>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace virtdb::gateway;
+using namespace virtdb::fsm;
+
+namespace virtdb { namespace replay {
+
+  auto no_trace = [](uint16_t seqno,
+                     const std::string & desc,
+                     const fsm::transition & trans,
+                     const fsm::state_machine & sm) {};
+
+  // the replayed messages and when the server got them
+  struct timings
+  {
+    std::mutex                     mtx_;
+    std::map<uint64_t, uint64_t>   pushed_;
+    std::map<uint64_t, uint64_t>   handled_;
+    std::atomic<uint64_t>          count_;
+
+    timings() : count_{0} {}
+  };
+
+  // takes every stream type and every part, like a handler that does nothing
+  void
+  add_counting_handlers(simple_server & server,
+                        timings & t)
+  {
+    auto new_stream = [&server,&t](const simple_gateway::stream_part & start,
+                                   state_machine::trace_fun trace_cb) {
+      state_machine::sptr fsm { new state_machine{"ReplayStream", trace_cb} };
+      action::sptr handled{new action{[&server,&t](uint16_t seqno, transition & tran, state_machine & sm) {
+        uint64_t now = simple_gateway::now_us();
+        std::lock_guard<std::mutex> lock{t.mtx_};
+        t.handled_[server.current_part().position_] = now;
+        ++t.count_;
+      }, "HANDLED"}};
+      transition::sptr one    {new transition{0, simple_gateway::EV_ONE,   2, "Single part"}};
+      transition::sptr start_ {new transition{0, simple_gateway::EV_START, 1, "First part"}};
+      transition::sptr next   {new transition{1, simple_gateway::EV_NEXT,  1, "Next part"}};
+      transition::sptr end    {new transition{1, simple_gateway::EV_END,   2, "Last part"}};
+      for( auto & tr : { one, start_, next, end } )
+      {
+        tr->set_action(1, handled);
+        fsm->add_transition(tr);
+      }
+      return fsm;
+    };
+    auto new_info = [](uint64_t id) {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      info->id_ = id;
+      return info;
+    };
+    for( int type=0; type<256; ++type )
+      server.add_handler((uint8_t)type, new_stream, { 2 }, new_info);
+  }
+
+  void
+  report(const queue_replay::stats & st,
+         timings & t)
+  {
+    std::vector<uint64_t> latencies;
+    {
+      std::lock_guard<std::mutex> lock{t.mtx_};
+      for( auto & h : t.handled_ )
+      {
+        auto it = t.pushed_.find(h.first);
+        if( it != t.pushed_.end() )
+          latencies.push_back(h.second > it->second ? h.second-it->second : 0);
+      }
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    double secs = (st.seconds_ > 0 ? st.seconds_ : 1e-9);
+    std::cout << "messages:    " << st.messages_ << " replayed, " << st.skipped_ << " skipped, "
+              << st.unstamped_ << " without stamp, " << latencies.size() << " handled\n"
+              << "throughput:  " << (uint64_t)(st.messages_/secs) << " msg/s "
+              << std::fixed << std::setprecision(1) << (st.bytes_/secs/1024.0/1024.0) << " MB/s in "
+              << std::setprecision(3) << secs << " s\n";
+    if( latencies.empty() )
+      return;
+
+    std::cout << "latency us:  ";
+    for( double p : { 0.5, 0.9, 0.99, 0.999 } )
+      std::cout << "p" << (p*100) << "=" << latencies[(uint64_t)(latencies.size()*p)] << " ";
+    std::cout << "max=" << latencies.back() << "\n";
+  }
+
+}}
+
+using namespace virtdb::replay;
+
+int main(int argc, char ** argv)
+{
+  if( argc < 3 )
+  {
+    std::cerr << "usage: " << argv[0] << " <captured gateway path> <target path> [speed] [max messages]\n"
+              << "  speed: 1 is the original pace, 2 twice as fast, 0 as fast as possible (default)\n";
+    return 1;
+  }
+
+  std::string capture{argv[1]};
+  std::string target{argv[2]};
+  double speed = (argc > 3 ? std::atof(argv[3]) : 0.0);
+  uint64_t max_messages = (argc > 4 ? std::strtoull(argv[4], nullptr, 10) : UINT64_MAX);
+
+  try
+  {
+    timings t;
+    auto server = simple_server::create(target, virtdb::queue::params(), no_trace);
+    server->seek_to_end();
+    add_counting_handlers(*server, t);
+    std::thread server_thr{[server](){ server->run(server->receiver_position()); }};
+
+    auto replay = queue_replay::create(capture, target);
+    auto pushed = [&t](uint64_t position,
+                       const simple_gateway::stream_part & part,
+                       uint64_t pushed_us) {
+      std::lock_guard<std::mutex> lock{t.mtx_};
+      t.pushed_[position] = pushed_us;
+    };
+    auto st = replay->run(speed, 0, max_messages, pushed);
+
+    // parts of streams started before the capture never reach a handler,
+    // so wait until the server is idle rather than for all of them
+    uint64_t seen = 0;
+    for( int idle=0; idle<100 && t.count_ < st.messages_; )
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      if( t.count_ == seen ) ++idle;
+      else                   idle = 0;
+      seen = t.count_;
+    }
+
+    server->stop();
+    server_thr.join();
+    report(st, t);
+  }
+  catch (const std::exception & e)
+  {
+    std::cerr << "replay failed: " << e.what() << "\n";
+    return 1;
+  }
+  return 0;
+}
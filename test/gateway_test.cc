@@ -5,17 +5,42 @@
 // -- end remove
 #include <gateway/streaming_gateway.hh>
 #include <gateway/zmq_gateway.hh>
+#include <gateway/striped_gateway.hh>
+#include <gateway/fanout_gateway.hh>
 #include <gateway/virtdb_gateway.hh>
+#include <gateway/pushdown.hh>
+#include <gateway/result_cache.hh>
+#include <gateway/crc32c.hh>
+#include <gateway/placement.hh>
+#include <gateway/queue_replay.hh>
+#include <gateway/column_frame.hh>
+#include <gateway/gateway_pool.hh>
+#include <gateway/spill_file.hh>
 // revamp
 #include <gateway/read_stream.hh>
+#include <gateway/duplex_stream.hh>
 #include <gateway/write_stream.hh>
 #include <gateway/message.hh>
+#include <gateway/pb_wire.hh>
+#include <queue/varint.hh>
 // std
+#include <algorithm>
+#include <atomic>
+#include <deque>
 #include <future>
 #include <iostream>
 #include <string.h>
 #include <map>
+#include <mutex>
 #include <thread>
+#include <vector>
+// C libs
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 using namespace virtdb::gateway;
 using namespace virtdb::fsm;
@@ -24,6 +49,11 @@ using namespace virtdb::queue;
 namespace virtdb { namespace test {
   
   class SimpleGatewayTest : public ::testing::Test { };
+  class ZmqGatewayTest : public ::testing::Test { };
+  class StripedGatewayTest : public ::testing::Test { };
+  class FanoutGatewayTest : public ::testing::Test { };
+  class VirtdbGatewayTest : public ::testing::Test { };
+  class PushdownTest : public ::testing::Test { };
   
   // revamp:
   class ReadStreamTest : public ::testing::Test { };
@@ -45,6 +75,61 @@ namespace virtdb { namespace test {
               << desc << "\n";
   };
   
+  // builds a virtdb Column message with INT64 data
+  std::string
+  encode_column(const std::string & query_id,
+                const std::string & name,
+                uint64_t seqno,
+                const std::vector<int64_t> & values,
+                const std::vector<bool> & nulls)
+  {
+    std::string value;
+    {
+      pb_writer w{value};
+      w.varint_field(1, value_view::INT64);
+      std::string packed;
+      pb_writer pw{packed};
+      for( auto v : values ) pw.varint((uint64_t)v);
+      w.bytes_field(4, packed.data(), packed.size());
+      for( auto n : nulls ) w.varint_field(11, n);
+    }
+    
+    std::string ret;
+    pb_writer w{ret};
+    w.string_field(1, query_id);
+    w.string_field(2, name);
+    w.string_field(3, value);
+    w.varint_field(4, seqno);
+    return ret;
+  }
+  
+  // sums the stream's parts and replies with the total at the end
+  class sum_parts : public stream_coroutine
+  {
+    uint64_t     total_;
+    std::string  result_;
+    
+  public:
+    sum_parts(const simple_gateway::stream_part & start)
+    : total_{0} {}
+    
+    bool resume(simple_server & server,
+                const simple_gateway::stream_part & part)
+    {
+      GATEWAY_CO_BEGIN;
+      while( true )
+      {
+        total_ += std::stoull(std::string{(const char *)part.buffer_, part.size_});
+        if( part.event_ == simple_gateway::EV_END || part.event_ == simple_gateway::EV_ONE )
+          break;
+        GATEWAY_CO_AWAIT;
+      }
+      result_ = std::to_string(total_);
+      yield(server, { simple_publisher::buffer{result_.data(), result_.size()} }, true);
+      GATEWAY_CO_END;
+    }
+  };
+  
 }}
 
 using namespace virtdb::test;
@@ -185,6 +270,2509 @@ TEST_F(SimpleGatewayTest, PushSingleNoHandler)
   thr.join();
 }
 
+TEST_F(SimpleGatewayTest, ConcurrentSend)
+{
+  const char * path = "/tmp/SimpleGatewayTest.ConcurrentSend";
+  const uint64_t threads  = 4;
+  const uint64_t streams  = 100;
+  const uint64_t parts    = 3;
+  
+  auto server = simple_server::create(path, params(), trace);
+  simple_subscriber sub{std::string{path}+"/0"};
+  sub.seek_to_end();
+  uint64_t from = sub.position();
+  
+  simple_gateway::options opts;
+  opts.concurrent_send_ = true;
+  opts.send_slots_ = 8;
+  auto client = simple_client::create(path, params(), opts);
+  
+  std::vector<std::thread> producers;
+  for( uint64_t t=0; t<threads; ++t )
+  {
+    producers.push_back(std::thread{[&,t]() {
+      state_machine::sptr fsm { new state_machine{"ConcurrentSendClient", trace} };
+      for( uint64_t i=0; i<streams; ++i )
+      {
+        uint64_t sent = 0;
+        std::string msg;
+        auto feeder = [&](simple_gateway::stream_part & p) {
+          msg = std::to_string(t) + ":" + std::to_string(sent);
+          p.buffer_ = (const uint8_t *)msg.data();
+          p.size_ = msg.size();
+          return ++sent < parts;
+        };
+        simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+        client->start(1, feeder, fsm, { 0 }, info);
+      }
+    }});
+  }
+  for( auto & p : producers )
+    p.join();
+  
+  // every stream has its own id and its parts arrive in order
+  std::map<uint64_t, std::vector<std::string>> received;
+  uint64_t count = 0;
+  auto pull = [&](uint64_t msg_id, const uint8_t * ptr, uint64_t len) {
+    simple_gateway::stream_part part;
+    EXPECT_TRUE(simple_gateway::parse_part(ptr, len, part));
+    received[part.id_].push_back(std::string{(const char *)part.buffer_, part.size_});
+    return ++count < threads*streams*parts;
+  };
+  while( count < threads*streams*parts )
+    from = sub.pull(from, pull, 1000);
+  
+  EXPECT_EQ(received.size(), threads*streams);
+  for( auto & r : received )
+  {
+    ASSERT_EQ(r.second.size(), parts);
+    std::string prefix{r.second[0].substr(0, r.second[0].find(':')+1)};
+    for( uint64_t i=0; i<parts; ++i )
+      EXPECT_EQ(r.second[i], prefix + std::to_string(i));
+  }
+}
+
+TEST_F(SimpleGatewayTest, TwoClients)
+{
+  const char * path = "/tmp/SimpleGatewayTest.TwoClients";
+  const uint64_t clients  = 2;
+  const uint64_t threads  = 2;
+  const uint64_t streams  = 100;
+  
+  auto server = simple_server::create(path, params(), trace);
+  simple_subscriber sub{std::string{path}+"/0"};
+  sub.seek_to_end();
+  uint64_t from = sub.position();
+  
+  // both clients read the same queue end, their ids must not collide
+  simple_gateway::options opts;
+  opts.concurrent_send_ = true;
+  std::vector<simple_client::sptr> senders;
+  for( uint64_t c=0; c<clients; ++c )
+    senders.push_back(simple_client::create(path, params(), opts));
+  
+  std::vector<std::thread> producers;
+  for( uint64_t c=0; c<clients; ++c )
+  {
+    for( uint64_t t=0; t<threads; ++t )
+    {
+      producers.push_back(std::thread{[&,c,t]() {
+        state_machine::sptr fsm { new state_machine{"TwoClientsClient", trace} };
+        std::string msg{std::to_string(c) + ":" + std::to_string(t)};
+        for( uint64_t i=0; i<streams; ++i )
+        {
+          auto feeder = [&](simple_gateway::stream_part & p) {
+            p.buffer_ = (const uint8_t *)msg.data();
+            p.size_ = msg.size();
+            return false;
+          };
+          simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+          senders[c]->start(1, feeder, fsm, { 0 }, info);
+        }
+      }});
+    }
+  }
+  for( auto & p : producers )
+    p.join();
+  
+  std::set<uint64_t> ids;
+  uint64_t count = 0;
+  auto pull = [&](uint64_t msg_id, const uint8_t * ptr, uint64_t len) {
+    simple_gateway::stream_part part;
+    EXPECT_TRUE(simple_gateway::parse_part(ptr, len, part));
+    ids.insert(part.id_);
+    return ++count < clients*threads*streams;
+  };
+  while( count < clients*threads*streams )
+    from = sub.pull(from, pull, 1000);
+  
+  EXPECT_EQ(ids.size(), clients*threads*streams);
+}
+
+TEST_F(SimpleGatewayTest, OutOfBand)
+{
+  const char * path = "/tmp/SimpleGatewayTest.OutOfBand";
+  
+  std::vector<std::string> parts{ "small", std::string(64*1024, 'a'), std::string(100*1024, 'b') };
+  std::vector<std::string> received;
+  std::vector<uint64_t> queued_bytes;
+  
+  std::promise<void> notify_on_end;
+  std::future<void> on_end{notify_on_end.get_future()};
+  
+  auto server = simple_server::create(path, params(), trace);
+  server->seek_to_end();
+  {
+    auto new_stream = [&](const simple_gateway::stream_part & start,
+                          state_machine::trace_fun trace_cb) {
+      state_machine::sptr fsm { new state_machine{"OutOfBand STREAM", trace_cb} };
+      simple_gateway::set_event_names(*fsm);
+      action::sptr store{new action{[&](uint16_t seqno, transition & tran, state_machine & sm) {
+        const simple_gateway::stream_part & p = server->current_part();
+        received.push_back(std::string{(const char *)p.buffer_, p.size_});
+        queued_bytes.push_back(p.total_bytes_);
+        if( p.event_ == simple_gateway::EV_END )
+          notify_on_end.set_value();
+      }, "STORE PART"}};
+      transition::sptr start_ {new transition{0, simple_gateway::EV_START, 1, "First part"}};
+      transition::sptr next   {new transition{1, simple_gateway::EV_NEXT,  1, "Next part"}};
+      transition::sptr end    {new transition{1, simple_gateway::EV_END,   2, "Last part"}};
+      for( auto & t : { start_, next, end } )
+      {
+        t->set_action(1, store);
+        fsm->add_transition(t);
+      }
+      return fsm;
+    };
+    auto new_info = [](uint64_t id) {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      info->id_ = id;
+      return info;
+    };
+    server->add_handler(1, new_stream, { 2 }, new_info);
+  }
+  std::thread thr{[server](){ server->run(server->receiver_position()); }};
+  
+  simple_gateway::options opts;
+  opts.oob_threshold_ = 4096;
+  auto client = simple_client::create(path, params(), opts);
+  client->seek_to_end();
+  {
+    size_t next = 0;
+    auto feeder = [&](simple_gateway::stream_part & p) {
+      p.buffer_ = (const uint8_t *)parts[next].data();
+      p.size_ = parts[next].size();
+      return ++next < parts.size();
+    };
+    state_machine::sptr fsm { new state_machine{"OutOfBandClient", trace} };
+    simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+    client->start(1, feeder, fsm, { 0 }, info);
+  }
+  
+  EXPECT_EQ(on_end.wait_for(std::chrono::seconds(10)), std::future_status::ready);
+  server->stop();
+  thr.join();
+  
+  EXPECT_EQ(received, parts);
+  ASSERT_EQ(queued_bytes.size(), 3);
+  EXPECT_LT(queued_bytes[1], 64);
+  EXPECT_LT(queued_bytes[2], 64);
+  
+  // segments are reclaimed at the end of the stream
+  std::string oob_dir{std::string{path}+"/oob"};
+  std::unique_ptr<DIR, int(*)(DIR*)> dir{::opendir(oob_dir.c_str()), ::closedir};
+  ASSERT_TRUE(dir.get() != nullptr);
+  int entries = 0;
+  while( struct dirent * e = ::readdir(dir.get() ) )
+    if( e->d_name[0] != '.' ) ++entries;
+  EXPECT_EQ(entries, 0);
+}
+
+TEST_F(SimpleGatewayTest, ControlLane)
+{
+  const char * path = "/tmp/SimpleGatewayTest.ControlLane";
+  const uint64_t parts = 100;
+  
+  std::atomic<uint64_t> handled{0};
+  
+  auto server = simple_server::create(path, params(), trace);
+  server->seek_to_end();
+  {
+    auto new_stream = [&](const simple_gateway::stream_part & start,
+                          state_machine::trace_fun trace_cb) {
+      state_machine::sptr fsm { new state_machine{"ControlLane STREAM", trace_cb} };
+      simple_gateway::set_event_names(*fsm);
+      action::sptr count{new action{[&](uint16_t seqno, transition & tran, state_machine & sm) {
+        // the first part stops the stream
+        if( handled++ == 0 )
+          server->stop_stream(server->current_part().id_);
+      }, "COUNT PART"}};
+      transition::sptr start_ {new transition{0, simple_gateway::EV_START, 1, "First part"}};
+      transition::sptr next   {new transition{1, simple_gateway::EV_NEXT,  1, "Next part"}};
+      transition::sptr end    {new transition{1, simple_gateway::EV_END,   2, "Last part"}};
+      for( auto & t : { start_, next, end } )
+      {
+        t->set_action(1, count);
+        fsm->add_transition(t);
+      }
+      return fsm;
+    };
+    auto new_info = [](uint64_t id) {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      info->id_ = id;
+      return info;
+    };
+    server->add_handler(1, new_stream, { 2 }, new_info);
+  }
+  
+  auto client = simple_client::create(path);
+  client->seek_to_end();
+  simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+  {
+    uint64_t sent = 0;
+    std::string msg{"part"};
+    auto feeder = [&](simple_gateway::stream_part & p) {
+      p.buffer_ = (const uint8_t *)msg.data();
+      p.size_ = msg.size();
+      return ++sent < parts;
+    };
+    state_machine::sptr fsm { new state_machine{"ControlLaneClient", trace} };
+    client->start(1, feeder, fsm, { 0 }, info);
+  }
+  
+  // all parts are queued before the server starts
+  std::thread thr{[server](){ server->run(server->receiver_position()); }};
+  
+  // the client learns about the stop on its control lane
+  EXPECT_FALSE(client->wait_data(info->id_, 0, 10000));
+  EXPECT_TRUE(client->is_reply_stopped(info->id_));
+  
+  for( int i=0; i<1000 && server->skipped_parts() < parts-1; ++i )
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  server->stop();
+  thr.join();
+  
+  EXPECT_EQ(handled.load(), 1);
+  EXPECT_EQ(server->skipped_parts(), parts-1);
+}
+
+TEST_F(SimpleGatewayTest, StopCancelsFeeder)
+{
+  const char * path = "/tmp/SimpleGatewayTest.StopCancelsFeeder";
+  const uint64_t parts       = 10000;
+  const uint64_t part_size   = 1024;
+  const uint64_t stop_after  = 10;
+  // the client may run this many parts ahead of the server
+  const uint64_t window      = 16;
+  
+  std::atomic<uint64_t> handled{0};
+  std::atomic<bool> stopped{false};
+  
+  auto server = simple_server::create(path, params(), trace);
+  server->seek_to_end();
+  {
+    auto new_stream = [&](const simple_gateway::stream_part & start,
+                          state_machine::trace_fun trace_cb) {
+      state_machine::sptr fsm { new state_machine{"StopCancelsFeeder STREAM", trace_cb} };
+      simple_gateway::set_event_names(*fsm);
+      action::sptr count{new action{[&](uint16_t seqno, transition & tran, state_machine & sm) {
+        if( ++handled == stop_after )
+        {
+          server->stop_stream(server->current_part().id_);
+          stopped = true;
+        }
+      }, "COUNT PART"}};
+      transition::sptr start_ {new transition{0, simple_gateway::EV_START, 1, "First part"}};
+      transition::sptr next   {new transition{1, simple_gateway::EV_NEXT,  1, "Next part"}};
+      transition::sptr end    {new transition{1, simple_gateway::EV_END,   2, "Last part"}};
+      for( auto & t : { start_, next, end } )
+      {
+        t->set_action(1, count);
+        fsm->add_transition(t);
+      }
+      return fsm;
+    };
+    auto new_info = [](uint64_t id) {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      info->id_ = id;
+      return info;
+    };
+    server->add_handler(1, new_stream, { 2 }, new_info);
+  }
+  std::thread thr{[server](){ server->run(server->receiver_position()); }};
+  
+  auto client = simple_client::create(path);
+  client->seek_to_end();
+  
+  uint64_t fed = 0;
+  uint64_t fed_after_stop = 0;
+  std::string payload(part_size, 'x');
+  auto feeder = [&](simple_gateway::stream_part & p) {
+    while( !stopped && handled + window < fed )
+      std::this_thread::yield();
+    if( stopped ) ++fed_after_stop;
+    p.buffer_ = (const uint8_t *)payload.data();
+    p.size_ = payload.size();
+    return ++fed < parts;
+  };
+  state_machine::sptr fsm { new state_machine{"StopCancelsFeederClient", trace} };
+  simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+  client->start(1, feeder, fsm, { 0 }, info);
+  
+  EXPECT_TRUE(info->cancelled_);
+  EXPECT_LT(fed, parts);
+  
+  // everything queued after the stop is skipped by the server
+  for( int i=0; i<1000 && server->skipped_parts() < fed-stop_after; ++i )
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  server->stop();
+  thr.join();
+  
+  // parts sent but never handled
+  uint64_t wasted_bytes = (fed - stop_after) * part_size;
+  std::cout << "wasted bytes after stop: " << wasted_bytes
+            << " (" << fed_after_stop << " parts fed after the stop)\n";
+  EXPECT_EQ(handled.load(), stop_after);
+  EXPECT_LE(fed_after_stop, 1);
+  EXPECT_LE(wasted_bytes, (window+1)*part_size);
+}
+
+TEST_F(SimpleGatewayTest, WeightedFairness)
+{
+  const char * path = "/tmp/SimpleGatewayTest.WeightedFairness";
+  const uint64_t parts = 200;
+  
+  std::vector<uint8_t> order;
+  std::promise<void> notify_on_done;
+  std::future<void> on_done{notify_on_done.get_future()};
+  
+  auto server = simple_server::create(path, params(), trace);
+  server->seek_to_end();
+  {
+    auto new_stream = [&](const simple_gateway::stream_part & start,
+                          state_machine::trace_fun trace_cb) {
+      state_machine::sptr fsm { new state_machine{"WeightedFairness STREAM", trace_cb} };
+      simple_gateway::set_event_names(*fsm);
+      action::sptr record{new action{[&](uint16_t seqno, transition & tran, state_machine & sm) {
+        order.push_back(server->current_part().stream_type_);
+        if( order.size() == parts+1 )
+          notify_on_done.set_value();
+      }, "RECORD PART"}};
+      transition::sptr one    {new transition{0, simple_gateway::EV_ONE,   2, "Single part"}};
+      transition::sptr start_ {new transition{0, simple_gateway::EV_START, 1, "First part"}};
+      transition::sptr next   {new transition{1, simple_gateway::EV_NEXT,  1, "Next part"}};
+      transition::sptr end    {new transition{1, simple_gateway::EV_END,   2, "Last part"}};
+      for( auto & t : { one, start_, next, end } )
+      {
+        t->set_action(1, record);
+        fsm->add_transition(t);
+      }
+      return fsm;
+    };
+    auto new_info = [](uint64_t id) {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      info->id_ = id;
+      return info;
+    };
+    server->add_handler(1, new_stream, { 2 }, new_info);
+    server->add_handler(2, new_stream, { 2 }, new_info);
+  }
+  server->set_weight(1, 1);
+  server->set_weight(2, 8);
+  server->set_scheduling(1024, 2*parts);
+  
+  auto client = simple_client::create(path);
+  client->seek_to_end();
+  {
+    // a bulk stream followed by a single interactive part
+    uint64_t sent = 0;
+    std::string bulk(1024, 'b');
+    auto feeder = [&](simple_gateway::stream_part & p) {
+      p.buffer_ = (const uint8_t *)bulk.data();
+      p.size_ = bulk.size();
+      return ++sent < parts;
+    };
+    state_machine::sptr fsm { new state_machine{"WeightedFairnessClient", trace} };
+    simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+    client->start(1, feeder, fsm, { 0 }, info);
+    
+    std::string query{"interactive"};
+    auto one = [&](simple_gateway::stream_part & p) {
+      p.buffer_ = (const uint8_t *)query.data();
+      p.size_ = query.size();
+      return false;
+    };
+    simple_gateway::stream_info::sptr one_info { new simple_gateway::stream_info };
+    client->start(2, one, fsm, { 0 }, one_info);
+  }
+  
+  // all parts are queued before the server starts
+  std::thread thr{[server](){ server->run(server->receiver_position()); }};
+  EXPECT_EQ(on_done.wait_for(std::chrono::seconds(10)), std::future_status::ready);
+  server->stop();
+  thr.join();
+  
+  // the interactive part overtakes most of the bulk stream
+  ASSERT_EQ(order.size(), parts+1);
+  auto it = std::find(order.begin(), order.end(), 2);
+  ASSERT_TRUE(it != order.end());
+  EXPECT_LT(it - order.begin(), 4);
+}
+
+TEST_F(SimpleGatewayTest, Deadline)
+{
+  const char * path = "/tmp/SimpleGatewayTest.Deadline";
+  
+  std::vector<std::string> handled;
+  std::vector<int64_t> budgets;
+  std::promise<void> notify_on_done;
+  std::future<void> on_done{notify_on_done.get_future()};
+  
+  auto server = simple_server::create(path, params(), trace);
+  server->seek_to_end();
+  {
+    auto new_stream = [&](const simple_gateway::stream_part & start,
+                          state_machine::trace_fun trace_cb) {
+      state_machine::sptr fsm { new state_machine{"Deadline STREAM", trace_cb} };
+      simple_gateway::set_event_names(*fsm);
+      action::sptr record{new action{[&](uint16_t seqno, transition & tran, state_machine & sm) {
+        const simple_gateway::stream_part & p = server->current_part();
+        handled.push_back(std::string{(const char *)p.buffer_, p.size_});
+        budgets.push_back(server->remaining_budget_us());
+        if( handled.size() == 2 )
+          notify_on_done.set_value();
+      }, "RECORD PART"}};
+      transition::sptr one    {new transition{0, simple_gateway::EV_ONE,   2, "Single part"}};
+      transition::sptr start_ {new transition{0, simple_gateway::EV_START, 1, "First part"}};
+      transition::sptr next   {new transition{1, simple_gateway::EV_NEXT,  1, "Next part"}};
+      transition::sptr end    {new transition{1, simple_gateway::EV_END,   2, "Last part"}};
+      for( auto & t : { one, start_, next, end } )
+      {
+        t->set_action(1, record);
+        fsm->add_transition(t);
+      }
+      return fsm;
+    };
+    auto new_info = [](uint64_t id) {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      info->id_ = id;
+      return info;
+    };
+    server->add_handler(1, new_stream, { 2 }, new_info);
+  }
+  
+  auto client = simple_client::create(path);
+  client->seek_to_end();
+  state_machine::sptr fsm { new state_machine{"DeadlineClient", trace} };
+  auto send = [&](const std::string & msg, uint64_t parts, uint64_t deadline) {
+    uint64_t sent = 0;
+    auto feeder = [&](simple_gateway::stream_part & p) {
+      p.buffer_ = (const uint8_t *)msg.data();
+      p.size_ = msg.size();
+      return ++sent < parts;
+    };
+    simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+    info->deadline_us_ = deadline;
+    client->start(1, feeder, fsm, { 0 }, info);
+  };
+  send("expired one", 1, simple_gateway::deadline_after(50));
+  send("expired stream", 5, simple_gateway::deadline_after(50));
+  send("no deadline", 1, 0);
+  send("in time", 1, simple_gateway::deadline_after(10000));
+  
+  // the server falls behind the deadlines
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  std::thread thr{[server](){ server->run(server->receiver_position()); }};
+  EXPECT_EQ(on_done.wait_for(std::chrono::seconds(10)), std::future_status::ready);
+  server->stop();
+  thr.join();
+  
+  std::vector<std::string> expected{ "no deadline", "in time" };
+  EXPECT_EQ(handled, expected);
+  ASSERT_EQ(budgets.size(), 2);
+  EXPECT_EQ(budgets[0], INT64_MAX);
+  EXPECT_GT(budgets[1], 0);
+  EXPECT_LE(budgets[1], 10000000);
+  
+  // the expired stream's header is dropped, the rest is skipped as stopped
+  EXPECT_EQ(server->expired_parts(), 2);
+  EXPECT_EQ(server->skipped_parts(), 4);
+}
+
+TEST_F(SimpleGatewayTest, AsyncStart)
+{
+  const char * path = "/tmp/SimpleGatewayTest.AsyncStart";
+  const uint64_t singles  = 1000;
+  const uint64_t streams  = 10;
+  const uint64_t parts    = 3;
+  
+  std::atomic<uint64_t> handled{0};
+  
+  auto server = simple_server::create(path, params(), trace);
+  server->seek_to_end();
+  {
+    auto new_stream = [&](const simple_gateway::stream_part & start,
+                          state_machine::trace_fun trace_cb) {
+      state_machine::sptr fsm { new state_machine{"AsyncStart STREAM", trace_cb} };
+      action::sptr count{new action{[&](uint16_t seqno, transition & tran, state_machine & sm) {
+        ++handled;
+      }, "COUNT PART"}};
+      transition::sptr one    {new transition{0, simple_gateway::EV_ONE,   2, "Single part"}};
+      transition::sptr start_ {new transition{0, simple_gateway::EV_START, 1, "First part"}};
+      transition::sptr next   {new transition{1, simple_gateway::EV_NEXT,  1, "Next part"}};
+      transition::sptr end    {new transition{1, simple_gateway::EV_END,   2, "Last part"}};
+      for( auto & t : { one, start_, next, end } )
+      {
+        t->set_action(1, count);
+        fsm->add_transition(t);
+      }
+      return fsm;
+    };
+    auto new_info = [](uint64_t id) {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      info->id_ = id;
+      return info;
+    };
+    server->add_handler(1, new_stream, { 2 }, new_info);
+  }
+  std::thread thr{[server](){ server->run(server->receiver_position()); }};
+  
+  auto client = simple_client::create(path);
+  client->seek_to_end();
+  state_machine::sptr fsm { new state_machine{"AsyncStartClient", trace} };
+  std::string msg{"async"};
+  
+  // all of them in flight from this thread
+  std::vector<std::future<simple_gateway::stream_info::sptr>> futures;
+  for( uint64_t i=0; i<singles; ++i )
+  {
+    auto feeder = [&](simple_gateway::stream_part & p) {
+      p.buffer_ = (const uint8_t *)msg.data();
+      p.size_ = msg.size();
+      return false;
+    };
+    simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+    futures.push_back(client->start_async(1, feeder, fsm, { 0 }, info));
+  }
+  
+  std::atomic<uint64_t> done{0};
+  for( uint64_t i=0; i<streams; ++i )
+  {
+    std::shared_ptr<uint64_t> sent{new uint64_t{0}};
+    auto feeder = [&msg,sent,parts](simple_gateway::stream_part & p) {
+      p.buffer_ = (const uint8_t *)msg.data();
+      p.size_ = msg.size();
+      return ++(*sent) < parts;
+    };
+    simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+    client->start_async(1, feeder, fsm, { 0 }, info,
+                        [&](simple_gateway::stream_info::sptr info, std::exception_ptr error) {
+                          EXPECT_FALSE(error);
+                          EXPECT_EQ(info->sent_seqno_, (int64_t)parts-1);
+                          ++done;
+                        });
+  }
+  
+  std::set<int64_t> ids;
+  for( auto & f : futures )
+  {
+    ASSERT_EQ(f.wait_for(std::chrono::seconds(10)), std::future_status::ready);
+    ids.insert(f.get()->id_);
+  }
+  EXPECT_EQ(ids.size(), singles);
+  EXPECT_EQ(ids.count(-1), 0);
+  
+  for( int i=0; i<1000 && (done < streams || handled < singles+streams*parts); ++i )
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  server->stop();
+  thr.join();
+  
+  EXPECT_EQ(done.load(), streams);
+  EXPECT_EQ(client->async_in_flight(), 0);
+  EXPECT_EQ(handled.load(), singles+streams*parts);
+}
+
+TEST_F(SimpleGatewayTest, CoroutineHandler)
+{
+  const char * path = "/tmp/SimpleGatewayTest.CoroutineHandler";
+  
+  auto server = simple_server::create(path, params(), trace);
+  server->seek_to_end();
+  server->add_coroutine_handler<sum_parts>(1);
+  std::thread thr{[server](){ server->run(server->receiver_position()); }};
+  
+  auto client = simple_client::create(path);
+  client->seek_to_end();
+  
+  std::vector<std::string> parts{ "1", "20", "300" };
+  size_t next = 0;
+  auto feeder = [&](simple_gateway::stream_part & p) {
+    p.buffer_ = (const uint8_t *)parts[next].data();
+    p.size_ = parts[next].size();
+    return ++next < parts.size();
+  };
+  state_machine::sptr fsm { new state_machine{"CoroutineHandlerClient", trace} };
+  simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+  client->start(1, feeder, fsm, { 0 }, info);
+  
+  ASSERT_TRUE(client->wait_data(info->id_, 0, 10000));
+  simple_gateway::stream_part reply;
+  ASSERT_TRUE(client->get_data(info->id_, 0, reply));
+  EXPECT_EQ(std::string((const char *)reply.buffer_, reply.size_), "321");
+  EXPECT_EQ(reply.event_, (uint8_t)simple_gateway::EV_END);
+  client->release_data(info->id_);
+  
+  server->stop();
+  thr.join();
+  
+  // the frame went back to the pool
+  EXPECT_EQ(server->coroutine_frames(), 0);
+}
+
+TEST_F(SimpleGatewayTest, ConcurrentReplies)
+{
+  const char * path = "/tmp/SimpleGatewayTest.ConcurrentReplies";
+  const uint64_t async_streams  = 200;
+  const uint64_t sync_streams   = 50;
+  
+  auto server = simple_server::create(path, params(), trace);
+  server->seek_to_end();
+  server->add_coroutine_handler<sum_parts>(1);
+  std::thread thr{[server](){ server->run(server->receiver_position()); }};
+  
+  simple_gateway::options opts;
+  opts.concurrent_send_ = true;
+  auto client = simple_client::create(path, params(), opts);
+  client->seek_to_end();
+  std::vector<std::string> parts{ "1", "20", "300" };
+  
+  // the async loop receives replies while this thread waits for its own
+  std::atomic<uint64_t> async_done{0};
+  state_machine::sptr async_fsm { new state_machine{"ConcurrentRepliesAsync", trace} };
+  for( uint64_t i=0; i<async_streams; ++i )
+  {
+    std::shared_ptr<size_t> next{new size_t{0}};
+    auto feeder = [&parts,next](simple_gateway::stream_part & p) {
+      p.buffer_ = (const uint8_t *)parts[*next].data();
+      p.size_ = parts[*next].size();
+      return ++(*next) < parts.size();
+    };
+    simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+    client->start_async(1, feeder, async_fsm, { 0 }, info,
+                        [&](simple_gateway::stream_info::sptr info, std::exception_ptr error) {
+                          ++async_done;
+                        });
+  }
+  
+  for( uint64_t i=0; i<sync_streams; ++i )
+  {
+    size_t next = 0;
+    auto feeder = [&](simple_gateway::stream_part & p) {
+      p.buffer_ = (const uint8_t *)parts[next].data();
+      p.size_ = parts[next].size();
+      return ++next < parts.size();
+    };
+    state_machine::sptr fsm { new state_machine{"ConcurrentRepliesClient", trace} };
+    simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+    client->start(1, feeder, fsm, { 0 }, info);
+    
+    ASSERT_TRUE(client->wait_data(info->id_, 0, 10000));
+    simple_gateway::stream_part reply;
+    ASSERT_TRUE(client->get_data(info->id_, 0, reply));
+    EXPECT_EQ(std::string((const char *)reply.buffer_, reply.size_), "321");
+    client->release_data(info->id_);
+  }
+  
+  for( int i=0; i<1000 && async_done < async_streams; ++i )
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  server->stop();
+  thr.join();
+  EXPECT_EQ(async_done.load(), async_streams);
+}
+
+TEST_F(SimpleGatewayTest, Crc32c)
+{
+  const char * check = "123456789";
+  EXPECT_EQ(crc32c(0, check, 9), 0xe3069283u);
+  EXPECT_EQ(crc32c_sw(0, check, 9), 0xe3069283u);
+  
+  // all lane paths, unaligned starts and chaining
+  std::string data(3*8192*2+1000, 0);
+  for( size_t i=0; i<data.size(); ++i )
+    data[i] = (char)((i*7919) >> 3);
+  for( size_t len : std::vector<size_t>{ 0, 1, 7, 8, 255, 768, 1000, 24576, 24577, data.size()-3 } )
+  {
+    for( size_t off : std::vector<size_t>{ 0, 1, 3 } )
+    {
+      if( off+len > data.size() ) continue;
+      EXPECT_EQ(crc32c(0, data.data()+off, len), crc32c_sw(0, data.data()+off, len));
+    }
+  }
+  uint32_t whole = crc32c(0, data.data(), data.size());
+  EXPECT_EQ(crc32c(crc32c(0, data.data(), 5000), data.data()+5000, data.size()-5000), whole);
+}
+
+TEST_F(SimpleGatewayTest, CorruptPartRequestsFix)
+{
+  const char * path = "/tmp/SimpleGatewayTest.CorruptPartRequestsFix";
+  
+  std::atomic<uint64_t> handled{0};
+  
+  auto server = simple_server::create(path, params(), trace);
+  server->seek_to_end();
+  {
+    auto new_stream = [&](const simple_gateway::stream_part & start,
+                          state_machine::trace_fun trace_cb) {
+      state_machine::sptr fsm { new state_machine{"CorruptPart STREAM", trace_cb} };
+      action::sptr count{new action{[&](uint16_t seqno, transition & tran, state_machine & sm) {
+        ++handled;
+      }, "COUNT PART"}};
+      transition::sptr one    {new transition{0, simple_gateway::EV_ONE,   2, "Single part"}};
+      transition::sptr start_ {new transition{0, simple_gateway::EV_START, 1, "First part"}};
+      transition::sptr next   {new transition{1, simple_gateway::EV_NEXT,  1, "Next part"}};
+      transition::sptr end    {new transition{1, simple_gateway::EV_END,   2, "Last part"}};
+      for( auto & t : { one, start_, next, end } )
+      {
+        t->set_action(1, count);
+        fsm->add_transition(t);
+      }
+      return fsm;
+    };
+    auto new_info = [](uint64_t id) {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      info->id_ = id;
+      return info;
+    };
+    server->add_handler(1, new_stream, { 2 }, new_info);
+  }
+  std::thread thr{[server](){ server->run(server->receiver_position()); }};
+  
+  // a checked stream goes through
+  simple_gateway::options opts;
+  opts.crc_ = true;
+  auto client = simple_client::create(path, params(), opts);
+  client->seek_to_end();
+  {
+    uint64_t sent = 0;
+    std::string msg{"checked part"};
+    auto feeder = [&](simple_gateway::stream_part & p) {
+      p.buffer_ = (const uint8_t *)msg.data();
+      p.size_ = msg.size();
+      return ++sent < 3;
+    };
+    state_machine::sptr fsm { new state_machine{"CorruptPartClient", trace} };
+    simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+    client->start(1, feeder, fsm, { 0 }, info);
+  }
+  
+  // a torn single part, written raw with the checksum of the intact one
+  const uint64_t torn_id = 12345;
+  {
+    varint v_id{torn_id};
+    std::string header;
+    header += (char)(simple_gateway::EV_ONE | simple_gateway::FLAG_CRC);
+    header += (char)1;
+    header.append((const char *)v_id.buf(), v_id.len());
+    std::string payload{"intact payload"};
+    uint32_t crc = crc32c(crc32c(0, header.data(), header.size()), payload.data(), payload.size());
+    uint8_t crc_buf[4] = { (uint8_t)crc, (uint8_t)(crc >> 8), (uint8_t)(crc >> 16), (uint8_t)(crc >> 24) };
+    payload[3] = 'X';
+    
+    simple_publisher raw{std::string{path}+"/0"};
+    raw.push(simple_publisher::buffer_vector{
+      simple_publisher::buffer{header.data(), header.size()},
+      simple_publisher::buffer{crc_buf, 4},
+      simple_publisher::buffer{payload.data(), payload.size()},
+    });
+  }
+  
+  std::set<uint64_t> fixes;
+  for( int i=0; i<1000 && fixes.empty(); ++i )
+  {
+    fixes = client->take_fix_requests(torn_id);
+    if( fixes.empty() )
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  server->stop();
+  thr.join();
+  
+  EXPECT_EQ(handled.load(), 3);
+  EXPECT_EQ(server->corrupt_parts(), 1);
+  EXPECT_EQ(fixes, std::set<uint64_t>{ 0 });
+}
+
+TEST_F(SimpleGatewayTest, ReclaimConsumed)
+{
+  const char * path = "/tmp/SimpleGatewayTest.ReclaimConsumed";
+  
+  std::atomic<uint64_t> handled{0};
+  
+  auto server = simple_server::create(path, params(), trace);
+  server->seek_to_end();
+  {
+    auto new_stream = [&](const simple_gateway::stream_part & start,
+                          state_machine::trace_fun trace_cb) {
+      state_machine::sptr fsm { new state_machine{"Reclaim STREAM", trace_cb} };
+      action::sptr count{new action{[&](uint16_t seqno, transition & tran, state_machine & sm) {
+        ++handled;
+      }, "COUNT PART"}};
+      transition::sptr start_ {new transition{0, simple_gateway::EV_START, 1, "First part"}};
+      transition::sptr next   {new transition{1, simple_gateway::EV_NEXT,  1, "Next part"}};
+      transition::sptr end    {new transition{1, simple_gateway::EV_END,   2, "Last part"}};
+      for( auto & t : { start_, next, end } )
+      {
+        t->set_action(1, count);
+        fsm->add_transition(t);
+      }
+      return fsm;
+    };
+    auto new_info = [](uint64_t id) {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      info->id_ = id;
+      return info;
+    };
+    server->add_handler(1, new_stream, { 2 }, new_info);
+  }
+  std::thread thr{[server](){ server->run(server->receiver_position()); }};
+  
+  simple_gateway::options opts;
+  opts.reclaim_interval_ms_ = 5;
+  auto client = simple_client::create(path, params(), opts);
+  client->seek_to_end();
+  
+  // while the stream is sent its start is the limit, whatever the
+  // server has read
+  uint64_t live_mark = 0;
+  uint64_t stream_id = 0;
+  {
+    uint64_t sent = 0;
+    std::string msg{"reclaimable part"};
+    auto feeder = [&](simple_gateway::stream_part & p) {
+      if( sent == 3 )
+      {
+        while( handled < 3 )
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        stream_id = p.id_;
+        live_mark = client->reclaim();
+      }
+      p.buffer_ = (const uint8_t *)msg.data();
+      p.size_ = msg.size();
+      return ++sent < 5;
+    };
+    state_machine::sptr fsm { new state_machine{"ReclaimClient", trace} };
+    simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+    client->start(1, feeder, fsm, { 0 }, info);
+  }
+  EXPECT_EQ(live_mark, stream_id);
+  
+  // the background pass catches up once the server has read everything
+  for( int i=0; i<1000 && client->reclaimed_position() < client->sender_position(); ++i )
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  
+  server->stop();
+  thr.join();
+  
+  EXPECT_EQ(handled.load(), 5);
+  EXPECT_EQ(client->reclaimed_position(), client->sender_position());
+  EXPECT_EQ(client->low_water_mark(), client->sender_position());
+}
+
+TEST_F(SimpleGatewayTest, Placement)
+{
+  const char * path = "/tmp/SimpleGatewayTest.Placement";
+  
+  std::vector<int> nodes = numa_nodes();
+  ASSERT_FALSE(nodes.empty());
+  EXPECT_FALSE(node_cpus(nodes[0]).empty());
+  
+  placement p;
+  EXPECT_TRUE(p.empty());
+  p.numa_node_ = nodes[0];
+  p.cpus_ = node_cpus(nodes[0]);
+  EXPECT_FALSE(p.empty());
+  
+  // a mapping under the gateway's folder is found through /proc/self/maps
+  auto server = simple_server::create(path, params(), trace);
+  std::string seg_path{std::string{path}+"/placed"};
+  int fd = ::open(seg_path.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0600);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(::ftruncate(fd, 1024*1024), 0);
+  void * seg = ::mmap(nullptr, 1024*1024, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  ASSERT_NE(seg, MAP_FAILED);
+  EXPECT_GE(server->set_placement(p), 1024*1024);
+  ::munmap(seg, 1024*1024);
+  ::unlink(seg_path.c_str());
+  
+  bool pinned = false;
+  std::thread thr{[&](){ pinned = place_thread(p); }};
+  thr.join();
+  EXPECT_TRUE(pinned);
+}
+
+TEST_F(SimpleGatewayTest, ReplayCapture)
+{
+  const char * capture = "/tmp/SimpleGatewayTest.ReplayCapture";
+  const char * target  = "/tmp/SimpleGatewayTest.ReplayTarget";
+  
+  // the capture: 3 stamped streams of 2 parts, 20ms apart
+  uint64_t from = 0;
+  {
+    simple_gateway::options opts;
+    opts.timestamp_ = true;
+    auto client = simple_client::create(capture, params(), opts);
+    from = client->sender_position();
+    std::string msg{"captured part"};
+    for( int i=0; i<3; ++i )
+    {
+      uint64_t sent = 0;
+      auto feeder = [&](simple_gateway::stream_part & p) {
+        p.buffer_ = (const uint8_t *)msg.data();
+        p.size_ = msg.size();
+        return ++sent < 2;
+      };
+      state_machine::sptr fsm { new state_machine{"CaptureClient", trace} };
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      client->start(1, feeder, fsm, { 0 }, info);
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+  }
+  
+  std::atomic<uint64_t> handled{0};
+  auto server = simple_server::create(target, params(), trace);
+  server->seek_to_end();
+  {
+    auto new_stream = [&](const simple_gateway::stream_part & start,
+                          state_machine::trace_fun trace_cb) {
+      state_machine::sptr fsm { new state_machine{"Replay STREAM", trace_cb} };
+      action::sptr count{new action{[&](uint16_t seqno, transition & tran, state_machine & sm) {
+        ++handled;
+      }, "COUNT PART"}};
+      transition::sptr start_ {new transition{0, simple_gateway::EV_START, 1, "First part"}};
+      transition::sptr end    {new transition{1, simple_gateway::EV_END,   2, "Last part"}};
+      for( auto & t : { start_, end } )
+      {
+        t->set_action(1, count);
+        fsm->add_transition(t);
+      }
+      return fsm;
+    };
+    auto new_info = [](uint64_t id) {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      info->id_ = id;
+      return info;
+    };
+    server->add_handler(1, new_stream, { 2 }, new_info);
+  }
+  std::thread thr{[server](){ server->run(server->receiver_position()); }};
+  
+  // the original pace takes the 40ms between the first and last stream
+  uint64_t stamped = 0;
+  auto replay = queue_replay::create(capture, target);
+  auto paced = replay->run(1.0, from, UINT64_MAX, [&](uint64_t position,
+                                                      const simple_gateway::stream_part & part,
+                                                      uint64_t pushed_us) {
+    if( part.flags_ & simple_gateway::FLAG_STAMP ) ++stamped;
+  });
+  EXPECT_EQ(paced.messages_, 6);
+  EXPECT_EQ(paced.unstamped_, 0);
+  EXPECT_EQ(stamped, 6);
+  EXPECT_GE(paced.seconds_, 0.035);
+  
+  // at 4x, or as fast as possible
+  auto fast = replay->run(4.0, from);
+  EXPECT_LT(fast.seconds_, paced.seconds_);
+  auto flat_out = replay->run(0, from, 3);
+  EXPECT_EQ(flat_out.messages_, 3);
+  
+  for( int i=0; i<100 && handled < 15; ++i )
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  server->stop();
+  thr.join();
+  
+  // the last stream of the third run was cut in half
+  EXPECT_EQ(handled.load(), 15);
+}
+
+TEST_F(SimpleGatewayTest, ScatterGather)
+{
+  const char * path = "/tmp/SimpleGatewayTest.ScatterGather";
+  
+  // a row group as separate columns, sent without concatenating them
+  std::vector<std::vector<std::string>> groups{
+    { "ids:0123", "", "names:alice,bob" },
+    { std::string(8*1024, 'x'), "tail" },
+  };
+  std::vector<std::vector<std::string>> received;
+  std::vector<uint8_t> flags;
+  
+  std::promise<void> notify_on_end;
+  std::future<void> on_end{notify_on_end.get_future()};
+  
+  auto server = simple_server::create(path, params(), trace);
+  server->seek_to_end();
+  {
+    auto new_stream = [&](const simple_gateway::stream_part & start,
+                          state_machine::trace_fun trace_cb) {
+      state_machine::sptr fsm { new state_machine{"ScatterGather STREAM", trace_cb} };
+      action::sptr store{new action{[&](uint16_t seqno, transition & tran, state_machine & sm) {
+        const simple_gateway::stream_part & p = server->current_part();
+        std::vector<std::string> segments;
+        simple_gateway::segment_reader reader{p};
+        bytes_view segment;
+        while( reader.next(segment) )
+          segments.push_back(segment.str());
+        received.push_back(segments);
+        flags.push_back(p.flags_);
+        if( p.event_ == simple_gateway::EV_END )
+          notify_on_end.set_value();
+      }, "STORE PART"}};
+      transition::sptr start_ {new transition{0, simple_gateway::EV_START, 1, "First part"}};
+      transition::sptr end    {new transition{1, simple_gateway::EV_END,   2, "Last part"}};
+      for( auto & t : { start_, end } )
+      {
+        t->set_action(1, store);
+        fsm->add_transition(t);
+      }
+      return fsm;
+    };
+    auto new_info = [](uint64_t id) {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      info->id_ = id;
+      return info;
+    };
+    server->add_handler(1, new_stream, { 2 }, new_info);
+  }
+  std::thread thr{[server](){ server->run(server->receiver_position()); }};
+  
+  // the checksum covers the gathered buffers too
+  simple_gateway::options opts;
+  opts.crc_ = true;
+  opts.oob_threshold_ = 4096;
+  auto client = simple_client::create(path, params(), opts);
+  client->seek_to_end();
+  {
+    size_t next = 0;
+    auto feeder = simple_gateway::gather_feeder([&](simple_gateway::stream_part & p,
+                                                   simple_publisher::buffer_vector & buffers) {
+      for( auto & column : groups[next] )
+        buffers.push_back(simple_publisher::buffer{column.data(), column.size()});
+      return ++next < groups.size();
+    });
+    state_machine::sptr fsm { new state_machine{"ScatterGatherClient", trace} };
+    simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+    client->start(1, feeder, fsm, { 0 }, info);
+  }
+  
+  EXPECT_EQ(on_end.wait_for(std::chrono::seconds(10)), std::future_status::ready);
+  server->stop();
+  thr.join();
+  
+  // gathered parts are never sent out-of-band
+  EXPECT_EQ(received, groups);
+  ASSERT_EQ(flags.size(), 2);
+  for( auto f : flags )
+  {
+    EXPECT_TRUE(f & simple_gateway::FLAG_SEGMENTS);
+    EXPECT_FALSE(f & simple_gateway::FLAG_OOB);
+  }
+  
+  // a plain part reads as a single segment
+  std::string plain{"plain"};
+  simple_gateway::stream_part p;
+  p.buffer_ = (const uint8_t *)plain.data();
+  p.size_ = plain.size();
+  simple_gateway::segment_reader reader{p};
+  bytes_view segment;
+  ASSERT_TRUE(reader.next(segment));
+  EXPECT_EQ(segment.str(), plain);
+  EXPECT_FALSE(reader.next(segment));
+}
+
+TEST_F(SimpleGatewayTest, Quarantine)
+{
+  const char * path = "/tmp/SimpleGatewayTest.Quarantine";
+  
+  std::atomic<uint64_t> handled{0};
+  auto server = simple_server::create(path, params(), trace);
+  server->seek_to_end();
+  uint64_t from = server->receiver_position();
+  // two ids kept, no reports
+  server->set_quarantine(2, 0);
+  {
+    auto new_stream = [&](const simple_gateway::stream_part & start,
+                          state_machine::trace_fun trace_cb) {
+      state_machine::sptr fsm { new state_machine{"Quarantine STREAM", trace_cb} };
+      action::sptr count{new action{[&](uint16_t seqno, transition & tran, state_machine & sm) {
+        ++handled;
+      }, "COUNT PART"}};
+      transition::sptr start_ {new transition{0, simple_gateway::EV_START, 1, "First part"}};
+      transition::sptr next   {new transition{1, simple_gateway::EV_NEXT,  1, "Next part"}};
+      transition::sptr end    {new transition{1, simple_gateway::EV_END,   2, "Last part"}};
+      for( auto & t : { start_, next, end } )
+      {
+        t->set_action(1, count);
+        fsm->add_transition(t);
+      }
+      return fsm;
+    };
+    server->add_handler(1, new_stream, { 2 }, [](uint64_t id) {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      info->id_ = id;
+      return info;
+    });
+  }
+  
+  // everything is queued before the server runs
+  {
+    auto client = simple_client::create(path);
+    std::string msg{"part"};
+    auto send = [&](uint8_t type, uint64_t parts) {
+      uint64_t sent = 0;
+      auto feeder = [&](simple_gateway::stream_part & p) {
+        p.buffer_ = (const uint8_t *)msg.data();
+        p.size_ = msg.size();
+        return ++sent < parts;
+      };
+      state_machine::sptr fsm { new state_machine{"QuarantineClient", trace} };
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      client->start(type, feeder, fsm, { 0 }, info);
+    };
+    // no handler for 9: a stream of 5 and a single part
+    send(9, 5);
+    send(9, 1);
+    send(1, 3);
+  }
+  {
+    simple_publisher pub{std::string{path}+"/0"};
+    auto raw = [&](uint8_t event, uint64_t id, uint64_t seqno) {
+      varint v_id{id};
+      varint v_seqno{seqno};
+      pub.push(simple_publisher::buffer_vector{
+        simple_publisher::buffer{&event, 1},
+        simple_publisher::buffer{v_id.buf(), v_id.len()},
+        simple_publisher::buffer{v_seqno.buf(), v_seqno.len()},
+      });
+    };
+    // parts of a stream the server never saw start
+    raw(simple_gateway::EV_NEXT, 12345, 1);
+    raw(simple_gateway::EV_NEXT, 12345, 2);
+    raw(simple_gateway::EV_END,  12345, 3);
+    for( uint64_t id : { 100, 101, 102 } )
+      raw(simple_gateway::EV_NEXT, id, 1);
+    // a truncated id
+    uint8_t torn[2] = { simple_gateway::EV_NEXT, 0x80 };
+    pub.push(torn, 2);
+  }
+  
+  std::thread thr{[server,from](){ server->run(from); }};
+  for( int i=0; i<100 && server->failed_parts(simple_server::FAIL_MALFORMED) == 0; ++i )
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  server->stop();
+  thr.join();
+  
+  EXPECT_EQ(handled, 3);
+  EXPECT_EQ(server->failed_parts(simple_server::FAIL_NO_HANDLER), 2);
+  EXPECT_EQ(server->failed_parts(simple_server::FAIL_UNKNOWN_STREAM), 4);
+  EXPECT_EQ(server->failed_parts(simple_server::FAIL_QUARANTINED), 6);
+  EXPECT_EQ(server->failed_parts(simple_server::FAIL_MALFORMED), 1);
+  EXPECT_EQ(server->failed_parts(simple_server::FAIL_HANDLER_ERROR), 0);
+  // finished streams are forgotten, of the rest the newest two are kept
+  EXPECT_EQ(server->quarantined_streams(), 2);
+}
+
+TEST_F(SimpleGatewayTest, GatewayPool)
+{
+  const char * path = "/tmp/SimpleGatewayTest.GatewayPool";
+  
+  auto server = simple_server::create(path, params(), trace);
+  gateway_pool pool{2};
+  
+  simple_client * first = nullptr;
+  {
+    auto client = pool.acquire(path);
+    first = client.get();
+    EXPECT_EQ(pool.idle(path), 0);
+  }
+  // back in the pool and handed out again
+  EXPECT_EQ(pool.idle(path), 1);
+  {
+    auto a = pool.acquire(path);
+    auto b = pool.acquire(path);
+    EXPECT_EQ(a.get(), first);
+    EXPECT_NE(b.get(), first);
+  }
+  EXPECT_EQ(pool.hits(), 1);
+  EXPECT_EQ(pool.misses(), 2);
+  EXPECT_EQ(pool.idle(path), 2);
+  
+  // other options are other clients, at most 2 kept per kind
+  simple_gateway::options opts;
+  opts.crc_ = true;
+  EXPECT_EQ(pool.idle(path, params(), opts), 0);
+  pool.warm(path, 5, params(), opts);
+  EXPECT_EQ(pool.idle(path, params(), opts), 2);
+  {
+    auto a = pool.acquire(path, params(), opts);
+    auto b = pool.acquire(path, params(), opts);
+    auto c = pool.acquire(path, params(), opts);
+  }
+  EXPECT_EQ(pool.idle(path, params(), opts), 2);
+  
+  pool.clear();
+  EXPECT_EQ(pool.idle(path), 0);
+  auto kept = pool.acquire(path);
+  EXPECT_EQ(&gateway_pool::instance(), &gateway_pool::instance());
+}
+
+TEST_F(SimpleGatewayTest, SpillToDisk)
+{
+  const char * path = "/tmp/SimpleGatewayTest.SpillToDisk";
+  const uint64_t parts = 64;
+  
+  std::vector<std::string> received;
+  std::promise<void> notify_on_done;
+  std::future<void> on_done{notify_on_done.get_future()};
+  
+  auto server = simple_server::create(path, params(), trace);
+  server->seek_to_end();
+  {
+    auto new_stream = [&](const simple_gateway::stream_part & start,
+                          state_machine::trace_fun trace_cb) {
+      state_machine::sptr fsm { new state_machine{"SpillToDisk STREAM", trace_cb} };
+      simple_gateway::set_event_names(*fsm);
+      action::sptr record{new action{[&](uint16_t seqno, transition & tran, state_machine & sm) {
+        const simple_gateway::stream_part & p = server->current_part();
+        received.push_back(std::string{(const char *)p.buffer_, p.size_});
+        if( received.size() == parts )
+          notify_on_done.set_value();
+      }, "RECORD PART"}};
+      transition::sptr start_ {new transition{0, simple_gateway::EV_START, 1, "First part"}};
+      transition::sptr next   {new transition{1, simple_gateway::EV_NEXT,  1, "Next part"}};
+      transition::sptr end    {new transition{1, simple_gateway::EV_END,   2, "Last part"}};
+      for( auto & t : { start_, next, end } )
+      {
+        t->set_action(1, record);
+        fsm->add_transition(t);
+      }
+      return fsm;
+    };
+    auto new_info = [](uint64_t id) {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      info->id_ = id;
+      return info;
+    };
+    server->add_handler(1, new_stream, { 2 }, new_info);
+  }
+  // the whole stream is read ahead, only 4 parts fit in memory
+  server->set_weight(1, 1);
+  server->set_scheduling(1024, parts);
+  server->set_memory_budget(4*1024);
+  
+  std::vector<std::string> msgs;
+  for( uint64_t i=0; i<parts; ++i )
+    msgs.push_back(std::string(1024, (char)('a'+i%26)) + std::to_string(i));
+  
+  auto client = simple_client::create(path);
+  client->seek_to_end();
+  {
+    uint64_t sent = 0;
+    auto feeder = [&](simple_gateway::stream_part & p) {
+      p.buffer_ = (const uint8_t *)msgs[sent].data();
+      p.size_ = msgs[sent].size();
+      return ++sent < parts;
+    };
+    state_machine::sptr fsm { new state_machine{"SpillToDiskClient", trace} };
+    simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+    client->start(1, feeder, fsm, { 0 }, info);
+  }
+  
+  std::thread thr{[server](){ server->run(server->receiver_position()); }};
+  EXPECT_EQ(on_done.wait_for(std::chrono::seconds(10)), std::future_status::ready);
+  server->stop();
+  thr.join();
+  
+  // the spilled parts come back intact and in order
+  ASSERT_EQ(received.size(), parts);
+  for( uint64_t i=0; i<parts; ++i )
+    EXPECT_EQ(received[i], msgs[i]);
+  EXPECT_GE(server->spilled_parts(), parts-4);
+  EXPECT_GE(server->spilled_bytes(), (parts-4)*1024);
+  EXPECT_EQ(server->buffered_bytes(), 0);
+  EXPECT_EQ(server->spill_errors(), 0);
+  
+  // the file starts over once everything is read back
+  spill_file spill{std::string{path}+"/spill"};
+  uint64_t a = spill.append((const uint8_t *)msgs[0].data(), msgs[0].size());
+  uint64_t b = spill.append((const uint8_t *)msgs[1].data(), msgs[1].size());
+  EXPECT_EQ(std::string((const char *)spill.read(b, msgs[1].size()), msgs[1].size()), msgs[1]);
+  EXPECT_EQ(std::string((const char *)spill.read(a, msgs[0].size()), msgs[0].size()), msgs[0]);
+  spill.release(b, msgs[1].size());
+  EXPECT_EQ(spill.live(), 1);
+  spill.release(a, msgs[0].size());
+  EXPECT_EQ(spill.size(), 0);
+  EXPECT_EQ(spill.total_bytes(), msgs[0].size()+msgs[1].size());
+  
+  // a backlog that never drains: the released prefix is given back, also
+  // when the parts are released out of order
+  spill_file backlog{std::string{path}+"/spill", 4096};
+  std::deque<std::pair<uint64_t, uint64_t>> live;
+  for( uint64_t i=0; i<parts; ++i )
+  {
+    live.push_back(std::make_pair(backlog.append((const uint8_t *)msgs[i].data(), msgs[i].size()), msgs[i].size()));
+    if( live.size() == 4 )
+    {
+      backlog.release(live[1].first, live[1].second);
+      backlog.release(live[0].first, live[0].second);
+      live.pop_front();
+      live.pop_front();
+    }
+  }
+  EXPECT_EQ(backlog.live(), 2);
+  EXPECT_GT(backlog.reclaimed_bytes(), backlog.size()/2);
+  EXPECT_LE(backlog.reclaimed_bytes(), backlog.size()-2*1024);
+}
+
+TEST_F(SimpleGatewayTest, Admission)
+{
+  const char * path = "/tmp/SimpleGatewayTest.Admission";
+  
+  auto server = simple_server::create(path, params(), trace);
+  server->seek_to_end();
+  {
+    // single parts keep their stream open until stopped
+    auto new_stream = [&](const simple_gateway::stream_part & start,
+                          state_machine::trace_fun trace_cb) {
+      state_machine::sptr fsm { new state_machine{"Admission STREAM", trace_cb} };
+      simple_gateway::set_event_names(*fsm);
+      fsm->add_transition(transition::sptr{new transition{0, simple_gateway::EV_ONE, 1, "Keep stream"}});
+      return fsm;
+    };
+    server->add_handler(1, new_stream, { 2 }, [](uint64_t id) {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      info->id_ = id;
+      return info;
+    });
+  }
+  // the handler says a stream of its takes 1000 bytes
+  server->set_admission(1, 2, 0, 1000);
+  std::thread thr{[server](){ server->run(server->receiver_position()); }};
+  
+  auto client = simple_client::create(path);
+  client->seek_to_end();
+  std::string msg{"request"};
+  auto send = [&]() {
+    auto feeder = [&](simple_gateway::stream_part & p) {
+      p.buffer_ = (const uint8_t *)msg.data();
+      p.size_ = msg.size();
+      return false;
+    };
+    state_machine::sptr fsm { new state_machine{"AdmissionClient", trace} };
+    simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+    client->start(1, feeder, fsm, { 0 }, info);
+    return (uint64_t)info->id_;
+  };
+  auto wait_for = [&](uint64_t active, uint64_t rejected) {
+    for( int i=0; i<500; ++i )
+    {
+      if( server->active_streams(1) == active &&
+          server->failed_parts(simple_server::FAIL_REJECTED) == rejected )
+        return true;
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+  };
+  
+  std::vector<uint64_t> ids;
+  for( int i=0; i<4; ++i )
+    ids.push_back(send());
+  EXPECT_TRUE(wait_for(2, 2));
+  // the declared bytes and the server's own record, no guesses
+  EXPECT_GT(server->memory_used(1), 2*1000);
+  EXPECT_LT(server->memory_used(1), 2*1000+2*1024);
+  EXPECT_EQ(server->memory_used(1), server->memory_used());
+  EXPECT_EQ(server->memory_used(2), 0);
+  
+  // the refused clients are told
+  EXPECT_FALSE(client->wait_data(ids[2], 0, 1000));
+  EXPECT_TRUE(client->is_reply_stopped(ids[2]));
+  EXPECT_TRUE(client->is_reply_stopped(ids[3]));
+  EXPECT_FALSE(client->is_reply_stopped(ids[0]));
+  
+  // a stopped stream makes room for a new one
+  client->stop(ids[0]);
+  EXPECT_TRUE(wait_for(1, 2));
+  send();
+  EXPECT_TRUE(wait_for(2, 2));
+  
+  server->stop();
+  thr.join();
+}
+
+TEST_F(ZmqGatewayTest, RelayIpc)
+{
+  const char * client_path  = "/tmp/ZmqGatewayTest.RelayIpc.Client";
+  const char * server_path  = "/tmp/ZmqGatewayTest.RelayIpc.Server";
+  const char * endpoint     = "ipc:///tmp/ZmqGatewayTest.RelayIpc.sock";
+  
+  std::vector<std::string> sent{"Hello world", std::string(1000, 'x'), "Foo"};
+  std::vector<std::string> received;
+  std::mutex mtx;
+  std::promise<void> notify_on_all;
+  std::future<void> on_all{notify_on_all.get_future()};
+  
+  // server on the remote side
+  auto server = simple_server::create(server_path, params(), trace);
+  server->seek_to_end();
+  {
+    auto new_stream = [&](const simple_gateway::stream_part & start,
+                          state_machine::trace_fun trace_cb) {
+      state_machine::sptr fsm { new state_machine{"RelayIpc STREAM", trace_cb} };
+      transition::sptr fake {new transition{0, simple_gateway::EV_ONE, 1, "Single message"}};
+      fsm->add_transition(fake);
+      
+      std::lock_guard<std::mutex> lock{mtx};
+      received.push_back(std::string{(const char *)start.buffer_, start.size_});
+      if( received.size() == sent.size() )
+        notify_on_all.set_value();
+      return fsm;
+    };
+    auto new_info = [&](uint64_t id) {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      info->id_ = id;
+      return info;
+    };
+    server->add_handler(1, new_stream, { 1 }, new_info);
+  }
+  std::thread server_thr{[server](){ server->run(server->receiver_position()); }};
+  
+  // relays: client side binds, server side connects
+  auto client_relay = zmq_gateway::create(client_path, endpoint, true,  zmq_gateway::LOCAL_CLIENTS);
+  auto server_relay = zmq_gateway::create(server_path, endpoint, false, zmq_gateway::LOCAL_SERVER);
+  client_relay->seek_to_end();
+  server_relay->seek_to_end();
+  std::thread client_relay_thr{[client_relay](){ client_relay->run(client_relay->receiver_position()); }};
+  std::thread server_relay_thr{[server_relay](){ server_relay->run(server_relay->receiver_position()); }};
+  
+  auto client = simple_client::create(client_path);
+  client->seek_to_end();
+  for( auto & msg : sent )
+  {
+    auto feeder = [&](simple_gateway::stream_part & p) {
+      p.buffer_ = (const uint8_t *)msg.c_str();
+      p.size_ = msg.size();
+      return false;
+    };
+    state_machine::sptr fsm { new state_machine{"RelayIpcClient", trace} };
+    simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+    client->start(1, feeder, fsm, { 0 }, info);
+  }
+  
+  EXPECT_EQ(on_all.wait_for(std::chrono::seconds(10)), std::future_status::ready);
+  {
+    std::lock_guard<std::mutex> lock{mtx};
+    EXPECT_EQ(received, sent);
+  }
+  
+  client_relay->stop();
+  server_relay->stop();
+  server->stop();
+  client_relay_thr.join();
+  server_relay_thr.join();
+  server_thr.join();
+  
+  EXPECT_EQ(client_relay->messages_out(), sent.size());
+  EXPECT_EQ(server_relay->messages_in(), sent.size());
+}
+
+TEST_F(ZmqGatewayTest, OversizedMessage)
+{
+  const char * path      = "/tmp/ZmqGatewayTest.OversizedMessage";
+  const char * sock_path = "/tmp/ZmqGatewayTest.OversizedMessage.sock";
+  
+  auto relay = zmq_gateway::create(path, std::string{"ipc://"}+sock_path, true, zmq_gateway::LOCAL_SERVER);
+  relay->set_max_message(4096);
+  relay->seek_to_end();
+  std::thread relay_thr{[relay](){ relay->run(relay->receiver_position()); }};
+  
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  ASSERT_GE(fd, 0);
+  struct sockaddr_un addr;
+  ::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  ::strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path)-1);
+  ASSERT_EQ(::connect(fd, (struct sockaddr *)&addr, sizeof(addr)), 0);
+  
+  // a message over the limit is read and dropped, the connection stays
+  // so the peer does not send it again and again. the next one goes on
+  std::string wire;
+  auto add_frame = [&](const std::string & data, bool more) {
+    uint8_t flags = (more ? zmq_gateway::FRAME_MORE : 0);
+    if( data.size() > 255 )
+    {
+      wire.push_back((char)(flags | zmq_gateway::FRAME_LONG));
+      for( int i=0; i<8; ++i )
+        wire.push_back((char)(data.size() >> (56-8*i)));
+    }
+    else
+    {
+      wire.push_back((char)flags);
+      wire.push_back((char)data.size());
+    }
+    wire += data;
+  };
+  add_frame("header", true);
+  add_frame(std::string(8192, 'x'), false);
+  add_frame("header", true);
+  add_frame("payload", false);
+  ASSERT_EQ(::send(fd, wire.data(), wire.size(), MSG_NOSIGNAL), (ssize_t)wire.size());
+  
+  for( int i=0; i<500 && relay->messages_in() == 0; ++i )
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  char buf[16];
+  EXPECT_EQ(::recv(fd, buf, sizeof(buf), MSG_DONTWAIT), -1);
+  ::close(fd);
+  
+  relay->stop();
+  relay_thr.join();
+  EXPECT_EQ(relay->oversized(), 1);
+  EXPECT_EQ(relay->messages_in(), 1);
+  EXPECT_EQ(relay->bytes_in(), 13);
+}
+
+TEST_F(ZmqGatewayTest, RelayOob)
+{
+  const char * client_path  = "/tmp/ZmqGatewayTest.RelayOob.Client";
+  const char * server_path  = "/tmp/ZmqGatewayTest.RelayOob.Server";
+  const char * endpoint     = "ipc:///tmp/ZmqGatewayTest.RelayOob.sock";
+  
+  // the middle one goes out-of-band, the relay sends its bytes inline
+  std::vector<std::string> sent{"Hello world", std::string(1000, 'x'), "Foo"};
+  std::vector<std::string> expected{sent};
+  std::vector<std::string> received;
+  std::mutex mtx;
+  std::promise<void> notify_on_all;
+  std::future<void> on_all{notify_on_all.get_future()};
+  
+  // server on the remote side
+  auto server = simple_server::create(server_path, params(), trace);
+  server->seek_to_end();
+  {
+    auto new_stream = [&](const simple_gateway::stream_part & start,
+                          state_machine::trace_fun trace_cb) {
+      state_machine::sptr fsm { new state_machine{"RelayOob STREAM", trace_cb} };
+      transition::sptr fake {new transition{0, simple_gateway::EV_ONE, 1, "Single message"}};
+      fsm->add_transition(fake);
+      
+      std::lock_guard<std::mutex> lock{mtx};
+      received.push_back(std::string{(const char *)start.buffer_, start.size_});
+      if( received.size() == expected.size() )
+        notify_on_all.set_value();
+      return fsm;
+    };
+    auto new_info = [&](uint64_t id) {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      info->id_ = id;
+      return info;
+    };
+    server->add_handler(1, new_stream, { 1 }, new_info);
+  }
+  std::thread server_thr{[server](){ server->run(server->receiver_position()); }};
+  
+  // relays: client side binds, server side connects
+  auto client_relay = zmq_gateway::create(client_path, endpoint, true,  zmq_gateway::LOCAL_CLIENTS);
+  auto server_relay = zmq_gateway::create(server_path, endpoint, false, zmq_gateway::LOCAL_SERVER);
+  client_relay->seek_to_end();
+  server_relay->seek_to_end();
+  std::thread client_relay_thr{[client_relay](){ client_relay->run(client_relay->receiver_position()); }};
+  std::thread server_relay_thr{[server_relay](){ server_relay->run(server_relay->receiver_position()); }};
+  
+  simple_gateway::options opts;
+  opts.oob_threshold_ = 512;
+  opts.crc_ = true;
+  auto client = simple_client::create(client_path, params(), opts);
+  client->seek_to_end();
+  for( auto & msg : sent )
+  {
+    auto feeder = [&](simple_gateway::stream_part & p) {
+      p.buffer_ = (const uint8_t *)msg.c_str();
+      p.size_ = msg.size();
+      return false;
+    };
+    state_machine::sptr fsm { new state_machine{"RelayOobClient", trace} };
+    simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+    client->start(1, feeder, fsm, { 0 }, info);
+  }
+  
+  EXPECT_EQ(on_all.wait_for(std::chrono::seconds(10)), std::future_status::ready);
+  {
+    std::lock_guard<std::mutex> lock{mtx};
+    EXPECT_EQ(received, expected);
+  }
+  
+  client_relay->stop();
+  server_relay->stop();
+  server->stop();
+  client_relay_thr.join();
+  server_relay_thr.join();
+  server_thr.join();
+  
+  EXPECT_EQ(client_relay->messages_out(), expected.size());
+  EXPECT_EQ(server_relay->messages_in(), expected.size());
+  EXPECT_EQ(client_relay->inlined_oob(), 1);
+  EXPECT_EQ(server->corrupt_parts(), 0);
+  
+  // the segment file went with the part, the folder is empty
+  EXPECT_EQ(::rmdir((std::string{client_path}+"/oob").c_str()), 0);
+}
+
+TEST_F(StripedGatewayTest, InOrder)
+{
+  const char * path = "/tmp/StripedGatewayTest.InOrder";
+  const uint64_t parts = 20;
+  
+  std::map<uint64_t, std::vector<std::string>> received;
+  std::map<uint64_t, std::vector<uint8_t>> events;
+  std::mutex mtx;
+  int ended = 0;
+  
+  auto server = striped_server::create(path, 3, params(), trace);
+  server->seek_to_end();
+  {
+    auto new_stream = [&](const simple_gateway::stream_part & start,
+                          state_machine::trace_fun trace_cb) {
+      state_machine::sptr fsm { new state_machine{"Striped STREAM", trace_cb} };
+      simple_gateway::set_event_names(*fsm);
+      action::sptr store{new action{[&](uint16_t seqno, transition & tran, state_machine & sm) {
+        const simple_gateway::stream_part & p = server->current_part();
+        std::lock_guard<std::mutex> lock{mtx};
+        received[p.id_].push_back(std::string{(const char *)p.buffer_, p.size_});
+        events[p.id_].push_back(p.event_);
+        if( p.event_ == simple_gateway::EV_END ) ++ended;
+      }, "STORE PART"}};
+      transition::sptr start_ {new transition{0, simple_gateway::EV_START, 1, "First part"}};
+      transition::sptr next   {new transition{1, simple_gateway::EV_NEXT,  1, "Next part"}};
+      transition::sptr end    {new transition{1, simple_gateway::EV_END,   2, "Last part"}};
+      for( auto & t : { start_, next, end } )
+      {
+        t->set_action(1, store);
+        fsm->add_transition(t);
+      }
+      return fsm;
+    };
+    auto new_info = [](uint64_t id) {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      info->id_ = id;
+      return info;
+    };
+    server->add_handler(1, new_stream, { 2 }, new_info);
+  }
+  std::thread thr{[server](){ server->run(); }};
+  
+  // two streams at the same time, their parts interleave on the stripes
+  auto client = striped_client::create(path, 3);
+  std::vector<std::thread> senders;
+  for( int s=0; s<2; ++s )
+  {
+    senders.push_back(std::thread{[&,s]() {
+      std::vector<std::string> msgs;
+      for( uint64_t i=0; i<parts; ++i )
+        msgs.push_back(std::to_string(s) + ":" + std::to_string(i));
+      client->start(1, parts, [&](uint64_t seqno, simple_gateway::stream_part & p) {
+        p.buffer_ = (const uint8_t *)msgs[seqno].data();
+        p.size_ = msgs[seqno].size();
+      });
+    }});
+  }
+  for( auto & t : senders )
+    t.join();
+  
+  for( int i=0; i<1000; ++i )
+  {
+    {
+      std::lock_guard<std::mutex> lock{mtx};
+      if( ended == 2 ) break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  server->stop();
+  thr.join();
+  
+  ASSERT_EQ(received.size(), 2);
+  for( auto & r : received )
+  {
+    ASSERT_EQ(r.second.size(), parts);
+    std::string prefix{r.second[0].substr(0, r.second[0].find(':')+1)};
+    for( uint64_t i=0; i<parts; ++i )
+      EXPECT_EQ(r.second[i], prefix + std::to_string(i));
+    
+    auto & ev = events[r.first];
+    EXPECT_EQ(ev.front(), (uint8_t)simple_gateway::EV_START);
+    EXPECT_EQ(ev.back(), (uint8_t)simple_gateway::EV_END);
+  }
+  EXPECT_EQ(server->failed_streams(), 0);
+}
+
+TEST_F(StripedGatewayTest, HandlerError)
+{
+  const char * path = "/tmp/StripedGatewayTest.HandlerError";
+  const uint64_t parts = 20;
+  
+  std::map<std::string, uint64_t> received;
+  std::mutex mtx;
+  
+  auto server = striped_server::create(path, 3, params(), trace);
+  server->seek_to_end();
+  // held parts go through the spill file
+  server->set_memory_budget(1);
+  {
+    auto new_stream = [&](const simple_gateway::stream_part & start,
+                          state_machine::trace_fun trace_cb) {
+      state_machine::sptr fsm { new state_machine{"Striped STREAM", trace_cb} };
+      simple_gateway::set_event_names(*fsm);
+      action::sptr store{new action{[&](uint16_t seqno, transition & tran, state_machine & sm) {
+        const simple_gateway::stream_part & p = server->current_part();
+        std::string msg{(const char *)p.buffer_, p.size_};
+        if( msg == "0:5" ) throw std::runtime_error{"bad part"};
+        std::lock_guard<std::mutex> lock{mtx};
+        ++received[msg.substr(0, 1)];
+      }, "STORE PART"}};
+      transition::sptr start_ {new transition{0, simple_gateway::EV_START, 1, "First part"}};
+      transition::sptr next   {new transition{1, simple_gateway::EV_NEXT,  1, "Next part"}};
+      transition::sptr end    {new transition{1, simple_gateway::EV_END,   2, "Last part"}};
+      for( auto & t : { start_, next, end } )
+      {
+        t->set_action(1, store);
+        fsm->add_transition(t);
+      }
+      return fsm;
+    };
+    auto new_info = [](uint64_t id) {
+      simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+      info->id_ = id;
+      return info;
+    };
+    server->add_handler(1, new_stream, { 2 }, new_info);
+  }
+  std::thread thr{[server](){ server->run(); }};
+  
+  auto client = striped_client::create(path, 3);
+  std::vector<std::thread> senders;
+  for( int s=0; s<2; ++s )
+  {
+    senders.push_back(std::thread{[&,s]() {
+      std::vector<std::string> msgs;
+      for( uint64_t i=0; i<parts; ++i )
+        msgs.push_back(std::to_string(s) + ":" + std::to_string(i));
+      client->start(1, parts, [&](uint64_t seqno, simple_gateway::stream_part & p) {
+        p.buffer_ = (const uint8_t *)msgs[seqno].data();
+        p.size_ = msgs[seqno].size();
+      });
+    }});
+  }
+  for( auto & t : senders )
+    t.join();
+  
+  for( int i=0; i<1000; ++i )
+  {
+    {
+      std::lock_guard<std::mutex> lock{mtx};
+      if( received["1"] == parts ) break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  server->stop();
+  thr.join();
+  
+  // the failed stream stops at the bad part, the other one is complete
+  EXPECT_EQ(received["0"], 5);
+  EXPECT_EQ(received["1"], parts);
+  EXPECT_EQ(server->failed_streams(), 1);
+  EXPECT_EQ(server->handler_errors(), 1);
+  EXPECT_EQ(server->buffered_bytes(), 0);
+  EXPECT_EQ(server->spill_errors(), 0);
+}
+
+TEST_F(StripedGatewayTest, TwoClients)
+{
+  const char * path = "/tmp/StripedGatewayTest.TwoClients";
+  const uint64_t streams = 50;
+  
+  // both clients see the same stripe ends, their ids must not collide
+  std::vector<striped_client::sptr> clients{striped_client::create(path, 3),
+                                            striped_client::create(path, 3)};
+  std::set<uint64_t> ids;
+  std::mutex mtx;
+  std::vector<std::thread> senders;
+  for( auto & client : clients )
+  {
+    senders.push_back(std::thread{[&,client]() {
+      std::string msg{"part"};
+      for( uint64_t i=0; i<streams; ++i )
+      {
+        uint64_t id = client->start(1, 4, [&](uint64_t seqno, simple_gateway::stream_part & p) {
+          p.buffer_ = (const uint8_t *)msg.data();
+          p.size_ = msg.size();
+        });
+        std::lock_guard<std::mutex> lock{mtx};
+        ids.insert(id);
+      }
+    }});
+  }
+  for( auto & t : senders )
+    t.join();
+  
+  EXPECT_EQ(ids.size(), clients.size()*streams);
+  
+  // a client opened later starts above all of them
+  auto later = striped_client::create(path, 3);
+  uint64_t id = later->start(1, 1, [](uint64_t seqno, simple_gateway::stream_part & p) { });
+  EXPECT_GT(id, *ids.rbegin());
+}
+
+TEST_F(FanoutGatewayTest, IndependentCursors)
+{
+  const char * path = "/tmp/FanoutGatewayTest.IndependentCursors";
+  
+  auto publisher = fanout_publisher::create(path);
+  auto fast = fanout_subscriber::create(path, "fast");
+  auto slow = fanout_subscriber::create(path, "slow");
+  fast->seek_to_end();
+  slow->seek_to_end();
+  
+  std::vector<std::string> msgs{"one", "two", "three"};
+  size_t next = 0;
+  publisher->publish(1, [&](simple_gateway::stream_part & p) {
+    p.buffer_ = (const uint8_t *)msgs[next].data();
+    p.size_ = msgs[next].size();
+    return ++next < msgs.size();
+  });
+  
+  auto read_all = [&](fanout_subscriber & sub) {
+    std::vector<std::string> ret;
+    while( ret.size() < msgs.size() )
+    {
+      sub.poll([&](const simple_gateway::stream_part & p) {
+        ret.push_back(std::string{(const char *)p.buffer_, p.size_});
+        return true;
+      }, 1000);
+    }
+    return ret;
+  };
+  
+  // the slow one does not hold back the fast one
+  EXPECT_EQ(read_all(*fast), msgs);
+  EXPECT_EQ(fast->lag(), 0);
+  EXPECT_GT(slow->lag(), 0);
+  
+  auto lags = publisher->subscriber_lags();
+  EXPECT_EQ(lags["fast"], 0);
+  EXPECT_EQ(lags["slow"], slow->lag());
+  
+  EXPECT_EQ(read_all(*slow), msgs);
+  EXPECT_EQ(slow->lag(), 0);
+  EXPECT_EQ(slow->messages(), msgs.size());
+  
+  // the cursor is resumed by name
+  uint64_t cursor = slow->cursor();
+  slow.reset();
+  auto resumed = fanout_subscriber::create(path, "slow");
+  EXPECT_EQ(resumed->cursor(), cursor);
+  
+  // the queue is kept from the slowest cursor on
+  EXPECT_EQ(publisher->reclaim(), std::min(fast->cursor(), resumed->cursor()));
+  
+  // even at the start of the queue
+  resumed->seek(0);
+  resumed.reset();
+  resumed = fanout_subscriber::create(path, "slow");
+  EXPECT_EQ(resumed->cursor(), 0);
+  EXPECT_EQ(publisher->reclaim(), 0);
+}
+
+TEST_F(VirtdbGatewayTest, DecodeColumn)
+{
+  std::vector<int64_t> values{1, -2, 300000, 0};
+  std::vector<bool> nulls{false, false, false, true};
+  std::string msg{encode_column("q1", "col", 7, values, nulls)};
+  
+  arena a{128};
+  column_view column;
+  const uint8_t * begin = (const uint8_t *)msg.data();
+  ASSERT_TRUE(virtdb_gateway::decode_column(begin, msg.size(), a, column));
+  
+  EXPECT_TRUE(column.query_id_ == "q1");
+  EXPECT_TRUE(column.name_ == "col");
+  EXPECT_EQ(column.seqno_, 7);
+  EXPECT_EQ(column.data_.kind_, (uint32_t)value_view::INT64);
+  ASSERT_EQ(column.data_.int64s_.size(), values.size());
+  for( size_t i=0; i<values.size(); ++i )
+    EXPECT_EQ(column.data_.int64s_[i], values[i]);
+  ASSERT_EQ(column.data_.is_null_.size(), nulls.size());
+  EXPECT_EQ(column.data_.is_null_[3], 1);
+  
+  // strings are not copied
+  EXPECT_GE(column.name_.data_, begin);
+  EXPECT_LT(column.name_.data_, begin+msg.size());
+  
+  // truncated messages are rejected
+  a.reset();
+  column_view bad;
+  EXPECT_FALSE(virtdb_gateway::decode_column(begin, msg.size()-3, a, bad));
+}
+
+TEST_F(VirtdbGatewayTest, DecodeQuery)
+{
+  std::string msg;
+  {
+    pb_writer w{msg};
+    w.string_field(1, "query-1");
+    w.string_field(2, "table");
+    for( auto name : { "a", "bb", "ccc" } )
+    {
+      std::string field;
+      pb_writer fw{field};
+      fw.string_field(1, name);
+      w.string_field(3, field);
+    }
+    w.varint_field(5, 1000);
+    w.string_field(6, "schema");
+  }
+  
+  arena a;
+  query_view query;
+  ASSERT_TRUE(virtdb_gateway::decode_query((const uint8_t *)msg.data(), msg.size(), a, query));
+  EXPECT_TRUE(query.query_id_ == "query-1");
+  EXPECT_TRUE(query.table_ == "table");
+  EXPECT_TRUE(query.schema_ == "schema");
+  EXPECT_EQ(query.limit_, 1000);
+  ASSERT_EQ(query.fields_.size(), 3);
+  EXPECT_TRUE(query.fields_[2] == "ccc");
+}
+
+TEST_F(VirtdbGatewayTest, ColumnStream)
+{
+  const char * path = "/tmp/VirtdbGatewayTest.ColumnStream";
+  
+  std::vector<std::string> parts;
+  for( uint64_t i=0; i<3; ++i )
+    parts.push_back(encode_column("q", "c", i, { (int64_t)i, (int64_t)i*10 }, {}));
+  
+  std::promise<void> notify_on_last;
+  std::future<void> on_last{notify_on_last.get_future()};
+  std::vector<uint64_t> seqnos;
+  int64_t sum = 0;
+  
+  auto server = simple_server::create(path, params(), trace);
+  server->seek_to_end();
+  virtdb_gateway gw{server};
+  gw.on_column([&](uint64_t id, const column_view & column) {
+    seqnos.push_back(column.seqno_);
+    for( auto v : column.data_.int64s_ ) sum += v;
+    if( seqnos.size() == parts.size() )
+      notify_on_last.set_value();
+  });
+  std::thread thr{[server](){ server->run(server->receiver_position()); }};
+  
+  auto client = simple_client::create(path);
+  client->seek_to_end();
+  {
+    size_t next = 0;
+    auto feeder = [&](simple_gateway::stream_part & p) {
+      p.buffer_ = (const uint8_t *)parts[next].data();
+      p.size_ = parts[next].size();
+      ++next;
+      return next < parts.size();
+    };
+    state_machine::sptr fsm { new state_machine{"ColumnStreamClient", trace} };
+    simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+    client->start(virtdb_gateway::COLUMN_STREAM, feeder, fsm, { 0 }, info);
+  }
+  
+  EXPECT_EQ(on_last.wait_for(std::chrono::seconds(10)), std::future_status::ready);
+  server->stop();
+  thr.join();
+  
+  EXPECT_EQ(seqnos, (std::vector<uint64_t>{0, 1, 2}));
+  EXPECT_EQ(sum, 33);
+  EXPECT_EQ(gw.decoded_parts(), 3);
+  EXPECT_EQ(gw.decode_errors(), 0);
+}
+
+TEST_F(VirtdbGatewayTest, PushdownStreamEnd)
+{
+  const char * path = "/tmp/VirtdbGatewayTest.PushdownStreamEnd";
+  
+  // b waits for a, which never comes. the stream ends with an empty
+  // part, then one that can't be decoded
+  std::vector<std::string> lasts{"", "not a column"};
+  std::string held{encode_column("q", "b", 0, { 10, 20 }, {})};
+  
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::vector<int64_t> emitted;
+  
+  auto server = simple_server::create(path, params(), trace);
+  server->seek_to_end();
+  virtdb_gateway gw{server};
+  std::shared_ptr<pushdown> stage{new pushdown{{ "b" }}};
+  stage->add_predicate(pushdown::predicate{"a", pushdown::OP_GT, {2}, {}, {}});
+  gw.set_pushdown(stage);
+  gw.on_column([&](uint64_t id, const column_view & column) {
+    std::lock_guard<std::mutex> lock{mtx};
+    for( auto v : column.data_.int64s_ ) emitted.push_back(v);
+    cv.notify_all();
+  });
+  std::thread thr{[server](){ server->run(server->receiver_position()); }};
+  
+  auto client = simple_client::create(path);
+  client->seek_to_end();
+  for( auto & last : lasts )
+  {
+    bool first = true;
+    auto feeder = [&](simple_gateway::stream_part & p) {
+      const std::string & msg = (first ? held : last);
+      p.buffer_ = (msg.empty() ? nullptr : (const uint8_t *)msg.data());
+      p.size_ = msg.size();
+      bool more = first;
+      first = false;
+      return more;
+    };
+    state_machine::sptr fsm { new state_machine{"PushdownStreamEndClient", trace} };
+    simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+    client->start(virtdb_gateway::COLUMN_STREAM, feeder, fsm, { 0 }, info);
+  }
+  
+  // the held block goes out with either end, without the predicate on a
+  {
+    std::unique_lock<std::mutex> lock{mtx};
+    EXPECT_TRUE(cv.wait_for(lock, std::chrono::seconds(10), [&](){ return emitted.size() == 4; }));
+    EXPECT_EQ(emitted, (std::vector<int64_t>{10, 20, 10, 20}));
+  }
+  server->stop();
+  thr.join();
+  
+  EXPECT_EQ(gw.decode_errors(), 1);
+}
+
+TEST_F(VirtdbGatewayTest, ResultCache)
+{
+  const char * path = "/tmp/VirtdbGatewayTest.ResultCache";
+  
+  auto encode_query = [](const std::string & query_id) {
+    std::string ret;
+    pb_writer w{ret};
+    w.string_field(1, query_id);
+    w.string_field(2, "table");
+    w.varint_field(5, 10);
+    return ret;
+  };
+  
+  auto server = simple_server::create(path, params(), trace);
+  server->seek_to_end();
+  virtdb_gateway gw{server};
+  gw.enable_cache(1024*1024, 60*1000);
+  
+  int queries = 0;
+  gw.on_query([&](uint64_t id, const query_view & query) {
+    ++queries;
+    for( uint64_t i=0; i<2; ++i )
+    {
+      std::string col{encode_column(query.query_id_.str(), "c", i, { (int64_t)i+1 }, {})};
+      gw.reply(id, (const uint8_t *)col.data(), col.size(), i == 1);
+    }
+  });
+  std::thread thr{[server](){ server->run(server->receiver_position()); }};
+  
+  auto client = simple_client::create(path);
+  client->seek_to_end();
+  
+  // the same query twice with different query ids
+  for( auto query_id : { "first", "second" } )
+  {
+    std::string query{encode_query(query_id)};
+    auto feeder = [&](simple_gateway::stream_part & p) {
+      p.buffer_ = (const uint8_t *)query.data();
+      p.size_ = query.size();
+      return false;
+    };
+    state_machine::sptr fsm { new state_machine{"ResultCacheClient", trace} };
+    simple_gateway::stream_info::sptr info { new simple_gateway::stream_info };
+    client->start(virtdb_gateway::QUERY_STREAM, feeder, fsm, { 0 }, info);
+    
+    int64_t sum = 0;
+    for( uint64_t seqno=0; seqno<2; ++seqno )
+    {
+      ASSERT_TRUE(client->wait_data(info->id_, seqno, 10000));
+      simple_gateway::stream_part part;
+      ASSERT_TRUE(client->get_data(info->id_, seqno, part));
+      EXPECT_EQ(part.event_, (uint8_t)(seqno == 1 ? simple_gateway::EV_END : simple_gateway::EV_NEXT));
+      
+      arena a;
+      column_view column;
+      ASSERT_TRUE(virtdb_gateway::decode_column(part.buffer_, part.size_, a, column));
+      EXPECT_TRUE(column.query_id_ == query_id);
+      EXPECT_EQ(column.seqno_, seqno);
+      for( auto v : column.data_.int64s_ ) sum += v;
+    }
+    EXPECT_EQ(sum, 3);
+    client->release_data(info->id_);
+  }
+  
+  server->stop();
+  thr.join();
+  
+  // the second one was served from the cache
+  EXPECT_EQ(queries, 1);
+  EXPECT_EQ(gw.cache()->hits(), 1);
+  EXPECT_EQ(gw.cache()->misses(), 1);
+  EXPECT_EQ(gw.cache()->stores(), 1);
+}
+
+TEST_F(VirtdbGatewayTest, ResultCacheEviction)
+{
+  // two slots: storing a third entry evicts the unreferenced one
+  result_cache cache{"/tmp/VirtdbGatewayTest.ResultCacheEviction", 2*128, 0, 128};
+  std::string data(100, 'x');
+  for( uint64_t i=0; i<3; ++i )
+  {
+    std::string key{std::to_string(i)};
+    if( i == 2 )
+    {
+      EXPECT_TRUE(cache.replay(result_cache::fingerprint("0"), "0", [](uint64_t, const result_cache::buffer_vector &, bool){}));
+    }
+    cache.begin(i, result_cache::fingerprint(key), key);
+    cache.append(i, (const uint8_t *)data.data(), data.size());
+    cache.commit(i);
+  }
+  
+  uint64_t parts = 0;
+  auto count = [&](uint64_t, const result_cache::buffer_vector & d, bool last) { ++parts; EXPECT_TRUE(last); };
+  EXPECT_TRUE(cache.replay(result_cache::fingerprint("0"), "0", count));
+  EXPECT_FALSE(cache.replay(result_cache::fingerprint("1"), "1", count));
+  EXPECT_TRUE(cache.replay(result_cache::fingerprint("2"), "2", count));
+  EXPECT_EQ(parts, 2);
+  EXPECT_EQ(cache.evictions(), 1);
+  
+  // a colliding fingerprint with another key is a miss
+  EXPECT_FALSE(cache.replay(result_cache::fingerprint("0"), "other", count));
+  
+  // entries expire after the TTL
+  result_cache short_lived{"/tmp/VirtdbGatewayTest.ResultCacheTtl", 2*128, 5, 128};
+  short_lived.begin(0, result_cache::fingerprint("0"), "0");
+  short_lived.append(0, (const uint8_t *)data.data(), data.size());
+  short_lived.commit(0);
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_FALSE(short_lived.replay(result_cache::fingerprint("0"), "0", count));
+  EXPECT_EQ(short_lived.expirations(), 1);
+  EXPECT_EQ(short_lived.bytes_used(), 0);
+}
+
+TEST_F(VirtdbGatewayTest, ResultCacheBuilds)
+{
+  result_cache cache{"/tmp/VirtdbGatewayTest.ResultCacheBuilds", 2*128, 0, 128};
+  std::string data(100, 'x');
+  std::string other(100, 'y');
+  cache.begin(0, result_cache::fingerprint("0"), "0");
+  cache.append(0, (const uint8_t *)data.data(), data.size());
+  cache.commit(0);
+  
+  // the replay runs without the lock, the slot read is not reused meanwhile
+  bool same = false;
+  auto rewrite = [&](uint64_t, const result_cache::buffer_vector & d, bool) {
+    cache.invalidate(result_cache::fingerprint("0"));
+    cache.begin(1, result_cache::fingerprint("1"), "1");
+    cache.append(1, (const uint8_t *)other.data(), other.size());
+    cache.commit(1);
+    same = (d.size() == 1 && std::string((const char *)d[0].first, d[0].second) == data);
+  };
+  EXPECT_TRUE(cache.replay(result_cache::fingerprint("0"), "0", rewrite));
+  EXPECT_TRUE(same);
+  EXPECT_FALSE(cache.replay(result_cache::fingerprint("0"), "0", rewrite));
+  
+  // the freed slot and the clock take two more entries, one is evicted
+  for( uint64_t i=2; i<4; ++i )
+  {
+    std::string key{std::to_string(i)};
+    cache.begin(i, result_cache::fingerprint(key), key);
+    cache.append(i, (const uint8_t *)data.data(), data.size());
+    cache.commit(i);
+  }
+  EXPECT_EQ(cache.evictions(), 1);
+  EXPECT_EQ(cache.bytes_used(), 2*128);
+  
+  // a build never committed nor aborted is abandoned after the timeout
+  cache.set_build_timeout(5);
+  cache.begin(4, result_cache::fingerprint("4"), "4");
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  cache.begin(5, result_cache::fingerprint("5"), "5");
+  EXPECT_FALSE(cache.is_building(4));
+  EXPECT_TRUE(cache.is_building(5));
+  EXPECT_EQ(cache.abandoned(), 1);
+}
+
+TEST_F(VirtdbGatewayTest, ColumnFrame)
+{
+  std::vector<int64_t> ids{1, 2, 3, 4, 5};
+  std::vector<double> prices{1.5, 0, 3.5, 4.5, 0};
+  std::vector<uint8_t> price_nulls{0, 1, 0, 0, 1};
+  std::vector<std::string> names{"a", "", "ccc", "dd", "e"};
+  std::vector<uint8_t> name_nulls{0, 1, 0, 0, 0};
+  
+  column_frame_writer writer{ids.size()};
+  writer.add_column("id", ids.data());
+  writer.add_column("price", prices.data(), price_nulls.data());
+  writer.add_strings("name", names.data(), name_nulls.data());
+  const std::vector<uint8_t> & frame = writer.finish();
+  EXPECT_TRUE(column_frame::is_frame(frame.data(), frame.size()));
+  
+  auto check = [&](const column_frame_reader & reader) {
+    ASSERT_EQ(reader.rows(), 5);
+    ASSERT_EQ(reader.columns(), 3);
+    EXPECT_EQ(reader.find("missing"), -1);
+    
+    int64_t id_col = reader.find("id");
+    ASSERT_EQ(id_col, 0);
+    auto id_values = reader.values<int64_t>(id_col);
+    EXPECT_EQ(std::vector<int64_t>(id_values.begin(), id_values.end()), ids);
+    EXPECT_EQ(reader.validity(id_col), nullptr);
+    EXPECT_EQ(reader.values<double>(id_col).size(), 0);
+    
+    int64_t price_col = reader.find("price");
+    auto price_values = reader.values<double>(price_col);
+    EXPECT_EQ((((uintptr_t)price_values.data_) % alignof(double)), 0);
+    EXPECT_EQ(price_values[3], 4.5);
+    EXPECT_TRUE(reader.is_null(price_col, 1));
+    EXPECT_FALSE(reader.is_null(price_col, 2));
+    
+    int64_t name_col = reader.find("name");
+    EXPECT_EQ(reader.type(name_col), (uint8_t)column_frame::STRING);
+    EXPECT_TRUE(reader.string(name_col, 2) == "ccc");
+    EXPECT_TRUE(reader.is_null(name_col, 1));
+    EXPECT_EQ(reader.offsets(name_col).size(), 6);
+    EXPECT_TRUE(reader.string_data(name_col) == "acccdde");
+  };
+  
+  // in place when aligned
+  column_frame_reader reader;
+  ASSERT_TRUE(reader.parse(frame.data(), frame.size()));
+  EXPECT_FALSE(reader.copied());
+  check(reader);
+  
+  // a misaligned part is copied once
+  std::vector<uint64_t> storage(frame.size()/8+2);
+  uint8_t * odd = (uint8_t *)storage.data()+3;
+  ::memcpy(odd, frame.data(), frame.size());
+  ASSERT_TRUE(reader.parse(odd, frame.size()));
+  EXPECT_TRUE(reader.copied());
+  check(reader);
+  
+  // truncated or foreign data is refused
+  EXPECT_FALSE(reader.parse(frame.data(), frame.size()-1));
+  EXPECT_EQ(reader.columns(), 0);
+  std::string text{"not a frame, just some bytes in a part"};
+  EXPECT_FALSE(reader.parse((const uint8_t *)text.data(), text.size()));
+  
+  // the writer's buffer is reused
+  writer.reset(2);
+  writer.add_column("id", ids.data());
+  writer.finish();
+  ASSERT_TRUE(reader.parse(writer.frame(), writer.size()));
+  EXPECT_EQ(reader.rows(), 2);
+}
+
+TEST_F(PushdownTest, Kernels)
+{
+  arena a;
+  
+  // int32 goes through the SSE2 kernel, 9 rows to have a scalar tail
+  std::vector<int32_t> ints{5, -1, 7, 3, 9, 0, 7, 2, 7};
+  std::vector<uint8_t> nulls{0, 0, 0, 0, 1, 0, 0, 0, 0};
+  value_view iv;
+  iv.kind_     = value_view::INT32;
+  iv.int32s_   = array_view<int32_t>{ints.data(), ints.size()};
+  iv.is_null_  = array_view<uint8_t>{nulls.data(), nulls.size()};
+  
+  auto select = [&](const value_view & v, const pushdown::predicate & p) {
+    uint64_t n = pushdown::rows(v);
+    std::vector<uint8_t> mask(n, 1);
+    std::vector<uint32_t> sel(n);
+    pushdown::evaluate(v, p, a, mask.data());
+    sel.resize(pushdown::build_selection(mask.data(), n, sel.data()));
+    return sel;
+  };
+  
+  pushdown::predicate ge{"c", pushdown::OP_GE, {5}, {}, {}};
+  EXPECT_EQ(select(iv, ge), (std::vector<uint32_t>{0, 2, 6, 8}));
+  
+  pushdown::predicate in{"c", pushdown::OP_IN, {3, 9, 0}, {}, {}};
+  EXPECT_EQ(select(iv, in), (std::vector<uint32_t>{3, 5}));
+  
+  pushdown::predicate is_null{"c", pushdown::OP_IS_NULL, {}, {}, {}};
+  EXPECT_EQ(select(iv, is_null), (std::vector<uint32_t>{4}));
+  
+  std::vector<double> doubles{0.5, 1.5, 2.5, 3.5, 4.5};
+  value_view dv;
+  dv.kind_     = value_view::DOUBLE;
+  dv.doubles_  = array_view<double>{doubles.data(), doubles.size()};
+  pushdown::predicate lt{"d", pushdown::OP_LT, {}, {2.0}, {}};
+  EXPECT_EQ(select(dv, lt), (std::vector<uint32_t>{0, 1}));
+  
+  // the doubles win over the ints, all of them and only them
+  pushdown::predicate in_d{"d", pushdown::OP_IN, {1, 2, 3}, {2.5}, {}};
+  EXPECT_EQ(select(dv, in_d), (std::vector<uint32_t>{2}));
+  pushdown::predicate in_i{"d", pushdown::OP_IN, {1, 2, 3}, {}, {}};
+  EXPECT_TRUE(select(dv, in_i).empty());
+  
+  std::string s0{"apple"}, s1{"pear"}, s2{"plum"};
+  std::vector<bytes_view> strings{
+    bytes_view{(const uint8_t *)s0.data(), s0.size()},
+    bytes_view{(const uint8_t *)s1.data(), s1.size()},
+    bytes_view{(const uint8_t *)s2.data(), s2.size()},
+  };
+  value_view sv;
+  sv.kind_     = value_view::STRING;
+  sv.strings_  = array_view<bytes_view>{strings.data(), strings.size()};
+  pushdown::predicate ne{"s", pushdown::OP_NE, {}, {}, {"pear"}};
+  EXPECT_EQ(select(sv, ne), (std::vector<uint32_t>{0, 2}));
+  
+  // gather the selected rows
+  std::vector<uint32_t> sel{0, 2};
+  value_view out;
+  pushdown::apply(sv, sel.data(), sel.size(), a, out);
+  ASSERT_EQ(out.strings_.size(), 2);
+  EXPECT_TRUE(out.strings_[1] == "plum");
+}
+
+TEST_F(PushdownTest, HoldsBlockUntilComplete)
+{
+  pushdown stage{{ "b" }};
+  stage.add_predicate(pushdown::predicate{"a", pushdown::OP_GT, {2}, {}, {}});
+  
+  std::vector<int64_t> emitted;
+  auto emit = [&](const column_view & c) {
+    EXPECT_TRUE(c.name_ == "b");
+    for( auto v : c.data_.int64s_ ) emitted.push_back(v);
+  };
+  
+  auto push = [&](const std::string & msg) {
+    arena a;
+    column_view column;
+    ASSERT_TRUE(virtdb_gateway::decode_column((const uint8_t *)msg.data(), msg.size(), a, column));
+    stage.push(1, (const uint8_t *)msg.data(), msg.size(), column, emit);
+  };
+  
+  // b arrives first and is held back until a is here, c is not needed
+  push(encode_column("q", "b", 0, { 10, 20, 30, 40 }, {}));
+  push(encode_column("q", "c", 0, { 1, 1, 1, 1 }, {}));
+  EXPECT_TRUE(emitted.empty());
+  push(encode_column("q", "a", 0, { 1, 3, 2, 5 }, {}));
+  
+  EXPECT_EQ(emitted, (std::vector<int64_t>{20, 40}));
+  EXPECT_EQ(stage.rows_in(), 4);
+  EXPECT_EQ(stage.rows_out(), 2);
+  EXPECT_EQ(stage.columns_dropped(), 1);
+  
+  // a dropped stream's held blocks are gone, nothing left for its end
+  push(encode_column("q", "b", 1, { 50, 60 }, {}));
+  stage.drop_stream(1);
+  stage.end_stream(1, emit);
+  EXPECT_EQ(emitted, (std::vector<int64_t>{20, 40}));
+  
+  // a projected column with another row count can't take the selection
+  pushdown wide{{ "b", "c" }};
+  wide.add_predicate(pushdown::predicate{"b", pushdown::OP_GT, {15}, {}, {}});
+  std::vector<std::string> names;
+  for( auto & msg : { encode_column("q", "b", 0, { 10, 20 }, {}),
+                      encode_column("q", "c", 0, { 1, 2, 3 }, {}) } )
+  {
+    arena a;
+    column_view column;
+    ASSERT_TRUE(virtdb_gateway::decode_column((const uint8_t *)msg.data(), msg.size(), a, column));
+    wide.push(1, (const uint8_t *)msg.data(), msg.size(), column, [&](const column_view & c) {
+      names.push_back(c.name_.str());
+      EXPECT_EQ(c.data_.int64s_.size(), 1);
+    });
+  }
+  EXPECT_EQ(names, (std::vector<std::string>{"b"}));
+  EXPECT_EQ(wide.columns_mismatched(), 1);
+}
+
+TEST_F(DuplexStreamTest, Pipelined)
+{
+  const char * path = "/tmp/DuplexStreamTest.Pipelined";
+  
+  // odd requests are answered later from another thread, newest first
+  std::mutex deferred_mtx;
+  std::vector<std::pair<std::string, duplex_server::responder>> deferred;
+  std::atomic<bool> stop_answering{false};
+  
+  // the default trace is silent, hundreds of calls would flood the output
+  auto server = simple_server::create(path);
+  server->seek_to_end();
+  auto duplex = duplex_server::create(server, 1, [&](bytes_view request,
+                                                     const duplex_server::responder & respond) {
+    std::string answer{"re:"+request.str()};
+    if( respond.tag() % 2 == 0 )
+    {
+      respond(answer);
+      return;
+    }
+    std::lock_guard<std::mutex> lock{deferred_mtx};
+    deferred.push_back(std::make_pair(answer, respond));
+  });
+  std::thread thr{[server](){ server->run(server->receiver_position()); }};
+  std::thread answering{[&](){
+    while( !stop_answering )
+    {
+      std::vector<std::pair<std::string, duplex_server::responder>> batch;
+      {
+        std::lock_guard<std::mutex> lock{deferred_mtx};
+        batch.swap(deferred);
+      }
+      for( auto it=batch.rbegin(); it!=batch.rend(); ++it )
+        EXPECT_TRUE(it->second(it->first));
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }};
+  
+  const uint64_t count = 500;
+  std::mutex results_mtx;
+  std::map<uint64_t, std::string> results;
+  std::vector<uint64_t> order;
+  {
+    auto client = duplex_client::create(path, 1, 64);
+    for( uint64_t i=0; i<count; ++i )
+    {
+      std::string request{std::to_string(i)};
+      uint64_t tag = client->call((const uint8_t *)request.data(), request.size(), [&, i](bool ok, bytes_view response) {
+        EXPECT_TRUE(ok);
+        std::lock_guard<std::mutex> lock{results_mtx};
+        results[i] = response.str();
+        order.push_back(i);
+      });
+      EXPECT_EQ(tag, i);
+      EXPECT_LE(client->outstanding(), 64);
+    }
+    auto sync = client->call("sync");
+    ASSERT_EQ(sync.wait_for(std::chrono::seconds(10)), std::future_status::ready);
+    EXPECT_EQ(sync.get(), "re:sync");
+    
+    client->close();
+    EXPECT_FALSE(client->is_open());
+    EXPECT_EQ(client->completed(), count+1);
+    EXPECT_THROW(client->call("late"), virtdb::gateway::exception);
+  }
+  
+  for( int i=0; i<100 && duplex->channels() > 0; ++i )
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  stop_answering = true;
+  answering.join();
+  server->stop();
+  thr.join();
+  
+  ASSERT_EQ(results.size(), count);
+  for( uint64_t i=0; i<count; ++i )
+    EXPECT_EQ(results[i], "re:"+std::to_string(i));
+  EXPECT_FALSE(std::is_sorted(order.begin(), order.end()));
+  EXPECT_EQ(duplex->requests(), count+1);
+  EXPECT_EQ(duplex->channels(), 0);
+  EXPECT_EQ(server->coroutine_frames(), 0);
+  
+  // a truncated exchange
+  std::string buf;
+  duplex_stream::append(buf, 7, (const uint8_t *)"abc", 3);
+  uint64_t seen = 0;
+  EXPECT_TRUE(duplex_stream::parse((const uint8_t *)buf.data(), buf.size(), [&](uint64_t tag, bytes_view data) {
+    EXPECT_EQ(tag, 7);
+    EXPECT_EQ(data.str(), "abc");
+    ++seen;
+  }));
+  EXPECT_EQ(seen, 1);
+  EXPECT_FALSE(duplex_stream::parse((const uint8_t *)buf.data(), buf.size()-1, [](uint64_t tag, bytes_view data) {}));
+}
+
 TEST_F(StreamingGatewayTest, PushSingle)
 {
   // TODO